@@ -0,0 +1,284 @@
+#ifndef REMOTE_CLIENT_ASYNCSINK_H
+#define REMOTE_CLIENT_ASYNCSINK_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+};
+
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+#include "sink.h"
+#include "Budget.h"
+#include "ThreadPolicy.h"
+#include "Log.h"
+
+struct AsyncSinkStats {
+    uint64_t enqueued;
+    uint64_t handled;
+    uint64_t dropped;
+    uint64_t blocked;
+    size_t depth;
+    size_t max_depth;
+};
+
+// a sink owns what it is handed (see source.h), dropping means freeing
+inline void release(AVFrame *frame) {
+    av_frame_free(&frame);
+}
+
+inline void release(AVPacket *packet) {
+    av_packet_free(&packet);
+}
+
+template<class T>
+void release(T *t) {
+    delete t;
+}
+
+// what an item weighs in the budget, other types tell their size with bytes()
+inline uint64_t queued_bytes(const AVFrame *frame) {
+    return MemoryBudget::frameBytes(frame);
+}
+
+inline int64_t queued_duration(const AVFrame *frame) {
+    return MemoryBudget::frameDuration(frame);
+}
+
+inline uint64_t queued_bytes(const AVPacket *packet) {
+    return packet->size;
+}
+
+inline int64_t queued_duration(const AVPacket *) {
+    return 0;
+}
+
+template<class T>
+uint64_t queued_bytes(const T *t) {
+    return t->bytes();
+}
+
+template<class T>
+int64_t queued_duration(const T *) {
+    return 0;
+}
+
+// runs the wrapped sink on its own thread, named after the sink, behind a queue held to the limits and drop
+// policy of a budget stage. the forwarding thread only pays for an enqueue whatever the sink does, or waits for
+// room under the block policy. stop() hands what is still queued to the sink, while stopped items are handled
+// inline, or dropped for sinks that must only ever run on their own thread
+template<class T>
+class AsyncSink : public Sink<T> {
+private:
+    struct Entry {
+        T *t;
+        uint64_t bytes;
+        int64_t duration_us;
+        bool counted;   // admitted in the budget, false for the unbounded ones
+    };
+
+    std::string name;
+    Sink<T> &sink;
+    BudgetStage &budget;
+
+    std::deque<Entry> queue;
+    std::mutex queue_mutex;
+    std::condition_variable not_empty_cv;
+    std::condition_variable not_full_cv;
+    const bool inline_when_stopped;
+
+    bool run_stop_condition = true;
+    std::thread run_thread;
+
+    std::atomic<uint64_t> enqueued = 0;
+    std::atomic<uint64_t> handled = 0;
+    std::atomic<uint64_t> dropped = 0;
+    std::atomic<uint64_t> blocked = 0;
+    std::atomic<size_t> depth = 0;
+    std::atomic<size_t> max_depth = 0;
+
+public:
+    AsyncSink(std::string name, Sink<T> &sink, BudgetStage &budget, bool inline_when_stopped = true)
+            : name(std::move(name)), sink(sink), budget(budget), inline_when_stopped(inline_when_stopped) {
+
+    }
+
+    ~AsyncSink() override {
+        stop();
+    }
+
+    void start() {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        if (run_stop_condition) {
+            run_stop_condition = false;
+            run_thread = std::thread(&AsyncSink::run, this);
+        }
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            if (run_stop_condition) {
+                return;
+            }
+            run_stop_condition = true;
+        }
+        not_empty_cv.notify_all();
+        not_full_cv.notify_all();
+        if (run_thread.joinable()) {
+            run_thread.join();
+        }
+    }
+
+    bool isRunning() {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        return !run_stop_condition;
+    }
+
+    void handle(T *t) override {
+        uint64_t evicted = 0;
+        enqueue(t, evicted);
+    }
+
+    // queues t under the stage limits and policy, items evicted to make room are freed and counted in evicted.
+    // false when t itself doesn't fit or the sink stopped while it waited, t is freed then
+    bool enqueue(T *t, uint64_t &evicted) {
+        const uint64_t bytes = queued_bytes(t);
+        const int64_t duration_us = queued_duration(t);
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        if (run_stop_condition) {
+            return handleStopped(lock, t);
+        }
+
+        const DropPolicy policy = budget.getLimits().policy;
+        bool admitted = budget.admit(bytes, duration_us);
+        if (!admitted && policy == DropPolicy::BLOCK) {
+            blocked.fetch_add(1, std::memory_order_relaxed);
+            // polled as well, the room may come from another stage under budget.total
+            while (!run_stop_condition && !(admitted = budget.admit(bytes, duration_us))) {
+                not_full_cv.wait_for(lock, std::chrono::milliseconds(10));
+            }
+        } else if (!admitted && policy != DropPolicy::DROP_NEWEST) {
+            // the oldest items or all of them, the unbounded ones stay
+            for (auto it = queue.begin(); it != queue.end() && !admitted;) {
+                if (!it->counted) {
+                    ++it;
+                    continue;
+                }
+                discard(*it);
+                it = queue.erase(it);
+                ++evicted;
+                if (policy == DropPolicy::DROP_OLDEST) {
+                    admitted = budget.admit(bytes, duration_us);
+                }
+            }
+            if (!admitted) {
+                admitted = budget.admit(bytes, duration_us);
+            }
+        }
+        if (!admitted) {
+            lock.unlock();
+            release(t);
+            budget.dropped();
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        push(lock, {t, bytes, duration_us, true});
+        return true;
+    }
+
+    // outside the budget, for the few items the sink can't do without (stream announcements...)
+    void handleUnbounded(T *t) {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        if (run_stop_condition) {
+            handleStopped(lock, t);
+            return;
+        }
+        push(lock, {t, 0, 0, false});
+    }
+
+    AsyncSinkStats getStats() const {
+        AsyncSinkStats stats = {};
+        stats.enqueued = enqueued.load(std::memory_order_relaxed);
+        stats.handled = handled.load(std::memory_order_relaxed);
+        stats.dropped = dropped.load(std::memory_order_relaxed);
+        stats.blocked = blocked.load(std::memory_order_relaxed);
+        stats.depth = depth.load(std::memory_order_relaxed);
+        stats.max_depth = max_depth.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+private:
+    bool handleStopped(std::unique_lock<std::mutex> &lock, T *t) {
+        lock.unlock();
+        if (inline_when_stopped) {
+            // not started, behave like the wrapped sink
+            sink.handle(t);
+            return true;
+        }
+        release(t);
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    void push(std::unique_lock<std::mutex> &lock, Entry &&entry) {
+        queue.push_back(entry);
+        const size_t size = queue.size();
+        lock.unlock();
+        not_empty_cv.notify_one();
+
+        enqueued.fetch_add(1, std::memory_order_relaxed);
+        depth.store(size, std::memory_order_relaxed);
+        if (size > max_depth.load(std::memory_order_relaxed)) {
+            max_depth.store(size, std::memory_order_relaxed);
+        }
+    }
+
+    void discard(Entry &entry) {
+        if (entry.counted) {
+            budget.release(entry.bytes, entry.duration_us);
+            budget.dropped();
+        }
+        release(entry.t);
+        dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void run() {
+        ThreadScope scope(name);
+        std::deque<Entry> batch;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                not_empty_cv.wait(lock, [this] { return run_stop_condition || !queue.empty(); });
+                // stopped, once the queue is drained
+                if (queue.empty()) {
+                    return;
+                }
+                batch.swap(queue);
+                depth.store(0, std::memory_order_relaxed);
+            }
+
+            for (Entry &entry : batch) {
+                if (entry.counted) {
+                    budget.release(entry.bytes, entry.duration_us);
+                    not_full_cv.notify_one();
+                }
+                try {
+                    sink.handle(entry.t);
+                } catch (const std::exception &e) {
+                    LOG_ERROR(name << ": " << e.what());
+                }
+                handled.fetch_add(1, std::memory_order_relaxed);
+            }
+            batch.clear();
+        }
+    }
+};
+
+#endif //REMOTE_CLIENT_ASYNCSINK_H
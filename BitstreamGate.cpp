@@ -0,0 +1,396 @@
+#include <cstring>
+#include <algorithm>
+#include <iterator>
+
+#include "BitstreamGate.h"
+#include "Config.h"
+#include "Log.h"
+
+constexpr int H264_SPS = 7;
+constexpr int H264_PPS = 8;
+constexpr int H264_IDR = 5;
+constexpr int HEVC_VPS = 32;
+constexpr int HEVC_SPS = 33;
+constexpr int HEVC_PPS = 34;
+constexpr int HEVC_BLA_FIRST = 16;
+constexpr int HEVC_IDR_FIRST = 19;
+constexpr int HEVC_CRA = 21;
+constexpr int HEVC_IRAP_LAST = 23;
+constexpr uint8_t START_CODE[] = {0, 0, 0, 1};
+
+namespace {
+
+// rbsp reader over a nal payload, skips the emulation prevention bytes
+class BitReader {
+private:
+    const uint8_t *data;
+    size_t size;
+    size_t pos = 0;
+    int bit = 0;
+    int zeros = 0;
+    bool overrun = false;
+
+public:
+    BitReader(const uint8_t *data, size_t size) : data(data), size(size) {
+
+    }
+
+    uint32_t read(int count) {
+        uint32_t value = 0;
+        for (int i = 0; i < count; ++i) {
+            if (pos >= size) {
+                overrun = true;
+                return 0;
+            }
+            value = (value << 1) | ((data[pos] >> (7 - bit)) & 1);
+            if (++bit == 8) {
+                bit = 0;
+                zeros = data[pos] == 0 ? zeros + 1 : 0;
+                ++pos;
+                if (zeros >= 2 && pos < size && data[pos] == 3) {
+                    ++pos;
+                    zeros = 0;
+                }
+            }
+        }
+        return value;
+    }
+
+    void skip(int count) {
+        while (count > 0) {
+            const int step = count > 32 ? 32 : count;
+            read(step);
+            count -= step;
+        }
+    }
+
+    uint32_t readUe() {
+        int leading_zeros = 0;
+        while (read(1) == 0) {
+            if (overrun || ++leading_zeros > 31) {
+                overrun = true;
+                return 0;
+            }
+        }
+        return (1u << leading_zeros) - 1 + read(leading_zeros);
+    }
+
+    bool failed() const {
+        return overrun;
+    }
+};
+
+}
+
+BitstreamGate::Settings BitstreamGate::Settings::fromConfig() {
+    const Config &config = Config::global();
+    Settings settings;
+    settings.enabled = config.getBool("decoder.gate", settings.enabled);
+    settings.keyframe_timeout_us = config.getInt("decoder.keyframe_timeout", settings.keyframe_timeout_us / 1000) * 1000;
+    settings.gate_timeout_us = config.getInt("decoder.gate_timeout", settings.gate_timeout_us / 1000) * 1000;
+    return settings;
+}
+
+BitstreamGate::BitstreamGate(const Settings &settings) : settings(settings) {
+
+}
+
+void BitstreamGate::reset(AVCodecID codec_id, const uint8_t *extradata, int extradata_size) {
+    if (codec_id != this->codec_id) {
+        for (auto &kind : parameter_sets) {
+            for (CachedSet &set : kind) {
+                set.nal.clear();
+                set.reference = -1;
+            }
+        }
+    }
+    this->codec_id = codec_id;
+    inspect = settings.enabled && supported();
+    close();
+
+    // annex b extradata from the sdp, avcC and hvcC have no start codes and give nothing
+    if (inspect && extradata && extradata_size > 0) {
+        split(extradata, extradata_size);
+        int pps_id;
+        scan(pps_id);
+    }
+}
+
+bool BitstreamGate::admit(AVPacket *packet, int64_t now_us) {
+    if (!inspect) {
+        random_access = packet->flags & AV_PKT_FLAG_KEY;
+        if (!open) {
+            openGate("passthrough");
+        }
+        return true;
+    }
+
+    split(packet->data, packet->size);
+    if (nals.empty()) {
+        LOG_WARNING("bitstream gate: no start code in the stream, decoding without inspection");
+        inspect = false;
+        random_access = packet->flags & AV_PKT_FLAG_KEY;
+        if (!open) {
+            openGate("passthrough");
+        }
+        return true;
+    }
+
+    int pps_id = -1;
+    const Nal *picture = scan(pps_id);
+    random_access = picture && isIrap(picture->type);
+    if (open) {
+        // the scan kept the cache current for the next decoder
+        return true;
+    }
+
+    if (random_access && buildPrefix(pps_id)) {
+        const char *reason = irapName(picture->type);
+        prepend(packet);
+        openGate(reason);
+        return true;
+    }
+
+    if (waiting_since_us < 0) {
+        waiting_since_us = now_us;
+        last_request_us = now_us;
+    }
+    if (picture && settings.gate_timeout_us > 0 && now_us - waiting_since_us >= settings.gate_timeout_us) {
+        // no random access point is coming (intra refresh), let the decoder conceal until the picture builds up
+        if (buildPrefix(pps_id)) {
+            prepend(packet);
+        }
+        openGate("timeout");
+        return true;
+    }
+
+    ++held;
+    return false;
+}
+
+bool BitstreamGate::keyframeDue(int64_t now_us) {
+    if (open || waiting_since_us < 0 || settings.keyframe_timeout_us <= 0 || now_us - last_request_us < settings.keyframe_timeout_us) {
+        return false;
+    }
+    last_request_us = now_us;
+    return true;
+}
+
+void BitstreamGate::close() {
+    open = false;
+    random_access = false;
+    start_reason = "";
+    waiting_since_us = -1;
+    last_request_us = -1;
+    held = 0;
+}
+
+bool BitstreamGate::isOpen() const {
+    return open;
+}
+
+bool BitstreamGate::isRandomAccess() const {
+    return random_access;
+}
+
+const char* BitstreamGate::getStartReason() const {
+    return start_reason;
+}
+
+uint64_t BitstreamGate::getHeld() const {
+    return held;
+}
+
+bool BitstreamGate::supported() const {
+    return codec_id == AV_CODEC_ID_H264 || codec_id == AV_CODEC_ID_HEVC;
+}
+
+bool BitstreamGate::isPicture(int type) const {
+    return codec_id == AV_CODEC_ID_H264 ? type >= 1 && type <= H264_IDR : type < HEVC_VPS;
+}
+
+bool BitstreamGate::isIrap(int type) const {
+    return codec_id == AV_CODEC_ID_H264 ? type == H264_IDR : type >= HEVC_BLA_FIRST && type <= HEVC_IRAP_LAST;
+}
+
+const char* BitstreamGate::irapName(int type) const {
+    if (codec_id == AV_CODEC_ID_H264) {
+        return "idr";
+    } else if (type < HEVC_IDR_FIRST) {
+        return "bla";
+    } else if (type < HEVC_CRA) {
+        return "idr";
+    }
+    return "cra";
+}
+
+void BitstreamGate::split(const uint8_t *data, size_t size) {
+    nals.clear();
+    const size_t header_size = codec_id == AV_CODEC_ID_H264 ? 1 : 2;
+    size_t start = SIZE_MAX;
+    size_t i = 0;
+    const auto push = [this, data, header_size](size_t begin, size_t end) {
+        // trailing zeros belong to the next start code
+        while (end > begin && data[end - 1] == 0) {
+            --end;
+        }
+        if (end - begin < header_size) {
+            return false;
+        }
+        const int type = codec_id == AV_CODEC_ID_H264 ? data[begin] & 0x1f : (data[begin] >> 1) & 0x3f;
+        nals.push_back({type, data + begin, end - begin});
+        return isPicture(type);
+    };
+
+    while (i + 2 < size) {
+        if (data[i + 2] > 1) {
+            i += 3;
+        } else if (data[i + 2] == 1 && data[i + 1] == 0 && data[i] == 0) {
+            if (start != SIZE_MAX && push(start, i)) {
+                return;
+            }
+            i += 3;
+            start = i;
+            // only the header of a picture nal is parsed, no need to look for its end
+            if (start < size && isPicture(codec_id == AV_CODEC_ID_H264 ? data[start] & 0x1f : (data[start] >> 1) & 0x3f)) {
+                push(start, size);
+                return;
+            }
+        } else {
+            ++i;
+        }
+    }
+    if (start != SIZE_MAX) {
+        push(start, size);
+    }
+}
+
+const BitstreamGate::Nal* BitstreamGate::scan(int &pps_id) {
+    packet_sets.clear();
+    const bool h264 = codec_id == AV_CODEC_ID_H264;
+    for (const Nal &nal : nals) {
+        const size_t header_size = h264 ? 1 : 2;
+        BitReader reader(nal.data + header_size, nal.size - header_size);
+        if (isPicture(nal.type)) {
+            if (h264) {
+                reader.readUe();    // first_mb_in_slice
+                reader.readUe();    // slice_type
+            } else {
+                reader.skip(1);     // first_slice_segment_in_pic_flag
+                if (isIrap(nal.type)) {
+                    reader.skip(1); // no_output_of_prior_pics_flag
+                }
+            }
+            pps_id = static_cast<int>(reader.readUe());
+            if (reader.failed() || pps_id >= MAX_PARAMETER_SET_ID) {
+                pps_id = -1;
+            }
+            return &nal;
+        }
+
+        int kind;
+        uint32_t id;
+        uint32_t reference = 0;
+        if (h264 && nal.type == H264_SPS) {
+            kind = SPS;
+            reader.skip(24);        // profile_idc, constraint flags, level_idc
+            id = reader.readUe();
+        } else if (nal.type == (h264 ? H264_PPS : HEVC_PPS)) {
+            kind = PPS;
+            id = reader.readUe();
+            reference = reader.readUe();
+        } else if (!h264 && nal.type == HEVC_VPS) {
+            kind = VPS;
+            id = reader.read(4);
+        } else if (!h264 && nal.type == HEVC_SPS) {
+            kind = SPS;
+            reference = reader.read(4);
+            const int max_sub_layers_minus1 = static_cast<int>(reader.read(3));
+            reader.skip(1);         // temporal_id_nesting_flag
+            reader.skip(96);        // general profile_tier_level
+            bool profile_present[8];
+            bool level_present[8];
+            for (int i = 0; i < max_sub_layers_minus1; ++i) {
+                profile_present[i] = reader.read(1);
+                level_present[i] = reader.read(1);
+            }
+            if (max_sub_layers_minus1 > 0) {
+                reader.skip(2 * (8 - max_sub_layers_minus1));
+            }
+            for (int i = 0; i < max_sub_layers_minus1; ++i) {
+                reader.skip((profile_present[i] ? 88 : 0) + (level_present[i] ? 8 : 0));
+            }
+            id = reader.readUe();
+        } else {
+            continue;
+        }
+
+        if (reader.failed() || id >= MAX_PARAMETER_SET_ID || reference >= MAX_PARAMETER_SET_ID) {
+            continue;
+        }
+        CachedSet &set = parameter_sets[kind][id];
+        set.nal.assign(nal.data, nal.data + nal.size);
+        set.reference = kind == VPS || (h264 && kind == SPS) ? -1 : static_cast<int>(reference);
+        packet_sets.emplace_back(kind, id);
+    }
+    return nullptr;
+}
+
+bool BitstreamGate::buildPrefix(int pps_id) {
+    prefix.clear();
+    if (pps_id < 0) {
+        return false;
+    }
+
+    int chain[PARAMETER_SETS] = {-1, -1, pps_id};
+    const CachedSet &pps = parameter_sets[PPS][pps_id];
+    if (pps.nal.empty() || pps.reference < 0) {
+        return false;
+    }
+    chain[SPS] = pps.reference;
+    const CachedSet &sps = parameter_sets[SPS][chain[SPS]];
+    if (sps.nal.empty()) {
+        return false;
+    }
+    if (codec_id == AV_CODEC_ID_HEVC) {
+        chain[VPS] = sps.reference;
+        if (chain[VPS] < 0 || parameter_sets[VPS][chain[VPS]].nal.empty()) {
+            return false;
+        }
+    }
+
+    for (int kind = VPS; kind < PARAMETER_SETS; ++kind) {
+        if (chain[kind] < 0 || std::find(packet_sets.begin(), packet_sets.end(), std::make_pair(kind, chain[kind])) != packet_sets.end()) {
+            continue;
+        }
+        const std::vector<uint8_t> &nal = parameter_sets[kind][chain[kind]].nal;
+        prefix.insert(prefix.end(), std::begin(START_CODE), std::end(START_CODE));
+        prefix.insert(prefix.end(), nal.begin(), nal.end());
+    }
+    return true;
+}
+
+void BitstreamGate::prepend(AVPacket *packet) {
+    if (prefix.empty()) {
+        return;
+    }
+    const size_t size = prefix.size() + packet->size;
+    AVBufferRef *buffer = av_buffer_alloc(size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!buffer) {
+        // the decoder may still know them from the extradata
+        return;
+    }
+    memcpy(buffer->data, prefix.data(), prefix.size());
+    memcpy(buffer->data + prefix.size(), packet->data, packet->size);
+    memset(buffer->data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    av_buffer_unref(&packet->buf);
+    packet->buf = buffer;
+    packet->data = buffer->data;
+    packet->size = static_cast<int>(size);
+}
+
+void BitstreamGate::openGate(const char *reason) {
+    open = true;
+    start_reason = reason;
+    waiting_since_us = -1;
+}
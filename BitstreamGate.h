@@ -0,0 +1,103 @@
+#ifndef REMOTE_CLIENT_BITSTREAMGATE_H
+#define REMOTE_CLIENT_BITSTREAMGATE_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+};
+
+#include <cstdint>
+#include <vector>
+#include <utility>
+
+// sits in front of the video decoder: H.264/HEVC access units are held back until a random access point
+// (IDR, CRA or BLA) arrives with every parameter set it needs, so the decoder never starts on a picture it
+// can't reconstruct. parameter sets are cached by id across decoder reinits, an IRAP that doesn't repeat
+// them gets the cached ones put in front. other codecs and streams without start codes go through as they are
+//   decoder.gate = true
+//   decoder.keyframe_timeout = 500   ms of waiting before asking the server for a keyframe, and between requests
+//   decoder.gate_timeout = 3000      ms after which decoding starts on any picture (intra refresh streams), 0 waits
+class BitstreamGate {
+public:
+    struct Settings {
+        bool enabled = true;
+        int64_t keyframe_timeout_us = 500000;
+        int64_t gate_timeout_us = 3000000;
+
+        static Settings fromConfig();
+    };
+
+private:
+    enum ParameterSet {
+        VPS,
+        SPS,
+        PPS,
+        PARAMETER_SETS,
+    };
+    static constexpr int MAX_PARAMETER_SET_ID = 256;
+
+    struct Nal {
+        int type;
+        const uint8_t *data;    // header included, start code excluded
+        size_t size;
+    };
+
+    struct CachedSet {
+        std::vector<uint8_t> nal;
+        int reference = -1;     // id of the sps of a pps, of the vps of a hevc sps
+    };
+
+    Settings settings;
+    AVCodecID codec_id = AV_CODEC_ID_NONE;
+    bool inspect = false;
+    bool open = false;
+    bool random_access = false;
+    const char *start_reason = "";
+    int64_t waiting_since_us = -1;
+    int64_t last_request_us = -1;
+    uint64_t held = 0;
+
+    // raw nal units by kind and id, kept as long as the codec stays the same
+    CachedSet parameter_sets[PARAMETER_SETS][MAX_PARAMETER_SET_ID];
+    // reused for every packet
+    std::vector<Nal> nals;
+    std::vector<std::pair<int, int>> packet_sets;
+    std::vector<uint8_t> prefix;
+
+public:
+    explicit BitstreamGate(const Settings &settings);
+
+    // a new decoder, closes the gate. the parameter sets of the extradata are cached, the cached ones of another
+    // codec are dropped
+    void reset(AVCodecID codec_id, const uint8_t *extradata, int extradata_size);
+
+    // true when the packet may go to the decoder, the first one may get cached parameter sets put in front
+    bool admit(AVPacket *packet, int64_t now_us);
+    // true once per keyframe_timeout while packets are being held
+    bool keyframeDue(int64_t now_us);
+    // back to waiting for a random access point, the cache is kept
+    void close();
+
+    bool isOpen() const;
+    // whether the last admitted packet starts a random access point
+    bool isRandomAccess() const;
+    // what opened the gate, idr, cra, bla, timeout or passthrough
+    const char* getStartReason() const;
+    // packets held since the last reset
+    uint64_t getHeld() const;
+
+private:
+    bool supported() const;
+    bool isPicture(int type) const;
+    bool isIrap(int type) const;
+    const char* irapName(int type) const;
+    // the nal units up to the first picture one, parameter sets always come before it
+    void split(const uint8_t *data, size_t size);
+    // caches the parameter sets of the split nal units, returns the first picture one and the pps it uses
+    const Nal* scan(int &pps_id);
+    // the cached pps, sps and vps the picture needs that the packet doesn't carry, false when one is missing
+    bool buildPrefix(int pps_id);
+    void prepend(AVPacket *packet);
+    void openGate(const char *reason);
+};
+
+#endif //REMOTE_CLIENT_BITSTREAMGATE_H
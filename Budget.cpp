@@ -0,0 +1,173 @@
+#include <algorithm>
+
+#include "Budget.h"
+#include "Config.h"
+#include "Log.h"
+
+BudgetLimits BudgetLimits::fromConfig(const std::string &config_name, const BudgetLimits &defaults) {
+    const Config &config = Config::global();
+    const std::string prefix = "budget." + config_name + '.';
+    BudgetLimits limits = defaults;
+    limits.items = config.getSize(prefix + "items", defaults.items);
+    limits.bytes = config.getSize(prefix + "bytes", defaults.bytes);
+    limits.duration_us = config.getInt(prefix + "ms", defaults.duration_us / 1000) * 1000;
+    const std::string policy = config.getString(prefix + "policy");
+    if (policy == "newest") {
+        limits.policy = DropPolicy::DROP_NEWEST;
+    } else if (policy == "oldest") {
+        limits.policy = DropPolicy::DROP_OLDEST;
+    } else if (policy == "flush") {
+        limits.policy = DropPolicy::FLUSH;
+    } else if (policy == "block") {
+        limits.policy = DropPolicy::BLOCK;
+    } else if (!policy.empty()) {
+        LOG_WARNING("budget: unknown policy " << policy << " for " << config_name << ", kept the default");
+    }
+    return limits;
+}
+
+BudgetStage::BudgetStage(std::string name, MemoryBudget &budget, const BudgetLimits &limits) : name(std::move(name)),
+    budget(budget), limits(limits),
+    drops(MetricsRegistry::global().counter("budget_dropped_total", "items dropped by the stage drop policy", {{"stage", this->name}})) {
+
+}
+
+bool BudgetStage::admit(uint64_t item_bytes, int64_t item_duration_us) {
+    const int64_t queued_items = items.fetch_add(1, std::memory_order_relaxed);
+    const int64_t queued_bytes = bytes.fetch_add(item_bytes, std::memory_order_relaxed);
+    const int64_t queued_duration = duration_us.fetch_add(item_duration_us, std::memory_order_relaxed);
+    const int64_t queued_total = budget.total.fetch_add(item_bytes, std::memory_order_relaxed);
+    if (queued_items == 0) {
+        return true;
+    }
+
+    const bool fits = (limits.items == 0 || queued_items + 1 <= static_cast<int64_t>(limits.items))
+                      && (limits.bytes == 0 || queued_bytes + item_bytes <= limits.bytes)
+                      && (limits.duration_us == 0 || queued_duration + item_duration_us <= limits.duration_us)
+                      && (budget.total_limit == 0 || queued_total + item_bytes <= budget.total_limit);
+    if (!fits) {
+        release(item_bytes, item_duration_us);
+    }
+    return fits;
+}
+
+void BudgetStage::release(uint64_t item_bytes, int64_t item_duration_us) {
+    items.fetch_sub(1, std::memory_order_relaxed);
+    bytes.fetch_sub(item_bytes, std::memory_order_relaxed);
+    duration_us.fetch_sub(item_duration_us, std::memory_order_relaxed);
+    budget.total.fetch_sub(item_bytes, std::memory_order_relaxed);
+}
+
+void BudgetStage::release(const AVFrame *frame) {
+    release(MemoryBudget::frameBytes(frame), MemoryBudget::frameDuration(frame));
+}
+
+bool BudgetStage::observe(size_t queued_items, uint64_t queued_bytes, int64_t queued_duration_us) {
+    items.store(queued_items, std::memory_order_relaxed);
+    budget.total.fetch_add(static_cast<int64_t>(queued_bytes) - bytes.exchange(queued_bytes, std::memory_order_relaxed), std::memory_order_relaxed);
+    duration_us.store(queued_duration_us, std::memory_order_relaxed);
+    return (limits.items != 0 && queued_items > limits.items)
+           || (limits.bytes != 0 && queued_bytes > limits.bytes)
+           || (limits.duration_us != 0 && queued_duration_us > limits.duration_us);
+}
+
+void BudgetStage::reserve(int64_t delta_bytes) {
+    reserved.fetch_add(delta_bytes, std::memory_order_relaxed);
+    budget.total.fetch_add(delta_bytes, std::memory_order_relaxed);
+}
+
+void BudgetStage::dropped(uint64_t count) {
+    drops.add(count);
+}
+
+void BudgetStage::setLimits(const BudgetLimits &limits) {
+    this->limits = limits;
+}
+
+const BudgetLimits& BudgetStage::getLimits() const {
+    return limits;
+}
+
+const std::string& BudgetStage::getName() const {
+    return name;
+}
+
+int64_t BudgetStage::getItems() const {
+    return items.load(std::memory_order_relaxed);
+}
+
+int64_t BudgetStage::getBytes() const {
+    return bytes.load(std::memory_order_relaxed);
+}
+
+int64_t BudgetStage::getDuration() const {
+    return duration_us.load(std::memory_order_relaxed);
+}
+
+int64_t BudgetStage::getReserved() const {
+    return reserved.load(std::memory_order_relaxed);
+}
+
+MemoryBudget::MemoryBudget() : total_limit(Config::global().getSize("budget.total", 0)) {
+    MetricsRegistry::global().addCollector(this, [this](std::vector<MetricSample> &samples) {
+        std::lock_guard<std::mutex> guard(mutex);
+        for (const BudgetStage &stage : stages) {
+            const Labels labels = {{"stage", stage.getName()}};
+            samples.push_back({"budget_queued_items", labels, "items waiting in the stage", MetricType::GAUGE, static_cast<double>(stage.getItems())});
+            samples.push_back({"budget_queued_bytes", labels, "bytes waiting in the stage", MetricType::GAUGE, static_cast<double>(stage.getBytes())});
+            samples.push_back({"budget_queued_ms", labels, "media time waiting in the stage", MetricType::GAUGE, stage.getDuration() / 1000.});
+            samples.push_back({"budget_reserved_bytes", labels, "fixed allocations of the stage", MetricType::GAUGE, static_cast<double>(stage.getReserved())});
+        }
+        samples.push_back({"budget_total_bytes", {}, "bytes queued and reserved in every stage", MetricType::GAUGE, static_cast<double>(getTotal())});
+        samples.push_back({"budget_limit_bytes", {}, "budget.total, 0 for none", MetricType::GAUGE, static_cast<double>(total_limit)});
+    });
+}
+
+MemoryBudget::~MemoryBudget() {
+    MetricsRegistry::global().removeCollectors(this);
+}
+
+MemoryBudget& MemoryBudget::global() {
+    static MemoryBudget budget;
+    return budget;
+}
+
+BudgetStage& MemoryBudget::stage(const std::string &name, const BudgetLimits &defaults, const std::string &config_name) {
+    std::lock_guard<std::mutex> guard(mutex);
+    for (BudgetStage &stage : stages) {
+        if (stage.getName() == name) {
+            return stage;
+        }
+    }
+    return stages.emplace_back(name, *this, BudgetLimits::fromConfig(config_name.empty() ? name : config_name, defaults));
+}
+
+int64_t MemoryBudget::getTotal() const {
+    return total.load(std::memory_order_relaxed);
+}
+
+uint64_t MemoryBudget::getTotalLimit() const {
+    return total_limit;
+}
+
+uint64_t MemoryBudget::frameBytes(const AVFrame *frame) {
+    uint64_t size = 0;
+    for (const AVBufferRef *buffer : frame->buf) {
+        if (buffer) {
+            size += buffer->size;
+        }
+    }
+    // hardware frames only reference their surface, count what it holds
+    if (size < 4096 && frame->width > 0) {
+        size = static_cast<uint64_t>(frame->width) * frame->height * 3 / 2;
+    }
+    return size;
+}
+
+int64_t MemoryBudget::frameDuration(const AVFrame *frame) {
+    if (frame->width == 0) {
+        return frame->sample_rate > 0 ? static_cast<int64_t>(frame->nb_samples) * 1000000 / frame->sample_rate : 0;
+    }
+    // rtp video clock
+    return frame->pkt_duration > 0 ? frame->pkt_duration * 1000000 / 90000 : 0;
+}
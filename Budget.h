@@ -0,0 +1,143 @@
+#ifndef REMOTE_CLIENT_BUDGET_H
+#define REMOTE_CLIENT_BUDGET_H
+
+extern "C" {
+#include <libavutil/frame.h>
+};
+
+#include <cstdint>
+#include <string>
+#include <deque>
+#include <mutex>
+#include <atomic>
+
+#include "Metrics.h"
+
+// what a full stage does with one more item
+enum class DropPolicy {
+    DROP_NEWEST,    // the incoming item is dropped
+    DROP_OLDEST,    // the oldest queued item makes room, for queues where fresh beats complete
+    FLUSH,          // the whole queue goes, for queues the owner can only clear (sdl audio)
+    BLOCK,          // the producer waits for room, async sinks only, the other queues drop the newest
+};
+
+// limits of one stage, 0 for none:
+//   budget.<stage>.items = 8
+//   budget.<stage>.bytes = 64M
+//   budget.<stage>.ms = 100
+//   budget.<stage>.policy = newest|oldest|flush|block
+struct BudgetLimits {
+    size_t items = 0;
+    uint64_t bytes = 0;
+    int64_t duration_us = 0;
+    DropPolicy policy = DropPolicy::DROP_NEWEST;
+
+    // the budget.<config_name>.* settings over the given defaults
+    static BudgetLimits fromConfig(const std::string &config_name, const BudgetLimits &defaults);
+};
+
+class MemoryBudget;
+
+// one queue of the pipeline: items, bytes and media time waiting in it, plus its fixed allocations.
+// producers admit() before they enqueue and consumers release() what they dequeue, the counts are
+// atomics so both ends stay lock free
+class BudgetStage {
+private:
+    std::string name;
+    MemoryBudget &budget;
+    BudgetLimits limits;
+
+    std::atomic<int64_t> items = 0;
+    std::atomic<int64_t> bytes = 0;
+    std::atomic<int64_t> duration_us = 0;
+    std::atomic<int64_t> reserved = 0;
+    Counter &drops;
+
+public:
+    BudgetStage(std::string name, MemoryBudget &budget, const BudgetLimits &limits);
+
+    // counts the item in when it fits the stage and the total, an empty stage always takes one
+    bool admit(uint64_t item_bytes, int64_t item_duration_us);
+    void release(uint64_t item_bytes, int64_t item_duration_us);
+    void release(const AVFrame *frame);
+
+    // enqueues a decoded frame under the limits and policy, frames evicted to make room are freed and
+    // counted in evicted. false when the frame itself doesn't fit, the caller keeps it then
+    template<class Queue>
+    bool enqueue(Queue &queue, AVFrame *frame, uint64_t &evicted);
+
+    // for queues owned by a library, counted from outside, true when over the limits
+    bool observe(size_t queued_items, uint64_t queued_bytes, int64_t queued_duration_us);
+    // fixed allocations (socket buffers...), positive or negative
+    void reserve(int64_t delta_bytes);
+    void dropped(uint64_t count = 1);
+
+    void setLimits(const BudgetLimits &limits);
+    const BudgetLimits& getLimits() const;
+    const std::string& getName() const;
+    int64_t getItems() const;
+    int64_t getBytes() const;
+    int64_t getDuration() const;
+    int64_t getReserved() const;
+};
+
+// every stage of the pipeline in one place, with an optional cap on the sum of the queued and reserved bytes:
+//   budget.total = 128M
+// totals are exported with the metrics, budget_* per stage
+class MemoryBudget {
+private:
+    std::deque<BudgetStage> stages;
+    mutable std::mutex mutex;
+    uint64_t total_limit;
+    std::atomic<int64_t> total = 0;
+
+    friend class BudgetStage;
+
+public:
+    MemoryBudget();
+    ~MemoryBudget();
+
+    static MemoryBudget& global();
+
+    // get or create, the budget.<config_name>.* settings apply on creation, config_name defaults to the name
+    BudgetStage& stage(const std::string &name, const BudgetLimits &defaults = {}, const std::string &config_name = "");
+
+    int64_t getTotal() const;
+    uint64_t getTotalLimit() const;
+
+    // bytes held by a decoded frame, and how long it plays
+    static uint64_t frameBytes(const AVFrame *frame);
+    static int64_t frameDuration(const AVFrame *frame);
+};
+
+template<class Queue>
+bool BudgetStage::enqueue(Queue &queue, AVFrame *frame, uint64_t &evicted) {
+    const uint64_t frame_bytes = MemoryBudget::frameBytes(frame);
+    const int64_t frame_duration = MemoryBudget::frameDuration(frame);
+    bool admitted = admit(frame_bytes, frame_duration);
+    if (!admitted && limits.policy != DropPolicy::DROP_NEWEST && limits.policy != DropPolicy::BLOCK) {
+        // the oldest frame or all of them, the consumer may have taken some meanwhile
+        AVFrame *old;
+        while (queue.try_dequeue(old)) {
+            release(old);
+            av_frame_free(&old);
+            dropped();
+            ++evicted;
+            if (limits.policy == DropPolicy::DROP_OLDEST) {
+                break;
+            }
+        }
+        admitted = admit(frame_bytes, frame_duration);
+    }
+
+    if (admitted && queue.try_enqueue(frame)) {
+        return true;
+    }
+    if (admitted) {
+        release(frame_bytes, frame_duration);
+    }
+    dropped();
+    return false;
+}
+
+#endif //REMOTE_CLIENT_BUDGET_H
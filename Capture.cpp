@@ -0,0 +1,330 @@
+extern "C" {
+#include <libavutil/mem.h>
+};
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <chrono>
+
+#include "Capture.h"
+#include "ClockSync.h"
+#include "Config.h"
+#include "Log.h"
+#include "exception.h"
+
+constexpr size_t ALIGNMENT = 8;
+
+static size_t padded(size_t size) {
+    return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+}
+
+CaptureWriter::StreamSink::StreamSink(CaptureWriter &writer, uint8_t stream) : writer(writer), stream(stream) {
+
+}
+
+void CaptureWriter::StreamSink::handle(AVPacket *packet) {
+    writer.queue.handle(new Item(CaptureRecordType::PACKET, stream, ClockSync::now(), packet, {}));
+}
+
+CaptureWriter::Item::Item(CaptureRecordType type, uint8_t stream, int64_t time_us, AVPacket *packet, std::string data) :
+    type(type), stream(stream), time_us(time_us), packet(packet), data(std::move(data)) {
+
+}
+
+CaptureWriter::Item::~Item() {
+    av_packet_free(&packet);
+}
+
+uint64_t CaptureWriter::Item::bytes() const {
+    return data.size() + (packet ? packet->size : 0);
+}
+
+CaptureWriter::ItemSink::ItemSink(CaptureWriter &writer) : writer(writer) {
+
+}
+
+void CaptureWriter::ItemSink::handle(Item *item) {
+    writer.writeItem(*item);
+    delete item;
+}
+
+// a capture with holes is still a capture. the file belongs to the writer thread, nothing is written inline while stopped
+CaptureWriter::CaptureWriter(std::string path) : name("capture"), path(std::move(path)), item_sink(*this),
+    queue(name, item_sink, MemoryBudget::global().stage("capture", {MAX_PENDING, 0, 0, DropPolicy::DROP_NEWEST}), false), audio_sink(*this, 0), video_sink(*this, 1) {
+
+}
+
+CaptureWriter::~CaptureWriter() {
+    stop();
+}
+
+std::unique_ptr<CaptureWriter> CaptureWriter::fromConfig() {
+    const std::string path = Config::global().getString("capture.file");
+    return path.empty() ? nullptr : std::make_unique<CaptureWriter>(path);
+}
+
+void CaptureWriter::start() {
+    if (queue.isRunning()) {
+        return;
+    }
+
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_ERROR(name << ": unable to open " << path << ", " << strerror(errno));
+        return;
+    }
+
+    start_us = ClockSync::now();
+    CaptureFileHeader header = {};
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = CAPTURE_VERSION;
+    header.header_size = sizeof(header);
+    header.start_us = start_us;
+    header.start_unix_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+    offset = 0;
+    index.clear();
+    write_buffer.reserve(WRITE_BUFFER_SIZE);
+    append(&header, sizeof(header));
+
+    queue.start();
+    LOG_INFO(name << ": writing to " << path);
+}
+
+void CaptureWriter::stop() {
+    if (!queue.isRunning()) {
+        return;
+    }
+    queue.stop();
+
+    CaptureTrailer trailer = {};
+    trailer.index_offset = offset;
+    trailer.index_count = index.size();
+    memcpy(trailer.magic, CAPTURE_INDEX_MAGIC, sizeof(trailer.magic));
+    append(index.data(), index.size() * sizeof(CaptureIndexEntry));
+    append(&trailer, sizeof(trailer));
+    flushBuffer();
+
+    close(fd);
+    fd = -1;
+    LOG_INFO(name << ": " << index.size() << " records written to " << path << ", " << getDropped() << " dropped");
+}
+
+CaptureWriter::StreamSink& CaptureWriter::getSink(uint8_t stream) {
+    return stream == 0 ? audio_sink : video_sink;
+}
+
+void CaptureWriter::writeStream(uint8_t stream, const AVCodecParameters *parameters) {
+    CaptureStreamInfo info = {};
+    info.codec_type = parameters->codec_type;
+    info.codec_id = parameters->codec_id;
+    info.format = parameters->format;
+    info.width = parameters->width;
+    info.height = parameters->height;
+    info.sample_rate = parameters->sample_rate;
+    info.channels = parameters->channels;
+    info.channel_layout = parameters->channel_layout;
+    // depacketized timestamps use the rtp clock of the media
+    info.time_base_num = 1;
+    info.time_base_den = parameters->codec_type == AVMEDIA_TYPE_AUDIO ? parameters->sample_rate : 90000;
+    info.extradata_size = parameters->extradata_size;
+
+    std::string data(reinterpret_cast<const char*>(&info), sizeof(info));
+    data.append(reinterpret_cast<const char*>(parameters->extradata), parameters->extradata_size);
+    // a replay can't open the decoder without it
+    queue.handleUnbounded(new Item(CaptureRecordType::STREAM, stream, ClockSync::now(), nullptr, std::move(data)));
+}
+
+void CaptureWriter::writeMessage(CaptureRecordType type, const char *data, size_t size) {
+    queue.handle(new Item(type, 0, ClockSync::now(), nullptr, std::string(data, size)));
+}
+
+uint64_t CaptureWriter::getWritten() const {
+    return written.load(std::memory_order_relaxed);
+}
+
+uint64_t CaptureWriter::getDropped() const {
+    return queue.getStats().dropped;
+}
+
+void CaptureWriter::writeItem(const Item &item) {
+    CaptureRecordHeader header = {};
+    header.type = item.type;
+    header.stream = item.stream;
+    header.time_us = item.time_us - start_us;
+    header.pts = AV_NOPTS_VALUE;
+    header.dts = AV_NOPTS_VALUE;
+
+    const void *payload = item.data.data();
+    header.size = item.data.size();
+    if (item.packet) {
+        payload = item.packet->data;
+        header.size = item.packet->size;
+        header.flags = item.packet->flags;
+        header.pts = item.packet->pts;
+        header.dts = item.packet->dts;
+    }
+
+    index.push_back({offset, header.time_us, header.type, header.stream, {}});
+    append(&header, sizeof(header));
+    append(payload, header.size);
+
+    static const uint8_t zeros[ALIGNMENT] = {};
+    append(zeros, padded(header.size) - header.size);
+    written.fetch_add(1, std::memory_order_relaxed);
+}
+
+void CaptureWriter::append(const void *data, size_t size) {
+    const auto *bytes = static_cast<const uint8_t*>(data);
+    offset += size;
+    while (size > 0) {
+        const size_t chunk = std::min(size, WRITE_BUFFER_SIZE - write_buffer.size());
+        write_buffer.insert(write_buffer.end(), bytes, bytes + chunk);
+        bytes += chunk;
+        size -= chunk;
+        if (write_buffer.size() == WRITE_BUFFER_SIZE) {
+            flushBuffer();
+        }
+    }
+}
+
+void CaptureWriter::flushBuffer() {
+    size_t done = 0;
+    while (done < write_buffer.size()) {
+        const ssize_t ret = write(fd, write_buffer.data() + done, write_buffer.size() - done);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR(name << ": write error, " << strerror(errno));
+            break;
+        }
+        done += ret;
+    }
+    write_buffer.clear();
+}
+
+CaptureReader::CaptureReader(std::string path) : path(std::move(path)) {
+    const int fd = open(this->path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw InitFail(strerror(errno));
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(CaptureFileHeader)) {
+        close(fd);
+        throw InitFail("Capture file is too short");
+    }
+
+    size = st.st_size;
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        throw InitFail(strerror(errno));
+    }
+    // replay reads front to back
+    madvise(mapping, size, MADV_SEQUENTIAL);
+    data = static_cast<const uint8_t*>(mapping);
+
+    header = reinterpret_cast<const CaptureFileHeader*>(data);
+    if (memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) != 0 || header->version != CAPTURE_VERSION
+        || header->header_size < sizeof(CaptureFileHeader) || header->header_size > size) {
+        munmap(mapping, size);
+        throw InitFail("Not a capture file or unsupported version");
+    }
+
+    // every offset and count is checked against the mapping before it's used, a corrupt file is rejected
+    const auto *trailer = reinterpret_cast<const CaptureTrailer*>(data + size - sizeof(CaptureTrailer));
+    const uint64_t index_end = size - sizeof(CaptureTrailer);
+    if (size >= header->header_size + sizeof(CaptureTrailer) && memcmp(trailer->magic, CAPTURE_INDEX_MAGIC, sizeof(trailer->magic)) == 0
+        && trailer->index_offset >= header->header_size && trailer->index_offset <= index_end
+        && trailer->index_count == (index_end - trailer->index_offset) / sizeof(CaptureIndexEntry)
+        && (index_end - trailer->index_offset) % sizeof(CaptureIndexEntry) == 0) {
+        const auto *entries = reinterpret_cast<const CaptureIndexEntry*>(data + trailer->index_offset);
+        index.assign(entries, entries + trailer->index_count);
+        for (const CaptureIndexEntry &entry : index) {
+            if (!fits(entry.offset, trailer->index_offset)) {
+                munmap(mapping, size);
+                throw InitFail("Corrupt capture index");
+            }
+        }
+        complete = true;
+    } else {
+        LOG_WARNING("capture: " << this->path << " has no index, scanning it");
+        scan();
+    }
+}
+
+CaptureReader::~CaptureReader() {
+    munmap(const_cast<uint8_t*>(data), size);
+}
+
+void CaptureReader::scan() {
+    // stop at the first record that doesn't fit, the tail of a killed capture
+    uint64_t offset = header->header_size;
+    while (fits(offset, size)) {
+        const auto *record = reinterpret_cast<const CaptureRecordHeader*>(data + offset);
+        index.push_back({offset, record->time_us, record->type, record->stream, {}});
+        offset += sizeof(CaptureRecordHeader) + padded(record->size);
+    }
+}
+
+bool CaptureReader::fits(uint64_t offset, uint64_t end) const {
+    if (offset < header->header_size || offset > end || end - offset < sizeof(CaptureRecordHeader)) {
+        return false;
+    }
+    const auto *record = reinterpret_cast<const CaptureRecordHeader*>(data + offset);
+    return record->type >= CaptureRecordType::STREAM && record->type <= CaptureRecordType::CLIENT_MESSAGE
+           && padded(record->size) <= end - offset - sizeof(CaptureRecordHeader);
+}
+
+const CaptureFileHeader& CaptureReader::getHeader() const {
+    return *header;
+}
+
+const std::vector<CaptureIndexEntry>& CaptureReader::getIndex() const {
+    return index;
+}
+
+bool CaptureReader::isComplete() const {
+    return complete;
+}
+
+CaptureRecord CaptureReader::record(size_t i) const {
+    if (i >= index.size() || !fits(index[i].offset, size)) {
+        throw RunError("Capture record out of the file");
+    }
+    const auto *record_header = reinterpret_cast<const CaptureRecordHeader*>(data + index[i].offset);
+    return {record_header, reinterpret_cast<const uint8_t*>(record_header + 1)};
+}
+
+void CaptureReader::toParameters(const CaptureRecord &record, AVCodecParameters *parameters) {
+    CaptureStreamInfo info;
+    if (record.header->size < sizeof(info)) {
+        throw RunError("Corrupt capture stream record");
+    }
+    memcpy(&info, record.payload, sizeof(info));
+    if (info.extradata_size > record.header->size - sizeof(info)) {
+        throw RunError("Corrupt capture stream record");
+    }
+    parameters->codec_type = static_cast<AVMediaType>(info.codec_type);
+    parameters->codec_id = static_cast<AVCodecID>(info.codec_id);
+    parameters->format = info.format;
+    parameters->width = info.width;
+    parameters->height = info.height;
+    parameters->sample_rate = info.sample_rate;
+    parameters->channels = info.channels;
+    parameters->channel_layout = info.channel_layout;
+
+    av_freep(&parameters->extradata);
+    parameters->extradata_size = 0;
+    if (info.extradata_size > 0) {
+        parameters->extradata = static_cast<uint8_t*>(av_mallocz(info.extradata_size + AV_INPUT_BUFFER_PADDING_SIZE));
+        memcpy(parameters->extradata, record.payload + sizeof(info), info.extradata_size);
+        parameters->extradata_size = info.extradata_size;
+    }
+}
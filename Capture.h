@@ -0,0 +1,208 @@
+#ifndef REMOTE_CLIENT_CAPTURE_H
+#define REMOTE_CLIENT_CAPTURE_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+};
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <memory>
+
+#include "sink.h"
+#include "AsyncSink.h"
+
+// capture file layout, little endian, everything 8 bytes aligned so it can be read in place from a mapping:
+//   CaptureFileHeader
+//   records: CaptureRecordHeader, payload, zero padding to 8 bytes
+//   index: CaptureIndexEntry per record, then CaptureTrailer
+// the index is written on stop, a file cut short by a crash is scanned record by record instead
+constexpr char CAPTURE_MAGIC[8] = {'R', 'C', 'C', 'A', 'P', 'T', 'U', 'R'};
+constexpr char CAPTURE_INDEX_MAGIC[8] = {'R', 'C', 'C', 'A', 'P', 'I', 'D', 'X'};
+constexpr uint32_t CAPTURE_VERSION = 1;
+
+enum class CaptureRecordType : uint8_t {
+    STREAM = 1,         // CaptureStreamInfo then extradata, the decoder parameters of a stream
+    PACKET = 2,         // depacketized frame as the decoder gets it
+    SERVER_MESSAGE = 3, // control message received
+    CLIENT_MESSAGE = 4, // control message or input datagram sent
+};
+
+struct CaptureFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    int64_t start_us;     // ClockSync::now() at open, record times are relative to it
+    int64_t start_unix_us;
+    uint8_t reserved[32];
+};
+static_assert(sizeof(CaptureFileHeader) == 64);
+
+struct CaptureRecordHeader {
+    uint32_t size;
+    CaptureRecordType type;
+    uint8_t stream;       // 0 audio, 1 video, like "g" in the stream command
+    uint16_t flags;       // AVPacket flags
+    int64_t time_us;      // arrival
+    int64_t pts;
+    int64_t dts;
+};
+static_assert(sizeof(CaptureRecordHeader) == 32);
+
+struct CaptureStreamInfo {
+    int32_t codec_type;
+    int32_t codec_id;
+    int32_t format;
+    int32_t width;
+    int32_t height;
+    int32_t sample_rate;
+    int32_t channels;
+    int32_t time_base_num;
+    int32_t time_base_den;
+    uint32_t extradata_size;
+    uint64_t channel_layout;
+};
+static_assert(sizeof(CaptureStreamInfo) % 8 == 0);
+
+struct CaptureIndexEntry {
+    uint64_t offset;
+    int64_t time_us;
+    CaptureRecordType type;
+    uint8_t stream;
+    uint8_t reserved[6];
+};
+static_assert(sizeof(CaptureIndexEntry) == 24);
+
+struct CaptureTrailer {
+    uint64_t index_offset;
+    uint64_t index_count;
+    char magic[8];
+};
+
+// appends what the client receives and sends to a capture file from its own thread,
+// the pipeline threads only take a packet reference or copy a message:
+//   capture.file = /tmp/session.rccap (default none)
+class CaptureWriter {
+public:
+    // one per stream, attach it to the receiver as an AVPacket sink
+    class StreamSink : public Sink<AVPacket> {
+    private:
+        CaptureWriter &writer;
+        uint8_t stream;
+
+    public:
+        StreamSink(CaptureWriter &writer, uint8_t stream);
+        void handle(AVPacket *packet) override;
+    };
+
+private:
+    struct Item {
+        CaptureRecordType type;
+        uint8_t stream;
+        int64_t time_us;
+        AVPacket *packet;
+        std::string data;
+
+        // takes packet
+        Item(CaptureRecordType type, uint8_t stream, int64_t time_us, AVPacket *packet, std::string data);
+        ~Item();
+        Item(const Item&) = delete;
+        Item& operator=(const Item&) = delete;
+
+        uint64_t bytes() const;
+    };
+
+    // the writer thread end of the queue
+    class ItemSink : public Sink<Item> {
+    private:
+        CaptureWriter &writer;
+
+    public:
+        explicit ItemSink(CaptureWriter &writer);
+        void handle(Item *item) override;
+    };
+
+    // default of budget.capture.items
+    static constexpr size_t MAX_PENDING = 4096;
+    static constexpr size_t WRITE_BUFFER_SIZE = 1 << 20;
+
+    std::string name;
+    std::string path;
+    int fd = -1;
+    int64_t start_us = 0;
+    uint64_t offset = 0;
+    std::vector<uint8_t> write_buffer;
+    std::vector<CaptureIndexEntry> index;
+
+    std::atomic<uint64_t> written = 0;
+
+    ItemSink item_sink;
+    AsyncSink<Item> queue;
+
+    StreamSink audio_sink;
+    StreamSink video_sink;
+
+public:
+    explicit CaptureWriter(std::string path);
+    ~CaptureWriter();
+
+    // from the capture.file setting, nullptr when capture is off
+    static std::unique_ptr<CaptureWriter> fromConfig();
+
+    void start();
+    // writes what is queued, then the index
+    void stop();
+
+    StreamSink& getSink(uint8_t stream);
+    void writeStream(uint8_t stream, const AVCodecParameters *parameters);
+    void writeMessage(CaptureRecordType type, const char *data, size_t size);
+
+    uint64_t getWritten() const;
+    uint64_t getDropped() const;
+
+private:
+    void writeItem(const Item &item);
+    void append(const void *data, size_t size);
+    void flushBuffer();
+};
+
+struct CaptureRecord {
+    const CaptureRecordHeader *header;
+    const uint8_t *payload;
+};
+
+// maps a capture file read only, records point into the mapping and live as long as the reader
+class CaptureReader {
+private:
+    std::string path;
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+    const CaptureFileHeader *header = nullptr;
+    std::vector<CaptureIndexEntry> index;
+    bool complete = false;
+
+public:
+    explicit CaptureReader(std::string path);
+    ~CaptureReader();
+
+    CaptureReader(const CaptureReader&) = delete;
+    CaptureReader& operator=(const CaptureReader&) = delete;
+
+    const CaptureFileHeader& getHeader() const;
+    const std::vector<CaptureIndexEntry>& getIndex() const;
+    // false if the index was rebuilt by scanning, e.g. the client died while capturing
+    bool isComplete() const;
+    CaptureRecord record(size_t i) const;
+
+    // fills parameters from a STREAM record, throws RunError when it's cut short
+    static void toParameters(const CaptureRecord &record, AVCodecParameters *parameters);
+
+private:
+    void scan();
+    // a whole record of a known type at offset, between the file header and end
+    bool fits(uint64_t offset, uint64_t end) const;
+};
+
+#endif //REMOTE_CLIENT_CAPTURE_H
@@ -0,0 +1,116 @@
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+
+#include "ClockSync.h"
+
+int64_t ClockSync::now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+std::string ClockSync::makePing(Channel channel) {
+    const uint32_t id = next_id.fetch_add(1, std::memory_order_relaxed);
+    const int64_t sent_us = now();
+
+    lock.lock();
+    // an unanswered slot is simply overwritten, the ping is considered lost
+    pending[id % MAX_PENDING] = {id, sent_us, channel, true};
+    lock.unlock();
+
+    sent_pings.fetch_add(1, std::memory_order_relaxed);
+    return R"({"t":"p","i":)" + std::to_string(id) + R"(,"c":)" + std::to_string(sent_us) + '}';
+}
+
+bool ClockSync::onPong(uint32_t id, int64_t server_receive_us, int64_t server_send_us, int64_t receive_us) {
+    lock.lock();
+    Pending &slot = pending[id % MAX_PENDING];
+    if (!slot.waiting || slot.id != id) {
+        lock.unlock();
+        rejected_pongs.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    slot.waiting = false;
+
+    const int64_t rtt = (receive_us - slot.sent_us) - (server_send_us - server_receive_us);
+    const int64_t offset = ((server_receive_us - slot.sent_us) + (server_send_us - receive_us)) / 2;
+    if (rtt < 0) {
+        lock.unlock();
+        rejected_pongs.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    samples[sample_index] = {rtt, offset};
+    sample_index = (sample_index + 1) % FILTER_SIZE;
+    sample_count = std::min(sample_count + 1, FILTER_SIZE);
+    // the lowest delay sample suffered the least queuing, its offset is the most accurate
+    const Sample best = *std::min_element(samples.begin(), samples.begin() + sample_count, [](const Sample &a, const Sample &b) {
+        return a.rtt_us < b.rtt_us;
+    });
+    const Channel channel = slot.channel;
+    lock.unlock();
+
+    last_rtt_us[channel].store(rtt, std::memory_order_relaxed);
+    offset_us.store(best.offset_us, std::memory_order_relaxed);
+    const int64_t min_rtt = min_rtt_us.load(std::memory_order_relaxed);
+    if (min_rtt < 0 || rtt < min_rtt) {
+        min_rtt_us.store(rtt, std::memory_order_relaxed);
+    }
+
+    const int64_t srtt = smoothed_rtt_us.load(std::memory_order_relaxed);
+    if (srtt < 0) {
+        smoothed_rtt_us.store(rtt, std::memory_order_relaxed);
+        rtt_variation_us.store(rtt / 2, std::memory_order_relaxed);
+    } else {
+        const int64_t rttvar = rtt_variation_us.load(std::memory_order_relaxed);
+        rtt_variation_us.store(rttvar + (std::abs(srtt - rtt) - rttvar) / 4, std::memory_order_relaxed);
+        smoothed_rtt_us.store(srtt + (rtt - srtt) / 8, std::memory_order_relaxed);
+    }
+
+    synchronized.store(true, std::memory_order_relaxed);
+    received_pongs.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+int64_t ClockSync::getRtt(Channel channel) const {
+    return last_rtt_us[channel].load(std::memory_order_relaxed);
+}
+
+int64_t ClockSync::getSmoothedRtt() const {
+    return smoothed_rtt_us.load(std::memory_order_relaxed);
+}
+
+int64_t ClockSync::getRttVariation() const {
+    return rtt_variation_us.load(std::memory_order_relaxed);
+}
+
+int64_t ClockSync::getMinRtt() const {
+    return min_rtt_us.load(std::memory_order_relaxed);
+}
+
+int64_t ClockSync::getOffset() const {
+    return offset_us.load(std::memory_order_relaxed);
+}
+
+bool ClockSync::isSynchronized() const {
+    return synchronized.load(std::memory_order_relaxed);
+}
+
+uint64_t ClockSync::getSentPings() const {
+    return sent_pings.load(std::memory_order_relaxed);
+}
+
+uint64_t ClockSync::getReceivedPongs() const {
+    return received_pongs.load(std::memory_order_relaxed);
+}
+
+uint64_t ClockSync::getRejectedPongs() const {
+    return rejected_pongs.load(std::memory_order_relaxed);
+}
+
+int64_t ClockSync::toLocal(int64_t server_us) const {
+    return server_us - offset_us.load(std::memory_order_relaxed);
+}
+
+int64_t ClockSync::toServer(int64_t local_us) const {
+    return local_us + offset_us.load(std::memory_order_relaxed);
+}
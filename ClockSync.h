@@ -0,0 +1,82 @@
+#ifndef REMOTE_CLIENT_CLOCKSYNC_H
+#define REMOTE_CLIENT_CLOCKSYNC_H
+
+#include <cstdint>
+#include <string>
+#include <array>
+#include <atomic>
+
+#include "spinlock.h"
+
+// NTP style round trip and clock offset estimation
+// ping: {"t":"p","i":id,"c":t0}, the server answers {"t":"P","i":id,"r":t1,"s":t2}
+// with t1 its receive time and t2 its send time, t3 is our receive time
+//   rtt = (t3 - t0) - (t2 - t1)
+//   offset = ((t1 - t0) + (t2 - t3)) / 2 (server clock minus ours)
+// the offset is taken from the lowest rtt sample of the last FILTER_SIZE ones,
+// the rtt is smoothed like TCP does (RFC 6298)
+class ClockSync {
+public:
+    enum Channel : uint8_t {
+        TCP = 0,
+        UDP = 1,
+    };
+
+    static constexpr size_t FILTER_SIZE = 8;
+    static constexpr size_t MAX_PENDING = 16;
+
+private:
+    struct Pending {
+        uint32_t id;
+        int64_t sent_us;
+        Channel channel;
+        bool waiting;
+    };
+
+    struct Sample {
+        int64_t rtt_us;
+        int64_t offset_us;
+    };
+
+    std::atomic<uint32_t> next_id = 1;
+    std::array<Pending, MAX_PENDING> pending = {};
+    std::array<Sample, FILTER_SIZE> samples = {};
+    size_t sample_count = 0;
+    size_t sample_index = 0;
+    spinlock lock;
+
+    std::atomic<int64_t> last_rtt_us[2] = {-1, -1};
+    std::atomic<int64_t> smoothed_rtt_us = -1;
+    std::atomic<int64_t> rtt_variation_us = 0;
+    std::atomic<int64_t> min_rtt_us = -1;
+    std::atomic<int64_t> offset_us = 0;
+    std::atomic<bool> synchronized = false;
+
+    std::atomic<uint64_t> sent_pings = 0;
+    std::atomic<uint64_t> received_pongs = 0;
+    std::atomic<uint64_t> rejected_pongs = 0;
+
+public:
+    // local monotonic clock in microseconds, the time base of every value here
+    static int64_t now();
+
+    std::string makePing(Channel channel);
+    bool onPong(uint32_t id, int64_t server_receive_us, int64_t server_send_us, int64_t receive_us = now());
+
+    int64_t getRtt(Channel channel) const;
+    int64_t getSmoothedRtt() const;
+    int64_t getRttVariation() const;
+    int64_t getMinRtt() const;
+    int64_t getOffset() const;
+    bool isSynchronized() const;
+
+    uint64_t getSentPings() const;
+    uint64_t getReceivedPongs() const;
+    uint64_t getRejectedPongs() const;
+
+    // server timestamp to local clock, e.g. to turn capture times into glass to glass latency
+    int64_t toLocal(int64_t server_us) const;
+    int64_t toServer(int64_t local_us) const;
+};
+
+#endif //REMOTE_CLIENT_CLOCKSYNC_H
@@ -5,49 +5,111 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sstream>
 #include <vector>
+#include <array>
+#include <algorithm>
 
 #include "CommandSocket.h"
+#include "Log.h"
 #include "exception.h"
+#include "ThreadPolicy.h"
+#include "Config.h"
 
 constexpr size_t BUFFER_SIZE = 4096;
-constexpr auto KEEPALIVE_DELAY = std::chrono::seconds(1);
+constexpr size_t FRAME_HEADER_SIZE = FrameReader::HEADER_SIZE;
+static_assert(FrameReader::PADDING >= simdjson::SIMDJSON_PADDING, "frames must be parseable in place");
+constexpr size_t MAX_WRITE_BATCH = 64;
+
+struct CommandHandler {
+    std::string_view type;
+    void (CommandSocket::*handle)(simdjson::ondemand::document &document);
+};
 
-CommandSocket::CommandSocket(SDLDisplay &display) : name("socket client"), display(display) {
+static const std::array<CommandHandler, 3> COMMAND_HANDLERS = {{
+    {"R", &CommandSocket::handleStreamCommand},
+    {"P", &CommandSocket::handlePong},
+    {"S", &CommandSocket::handleSession},
+}};
 
+constexpr auto KEEPALIVE_DELAY = std::chrono::seconds(1);
+constexpr auto RECONNECT_MIN_DELAY = std::chrono::milliseconds(50);
+constexpr auto RECONNECT_MAX_DELAY = std::chrono::milliseconds(5000);
+// detect a silently dead control connection within ~5s
+constexpr int TCP_KEEPALIVE_IDLE = 2;
+constexpr int TCP_KEEPALIVE_INTERVAL = 1;
+constexpr int TCP_KEEPALIVE_COUNT = 3;
+
+CommandSocket::CommandSocket(SDLDisplay &display) : name("socket client"), capture(CaptureWriter::fromConfig()), recorder(Recorder::fromConfig()), rate(RateController::fromConfig()), display(display),
+    reactor("command", 1 + MAX_VIDEO_STREAMS),
+    power_saving(Config::global().getBool("power.enabled", true)),
+    hidden_bitrate_kbps(Config::global().getInt("power.hidden_bitrate", 0)),
+    audio_init_time(MetricsRegistry::global().histogram("stream_init_time_us", "time from a stream announcement to its decoder running", {{"stream", "audio"}})),
+    video_init_time(MetricsRegistry::global().histogram("stream_init_time_us", "time from a stream announcement to its decoder running", {{"stream", "video"}})) {
+    display.setClockSync(&clock_sync);
+    display.setVisibilityCallback([this](int index, bool hidden) {
+        reactor.post([this, index, hidden] { onVisibility(index, hidden); });
+    });
+    for (int i = 0; i < MAX_VIDEO_STREAMS; ++i) {
+        rtp_video[i] = std::make_unique<RTPVideoReceiver>(i == 0 ? "rtp video receiver" : "rtp video receiver " + std::to_string(i), i);
+        rtp_video[i]->setKeyframeRequest([this, i] { requestKeyframe(i); });
+    }
+    if (capture) {
+        capture->start();
+    }
+    if (recorder) {
+        recorder->start();
+    }
+    MetricsRegistry::global().addCollector(this, [this](std::vector<MetricSample> &samples) {
+        collectMetrics(samples);
+    });
 }
 
 CommandSocket::~CommandSocket() {
+    MetricsRegistry::global().removeCollectors(this);
+    if (!listen_stop_condition.load(std::memory_order_relaxed)) {
+        stop();
+    }
+    // let a pending stream init finish before tearing everything down
+    reactor.stopWorkers();
     close(tcp_socket);
     close(udp_socket);
+    // receivers first, what they still forward would be presented from this thread by a stopped display
+    rtp_audio.stop(false);
+    for (auto &receiver : rtp_video) {
+        receiver->stop(false);
+    }
     display.stop();
-    rtp_audio.stop();
-    rtp_video.stop();
+    if (capture) {
+        capture->stop();
+    }
+    if (recorder) {
+        recorder->stop();
+    }
 }
 
 void CommandSocket::init(const char *remote_ip, uint16_t remote_port, uint16_t local_port) {
     if (tcp_socket >= 0) {
         close(tcp_socket);
+        tcp_socket = -1;
     }
 
     if (udp_socket >= 0) {
         close(udp_socket);
     }
 
-    tcp_socket =  socket(AF_INET, SOCK_STREAM, 0);
-    if (tcp_socket < 0) {
-        throw InitFail(strerror(errno));
-    }
-
     udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
     if (udp_socket < 0) {
         throw InitFail(strerror(errno));
     }
 
-    sockaddr_in local_address = {};
+    local_address = {};
     // Filling server information
     local_address.sin_family = AF_INET;
     local_address.sin_port = htons(local_port);
@@ -55,7 +117,7 @@ void CommandSocket::init(const char *remote_ip, uint16_t remote_port, uint16_t l
         throw InitFail(strerror(errno));
     }
 
-    sockaddr_in remote_address = {};
+    remote_address = {};
     // Filling server information
     remote_address.sin_family = AF_INET;
     remote_address.sin_port = htons(remote_port);
@@ -63,6 +125,28 @@ void CommandSocket::init(const char *remote_ip, uint16_t remote_port, uint16_t l
         throw InitFail(strerror(errno));
     }
 
+    connectControl(true);
+
+    const int enable = 1;
+    if (setsockopt(udp_socket, SOL_SOCKET, SO_REUSEPORT | SO_REUSEADDR | SO_DEBUG, &enable, sizeof(enable)) < 0) {
+        throw InitFail(strerror(errno));
+    }
+
+    if (bind(udp_socket, (sockaddr*)&local_address, sizeof(local_address)) < 0) {
+        throw InitFail(strerror(errno));
+    }
+
+    if (connect(udp_socket, (sockaddr*)&remote_address, sizeof(remote_address)) < 0) {
+        throw InitFail(strerror(errno));
+    }
+}
+
+void CommandSocket::connectControl(bool blocking) {
+    tcp_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (tcp_socket < 0) {
+        throw InitFail(strerror(errno));
+    }
+
     const int enable = 1;
     if (setsockopt(tcp_socket, SOL_SOCKET, SO_REUSEPORT | SO_REUSEADDR | SO_DEBUG, &enable, sizeof(enable)) < 0) {
         throw InitFail(strerror(errno));;
@@ -72,138 +156,260 @@ void CommandSocket::init(const char *remote_ip, uint16_t remote_port, uint16_t l
         throw InitFail(strerror(errno));
     }
 
-    if (connect(tcp_socket, (sockaddr*)&remote_address, sizeof(remote_address)) < 0) {
+    // commands are small and latency sensitive, don't let Nagle hold them back
+    if (setsockopt(tcp_socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) < 0) {
         throw InitFail(strerror(errno));
     }
 
-    if (setsockopt(udp_socket, SOL_SOCKET, SO_REUSEPORT | SO_REUSEADDR | SO_DEBUG, &enable, sizeof(enable)) < 0) {
+    if (setsockopt(tcp_socket, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable)) < 0 ||
+        setsockopt(tcp_socket, IPPROTO_TCP, TCP_KEEPIDLE, &TCP_KEEPALIVE_IDLE, sizeof(TCP_KEEPALIVE_IDLE)) < 0 ||
+        setsockopt(tcp_socket, IPPROTO_TCP, TCP_KEEPINTVL, &TCP_KEEPALIVE_INTERVAL, sizeof(TCP_KEEPALIVE_INTERVAL)) < 0 ||
+        setsockopt(tcp_socket, IPPROTO_TCP, TCP_KEEPCNT, &TCP_KEEPALIVE_COUNT, sizeof(TCP_KEEPALIVE_COUNT)) < 0) {
         throw InitFail(strerror(errno));
     }
 
-    if (bind(udp_socket, (sockaddr*)&local_address, sizeof(local_address)) < 0) {
+    // only the reactor thread writes, it must never block
+    if (!blocking && fcntl(tcp_socket, F_SETFL, fcntl(tcp_socket, F_GETFL) | O_NONBLOCK) < 0) {
         throw InitFail(strerror(errno));
     }
 
-    if (connect(udp_socket, (sockaddr*)&remote_address, sizeof(remote_address)) < 0) {
+    if (connect(tcp_socket, (sockaddr*)&remote_address, sizeof(remote_address)) < 0 && (blocking || errno != EINPROGRESS)) {
         throw InitFail(strerror(errno));
     }
+
+    if (blocking) {
+        if (fcntl(tcp_socket, F_SETFL, fcntl(tcp_socket, F_GETFL) | O_NONBLOCK) < 0) {
+            throw InitFail(strerror(errno));
+        }
+        connected = true;
+    }
+}
+
+void CommandSocket::watchControl() {
+    reactor.add(tcp_socket, EPOLLIN, [this](uint32_t events) {
+        if (events & EPOLLOUT) {
+            writeTcp();
+        }
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            readTcp();
+        }
+    });
+}
+
+void CommandSocket::onDisconnect(const char *reason) {
+    if (!connected) {
+        return;
+    }
+
+    LOG_WARNING(name << ": control connection lost (" << reason << "), reconnecting");
+    connected = false;
+    disconnect_timepoint = std::chrono::steady_clock::now();
+    reactor.remove(tcp_socket);
+    close(tcp_socket);
+    tcp_socket = -1;
+
+    // a partially written frame would desync the new stream, everything queued is stale anyway
+    dropped_messages.fetch_add(write_backlog.size(), std::memory_order_relaxed);
+    for (const std::string &msg : write_backlog) {
+        dropped_bytes.fetch_add(msg.size(), std::memory_order_relaxed);
+    }
+    write_backlog.clear();
+    write_offset = 0;
+    write_blocked = false;
+    frame_reader.clear();
+
+    reconnect_delay = RECONNECT_MIN_DELAY;
+    scheduleReconnect();
+}
+
+void CommandSocket::scheduleReconnect() {
+    reconnect_timer = reactor.addTimer(reconnect_delay, [this] { reconnect(); }, false);
+    reconnect_delay = std::min(2 * reconnect_delay, RECONNECT_MAX_DELAY);
+}
+
+void CommandSocket::reconnect() {
+    reactor.removeTimer(reconnect_timer);
+    reconnect_timer = -1;
+    try {
+        connectControl(false);
+    } catch (const std::exception &e) {
+        LOG_WARNING(name << ": reconnection failed, " << e.what());
+        if (tcp_socket >= 0) {
+            close(tcp_socket);
+            tcp_socket = -1;
+        }
+        scheduleReconnect();
+        return;
+    }
+
+    // connection completes asynchronously, the socket becomes writable once it's done
+    reactor.add(tcp_socket, EPOLLOUT, [this](uint32_t) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(tcp_socket, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+            reactor.remove(tcp_socket);
+            close(tcp_socket);
+            tcp_socket = -1;
+            scheduleReconnect();
+            return;
+        }
+
+        reactor.remove(tcp_socket);
+        onConnected();
+    });
+}
+
+void CommandSocket::onConnected() {
+    connected = true;
+    reconnects.fetch_add(1, std::memory_order_relaxed);
+    watchControl();
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - disconnect_timepoint);
+    LOG_INFO(name << ": control connection restored after " << elapsed.count() << " ms");
+
+    // decoders, textures and audio device are still alive, a keyframe is enough to get the picture back
+    if (!session_token.empty()) {
+        writeCommand(R"({"t":"r","q":"resume","s":")" + session_token + R"("})");
+        requestKeyframe();
+        for (int i = 1; i < MAX_VIDEO_STREAMS; ++i) {
+            if (rtp_video[i]->isInitialized()) {
+                requestKeyframe(i);
+            }
+        }
+    } else {
+        writeCommand(R"({"t":"r","q":"rtp"})");
+    }
 }
 
 void CommandSocket::start() {
     startListen();
-    //startKeepAlive();
+    startKeepAlive();
+    startRateControl();
     display.startEvent();
 }
 
 void CommandSocket::stop() {
     display.stopEvent();
-    //stopKeepAlive();
+    stopRateControl();
+    stopKeepAlive();
     stopListen();
 }
 
 void CommandSocket::startListen() {
-    listen_stop_condition.store(false, std::memory_order_relaxed);
-    listen_thread = std::thread(&CommandSocket::listen, this);
+    if (listen_stop_condition.load(std::memory_order_relaxed)) {
+        listen_stop_condition.store(false, std::memory_order_relaxed);
+        watchControl();
+        reactor.add(udp_socket, EPOLLIN, [this](uint32_t) { readUdp(); });
+        listen_thread = std::thread(&CommandSocket::listen, this);
+    }
 }
 
 void CommandSocket::listen() {
-    fd_set fds;
-    timeval tv;
-    uint8_t buffer[BUFFER_SIZE];
-    uint8_t stream_buffer[2 * BUFFER_SIZE];
-    size_t stream_size = 0;
-    while (!listen_stop_condition.load(std::memory_order_relaxed)) {
-        FD_ZERO(&fds);
-        FD_SET(tcp_socket, &fds);
-        FD_SET(udp_socket, &fds);
-        tv.tv_sec = 0;
-        tv.tv_usec = 100'000;
-        int res = select(std::max(tcp_socket, udp_socket) + 1, &fds, NULL, NULL, &tv);
-        if (res < 0) {
-            throw std::exception();
-        } else if (res == 0) {
-            continue;
+    ThreadScope scope("command");
+    try {
+        reactor.run();
+    } catch (const std::exception &e) {
+        LOG_ERROR(name << ": " << e.what());
+    }
+}
+
+void CommandSocket::stopListen() {
+    if (!listen_stop_condition.load(std::memory_order_relaxed)) {
+        listen_stop_condition.store(true, std::memory_order_relaxed);
+        reactor.stop();
+        if (listen_thread.joinable()) {
+            listen_thread.join();
         } else {
-            if (FD_ISSET(tcp_socket, &fds)) {
-                ssize_t size = recv(tcp_socket, stream_buffer + stream_size, sizeof(stream_buffer) - stream_size, 0);
-                if (size < 0) {
-                    if (errno != EAGAIN || errno != EWOULDBLOCK) {
-                        throw RunError("error while reading socket");
-                    }
-                    continue;
-                }
-
-                // ret == 0 means disconnection
-                if (size == 0) {
-                    continue;
-                }
-
-                stream_size += size;
-                size_t start_offset = 0;
-                static constexpr uint8_t delimiter = 0xff;
-                uint16_t msg_size;
-                while (start_offset + sizeof(delimiter) + sizeof(msg_size) <= stream_size) {
-                    if (stream_buffer[start_offset] != delimiter) {
-                        start_offset += sizeof(delimiter);
-                        continue;
-                    }
-
-                    msg_size = ntohs(*reinterpret_cast<uint16_t*>(stream_buffer + start_offset + sizeof(delimiter)));
-                    // incomplete message
-                    if (start_offset + msg_size + sizeof(msg_size) + sizeof(delimiter) > stream_size) {
-                        break;
-                    }
-
-
-                    handleCommand(stream_buffer + start_offset + sizeof(msg_size) + sizeof(delimiter), msg_size, sizeof(stream_buffer) - start_offset - sizeof(msg_size) - sizeof(delimiter));
-                    start_offset += msg_size + sizeof(msg_size) + sizeof(delimiter);
-                };
-
-                // consume read data
-                std::memmove(stream_buffer, stream_buffer + start_offset, stream_size -= start_offset);
-            }
+            LOG_DEBUG(name << ": listen thread is not joinable");
+        }
+        if (reconnect_timer >= 0) {
+            reactor.removeTimer(reconnect_timer);
+            reconnect_timer = -1;
+        }
+        reactor.remove(tcp_socket);
+        reactor.remove(udp_socket);
+    } else {
+        LOG_DEBUG(name << ": listen thread already stopped");
+    }
+}
 
-            if (FD_ISSET(udp_socket, &fds)) {
-                ssize_t size = recv(udp_socket, buffer, sizeof(buffer), 0);
-                if (size > 0) {
-                    std::cout << '(' << size << "): " << buffer << std::endl;
-                }
-            }
+void CommandSocket::readTcp() {
+    ssize_t size = frame_reader.readFrom(tcp_socket);
+    if (size < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            onDisconnect(strerror(errno));
         }
+        return;
+    }
+
+    // ret == 0 means disconnection
+    if (size == 0) {
+        onDisconnect("closed by remote");
+        return;
+    }
+
+    // frames are parsed in place, the reader keeps enough padding after each one for simdjson
+    Frame frame;
+    while (frame_reader.next(frame)) {
+        handleCommand(frame.data, frame.size, frame.capacity);
     }
 }
 
-void CommandSocket::stopListen() {
-    listen_stop_condition.store(true, std::memory_order_relaxed);
-    listen_thread.join();
+void CommandSocket::readUdp() {
+    uint8_t buffer[BUFFER_SIZE + simdjson::SIMDJSON_PADDING];
+    ssize_t size = recv(udp_socket, buffer, BUFFER_SIZE, 0);
+    if (size <= 0) {
+        return;
+    }
+
+    if (buffer[0] == '{') {
+        handleCommand(buffer, size, sizeof(buffer));
+    } else {
+        buffer[size] = 0;
+        LOG_DEBUG('(' << size << "): " << buffer);
+    }
 }
 
 void CommandSocket::startKeepAlive() {
-    keepalive_stop_condition.store(false, std::memory_order_relaxed);
-    keepalive_thread = std::thread(&CommandSocket::keepAlive, this);
+    if (keepalive_stop_condition.load(std::memory_order_relaxed)) {
+        keepalive_stop_condition.store(false, std::memory_order_relaxed);
+        keepalive_timer = reactor.addTimer(KEEPALIVE_DELAY, [this] { keepAlive(); });
+    }
 }
 
 void CommandSocket::keepAlive() {
-    while (!keepalive_stop_condition.load(std::memory_order_relaxed)) {
-        const auto delta = KEEPALIVE_DELAY + send_timepoint - std::chrono::steady_clock::now();
-        if (delta.count() <= 0) {
-            writeCommand(R"({"t":"k"})");
-        } else {
-            std::this_thread::sleep_for(delta);
-        }
-    }
+    // pings double as keepalive, send one on each channel so both paths get measured
+    writeCommand(clock_sync.makePing(ClockSync::TCP));
+    handle(clock_sync.makePing(ClockSync::UDP));
 }
 
 void CommandSocket::stopKeepAlive() {
     if (!keepalive_stop_condition.load(std::memory_order_relaxed)) {
         keepalive_stop_condition.store(true, std::memory_order_relaxed);
-        if (keepalive_thread.joinable()) {
-            keepalive_thread.join();
-        } else {
-            std::cout << name << ": keepalive thread is not joinable" << std::endl;
-        }
+        reactor.removeTimer(keepalive_timer);
+        keepalive_timer = -1;
     } else {
-        std::cout << name << ": keepalive thread already stopped" << std::endl;
+        LOG_DEBUG(name << ": keepalive timer already stopped");
+    }
+}
+
+void CommandSocket::startRateControl() {
+    if (rate && rate_timer < 0) {
+        rate_timer = reactor.addTimer(std::chrono::milliseconds(RateController::intervalFromConfig()), [this] { updateRate(); });
+    }
+}
+
+void CommandSocket::updateRate() {
+    // the counters keep running while disconnected, the first update after a resume has the whole gap
+    const std::string msg = rate->update(display.getVideoQueueDepth(0), clock_sync.getSmoothedRtt());
+    if (connected && !msg.empty()) {
+        writeCommand(msg);
+    }
+}
+
+void CommandSocket::stopRateControl() {
+    if (rate_timer >= 0) {
+        reactor.removeTimer(rate_timer);
+        rate_timer = -1;
     }
 }
 
@@ -212,80 +418,227 @@ size_t CommandSocket::handleCommand(const uint8_t *buffer, size_t size, size_t c
     try {
         simdjson::ondemand::document document = parser.iterate(buffer, size, capacity);
         parsed_size = document.raw_json().value().size();
+        if (capture) {
+            capture->writeMessage(CaptureRecordType::SERVER_MESSAGE, reinterpret_cast<const char*>(buffer), parsed_size);
+        }
         const std::string_view type = document["t"];
-        if (type == "R") {
-            const int64_t idx = document["g"];
-            if (idx == 0) {
-                const int64_t kind = document["k"];
-                const std::string_view val = document["v"];
-                switch (kind) {
-                    case 0: {// sdp
-                        std::ofstream file;
-                        file.open("./sdp_audio");
-                        file << val << std::endl;
-                        file.close();
-
-                        display.stopAudio();
-                        rtp_audio.stop();
-                        display.stopDisplay();
-                        rtp_audio.init("./sdp_audio");
-                        display.initAudio(rtp_audio.getContext());
-                        rtp_audio.Source<AVFrame>::attachSink(&display);
-                        rtp_audio.start();
-                        display.startAudio();
-                        break;
-                    }
-                    case 1: {// rtp_mpegts
-                        rtp_audio.stop();
-                        rtp_audio.init(val.data());
-                        rtp_audio.start();
-                        break;
-                    }
-                    default:
-                        std::cout << "unknown kind, unable to init audio rtp stream" << std::endl;
-                }
-            } else if (idx == 1) {
-                const int64_t kind = document["k"];
-                const std::string_view val = document["v"];
-                switch (kind) {
-                    case 0: {// sdp
-                        std::ofstream file;
-                        file.open("./sdp_video");
-                        file << val << std::endl;
-                        file.close();
-
-                        display.stopDisplay();
-                        rtp_video.stop();
-                        display.stopDisplay();
-                        rtp_video.init("./sdp_video");
-                        display.initVideo(rtp_video.getContext());
-                        rtp_video.Source<AVFrame>::attachSink(&display);
-                        rtp_video.start();
-                        display.startDisplay();
-                        break;
-                    }
-                    case 1: {// rtp_mpegts
-                        display.stopDisplay();
-                        rtp_video.stop();
-                        rtp_video.init(val.data());
-                        display.initVideo(rtp_video.getContext());
-                        rtp_video.Source<AVFrame>::attachSink(&display);
-                        rtp_video.start();
-                        display.startDisplay();
-                        break;
-                    }
-                    default:
-                        std::cout << "unknown kind, unable to init video rtp stream" << std::endl;
-                }
-            }
+        const auto it = std::find_if(COMMAND_HANDLERS.begin(), COMMAND_HANDLERS.end(), [&type](const CommandHandler &handler) {
+            return handler.type == type;
+        });
+        if (it != COMMAND_HANDLERS.end()) {
+            (this->*(it->handle))(document);
+        } else {
+            LOG_WARNING(name << ": no handler for command type " << type);
         }
     } catch (const simdjson::simdjson_error &err) {
-        std::cout << err.what() << std::endl;
+        LOG_WARNING(err.what());
     }
 
     return parsed_size;
 }
 
+void CommandSocket::handleStreamCommand(simdjson::ondemand::document &document) {
+    const int64_t idx = document["g"];
+    const int64_t kind = document["k"];
+    const std::string_view v = document["v"];
+    if (idx < 0 || idx > MAX_VIDEO_STREAMS) {
+        LOG_WARNING(name << ": no stream " << idx << ", ignored");
+        return;
+    }
+    // copy, the buffer is reused as soon as we return
+    scheduleStreamInit(static_cast<int>(idx), kind, std::string(v));
+}
+
+void CommandSocket::scheduleStreamInit(int stream, int64_t kind, std::string val) {
+    StreamInit &init = stream_inits[stream];
+    init.kind = kind;
+    init.val = std::move(val);
+    init.requested_us = ClockSync::now();
+    init.pending = true;
+    if (recorder && stream <= 1) {
+        recorder->expectStream(stream);
+    }
+    if (init.running) {
+        LOG_DEBUG(name << ": stream " << stream << " still " << init.phase << ", announcement queued");
+        return;
+    }
+    runStreamInit(stream);
+}
+
+void CommandSocket::runStreamInit(int stream) {
+    StreamInit &init = stream_inits[stream];
+    init.running = true;
+    init.pending = false;
+    init.phase = "probing";
+    // stream init blocks until the first packets are probed, keep the reactor free meanwhile.
+    // audio and every video stream have a worker of their own and come up in parallel
+    reactor.defer([this, stream, kind = init.kind, val = std::move(init.val), requested_us = init.requested_us] {
+        bool ok = true;
+        try {
+            if (stream == 0) {
+                initAudioStream(kind, val);
+            } else {
+                initVideoStream(stream - 1, kind, val);
+            }
+        } catch (const std::exception &e) {
+            LOG_ERROR(name << ": stream " << stream << " init failed, " << e.what());
+            ok = false;
+        }
+        const int64_t elapsed_us = ClockSync::now() - requested_us;
+        reactor.post([this, stream, ok, elapsed_us] { onStreamInit(stream, ok, elapsed_us); });
+    });
+}
+
+void CommandSocket::reportStreamInit(int stream, const char *phase) {
+    const int64_t report_us = ClockSync::now();
+    reactor.post([this, stream, phase, report_us] {
+        StreamInit &init = stream_inits[stream];
+        init.phase = phase;
+        LOG_DEBUG(name << ": stream " << stream << " " << phase << " after " << (report_us - init.requested_us) / 1000 << " ms");
+    });
+}
+
+void CommandSocket::onStreamInit(int stream, bool ok, int64_t elapsed_us) {
+    StreamInit &init = stream_inits[stream];
+    init.running = false;
+    init.phase = ok ? "ready" : "failed";
+    if (ok) {
+        (stream == 0 ? audio_init_time : video_init_time).record(elapsed_us);
+        LOG_INFO(name << ": stream " << stream << " ready after " << elapsed_us / 1000 << " ms");
+    }
+    if (init.pending) {
+        runStreamInit(stream);
+    }
+}
+
+void CommandSocket::handlePong(simdjson::ondemand::document &document) {
+    const int64_t receive_us = ClockSync::now();
+    const uint64_t id = document["i"];
+    const int64_t server_receive_us = document["r"];
+    const int64_t server_send_us = document["s"];
+    clock_sync.onPong(id, server_receive_us, server_send_us, receive_us);
+}
+
+void CommandSocket::handleSession(simdjson::ondemand::document &document) {
+    const std::string_view token = document["v"];
+    session_token = token;
+}
+
+void CommandSocket::initAudioStream(int64_t kind, const std::string &val) {
+    switch (kind) {
+        case 0: {// sdp
+            if (val == audio_sdp && rtp_audio.isInitialized()) {
+                LOG_INFO(name << ": audio stream unchanged, keep current decoder");
+                break;
+            }
+            audio_sdp = val;
+
+            std::ofstream file;
+            file.open("./sdp_audio");
+            file << val << std::endl;
+            file.close();
+
+            rtp_audio.stop(false);
+            display.stopAudio();
+            rtp_audio.init("./sdp_audio");
+            reportStreamInit(0, "probed");
+            attachPacketSinks(0, rtp_audio.getContext(), rtp_audio.getTimeBase(), rtp_audio);
+            {
+                std::lock_guard<std::mutex> guard(sdl_init_mutex);
+                display.initAudio(rtp_audio.getContext());
+            }
+            rtp_audio.Source<AVFrame>::attachSink(&display);
+            rtp_audio.start();
+            display.startAudio();
+            break;
+        }
+        case 1: {// rtp_mpegts
+            rtp_audio.stop(false);
+            rtp_audio.init(val.c_str());
+            reportStreamInit(0, "probed");
+            attachPacketSinks(0, rtp_audio.getContext(), rtp_audio.getTimeBase(), rtp_audio);
+            rtp_audio.start();
+            break;
+        }
+        default:
+            LOG_WARNING("unknown kind, unable to init audio rtp stream");
+    }
+}
+
+void CommandSocket::initVideoStream(int index, int64_t kind, const std::string &val) {
+    RTPVideoReceiver &receiver = *rtp_video[index];
+    const uint8_t stream = 1 + index;
+    switch (kind) {
+        case 0: {// sdp
+            if (val == video_sdp[index] && receiver.isInitialized()) {
+                LOG_INFO(name << ": video stream " << index << " unchanged, keep current decoder");
+                requestKeyframe(index);
+                break;
+            }
+            video_sdp[index] = val;
+
+            const std::string path = index == 0 ? "./sdp_video" : "./sdp_video" + std::to_string(index);
+            std::ofstream file;
+            file.open(path);
+            file << val << std::endl;
+            file.close();
+
+            receiver.stop(false);
+            display.stopDisplay(index);
+            receiver.init(path.c_str());
+            reportStreamInit(stream, "probed");
+            attachPacketSinks(stream, receiver.getContext(), receiver.getTimeBase(), receiver);
+            attachRateControl(index, receiver);
+            {
+                std::lock_guard<std::mutex> guard(sdl_init_mutex);
+                display.initVideo(receiver.getContext(), index);
+            }
+            receiver.Source<AVFrame>::attachSink(&display.getVideoSink(index));
+            receiver.start();
+            display.startDisplay(index);
+            break;
+        }
+        case 1: {// rtp_mpegts
+            receiver.stop(false);
+            display.stopDisplay(index);
+            receiver.init(val.c_str());
+            reportStreamInit(stream, "probed");
+            attachPacketSinks(stream, receiver.getContext(), receiver.getTimeBase(), receiver);
+            attachRateControl(index, receiver);
+            {
+                std::lock_guard<std::mutex> guard(sdl_init_mutex);
+                display.initVideo(receiver.getContext(), index);
+            }
+            receiver.Source<AVFrame>::attachSink(&display.getVideoSink(index));
+            receiver.start();
+            display.startDisplay(index);
+            break;
+        }
+        default:
+            LOG_WARNING("unknown kind, unable to init video rtp stream");
+    }
+}
+
+void CommandSocket::attachPacketSinks(uint8_t stream, const AVCodecContext *codec_ctx, AVRational time_base, Source<AVPacket> &source) {
+    // captures and recordings hold the audio and the primary screen only
+    if ((!capture && !recorder) || stream > 1) {
+        return;
+    }
+
+    // the decoder parameters go first, a replay opens its decoder and the recording its streams from them
+    AVCodecParameters *parameters = avcodec_parameters_alloc();
+    avcodec_parameters_from_context(parameters, codec_ctx);
+    if (capture) {
+        capture->writeStream(stream, parameters);
+        source.attachSink(&capture->getSink(stream));
+    }
+    if (recorder) {
+        recorder->addStream(stream, parameters, time_base);
+        source.attachSink(&recorder->getSink(stream));
+    }
+    avcodec_parameters_free(&parameters);
+}
+
 void CommandSocket::writeCommand(const std::string &msg) {
     writeCommandImpl(msg.c_str(), msg.size());
 }
@@ -295,16 +648,203 @@ void CommandSocket::writeCommand(const char *msg, size_t size) {
 }
 
 void CommandSocket::writeCommandImpl(const char *msg, size_t size) {
-    uint8_t msg_header[3];
-    msg_header[0] = 0xff;
-    for (size_t i = 0; i < sizeof(msg_header) - 1; i++) {
-        msg_header[sizeof(msg_header) - 1 - i] = (size >> (8 * (sizeof(size) - i))) & 0xff;
+    if (size > FrameReader::MAX_FRAME_SIZE) {
+        LOG_WARNING(name << ": command of " << size << " bytes exceeds the frame limit, dropped");
+        return;
+    }
+
+    if (capture) {
+        capture->writeMessage(CaptureRecordType::CLIENT_MESSAGE, msg, size);
+    }
+
+    // delimiter then big endian 16 bits size
+    std::string framed;
+    framed.reserve(FRAME_HEADER_SIZE + size);
+    framed.push_back(static_cast<char>(0xff));
+    framed.push_back(static_cast<char>((size >> 8) & 0xff));
+    framed.push_back(static_cast<char>(size & 0xff));
+    framed.append(msg, size);
+
+    const uint64_t framed_size = framed.size();
+    outbox.enqueue(std::move(framed));
+    queued_messages.fetch_add(1, std::memory_order_relaxed);
+    const uint64_t backlog = queued_bytes.fetch_add(framed_size, std::memory_order_relaxed) + framed_size
+                             - sent_bytes.load(std::memory_order_relaxed) - dropped_bytes.load(std::memory_order_relaxed);
+    uint64_t max_backlog = max_backlog_bytes.load(std::memory_order_relaxed);
+    while (backlog > max_backlog && !max_backlog_bytes.compare_exchange_weak(max_backlog, backlog, std::memory_order_relaxed));
+
+    if (!flush_scheduled.exchange(true, std::memory_order_acq_rel)) {
+        reactor.post([this] { flushOutbox(); });
+    }
+}
+
+void CommandSocket::flushOutbox() {
+    // reset first, a message enqueued after the drain below schedules another flush
+    flush_scheduled.store(false, std::memory_order_release);
+    std::string batch[MAX_WRITE_BATCH];
+    size_t count;
+    while ((count = outbox.try_dequeue_bulk(batch, MAX_WRITE_BATCH)) > 0) {
+        for (size_t i = 0; i < count; ++i) {
+            write_backlog.emplace_back(std::move(batch[i]));
+        }
+    }
+
+    // nobody to send to, commands would be stale once reconnected
+    if (!connected) {
+        dropped_messages.fetch_add(write_backlog.size(), std::memory_order_relaxed);
+        for (const std::string &msg : write_backlog) {
+            dropped_bytes.fetch_add(msg.size(), std::memory_order_relaxed);
+        }
+        write_backlog.clear();
+        return;
+    }
+
+    // wait for EPOLLOUT
+    if (write_blocked) {
+        return;
+    }
+
+    while (!write_backlog.empty()) {
+        iovec iov[MAX_WRITE_BATCH];
+        size_t iov_count = 0;
+        for (auto it = write_backlog.begin(); it != write_backlog.end() && iov_count < MAX_WRITE_BATCH; ++it, ++iov_count) {
+            const size_t offset = iov_count == 0 ? write_offset : 0;
+            iov[iov_count].iov_base = it->data() + offset;
+            iov[iov_count].iov_len = it->size() - offset;
+        }
+
+        msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov_count;
+        const ssize_t written = sendmsg(tcp_socket, &msg, MSG_NOSIGNAL);
+        write_calls.fetch_add(1, std::memory_order_relaxed);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                would_block.fetch_add(1, std::memory_order_relaxed);
+                write_blocked = true;
+                reactor.modify(tcp_socket, EPOLLIN | EPOLLOUT);
+                return;
+            }
+            onDisconnect(strerror(errno));
+            return;
+        }
+
+        size_t remaining = written;
+        while (remaining > 0) {
+            const size_t left = write_backlog.front().size() - write_offset;
+            if (remaining < left) {
+                write_offset += remaining;
+                break;
+            }
+
+            remaining -= left;
+            sent_messages.fetch_add(1, std::memory_order_relaxed);
+            sent_bytes.fetch_add(write_backlog.front().size(), std::memory_order_relaxed);
+            write_backlog.pop_front();
+            write_offset = 0;
+        }
+        send_timepoint.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+    }
+}
+
+void CommandSocket::attachRateControl(int index, RTPVideoReceiver &receiver) {
+    // the primary screen speaks for the session
+    if (rate && index == 0) {
+        rate->setStream(receiver.getContext(), receiver.getTimeBase());
+        receiver.Source<AVPacket>::attachSink(rate.get());
+    }
+}
+
+void CommandSocket::writeTcp() {
+    write_blocked = false;
+    reactor.modify(tcp_socket, EPOLLIN);
+    flushOutbox();
+}
+
+void CommandSocket::onVisibility(int index, bool hidden) {
+    if (!power_saving) {
+        return;
+    }
+    // the receiver resumes from its backlog or asks for a keyframe by itself
+    rtp_video[index]->setHidden(hidden);
+    if (index == 0 && rate && hidden_bitrate_kbps > 0) {
+        rate->setBitrateCap(hidden ? hidden_bitrate_kbps : 0);
+        updateRate();
+    }
+}
+
+void CommandSocket::requestKeyframe(int index) {
+    if (index == 0) {
+        writeCommand(R"({"t":"r","q":"key"})");
+    } else {
+        writeCommand(R"({"t":"r","q":"key","g":)" + std::to_string(index + 1) + '}');
     }
-    send_lock.lock();
-    send(tcp_socket, msg_header, sizeof(msg_header), 0);
-    send(tcp_socket, msg, size, 0);
-    send_timepoint = std::chrono::steady_clock::now();
-    send_lock.unlock();
+}
+
+OutboxStats CommandSocket::getOutboxStats() const {
+    OutboxStats stats = {};
+    stats.queued_messages = queued_messages.load(std::memory_order_relaxed);
+    stats.queued_bytes = queued_bytes.load(std::memory_order_relaxed);
+    stats.sent_messages = sent_messages.load(std::memory_order_relaxed);
+    stats.sent_bytes = sent_bytes.load(std::memory_order_relaxed);
+    stats.write_calls = write_calls.load(std::memory_order_relaxed);
+    stats.would_block = would_block.load(std::memory_order_relaxed);
+    stats.dropped_bytes = dropped_bytes.load(std::memory_order_relaxed);
+    stats.backlog_bytes = stats.queued_bytes - stats.sent_bytes - stats.dropped_bytes;
+    stats.max_backlog_bytes = max_backlog_bytes.load(std::memory_order_relaxed);
+    stats.dropped_messages = dropped_messages.load(std::memory_order_relaxed);
+    return stats;
+}
+
+const ClockSync& CommandSocket::getClockSync() const {
+    return clock_sync;
+}
+
+uint64_t CommandSocket::getReconnects() const {
+    return reconnects.load(std::memory_order_relaxed);
+}
+
+void CommandSocket::collectMetrics(std::vector<MetricSample> &samples) const {
+    const auto gauge = [&samples](const char *name, const char *help, double value, Labels labels = {}) {
+        samples.push_back({name, std::move(labels), help, MetricType::GAUGE, value});
+    };
+    const auto counter = [&samples](const char *name, const char *help, double value, Labels labels = {}) {
+        samples.push_back({name, std::move(labels), help, MetricType::COUNTER, value});
+    };
+
+    gauge("rtt_us", "last round trip time", clock_sync.getRtt(ClockSync::TCP), {{"channel", "tcp"}});
+    gauge("rtt_us", "last round trip time", clock_sync.getRtt(ClockSync::UDP), {{"channel", "udp"}});
+    gauge("rtt_smoothed_us", "smoothed round trip time", clock_sync.getSmoothedRtt());
+    gauge("rtt_variation_us", "round trip time variation", clock_sync.getRttVariation());
+    gauge("clock_offset_us", "server clock minus local clock", clock_sync.getOffset());
+    counter("pings_total", "clock sync pings sent", clock_sync.getSentPings());
+    counter("pongs_total", "clock sync pongs accepted", clock_sync.getReceivedPongs());
+    counter("reconnects_total", "control channel reconnections", getReconnects());
+
+    const OutboxStats outbox_stats = getOutboxStats();
+    counter("outbox_messages_total", "control messages sent", outbox_stats.sent_messages);
+    counter("outbox_bytes_total", "control bytes sent", outbox_stats.sent_bytes);
+    counter("outbox_write_calls_total", "write calls on the control socket", outbox_stats.write_calls);
+    counter("outbox_would_block_total", "writes that hit a full socket buffer", outbox_stats.would_block);
+    counter("outbox_dropped_messages_total", "control messages dropped while disconnected", outbox_stats.dropped_messages);
+    counter("outbox_dropped_bytes_total", "control bytes dropped while disconnected", outbox_stats.dropped_bytes);
+    gauge("outbox_backlog_bytes", "control bytes waiting to be written", outbox_stats.backlog_bytes);
+
+#ifdef LOCK_STATS
+    const auto lock = [&counter, &gauge](const char *lock_name, const LockStats &stats) {
+        counter("lock_acquisitions_total", "lock acquisitions", stats.acquisitions, {{"lock", lock_name}});
+        counter("lock_contended_total", "acquisitions that had to wait", stats.contended, {{"lock", lock_name}});
+        counter("lock_spins_total", "spin iterations while waiting", stats.spins, {{"lock", lock_name}});
+        counter("lock_parks_total", "waits that parked on the futex", stats.parks, {{"lock", lock_name}});
+        gauge("lock_max_hold_ns", "longest time the lock was held", stats.max_hold_ns, {{"lock", lock_name}});
+    };
+    lock("video-packet-sinks", rtp_video[0]->Source<AVPacket>::lockStats());
+    lock("video-frame-sinks", rtp_video[0]->Source<AVFrame>::lockStats());
+    lock("audio-packet-sinks", rtp_audio.Source<AVPacket>::lockStats());
+    lock("audio-frame-sinks", rtp_audio.Source<AVFrame>::lockStats());
+#endif
 }
 
 void CommandSocket::handle(const std::string &msg) {
@@ -312,8 +852,10 @@ void CommandSocket::handle(const std::string &msg) {
 }
 
 void CommandSocket::handle(const char *msg, size_t size) {
-    send_lock.lock();
-    send(udp_socket, msg, size, 0);
-    send_timepoint = std::chrono::steady_clock::now();
-    send_lock.unlock();
+    // a datagram is sent atomically, no need to serialize senders
+    send(udp_socket, msg, size, MSG_NOSIGNAL);
+    if (capture) {
+        capture->writeMessage(CaptureRecordType::CLIENT_MESSAGE, msg, size);
+    }
+    send_timepoint.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
 }
@@ -2,45 +2,137 @@
 #define REMOTE_CLIENT_COMMANDSOCKET_H
 
 #include <vector>
+#include <deque>
 #include <unordered_set>
 #include <chrono>
 #include <thread>
 #include <atomic>
+#include <array>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
 #include "spinlock.h"
+#include "Reactor.h"
 #include "CommandSink.h"
+#include "FrameReader.h"
+#include "ClockSync.h"
+#include "Metrics.h"
+#include "Capture.h"
+#include "Recorder.h"
+#include "RateController.h"
 
 #include "simdjson/singleheader/simdjson.h"
+#include "concurrentqueue/concurrentqueue.h"
 
 #include "SDLDisplay.h"
 #include "RTPVideoReceiver.h"
 #include "RTPAudioReceiver.h"
 
+struct OutboxStats {
+    uint64_t queued_messages;
+    uint64_t queued_bytes;
+    uint64_t sent_messages;
+    uint64_t sent_bytes;
+    uint64_t write_calls;
+    uint64_t would_block;
+    uint64_t backlog_bytes;
+    uint64_t max_backlog_bytes;
+    uint64_t dropped_messages;
+    uint64_t dropped_bytes;
+};
+
 class CommandSocket: public CommandSink {
 private:
     std::string name;
     bool initialized = false;
 
+    // declared first, the receivers hold their sinks
+    std::unique_ptr<CaptureWriter> capture;
+    std::unique_ptr<Recorder> recorder;
+    std::unique_ptr<RateController> rate;
     RTPAudioReceiver rtp_audio;
-    RTPVideoReceiver rtp_video;
+    // one receiver and decoder per video stream, "g" 1 is the primary screen
+    std::array<std::unique_ptr<RTPVideoReceiver>, MAX_VIDEO_STREAMS> rtp_video;
     SDLDisplay &display;
 
     int tcp_socket = -1;
     int udp_socket = -1;
+    sockaddr_in local_address = {};
+    sockaddr_in remote_address = {};
+
+    // control connection state, reactor thread only once started
+    bool connected = false;
+    int reconnect_timer = -1;
+    std::chrono::milliseconds reconnect_delay{0};
+    std::chrono::steady_clock::time_point disconnect_timepoint;
+    std::string session_token;
+    std::atomic<uint64_t> reconnects = 0;
+
+    // last negotiated streams, an identical one after a resume keeps the running decoder
+    std::string audio_sdp;
+    std::array<std::string, MAX_VIDEO_STREAMS> video_sdp;
+
+    // stream setup, reactor thread only. each stream ("g", 0 is the audio) runs one init at a time on the
+    // reactor workers, a newer announcement waits for it and replaces any older one still waiting
+    struct StreamInit {
+        bool running = false;
+        bool pending = false;
+        int64_t kind = 0;
+        std::string val;
+        int64_t requested_us = 0;
+        const char *phase = "idle";
+    };
+    std::array<StreamInit, 1 + MAX_VIDEO_STREAMS> stream_inits;
+    // sdl windows and the audio device are created one at a time, only the probing runs in parallel
+    std::mutex sdl_init_mutex;
+
+    Reactor reactor;
+
+    // power.*, decoding stops behind a hidden window
+    bool power_saving;
+    int64_t hidden_bitrate_kbps;
 
     std::atomic<bool> listen_stop_condition = true;
     std::thread listen_thread;
+    FrameReader frame_reader;
     simdjson::ondemand::parser parser;
-    std::chrono::steady_clock::time_point send_timepoint;
-    spinlock send_lock;
+    std::atomic<std::chrono::steady_clock::rep> send_timepoint = 0;
+
+    // framed messages from any thread, written by the reactor thread only
+    moodycamel::ConcurrentQueue<std::string> outbox;
+    std::atomic<bool> flush_scheduled = false;
+    std::deque<std::string> write_backlog;
+    size_t write_offset = 0;
+    bool write_blocked = false;
+
+    std::atomic<uint64_t> queued_messages = 0;
+    std::atomic<uint64_t> queued_bytes = 0;
+    std::atomic<uint64_t> sent_messages = 0;
+    std::atomic<uint64_t> sent_bytes = 0;
+    std::atomic<uint64_t> write_calls = 0;
+    std::atomic<uint64_t> would_block = 0;
+    std::atomic<uint64_t> max_backlog_bytes = 0;
+    std::atomic<uint64_t> dropped_messages = 0;
+    std::atomic<uint64_t> dropped_bytes = 0;
 
     std::atomic<bool> keepalive_stop_condition = true;
-    std::thread keepalive_thread;
+    int keepalive_timer = -1;
+    int rate_timer = -1;
+    ClockSync clock_sync;
+    Histogram &audio_init_time;
+    Histogram &video_init_time;
 
 public:
     explicit CommandSocket(SDLDisplay &display);
     ~CommandSocket() override;
 
     void init(const char *remote_ip, uint16_t remote_port, uint16_t local_port);
+    void connectControl(bool blocking);
+    void watchControl();
+    void onConnected();
+    void onDisconnect(const char *reason);
+    void scheduleReconnect();
+    void reconnect();
 
     void start();
     void stop();
@@ -53,10 +145,36 @@ public:
     void keepAlive();
     void stopKeepAlive();
 
+    void startRateControl();
+    void updateRate();
+    void stopRateControl();
+
+    void readTcp();
+    void readUdp();
+    void writeTcp();
+    void flushOutbox();
+
     size_t handleCommand(const uint8_t *buffer, size_t size, size_t capacity);
+    void handleStreamCommand(simdjson::ondemand::document &document);
+    void handlePong(simdjson::ondemand::document &document);
+    void handleSession(simdjson::ondemand::document &document);
+    void scheduleStreamInit(int stream, int64_t kind, std::string val);
+    void runStreamInit(int stream);
+    void reportStreamInit(int stream, const char *phase);
+    void onStreamInit(int stream, bool ok, int64_t elapsed_us);
+    void initAudioStream(int64_t kind, const std::string &val);
+    void initVideoStream(int index, int64_t kind, const std::string &val);
+    void attachPacketSinks(uint8_t stream, const AVCodecContext *codec_ctx, AVRational time_base, Source<AVPacket> &source);
+    void attachRateControl(int index, RTPVideoReceiver &receiver);
     void writeCommand(const std::string &msg);
     void writeCommand(const char *msg, size_t size);
     void writeCommandImpl(const char *msg, size_t size);
+    void onVisibility(int index, bool hidden);
+    void requestKeyframe(int index = 0);
+    OutboxStats getOutboxStats() const;
+    const ClockSync& getClockSync() const;
+    uint64_t getReconnects() const;
+    void collectMetrics(std::vector<MetricSample> &samples) const;
 
     void handle(const std::string &msg) override;
     void handle(const char *msg, size_t size) override;
@@ -0,0 +1,139 @@
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+#include "Config.h"
+#include "exception.h"
+
+static std::string trim(const std::string &s) {
+    const size_t first = s.find_first_not_of(" \t\r\n");
+    if (first == std::string::npos) {
+        return "";
+    }
+    const size_t last = s.find_last_not_of(" \t\r\n");
+    return s.substr(first, last - first + 1);
+}
+
+Config& Config::global() {
+    static Config config;
+    return config;
+}
+
+void Config::load(const std::string &path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        throw InitFail("Couldn't open config file");
+    }
+
+    std::string line;
+    size_t line_number = 0;
+    while (std::getline(file, line)) {
+        ++line_number;
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty()) {
+            continue;
+        }
+
+        const size_t separator = line.find('=');
+        if (separator == std::string::npos) {
+            std::cerr << path << ":" << line_number << ": expected key = value, line ignored" << std::endl;
+            continue;
+        }
+        set(trim(line.substr(0, separator)), trim(line.substr(separator + 1)));
+    }
+}
+
+void Config::set(const std::string &key, const std::string &value) {
+    values[key] = value;
+}
+
+bool Config::has(const std::string &key) const {
+    return values.find(key) != values.end();
+}
+
+std::string Config::getString(const std::string &key, const std::string &fallback) const {
+    const auto it = values.find(key);
+    return it != values.end() ? it->second : fallback;
+}
+
+int64_t Config::getInt(const std::string &key, int64_t fallback) const {
+    const auto it = values.find(key);
+    if (it == values.end()) {
+        return fallback;
+    }
+
+    try {
+        return std::stoll(it->second);
+    } catch (const std::exception &e) {
+        std::cerr << "config: " << key << " is not an integer, use " << fallback << std::endl;
+        return fallback;
+    }
+}
+
+double Config::getDouble(const std::string &key, double fallback) const {
+    const auto it = values.find(key);
+    if (it == values.end()) {
+        return fallback;
+    }
+
+    try {
+        return std::stod(it->second);
+    } catch (const std::exception &e) {
+        std::cerr << "config: " << key << " is not a number, use " << fallback << std::endl;
+        return fallback;
+    }
+}
+
+bool Config::getBool(const std::string &key, bool fallback) const {
+    const auto it = values.find(key);
+    if (it == values.end()) {
+        return fallback;
+    }
+    return it->second == "1" || it->second == "true" || it->second == "yes" || it->second == "on";
+}
+
+uint64_t Config::getSize(const std::string &key, uint64_t fallback) const {
+    const auto it = values.find(key);
+    if (it == values.end()) {
+        return fallback;
+    }
+
+    try {
+        size_t end;
+        uint64_t size = std::stoull(it->second, &end);
+        switch (end < it->second.size() ? it->second[end] : '\0') {
+            case 'G': case 'g': size <<= 10; [[fallthrough]];
+            case 'M': case 'm': size <<= 10; [[fallthrough]];
+            case 'K': case 'k': size <<= 10; break;
+            default: break;
+        }
+        return size;
+    } catch (const std::exception &e) {
+        std::cerr << "config: " << key << " is not a size, use " << fallback << std::endl;
+        return fallback;
+    }
+}
+
+std::vector<int> Config::getIntList(const std::string &key) const {
+    std::vector<int> list;
+    std::stringstream ss(getString(key));
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        item = trim(item);
+        if (item.empty()) {
+            continue;
+        }
+
+        try {
+            const size_t dash = item.find('-', 1);
+            const int first = std::stoi(item.substr(0, dash));
+            const int last = dash != std::string::npos ? std::stoi(item.substr(dash + 1)) : first;
+            for (int i = first; i <= last; ++i) {
+                list.push_back(i);
+            }
+        } catch (const std::exception &e) {
+            std::cerr << "config: " << key << " has an invalid item '" << item << "', ignored" << std::endl;
+        }
+    }
+    return list;
+}
@@ -0,0 +1,32 @@
+#ifndef REMOTE_CLIENT_CONFIG_H
+#define REMOTE_CLIENT_CONFIG_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// flat "key = value" settings, '#' starts a comment
+// keys are dotted by subsystem, e.g. thread.display.cpus = 2
+class Config {
+private:
+    std::unordered_map<std::string, std::string> values;
+
+public:
+    static Config& global();
+
+    void load(const std::string &path);
+    void set(const std::string &key, const std::string &value);
+
+    bool has(const std::string &key) const;
+    std::string getString(const std::string &key, const std::string &fallback = "") const;
+    int64_t getInt(const std::string &key, int64_t fallback = 0) const;
+    double getDouble(const std::string &key, double fallback = 0) const;
+    bool getBool(const std::string &key, bool fallback = false) const;
+    // size with an optional K, M or G suffix (powers of 1024)
+    uint64_t getSize(const std::string &key, uint64_t fallback = 0) const;
+    // comma separated integers and ranges, e.g. "0,2,4-7"
+    std::vector<int> getIntList(const std::string &key) const;
+};
+
+#endif //REMOTE_CLIENT_CONFIG_H
@@ -0,0 +1,246 @@
+#include <cstring>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "DamageTracker.h"
+#include "Config.h"
+
+constexpr uint8_t DAMAGE_UUID[16] = {'g', 's', 'c', '-', 'd', 'a', 'm', 'a', 'g', 'e', '-', 'r', 'e', 'c', 't', 's'};
+
+static inline int read_u16(const uint8_t *data) {
+    return (data[0] << 8) | data[1];
+}
+
+DamageTracker::Settings DamageTracker::Settings::fromConfig() {
+    const Config &config = Config::global();
+    Settings settings;
+    settings.enabled = config.getBool("display.damage", settings.enabled);
+    settings.limit_percent = std::clamp<int>(config.getInt("display.damage_limit", settings.limit_percent), 0, 100);
+    return settings;
+}
+
+DamageTracker::DamageTracker(const Settings &settings) : settings(settings), previous(av_frame_alloc()) {
+
+}
+
+DamageTracker::~DamageTracker() {
+    av_frame_free(&previous);
+}
+
+bool DamageTracker::update(const AVFrame *frame, std::vector<DamageRect> &rects) {
+    rects.clear();
+    const bool supported = frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_NV12;
+    bool partial = settings.enabled && supported && previous->data[0] && previous->format == frame->format
+                   && previous->width == frame->width && previous->height == frame->height;
+    if (partial) {
+        // the server only knows what changed since the frame it encoded before, a gap or a concealed error
+        // leaves the texture behind that
+        const bool consecutive = frame->pts != AV_NOPTS_VALUE && frame->pts == next_pts;
+        const bool intact = !frame->decode_error_flags && !(frame->flags & AV_FRAME_FLAG_CORRUPT);
+        if (consecutive && intact && serverRects(frame, rects)) {
+            source = SERVER;
+        } else {
+            const int tiles_x = (frame->width + TILE_WIDTH - 1) / TILE_WIDTH;
+            const int tiles_y = (frame->height + TILE_HEIGHT - 1) / TILE_HEIGHT;
+            compare(frame, tiles_x, tiles_y);
+            merge(tiles_x, tiles_y, frame->width, frame->height, rects);
+            source = COMPARE;
+        }
+        partial = !tooLarge(rects, frame->width, frame->height);
+    }
+    if (!partial) {
+        rects.clear();
+        source = FULL;
+    }
+
+    next_pts = frame->pts != AV_NOPTS_VALUE && frame->pkt_duration > 0 ? frame->pts + frame->pkt_duration : AV_NOPTS_VALUE;
+    av_frame_unref(previous);
+    if (settings.enabled && supported && av_frame_ref(previous, frame) < 0) {
+        av_frame_unref(previous);
+    }
+    return partial;
+}
+
+void DamageTracker::reset() {
+    av_frame_unref(previous);
+    next_pts = AV_NOPTS_VALUE;
+}
+
+DamageTracker::Source DamageTracker::getSource() const {
+    return source;
+}
+
+bool DamageTracker::equal(const uint8_t *a, const uint8_t *b, size_t size) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    // sse2 only, the build doesn't pick a -march
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 64 <= size; i += 64) {
+        __m128i diff = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)),
+                                     _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+        diff = _mm_or_si128(diff, _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i + 16)),
+                                                _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i + 16))));
+        diff = _mm_or_si128(diff, _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i + 32)),
+                                                _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i + 32))));
+        diff = _mm_or_si128(diff, _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i + 48)),
+                                                _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, zero)) != 0xFFFF) {
+            return false;
+        }
+    }
+    for (; i + 16 <= size; i += 16) {
+        const __m128i diff = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)),
+                                           _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, zero)) != 0xFFFF) {
+            return false;
+        }
+    }
+#elif defined(__aarch64__)
+    for (; i + 64 <= size; i += 64) {
+        uint8x16_t diff = veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+        diff = vorrq_u8(diff, veorq_u8(vld1q_u8(a + i + 16), vld1q_u8(b + i + 16)));
+        diff = vorrq_u8(diff, veorq_u8(vld1q_u8(a + i + 32), vld1q_u8(b + i + 32)));
+        diff = vorrq_u8(diff, veorq_u8(vld1q_u8(a + i + 48), vld1q_u8(b + i + 48)));
+        if (vmaxvq_u8(diff)) {
+            return false;
+        }
+    }
+    for (; i + 16 <= size; i += 16) {
+        if (vmaxvq_u8(veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i)))) {
+            return false;
+        }
+    }
+#endif
+    return std::memcmp(a + i, b + i, size - i) == 0;
+}
+
+bool DamageTracker::serverRects(const AVFrame *frame, std::vector<DamageRect> &rects) const {
+    for (int s = 0; s < frame->nb_side_data; ++s) {
+        const AVFrameSideData *side_data = frame->side_data[s];
+        if (side_data->type != AV_FRAME_DATA_SEI_UNREGISTERED || side_data->size < sizeof(DAMAGE_UUID) + 2
+            || memcmp(side_data->data, DAMAGE_UUID, sizeof(DAMAGE_UUID)) != 0) {
+            continue;
+        }
+        const uint8_t *data = side_data->data + sizeof(DAMAGE_UUID);
+        const int count = read_u16(data);
+        if (side_data->size < sizeof(DAMAGE_UUID) + 2 + static_cast<size_t>(count) * 8) {
+            return false;
+        }
+        data += 2;
+        for (int i = 0; i < count; ++i, data += 8) {
+            // even origins and sizes, the chroma planes have half the resolution
+            const int x = std::min(read_u16(data), frame->width) & ~1;
+            const int y = std::min(read_u16(data + 2), frame->height) & ~1;
+            const int right = std::min((read_u16(data) + read_u16(data + 4) + 1) & ~1, frame->width);
+            const int bottom = std::min((read_u16(data + 2) + read_u16(data + 6) + 1) & ~1, frame->height);
+            if (right > x && bottom > y) {
+                rects.push_back({x, y, right - x, bottom - y});
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+void DamageTracker::compare(const AVFrame *frame, int tiles_x, int tiles_y) {
+    struct Plane {
+        int index;
+        int tile_bytes;
+        int tile_rows;
+        int row_bytes;
+        int rows;
+    };
+    const int chroma_width = (frame->width + 1) / 2;
+    const int chroma_height = (frame->height + 1) / 2;
+    Plane planes[3];
+    int plane_count;
+    planes[0] = {0, TILE_WIDTH, TILE_HEIGHT, frame->width, frame->height};
+    if (frame->format == AV_PIX_FMT_NV12) {
+        planes[1] = {1, TILE_WIDTH, TILE_HEIGHT / 2, chroma_width * 2, chroma_height};
+        plane_count = 2;
+    } else {
+        planes[1] = {1, TILE_WIDTH / 2, TILE_HEIGHT / 2, chroma_width, chroma_height};
+        planes[2] = {2, TILE_WIDTH / 2, TILE_HEIGHT / 2, chroma_width, chroma_height};
+        plane_count = 3;
+    }
+
+    dirty.assign(static_cast<size_t>(tiles_x) * tiles_y, 0);
+    for (int ty = 0; ty < tiles_y; ++ty) {
+        uint8_t *dirty_row = dirty.data() + static_cast<size_t>(ty) * tiles_x;
+        // row by row through the band, a tile is skipped once it's known to be dirty
+        for (int p = 0; p < plane_count; ++p) {
+            const Plane &plane = planes[p];
+            const int first = ty * plane.tile_rows;
+            const int last = std::min(first + plane.tile_rows, plane.rows);
+            for (int row = first; row < last; ++row) {
+                const uint8_t *current = frame->data[plane.index] + static_cast<ptrdiff_t>(row) * frame->linesize[plane.index];
+                const uint8_t *before = previous->data[plane.index] + static_cast<ptrdiff_t>(row) * previous->linesize[plane.index];
+                for (int tx = 0; tx < tiles_x; ++tx) {
+                    if (dirty_row[tx]) {
+                        continue;
+                    }
+                    const int offset = tx * plane.tile_bytes;
+                    const int size = std::min(plane.tile_bytes, plane.row_bytes - offset);
+                    if (size > 0 && !equal(current + offset, before + offset, size)) {
+                        dirty_row[tx] = 1;
+                    }
+                }
+            }
+        }
+    }
+}
+
+void DamageTracker::merge(int tiles_x, int tiles_y, int width, int height, std::vector<DamageRect> &rects) {
+    // in tiles until they are closed
+    const auto close = [&](const DamageRect &rect) {
+        const int x = rect.x * TILE_WIDTH;
+        const int y = rect.y * TILE_HEIGHT;
+        rects.push_back({x, y, std::min(rect.width * TILE_WIDTH, width - x), std::min(rect.height * TILE_HEIGHT, height - y)});
+    };
+
+    open_rects.clear();
+    for (int ty = 0; ty <= tiles_y; ++ty) {
+        next_rects.clear();
+        size_t o = 0;
+        int tx = 0;
+        while (ty < tiles_y && tx < tiles_x) {
+            const uint8_t *dirty_row = dirty.data() + static_cast<size_t>(ty) * tiles_x;
+            if (!dirty_row[tx]) {
+                ++tx;
+                continue;
+            }
+            const int start = tx;
+            while (tx < tiles_x && dirty_row[tx]) {
+                ++tx;
+            }
+            // open rects are ordered by x, the ones left of the run don't go on
+            while (o < open_rects.size() && open_rects[o].x < start) {
+                close(open_rects[o++]);
+            }
+            if (o < open_rects.size() && open_rects[o].x == start && open_rects[o].width == tx - start) {
+                DamageRect rect = open_rects[o++];
+                ++rect.height;
+                next_rects.push_back(rect);
+            } else {
+                next_rects.push_back({start, ty, tx - start, 1});
+            }
+        }
+        while (o < open_rects.size()) {
+            close(open_rects[o++]);
+        }
+        open_rects.swap(next_rects);
+    }
+}
+
+bool DamageTracker::tooLarge(const std::vector<DamageRect> &rects, int width, int height) const {
+    int64_t area = 0;
+    for (const DamageRect &rect : rects) {
+        area += static_cast<int64_t>(rect.width) * rect.height;
+    }
+    return area * 100 > static_cast<int64_t>(width) * height * settings.limit_percent;
+}
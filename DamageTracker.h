@@ -0,0 +1,80 @@
+#ifndef REMOTE_CLIENT_DAMAGETRACKER_H
+#define REMOTE_CLIENT_DAMAGETRACKER_H
+
+extern "C" {
+#include <libavutil/frame.h>
+};
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct DamageRect {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+// finds the parts of a video frame that changed since the last one that went into the texture, so a mostly static
+// desktop only uploads what moved. the server may list them itself in a user data unregistered sei, uuid
+// "gsc-damage-rects" followed by a big endian u16 count and count x, y, width, height u16 in luma pixels. without
+// it, or when a frame in between was lost or concealed, the frame is compared with the previous one in tiles
+//   display.damage = true
+//   display.damage_limit = 50    % of the frame changed above which it is uploaded whole
+class DamageTracker {
+public:
+    struct Settings {
+        bool enabled = true;
+        int limit_percent = 50;
+
+        static Settings fromConfig();
+    };
+
+    static constexpr int TILE_WIDTH = 64;
+    static constexpr int TILE_HEIGHT = 16;
+
+    enum Source {
+        FULL,
+        SERVER,
+        COMPARE,
+    };
+
+private:
+    Settings settings;
+    // a reference to the frame the texture holds, its buffers aren't reused by the decoder while it's kept
+    AVFrame *previous;
+    int64_t next_pts = AV_NOPTS_VALUE;
+    Source source = FULL;
+
+    // reused for every frame
+    std::vector<uint8_t> dirty;
+    std::vector<DamageRect> open_rects;
+    std::vector<DamageRect> next_rects;
+
+public:
+    explicit DamageTracker(const Settings &settings);
+    ~DamageTracker();
+
+    // the rects of frame that differ from the texture, in luma pixels with even origins. false when the whole
+    // frame has to be uploaded: the first one, a new size or format, too much damage. the frame becomes the
+    // previous one either way, an empty list means nothing changed
+    bool update(const AVFrame *frame, std::vector<DamageRect> &rects);
+    // the texture lost its content, the next frame is uploaded whole
+    void reset();
+
+    // how the rects of the last update were found
+    Source getSource() const;
+
+    // true when both rows hold the same bytes, simd where there is some
+    static bool equal(const uint8_t *a, const uint8_t *b, size_t size);
+
+private:
+    bool serverRects(const AVFrame *frame, std::vector<DamageRect> &rects) const;
+    void compare(const AVFrame *frame, int tiles_x, int tiles_y);
+    // dirty tiles to rects, runs of a tile row merged horizontally, equal runs of consecutive rows vertically
+    void merge(int tiles_x, int tiles_y, int width, int height, std::vector<DamageRect> &rects);
+    bool tooLarge(const std::vector<DamageRect> &rects, int width, int height) const;
+};
+
+#endif //REMOTE_CLIENT_DAMAGETRACKER_H
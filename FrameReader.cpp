@@ -0,0 +1,135 @@
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "FrameReader.h"
+#include "exception.h"
+
+static size_t round_to_pages(size_t size) {
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t capacity = page_size;
+    while (capacity < size) {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+FrameReader::FrameReader(size_t initial_capacity) {
+    capacity = round_to_pages(initial_capacity);
+    ring = map(capacity);
+}
+
+FrameReader::~FrameReader() {
+    unmap(ring, capacity);
+}
+
+uint8_t* FrameReader::map(size_t capacity) {
+    const int fd = memfd_create("frame reader", MFD_CLOEXEC);
+    if (fd < 0) {
+        throw InitFail(strerror(errno));
+    }
+
+    if (ftruncate(fd, capacity) < 0) {
+        close(fd);
+        throw InitFail(strerror(errno));
+    }
+
+    // reserve twice the size then map the same pages on both halves
+    void *base = mmap(nullptr, 2 * capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        throw InitFail(strerror(errno));
+    }
+
+    auto *ring = static_cast<uint8_t*>(base);
+    if (mmap(ring, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(ring + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, 2 * capacity);
+        close(fd);
+        throw InitFail(strerror(errno));
+    }
+
+    // the mappings keep the memory alive
+    close(fd);
+    return ring;
+}
+
+void FrameReader::unmap(uint8_t *ring, size_t capacity) {
+    if (ring) {
+        munmap(ring, 2 * capacity);
+    }
+}
+
+void FrameReader::reserve(size_t needed) {
+    if (needed <= capacity) {
+        return;
+    }
+
+    // only happens for frames bigger than anything seen so far
+    const size_t new_capacity = round_to_pages(needed);
+    uint8_t *new_ring = map(new_capacity);
+    memcpy(new_ring, ring + head, size);
+    unmap(ring, capacity);
+    ring = new_ring;
+    capacity = new_capacity;
+    head = 0;
+}
+
+ssize_t FrameReader::readFrom(int fd) {
+    // keep some room, a full ring could not make progress
+    reserve(size + PADDING + 1);
+    const size_t tail = (head + size) % capacity;
+    const ssize_t ret = recv(fd, ring + tail, capacity - size - PADDING, 0);
+    if (ret > 0) {
+        size += ret;
+    }
+    return ret;
+}
+
+void FrameReader::append(const uint8_t *data, size_t length) {
+    reserve(size + length + PADDING);
+    memcpy(ring + (head + size) % capacity, data, length);
+    size += length;
+}
+
+bool FrameReader::next(Frame &frame) {
+    // resync on the delimiter, bytes before it can't be part of a frame
+    while (size > 0 && ring[head] != DELIMITER) {
+        head = (head + 1) % capacity;
+        --size;
+    }
+
+    if (size < HEADER_SIZE) {
+        return false;
+    }
+
+    const uint8_t *header = ring + head;
+    const size_t frame_size = (static_cast<size_t>(header[1]) << 8) | header[2];
+    // grow now so the next reads can complete the frame
+    reserve(HEADER_SIZE + frame_size + PADDING);
+    if (size < HEADER_SIZE + frame_size) {
+        return false;
+    }
+
+    frame.data = ring + head + HEADER_SIZE;
+    frame.size = frame_size;
+    frame.capacity = 2 * capacity - head - HEADER_SIZE;
+    head = (head + HEADER_SIZE + frame_size) % capacity;
+    size -= HEADER_SIZE + frame_size;
+    return true;
+}
+
+void FrameReader::clear() {
+    head = 0;
+    size = 0;
+}
+
+size_t FrameReader::buffered() const {
+    return size;
+}
+
+size_t FrameReader::getCapacity() const {
+    return capacity;
+}
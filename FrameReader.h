@@ -0,0 +1,56 @@
+#ifndef REMOTE_CLIENT_FRAMEREADER_H
+#define REMOTE_CLIENT_FRAMEREADER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <sys/types.h>
+
+struct Frame {
+    const uint8_t *data;
+    size_t size;
+    // readable bytes from data, always at least size + FrameReader::PADDING
+    size_t capacity;
+};
+
+// reassembles 0xff | size (16 bits, big endian) | payload frames from a stream socket
+// the ring is mapped twice back to back so a frame wrapping around the end is still
+// contiguous in memory and can be parsed in place, nothing is ever moved except on growth
+class FrameReader {
+public:
+    static constexpr uint8_t DELIMITER = 0xff;
+    static constexpr size_t HEADER_SIZE = 3;
+    static constexpr size_t MAX_FRAME_SIZE = UINT16_MAX;
+    // simdjson reads up to SIMDJSON_PADDING bytes past the end of the document
+    static constexpr size_t PADDING = 64;
+
+private:
+    uint8_t *ring = nullptr;
+    size_t capacity = 0;
+    size_t head = 0;
+    size_t size = 0;
+
+public:
+    explicit FrameReader(size_t initial_capacity = 16 * 1024);
+    ~FrameReader();
+
+    FrameReader(const FrameReader&) = delete;
+    FrameReader& operator=(const FrameReader&) = delete;
+
+    // recv() into the free part of the ring, same return value as recv()
+    ssize_t readFrom(int fd);
+    // copy bytes into the ring, for sources other than a socket
+    void append(const uint8_t *data, size_t length);
+    // next complete frame, only valid until the next readFrom() or append()
+    bool next(Frame &frame);
+
+    void clear();
+    size_t buffered() const;
+    size_t getCapacity() const;
+
+private:
+    void reserve(size_t needed);
+    static uint8_t* map(size_t capacity);
+    static void unmap(uint8_t *ring, size_t capacity);
+};
+
+#endif //REMOTE_CLIENT_FRAMEREADER_H
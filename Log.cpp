@@ -0,0 +1,168 @@
+#include <errno.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#include "Log.h"
+#include "Config.h"
+#include "ThreadPolicy.h"
+
+constexpr auto RATE_WINDOW = std::chrono::seconds(1);
+constexpr size_t WRITE_BATCH = 64;
+
+static const auto start_timepoint = std::chrono::steady_clock::now();
+
+static int64_t elapsed_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_timepoint).count();
+}
+
+LogSite::LogSite(const char *file, int line) : file(file), line(line) {
+    Log::global().registerSite(this);
+}
+
+bool LogSite::acquire(uint64_t &reported) {
+    const uint32_t limit = Log::global().rate_limit.load(std::memory_order_relaxed);
+    if (limit > 0) {
+        const int64_t now = elapsed_us();
+        int64_t start = window_start.load(std::memory_order_relaxed);
+        if (now - start >= std::chrono::duration_cast<std::chrono::microseconds>(RATE_WINDOW).count()
+            && window_start.compare_exchange_strong(start, now, std::memory_order_relaxed)) {
+            window_count.store(0, std::memory_order_relaxed);
+        }
+
+        if (window_count.fetch_add(1, std::memory_order_relaxed) >= limit) {
+            suppressed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    }
+
+    reported = suppressed.exchange(0, std::memory_order_relaxed);
+    return true;
+}
+
+Log& Log::global() {
+    static Log log;
+    return log;
+}
+
+Log::~Log() {
+    stop();
+    if (output != stderr) {
+        fclose(output);
+    }
+}
+
+void Log::start() {
+    if (!write_stop_condition.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    const Config &config = Config::global();
+    const std::string level_name = config.getString("log.level", "info");
+    if (level_name == "debug") {
+        level = static_cast<int>(LogLevel::Debug);
+    } else if (level_name == "warning") {
+        level = static_cast<int>(LogLevel::Warning);
+    } else if (level_name == "error") {
+        level = static_cast<int>(LogLevel::Error);
+    } else {
+        level = static_cast<int>(LogLevel::Info);
+    }
+    rate_limit = static_cast<uint32_t>(config.getInt("log.rate_limit", 10));
+
+    if (const std::string path = config.getString("log.file"); !path.empty() && output == stderr) {
+        if (FILE *file = fopen(path.c_str(), "a")) {
+            output = file;
+        } else {
+            fprintf(stderr, "log: unable to open %s, %s, keep stderr\n", path.c_str(), strerror(errno));
+        }
+    }
+
+    write_stop_condition.store(false, std::memory_order_relaxed);
+    write_thread = std::thread(&Log::run, this);
+}
+
+void Log::run() {
+    ThreadScope scope("log");
+    std::vector<LogRecord> records(WRITE_BATCH);
+    auto last_report = std::chrono::steady_clock::now();
+    while (!write_stop_condition.load(std::memory_order_relaxed)) {
+        const size_t count = queue.wait_dequeue_bulk_timed(records.begin(), WRITE_BATCH, std::chrono::milliseconds(100));
+        for (size_t i = 0; i < count; ++i) {
+            outputRecord(records[i]);
+        }
+
+        if (std::chrono::steady_clock::now() - last_report >= RATE_WINDOW) {
+            reportSuppressed();
+            last_report = std::chrono::steady_clock::now();
+        }
+
+        if (count > 0) {
+            fflush(output);
+        }
+    }
+
+    // what was logged before stop()
+    LogRecord record;
+    while (queue.try_dequeue(record)) {
+        outputRecord(record);
+    }
+    reportSuppressed();
+    fflush(output);
+}
+
+void Log::stop() {
+    if (!write_stop_condition.load(std::memory_order_relaxed)) {
+        write_stop_condition.store(true, std::memory_order_relaxed);
+        if (write_thread.joinable()) {
+            write_thread.join();
+        }
+    }
+}
+
+void Log::write(LogLevel level, std::string text, uint64_t suppressed) {
+    if (suppressed > 0) {
+        text += " (" + std::to_string(suppressed) + " similar messages suppressed)";
+    }
+
+    LogRecord record = {level, elapsed_us(), std::move(text)};
+    if (write_stop_condition.load(std::memory_order_relaxed)) {
+        outputRecord(record);
+        fflush(output);
+        return;
+    }
+
+    // never block or grow without bound, a stuck terminal must not stall the pipeline
+    if (queue.size_approx() >= MAX_PENDING || !queue.enqueue(std::move(record))) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void Log::registerSite(LogSite *site) {
+    site->next = sites.load(std::memory_order_relaxed);
+    while (!sites.compare_exchange_weak(site->next, site, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void Log::reportSuppressed() {
+    // callsites that went quiet after being limited never get to report with their next message
+    for (LogSite *site = sites.load(std::memory_order_acquire); site; site = site->next) {
+        const int64_t start = site->window_start.load(std::memory_order_relaxed);
+        if (elapsed_us() - start < std::chrono::duration_cast<std::chrono::microseconds>(RATE_WINDOW).count()) {
+            continue;
+        }
+
+        if (const uint64_t count = site->suppressed.exchange(0, std::memory_order_relaxed); count > 0) {
+            outputRecord({LogLevel::Info, elapsed_us(), std::string(site->file) + ":" + std::to_string(site->line) + ": " + std::to_string(count) + " messages suppressed"});
+        }
+    }
+
+    if (const uint64_t count = dropped.exchange(0, std::memory_order_relaxed); count > 0) {
+        outputRecord({LogLevel::Warning, elapsed_us(), "log: queue full, " + std::to_string(count) + " messages dropped"});
+    }
+}
+
+void Log::outputRecord(const LogRecord &record) {
+    static constexpr char LEVELS[] = {'D', 'I', 'W', 'E'};
+    fprintf(output, "%lld.%06lld %c %s\n", static_cast<long long>(record.time_us / 1000000), static_cast<long long>(record.time_us % 1000000),
+            LEVELS[static_cast<int>(record.level)], record.text.c_str());
+}
@@ -0,0 +1,124 @@
+#ifndef REMOTE_CLIENT_LOG_H
+#define REMOTE_CLIENT_LOG_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <sstream>
+#include <atomic>
+#include <thread>
+
+#include "concurrentqueue/blockingconcurrentqueue.h"
+
+// levels below are compiled out, e.g. -DLOG_MIN_LEVEL=1 drops LOG_DEBUG from release builds
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0
+#endif
+
+// not upper case, DEBUG and ERROR are commonly defined as macros
+enum class LogLevel {
+    Debug = 0,
+    Info = 1,
+    Warning = 2,
+    Error = 3,
+};
+
+// one per LOG_* statement, lets a callsite through at most rate_limit times per second
+// and counts what it held back, the count goes with the next message or the writer reports it
+class LogSite {
+private:
+    const char *file;
+    int line;
+    std::atomic<int64_t> window_start = 0;
+    std::atomic<uint32_t> window_count = 0;
+    std::atomic<uint64_t> suppressed = 0;
+    LogSite *next = nullptr;
+
+    friend class Log;
+
+public:
+    LogSite(const char *file, int line);
+
+    // on success reported is the number of messages suppressed since the last one that went through
+    bool acquire(uint64_t &reported);
+};
+
+struct LogRecord {
+    LogLevel level;
+    int64_t time_us;
+    std::string text;
+};
+
+// producers only format and enqueue, a background thread does the console or file i/o:
+//   log.level = debug|info|warning|error (default info)
+//   log.rate_limit = 10 (messages per second per callsite, 0 for no limit)
+//   log.file = remote_client.log (default stderr)
+class Log {
+private:
+    static constexpr size_t MAX_PENDING = 4096;
+
+    std::atomic<int> level = static_cast<int>(LogLevel::Info);
+    std::atomic<uint32_t> rate_limit = 10;
+    FILE *output = stderr;
+
+    moodycamel::BlockingConcurrentQueue<LogRecord> queue;
+    std::atomic<uint64_t> dropped = 0;
+    std::atomic<LogSite*> sites = nullptr;
+
+    std::atomic<bool> write_stop_condition = true;
+    std::thread write_thread;
+
+public:
+    static Log& global();
+    ~Log();
+
+    // reads the log.* settings, messages are written synchronously until then and after stop
+    void start();
+    void run();
+    void stop();
+
+    bool enabled(LogLevel level) const {
+        return static_cast<int>(level) >= this->level.load(std::memory_order_relaxed);
+    }
+
+    void write(LogLevel level, std::string text, uint64_t suppressed);
+
+private:
+    void registerSite(LogSite *site);
+    void reportSuppressed();
+    void outputRecord(const LogRecord &record);
+
+    friend class LogSite;
+};
+
+#define LOG_AT(log_level, expr) do { \
+        static LogSite log_site(__FILE__, __LINE__); \
+        uint64_t log_suppressed; \
+        if (Log::global().enabled(log_level) && log_site.acquire(log_suppressed)) { \
+            std::ostringstream log_stream; \
+            log_stream << expr; \
+            Log::global().write(log_level, log_stream.str(), log_suppressed); \
+        } \
+    } while (0)
+
+#if LOG_MIN_LEVEL <= 0
+#define LOG_DEBUG(expr) LOG_AT(LogLevel::Debug, expr)
+#else
+#define LOG_DEBUG(expr) do {} while (0)
+#endif
+
+#if LOG_MIN_LEVEL <= 1
+#define LOG_INFO(expr) LOG_AT(LogLevel::Info, expr)
+#else
+#define LOG_INFO(expr) do {} while (0)
+#endif
+
+#if LOG_MIN_LEVEL <= 2
+#define LOG_WARNING(expr) LOG_AT(LogLevel::Warning, expr)
+#else
+#define LOG_WARNING(expr) do {} while (0)
+#endif
+
+#define LOG_ERROR(expr) LOG_AT(LogLevel::Error, expr)
+
+#endif //REMOTE_CLIENT_LOG_H
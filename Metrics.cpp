@@ -0,0 +1,357 @@
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+
+#include "Metrics.h"
+#include "Config.h"
+#include "ThreadPolicy.h"
+
+size_t metric_shard() {
+    static std::atomic<size_t> next_shard = 0;
+    static thread_local const size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed) % METRIC_SHARDS;
+    return shard;
+}
+
+uint64_t Counter::value() const {
+    uint64_t total = 0;
+    for (const Shard &shard : shards) {
+        total += shard.value.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+Histogram::Histogram() : shards(new Shard[METRIC_SHARDS]) {
+
+}
+
+HistogramSnapshot Histogram::snapshot() const {
+    HistogramSnapshot snapshot = {0, 0, 0, std::vector<uint64_t>(BUCKETS, 0)};
+    for (size_t s = 0; s < METRIC_SHARDS; ++s) {
+        const Shard &shard = shards[s];
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            const uint64_t count = shard.buckets[i].load(std::memory_order_relaxed);
+            snapshot.buckets[i] += count;
+            snapshot.count += count;
+        }
+        snapshot.sum += shard.sum.load(std::memory_order_relaxed);
+        snapshot.max = std::max(snapshot.max, shard.max.load(std::memory_order_relaxed));
+    }
+    return snapshot;
+}
+
+uint64_t Histogram::upperBound(size_t index) {
+    const size_t group = index / SUB_BUCKETS;
+    const uint64_t sub_bucket = index % SUB_BUCKETS;
+    if (group == 0) {
+        return sub_bucket;
+    }
+    return ((SUB_BUCKETS + sub_bucket + 1) << (group - 1)) - 1;
+}
+
+uint64_t HistogramSnapshot::quantile(double q) const {
+    if (count == 0) {
+        return 0;
+    }
+
+    const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * count + 0.5));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return std::min(Histogram::upperBound(i), max);
+        }
+    }
+    return max;
+}
+
+MetricsRegistry& MetricsRegistry::global() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+MetricsRegistry::Entry* MetricsRegistry::find(const std::string &name, const Labels &labels) {
+    for (Entry &entry : entries) {
+        if (entry.name == name && entry.labels == labels) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+Counter& MetricsRegistry::counter(const std::string &name, const std::string &help, const Labels &labels) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (Entry *entry = find(name, labels); entry && entry->counter) {
+        return *entry->counter;
+    }
+    entries.push_back({name, labels, help, MetricType::COUNTER, std::make_unique<Counter>(), nullptr, nullptr});
+    return *entries.back().counter;
+}
+
+Gauge& MetricsRegistry::gauge(const std::string &name, const std::string &help, const Labels &labels) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (Entry *entry = find(name, labels); entry && entry->gauge) {
+        return *entry->gauge;
+    }
+    entries.push_back({name, labels, help, MetricType::GAUGE, nullptr, std::make_unique<Gauge>(), nullptr});
+    return *entries.back().gauge;
+}
+
+Histogram& MetricsRegistry::histogram(const std::string &name, const std::string &help, const Labels &labels) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (Entry *entry = find(name, labels); entry && entry->histogram) {
+        return *entry->histogram;
+    }
+    entries.push_back({name, labels, help, MetricType::SUMMARY, nullptr, nullptr, std::make_unique<Histogram>()});
+    return *entries.back().histogram;
+}
+
+void MetricsRegistry::addCollector(const void *owner, Collector collector) {
+    std::lock_guard<std::mutex> lock(mutex);
+    collectors.emplace_back(owner, std::move(collector));
+}
+
+void MetricsRegistry::removeCollectors(const void *owner) {
+    std::lock_guard<std::mutex> lock(mutex);
+    collectors.erase(std::remove_if(collectors.begin(), collectors.end(), [owner](const auto &c) {
+        return c.first == owner;
+    }), collectors.end());
+}
+
+static std::string family(const MetricSample &sample) {
+    if (sample.type == MetricType::SUMMARY) {
+        for (const char *suffix : {"_sum", "_count"}) {
+            const size_t length = strlen(suffix);
+            if (sample.name.size() > length && sample.name.compare(sample.name.size() - length, length, suffix) == 0) {
+                return sample.name.substr(0, sample.name.size() - length);
+            }
+        }
+    }
+    return sample.name;
+}
+
+std::vector<MetricSample> MetricsRegistry::collect() const {
+    static constexpr std::pair<const char*, double> QUANTILES[] = {{"0.5", 0.5}, {"0.9", 0.9}, {"0.99", 0.99}, {"0.999", 0.999}};
+
+    std::vector<MetricSample> samples;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const Entry &entry : entries) {
+        switch (entry.type) {
+            case MetricType::COUNTER:
+                samples.push_back({entry.name, entry.labels, entry.help, entry.type, static_cast<double>(entry.counter->value())});
+                break;
+            case MetricType::GAUGE:
+                samples.push_back({entry.name, entry.labels, entry.help, entry.type, static_cast<double>(entry.gauge->value())});
+                break;
+            case MetricType::SUMMARY: {
+                const HistogramSnapshot snapshot = entry.histogram->snapshot();
+                for (const auto &[label, q] : QUANTILES) {
+                    Labels labels = entry.labels;
+                    labels.emplace_back("quantile", label);
+                    samples.push_back({entry.name, labels, entry.help, entry.type, static_cast<double>(snapshot.quantile(q))});
+                }
+                samples.push_back({entry.name + "_sum", entry.labels, entry.help, entry.type, static_cast<double>(snapshot.sum)});
+                samples.push_back({entry.name + "_count", entry.labels, entry.help, entry.type, static_cast<double>(snapshot.count)});
+                samples.push_back({entry.name + "_max", entry.labels, entry.help, MetricType::GAUGE, static_cast<double>(snapshot.max)});
+                break;
+            }
+        }
+    }
+
+    for (const auto &collector : collectors) {
+        collector.second(samples);
+    }
+
+    // group by family for the exposition format
+    std::stable_sort(samples.begin(), samples.end(), [](const MetricSample &a, const MetricSample &b) {
+        return family(a) < family(b);
+    });
+    return samples;
+}
+
+static void write_escaped(std::ostream &os, const std::string &s) {
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            os << '\\' << c;
+        } else if (c == '\n') {
+            os << "\\n";
+        } else {
+            os << c;
+        }
+    }
+}
+
+void MetricsRegistry::writePrometheus(std::ostream &os) const {
+    std::string last_family;
+    for (const MetricSample &sample : collect()) {
+        const std::string name = family(sample);
+        if (name != last_family) {
+            os << "# HELP " << name << ' ' << sample.help << '\n';
+            os << "# TYPE " << name << ' ' << (sample.type == MetricType::COUNTER ? "counter" : sample.type == MetricType::GAUGE ? "gauge" : "summary") << '\n';
+            last_family = name;
+        }
+
+        os << sample.name;
+        if (!sample.labels.empty()) {
+            os << '{';
+            bool comma = false;
+            for (const auto &[key, value] : sample.labels) {
+                os << (comma ? "," : "") << key << "=\"";
+                write_escaped(os, value);
+                os << '"';
+                comma = true;
+            }
+            os << '}';
+        }
+        os << ' ' << sample.value << '\n';
+    }
+}
+
+void MetricsRegistry::writeJson(std::ostream &os) const {
+    os << R"({"metrics":[)";
+    bool comma = false;
+    for (const MetricSample &sample : collect()) {
+        os << (comma ? "," : "") << R"({"name":")" << sample.name << R"(","labels":{)";
+        bool label_comma = false;
+        for (const auto &[key, value] : sample.labels) {
+            os << (label_comma ? "," : "") << '"' << key << R"(":")";
+            write_escaped(os, value);
+            os << '"';
+            label_comma = true;
+        }
+        os << R"(},"value":)" << sample.value << '}';
+        comma = true;
+    }
+    os << "]}";
+}
+
+MetricsExporter::MetricsExporter() : name("metrics exporter") {
+    const Config &config = Config::global();
+    file_path = config.getString("metrics.file");
+    socket_path = config.getString("metrics.socket");
+    json = config.getString("metrics.format", "prometheus") == "json";
+    period = std::chrono::milliseconds(config.getInt("metrics.period", 1000));
+}
+
+MetricsExporter::~MetricsExporter() {
+    stop();
+}
+
+bool MetricsExporter::enabled() const {
+    return !file_path.empty() || !socket_path.empty();
+}
+
+void MetricsExporter::start() {
+    if (!enabled() || !export_stop_condition.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    if (!socket_path.empty()) {
+        listen_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+        unlink(socket_path.c_str());
+        if (listen_socket < 0 || bind(listen_socket, (sockaddr*)&address, sizeof(address)) < 0 || ::listen(listen_socket, 4) < 0) {
+            std::cerr << name << ": unable to serve on " << socket_path << ", " << strerror(errno) << std::endl;
+            if (listen_socket >= 0) {
+                close(listen_socket);
+            }
+            listen_socket = -1;
+        }
+    }
+
+    export_stop_condition.store(false, std::memory_order_relaxed);
+    export_thread = std::thread(&MetricsExporter::run, this);
+}
+
+void MetricsExporter::run() {
+    ThreadScope scope("metrics");
+    auto next_write = std::chrono::steady_clock::now();
+    while (!export_stop_condition.load(std::memory_order_relaxed)) {
+        if (!file_path.empty() && std::chrono::steady_clock::now() >= next_write) {
+            writeFile();
+            next_write += period;
+        }
+
+        // wake up at least every 100ms to notice stop()
+        const auto wait = std::min(std::chrono::duration_cast<std::chrono::milliseconds>(next_write - std::chrono::steady_clock::now()), std::chrono::milliseconds(100));
+        if (listen_socket >= 0) {
+            pollfd fd = {listen_socket, POLLIN, 0};
+            if (poll(&fd, 1, std::max<int>(0, wait.count())) > 0) {
+                serve();
+            }
+        } else if (wait.count() > 0) {
+            std::this_thread::sleep_for(wait);
+        }
+    }
+}
+
+void MetricsExporter::stop() {
+    if (!export_stop_condition.load(std::memory_order_relaxed)) {
+        export_stop_condition.store(true, std::memory_order_relaxed);
+        if (export_thread.joinable()) {
+            export_thread.join();
+        }
+        // final values
+        if (!file_path.empty()) {
+            writeFile();
+        }
+        if (listen_socket >= 0) {
+            close(listen_socket);
+            unlink(socket_path.c_str());
+            listen_socket = -1;
+        }
+    }
+}
+
+std::string MetricsExporter::render() const {
+    std::ostringstream os;
+    if (json) {
+        MetricsRegistry::global().writeJson(os);
+    } else {
+        MetricsRegistry::global().writePrometheus(os);
+    }
+    return os.str();
+}
+
+void MetricsExporter::writeFile() const {
+    // scrapers must never see a partial file
+    const std::string tmp_path = file_path + ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::trunc);
+        file << render();
+        if (!file) {
+            std::cerr << name << ": unable to write " << tmp_path << std::endl;
+            return;
+        }
+    }
+    if (rename(tmp_path.c_str(), file_path.c_str()) < 0) {
+        std::cerr << name << ": unable to replace " << file_path << ", " << strerror(errno) << std::endl;
+    }
+}
+
+void MetricsExporter::serve() {
+    const int client = accept4(listen_socket, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client < 0) {
+        return;
+    }
+
+    const std::string text = render();
+    size_t offset = 0;
+    while (offset < text.size()) {
+        const ssize_t written = send(client, text.data() + offset, text.size() - offset, MSG_NOSIGNAL);
+        if (written <= 0) {
+            break;
+        }
+        offset += written;
+    }
+    close(client);
+}
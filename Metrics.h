@@ -0,0 +1,199 @@
+#ifndef REMOTE_CLIENT_METRICS_H
+#define REMOTE_CLIENT_METRICS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <ostream>
+
+// updates are relaxed atomics on a per thread shard so hot paths pay a few ns
+// and never share a cache line with another writer, reads merge the shards
+constexpr size_t METRIC_SHARDS = 8;
+
+size_t metric_shard();
+
+using Labels = std::vector<std::pair<std::string, std::string>>;
+
+enum class MetricType {
+    COUNTER,
+    GAUGE,
+    SUMMARY,
+};
+
+class Counter {
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> value = 0;
+    };
+    Shard shards[METRIC_SHARDS];
+
+public:
+    void add(uint64_t n = 1) {
+        shards[metric_shard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const;
+};
+
+class Gauge {
+private:
+    std::atomic<int64_t> current = 0;
+
+public:
+    void set(int64_t v) {
+        current.store(v, std::memory_order_relaxed);
+    }
+
+    void add(int64_t n) {
+        current.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    int64_t value() const {
+        return current.load(std::memory_order_relaxed);
+    }
+};
+
+struct HistogramSnapshot {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    std::vector<uint64_t> buckets;
+
+    // upper bound of the bucket holding the q-th value, relative error below 1/SUB_BUCKETS
+    uint64_t quantile(double q) const;
+};
+
+// HDR style log-linear buckets: exact below SUB_BUCKETS, then SUB_BUCKETS buckets per power of two
+class Histogram {
+public:
+    static constexpr unsigned SUB_BUCKET_BITS = 4;
+    static constexpr uint64_t SUB_BUCKETS = 1U << SUB_BUCKET_BITS;
+    static constexpr unsigned MAX_BITS = 40;
+    static constexpr size_t BUCKETS = (MAX_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> buckets[BUCKETS] = {};
+        std::atomic<uint64_t> sum = 0;
+        std::atomic<uint64_t> max = 0;
+    };
+    std::unique_ptr<Shard[]> shards;
+
+public:
+    Histogram();
+
+    void record(uint64_t value) {
+        Shard &shard = shards[metric_shard()];
+        shard.buckets[index(value)].fetch_add(1, std::memory_order_relaxed);
+        shard.sum.fetch_add(value, std::memory_order_relaxed);
+        if (value > shard.max.load(std::memory_order_relaxed)) {
+            shard.max.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    HistogramSnapshot snapshot() const;
+
+    static size_t index(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return value;
+        }
+        if (value >= (uint64_t(1) << MAX_BITS)) {
+            return BUCKETS - 1;
+        }
+        // group by power of two, then the SUB_BUCKET_BITS bits following the leading one
+        const unsigned msb = 63 - __builtin_clzll(value);
+        const unsigned group = msb - SUB_BUCKET_BITS + 1;
+        return group * SUB_BUCKETS + ((value >> (group - 1)) & (SUB_BUCKETS - 1));
+    }
+
+    static uint64_t upperBound(size_t index);
+};
+
+struct MetricSample {
+    std::string name;
+    Labels labels;
+    std::string help;
+    MetricType type;
+    double value;
+};
+
+class MetricsRegistry {
+public:
+    using Collector = std::function<void(std::vector<MetricSample> &samples)>;
+
+private:
+    struct Entry {
+        std::string name;
+        Labels labels;
+        std::string help;
+        MetricType type;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Histogram> histogram;
+    };
+
+    std::deque<Entry> entries;
+    std::vector<std::pair<const void*, Collector>> collectors;
+    mutable std::mutex mutex;
+
+public:
+    static MetricsRegistry& global();
+
+    // get or create, the returned reference lives as long as the registry
+    Counter& counter(const std::string &name, const std::string &help, const Labels &labels = {});
+    Gauge& gauge(const std::string &name, const std::string &help, const Labels &labels = {});
+    Histogram& histogram(const std::string &name, const std::string &help, const Labels &labels = {});
+
+    // values owned elsewhere (queue depth, stats structs...) are pulled at export time
+    void addCollector(const void *owner, Collector collector);
+    void removeCollectors(const void *owner);
+
+    std::vector<MetricSample> collect() const;
+    void writePrometheus(std::ostream &os) const;
+    void writeJson(std::ostream &os) const;
+
+private:
+    Entry* find(const std::string &name, const Labels &labels);
+};
+
+// periodically writes the registry to a file (atomically replaced) and/or serves it on a unix socket:
+//   metrics.file = /run/user/1000/remote_client.prom
+//   metrics.socket = /run/user/1000/remote_client.sock
+//   metrics.format = prometheus|json
+//   metrics.period = 1000 (ms)
+class MetricsExporter {
+private:
+    std::string name;
+    std::string file_path;
+    std::string socket_path;
+    bool json;
+    std::chrono::milliseconds period;
+    int listen_socket = -1;
+
+    std::atomic<bool> export_stop_condition = true;
+    std::thread export_thread;
+
+public:
+    MetricsExporter();
+    ~MetricsExporter();
+
+    bool enabled() const;
+
+    void start();
+    void run();
+    void stop();
+
+private:
+    void writeFile() const;
+    void serve();
+    std::string render() const;
+};
+
+#endif //REMOTE_CLIENT_METRICS_H
@@ -1,19 +1,33 @@
 #include <unistd.h>
 #include <iostream>
+#include <chrono>
 
 #include "RTPAudioReceiver.h"
+#include "Log.h"
 #include "exception.h"
+#include "ThreadPolicy.h"
+#include "Trace.h"
+#include "ClockSync.h"
+#include "Config.h"
 
-RTPAudioReceiver::RTPAudioReceiver() : name("rtp audio receiver") {
+RTPAudioReceiver::RTPAudioReceiver() : RTPAudioReceiver("rtp audio receiver") {
 
 }
 
-RTPAudioReceiver::RTPAudioReceiver(std::string name) : name(std::move(name)) {
+RTPAudioReceiver::RTPAudioReceiver(std::string name) : name(std::move(name)),
+    packets_received(MetricsRegistry::global().counter("rtp_packets_total", "depacketized packets received", {{"stream", "audio"}})),
+    bytes_received(MetricsRegistry::global().counter("rtp_bytes_total", "depacketized bytes received", {{"stream", "audio"}})),
+    corrupt_packets(MetricsRegistry::global().counter("rtp_corrupt_packets_total", "packets flagged corrupt by the depacketizer, usually loss", {{"stream", "audio"}})),
+    decode_errors(MetricsRegistry::global().counter("decode_errors_total", "packets the decoder rejected", {{"stream", "audio"}})),
+    frames_decoded(MetricsRegistry::global().counter("decoded_frames_total", "frames out of the decoder", {{"stream", "audio"}})),
+    decode_time(MetricsRegistry::global().histogram("decode_time_us", "time to send a packet and receive its frames", {{"stream", "audio"}})),
+    socket_budget(MemoryBudget::global().stage("audio-socket")) {
 
 }
 
 RTPAudioReceiver::~RTPAudioReceiver() {
     stop();
+    socket_budget.reserve(-socket_reserved);
     if (format_ctx) {
         avformat_free_context(format_ctx);
         format_ctx = nullptr;
@@ -40,7 +54,10 @@ void RTPAudioReceiver::init(const char *path) {
     av_dict_set(&options,"protocol_whitelist","file,udp,rtp,rtp_mpegts,rtcp",0);
     //av_dict_set(&options,"probesize","1M",0);
     //av_dict_set(&options,"fifo_size","1M",0);
-    av_dict_set(&options,"buffer_size","384K",0);
+    const uint64_t buffer_size = Config::global().getSize("budget.audio-socket.buffer", 384 << 10);
+    av_dict_set_int(&options, "buffer_size", buffer_size, 0);
+    socket_budget.reserve(buffer_size - socket_reserved);
+    socket_reserved = buffer_size;
     if (avformat_open_input(&format_ctx, path, NULL, &options) != 0) {
         throw InitFail("Couldn't open input stream");
     }
@@ -56,36 +73,67 @@ void RTPAudioReceiver::init(const char *path) {
         throw InitFail("Couldn't find a video stream");
     }
 
+    openDecoder(codec, format_ctx->streams[stream_index]->codecpar);
+}
+
+void RTPAudioReceiver::init(const AVCodecParameters *parameters) {
+    // replay, packets come from decodePacket instead of a format context
+    if (format_ctx) {
+        avformat_free_context(format_ctx);
+        format_ctx = nullptr;
+    }
+
+    if (codec_ctx) {
+        avcodec_free_context(&codec_ctx);
+    }
+
+    AVCodec *codec = avcodec_find_decoder(parameters->codec_id);
+    if (!codec) {
+        throw InitFail("Couldn't find an audio decoder");
+    }
+    openDecoder(codec, parameters);
+}
+
+void RTPAudioReceiver::openDecoder(AVCodec *codec, const AVCodecParameters *parameters) {
     codec_ctx = avcodec_alloc_context3(codec);
     if (!codec_ctx) {
         throw InitFail("Could not allocate video codec context");
     }
 
-    if (avcodec_parameters_to_context(codec_ctx, format_ctx->streams[stream_index]->codecpar) < 0) {
+    if (avcodec_parameters_to_context(codec_ctx, parameters) < 0) {
         throw InitFail("Could not allocate video codec context");
     }
 
-    if(avcodec_open2(codec_ctx, codec, NULL) < 0) {
+    if (ThreadPolicy::adopt("audio-decoder", [this, codec] { return avcodec_open2(codec_ctx, codec, NULL); }) < 0) {
         throw InitFail("Could not open codec");
     }
 
     initialized = true;
-    std::cerr << name << ": initialized" << std::endl;
+    LOG_INFO(name << ": initialized");
 }
 
 AVCodecContext* RTPAudioReceiver::getContext() const {
     return codec_ctx;
 }
 
+AVRational RTPAudioReceiver::getTimeBase() const {
+    // without a format context the packets come from a capture, stamped with the rtp clock
+    return format_ctx ? format_ctx->streams[stream_index]->time_base : AVRational{1, codec_ctx->sample_rate};
+}
+
+bool RTPAudioReceiver::isInitialized() const {
+    return initialized;
+}
+
 void RTPAudioReceiver::start() {
     //startDrain();
     startReceive();
 }
 
-void RTPAudioReceiver::stop() {
+void RTPAudioReceiver::stop(bool drain) {
     stopReceive();
     stopDrain();
-    flush();
+    flush(drain);
 }
 
 void RTPAudioReceiver::startReceive() {
@@ -96,59 +144,82 @@ void RTPAudioReceiver::startReceive() {
 }
 
 void RTPAudioReceiver::receive() {
-    std::cerr << name << ": receive thread pid is " << gettid() << std::endl;
-    int ret;
+    ThreadScope scope("audio-receive");
+    LOG_DEBUG(name << ": receive thread pid is " << gettid());
     AVPacket *packet = av_packet_alloc();
     try {
         while (initialized && !receive_stop_condition) {
             if (av_read_frame(format_ctx, packet) < 0) {
                 throw RunError("can't grab frame");
             }
+            const int64_t receive_us = ClockSync::now();
 
             if (packet->stream_index != stream_index) {
                 throw RunError("wrong index");
             }
 
-            Source<AVPacket>::forward(packet);
-
-            // for 2 threads
-            /*decoder_lock.lock();
-            ret = avcodec_send_packet(codec_ctx, packet);
-            decoder_lock.unlock();
-            decoder_cv.notify_all();
-            if (ret == AVERROR(EAGAIN)) {
-                std::cout << name << ": encoder buffer may be full, drop frame" << std::endl;
-            } else if (ret < 0) {
-                throw RunError("error when sending frame to encoder");
-            }*/
-
-            // for 1 thread
-            ret = avcodec_send_packet(codec_ctx, packet);
-            if (ret < 0) {
-                throw RunError("decode packet error");
-            }
-            while (ret >= 0) {
-                AVFrame *frame = av_frame_alloc();
-                ret = avcodec_receive_frame(codec_ctx, frame);
-                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                    break;
-                } else if (ret < 0) {
-                    throw RunError("error during decoding");
-                }
-
-                Source<AVFrame>::forward(frame);
-                av_frame_unref(frame);
-            }
-
+            decodePacket(packet, receive_us);
             av_packet_unref(packet);
         }
     } catch (const std::exception &e) {
-        std::cerr << name << ": " << e.what() << std::endl;
+        LOG_ERROR(name << ": " << e.what());
     }
 
     av_packet_free(&packet);
 }
 
+void RTPAudioReceiver::decodePacket(AVPacket *packet, int64_t receive_us) {
+    int ret;
+    Trace::instant("audio packet", packet->size);
+    packets_received.add();
+    bytes_received.add(packet->size);
+    if (packet->flags & AV_PKT_FLAG_CORRUPT) {
+        corrupt_packets.add();
+    }
+
+    Source<AVPacket>::forward(packet);
+
+    // for 2 threads
+    /*decoder_lock.lock();
+    ret = avcodec_send_packet(codec_ctx, packet);
+    decoder_lock.unlock();
+    decoder_cv.notify_all();
+    if (ret == AVERROR(EAGAIN)) {
+        std::cout << name << ": encoder buffer may be full, drop frame" << std::endl;
+    } else if (ret < 0) {
+        throw RunError("error when sending frame to encoder");
+    }*/
+
+    // for 1 thread
+    const auto decode_start = std::chrono::steady_clock::now();
+    TraceScope trace_decode("audio decode");
+    ret = avcodec_send_packet(codec_ctx, packet);
+    if (ret < 0) {
+        decode_errors.add();
+        throw RunError("decode packet error");
+    }
+    while (ret >= 0) {
+        AVFrame *frame = av_frame_alloc();
+        ret = avcodec_receive_frame(codec_ctx, frame);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            av_frame_free(&frame);
+            break;
+        } else if (ret < 0) {
+            av_frame_free(&frame);
+            decode_errors.add();
+            throw RunError("error during decoding");
+        }
+
+        // arrival time of the packet, the display measures the latency of the rest of the pipeline from it
+        frame->opaque = reinterpret_cast<void*>(static_cast<intptr_t>(receive_us));
+        frames_decoded.add();
+        // the sinks get references of their own
+        Source<AVFrame>::forward(frame);
+        av_frame_free(&frame);
+    }
+    decode_time.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - decode_start).count());
+}
+
 void RTPAudioReceiver::stopReceive() {
     if (!receive_stop_condition) {
         receive_stop_condition = true;
@@ -166,7 +237,8 @@ void RTPAudioReceiver::startDrain() {
 }
 
 void RTPAudioReceiver::drain() {
-    std::cerr << name << ": drain thread pid is " << gettid() << std::endl;
+    ThreadScope scope("audio-drain");
+    LOG_DEBUG(name << ": drain thread pid is " << gettid());
     std::mutex m;
     AVFrame *frame = av_frame_alloc();
     int ret = 0;
@@ -193,7 +265,7 @@ void RTPAudioReceiver::drain() {
             }
         }
     } catch (const std::exception &e) {
-        std::cout << e.what() << std::endl;
+        LOG_ERROR(e.what());
     }
 
     av_frame_free(&frame);
@@ -208,33 +280,41 @@ void RTPAudioReceiver::stopDrain() {
     }
 }
 
-void RTPAudioReceiver::flush() {
+void RTPAudioReceiver::flush(bool drain) {
     if (!receive_stop_condition || !drain_stop_condition) {
-        std::cout << name << ": flush order ignored, stop threads first" << std::endl;
+        LOG_WARNING(name << ": flush order ignored, stop threads first");
         return;
     }
 
     if (!initialized) {
-        std::cout << name << ": is not initialized, nothing to do" << std::endl;
+        LOG_DEBUG(name << ": is not initialized, nothing to do");
         return;
     }
 
     initialized = false;
-    int ret = avcodec_send_frame(codec_ctx, nullptr);
-    AVFrame *frame = av_frame_alloc();
+    if (!drain) {
+        // the next init replaces the decoder with what it still holds
+        return;
+    }
+    // end of stream, the decoder hands out the frames it still holds
+    int ret = avcodec_send_packet(codec_ctx, nullptr);
     try {
-        while (ret >= 0 || ret == AVERROR(EAGAIN)) {
+        while (ret >= 0) {
+            AVFrame *frame = av_frame_alloc();
             ret = avcodec_receive_frame(codec_ctx, frame);
-            if (ret < 0 && ret != AVERROR_EOF) {
-                throw RunError("error while flushing decoder");
+            if (ret < 0) {
+                av_frame_free(&frame);
+                if (ret != AVERROR_EOF) {
+                    throw RunError("error while flushing decoder");
+                }
+                break;
             }
 
+            frames_decoded.add();
             Source<AVFrame>::forward(frame);
-            av_frame_unref(frame);
+            av_frame_free(&frame);
         }
     } catch (const std::exception &e) {
-        std::cout << e.what() << std::endl;
+        LOG_ERROR(e.what());
     }
-
-    av_frame_free(&frame);
 }
\ No newline at end of file
@@ -14,6 +14,8 @@ extern "C" {
 
 #include "source.h"
 #include "spinlock.h"
+#include "Metrics.h"
+#include "Budget.h"
 
 class RTPAudioReceiver : public Source<AVPacket>, public Source<AVFrame> {
 private:
@@ -33,26 +35,48 @@ private:
     spinlock decoder_lock;
     std::condition_variable decoder_cv;
 
+    Counter &packets_received;
+    Counter &bytes_received;
+    Counter &corrupt_packets;
+    Counter &decode_errors;
+    Counter &frames_decoded;
+    Histogram &decode_time;
+    // socket buffers handed to ffmpeg, counted in the budget while a stream is open
+    BudgetStage &socket_budget;
+    int64_t socket_reserved = 0;
+
+    void openDecoder(AVCodec *codec, const AVCodecParameters *parameters);
+
 public:
     explicit RTPAudioReceiver();
     explicit RTPAudioReceiver(std::string name);
     ~RTPAudioReceiver();
 
     void init(const char *path);
+    // decoder only, for packets fed through decodePacket
+    void init(const AVCodecParameters *parameters);
     AVCodecContext* getContext() const;
+    // of the packet timestamps
+    AVRational getTimeBase() const;
+    bool isInitialized() const;
 
     void start();
-    void stop();
+    // drain: the frames still in the decoder go to the sinks, otherwise they are dropped, for a re-init
+    // where the sinks are being torn down and the stream they belong to is gone
+    void stop(bool drain = true);
 
     void startReceive();
     void receive();
     void stopReceive();
 
+    // forwards the packet to the packet sinks, decodes it and forwards its frames
+    void decodePacket(AVPacket *packet, int64_t receive_us);
+
     void startDrain();
     void drain();
     void stopDrain();
 
-    void flush();
+    void flush(bool drain = true);
 };
 
 
@@ -1,8 +1,14 @@
 #include <unistd.h>
 #include <iostream>
+#include <chrono>
 
 #include "RTPVideoReceiver.h"
+#include "Log.h"
 #include "exception.h"
+#include "ThreadPolicy.h"
+#include "Trace.h"
+#include "ClockSync.h"
+#include "Config.h"
 
 static AVHWAccel* ff_find_hwaccel(AVCodecID codec_id, AVPixelFormat pixel_format) {
     AVHWAccel *hwaccel = NULL;
@@ -24,16 +30,35 @@ static AVPixelFormat get_format_vaapi(AVCodecContext *ctx, const AVPixelFormat *
     return AV_PIX_FMT_NONE;
 }
 
-RTPVideoReceiver::RTPVideoReceiver() : name("rtp video receiver") {
+RTPVideoReceiver::RTPVideoReceiver() : RTPVideoReceiver("rtp video receiver") {
 
 }
 
-RTPVideoReceiver::RTPVideoReceiver(std::string name) : name(std::move(name)){
+// every screen has its own series, the rate controller only follows the primary one
+static Labels video_labels(int index) {
+    return {{"stream", "video"}, {"index", std::to_string(index)}};
+}
 
+RTPVideoReceiver::RTPVideoReceiver(std::string name, int index) : name(std::move(name)), gate(BitstreamGate::Settings::fromConfig()),
+    packets_received(MetricsRegistry::global().counter("rtp_packets_total", "depacketized packets received", video_labels(index))),
+    bytes_received(MetricsRegistry::global().counter("rtp_bytes_total", "depacketized bytes received", video_labels(index))),
+    corrupt_packets(MetricsRegistry::global().counter("rtp_corrupt_packets_total", "packets flagged corrupt by the depacketizer, usually loss", video_labels(index))),
+    decode_errors(MetricsRegistry::global().counter("decode_errors_total", "packets the decoder rejected", video_labels(index))),
+    frames_decoded(MetricsRegistry::global().counter("decoded_frames_total", "frames out of the decoder", video_labels(index))),
+    decode_time(MetricsRegistry::global().histogram("decode_time_us", "time to send a packet and receive its frames", video_labels(index))),
+    hidden_packets(MetricsRegistry::global().counter("hidden_packets_total", "packets left undecoded while the window was hidden", video_labels(index))),
+    held_packets(MetricsRegistry::global().counter("gate_held_packets_total", "packets held back until the decoder can start on a random access point", video_labels(index))),
+    keyframe_requests(MetricsRegistry::global().counter("gate_keyframe_requests_total", "keyframes asked for while the decoder waited", video_labels(index))),
+    socket_budget(MemoryBudget::global().stage("video-socket")) {
+    const Config &config = Config::global();
+    decoder_threads = static_cast<int>(config.getInt("decoder.threads", 4));
+    decoder_thread_type = config.getString("decoder.thread_type", "slice") == "frame" ? FF_THREAD_FRAME : FF_THREAD_SLICE;
+    max_backlog = config.getSize("power.max_backlog", 600);
 }
 
 RTPVideoReceiver::~RTPVideoReceiver() {
     stop();
+    socket_budget.reserve(-socket_reserved);
     if (format_ctx) {
         avformat_free_context(format_ctx);
         format_ctx = nullptr;
@@ -60,8 +85,14 @@ void RTPVideoReceiver::init(const char *path) {
     av_dict_set(&options, "protocol_whitelist", "file,udp,rtp,rtcp,rtp_mpegts", 0);
     //av_dict_set(&options,"framerate","-1",0);
     //av_dict_set(&options, "probesize", "4M", 0);
-    av_dict_set(&options, "fifo_size", "16M", 0);
-    av_dict_set(&options, "buffer_size", "1M", 0);
+    // handed to ffmpeg as they are, the budget counts them as bytes
+    const Config &config = Config::global();
+    const uint64_t fifo_size = config.getSize("budget.video-socket.fifo", 16 << 20);
+    const uint64_t buffer_size = config.getSize("budget.video-socket.buffer", 1 << 20);
+    av_dict_set_int(&options, "fifo_size", fifo_size, 0);
+    av_dict_set_int(&options, "buffer_size", buffer_size, 0);
+    socket_budget.reserve(fifo_size + buffer_size - socket_reserved);
+    socket_reserved = fifo_size + buffer_size;
     if (avformat_open_input(&format_ctx, path, NULL, &options) != 0) {
     //if (avformat_open_input(&format_ctx, "rtp://127.0.0.1:10002", NULL, &options) != 0) {
         throw InitFail("Couldn't open input stream");
@@ -78,17 +109,43 @@ void RTPVideoReceiver::init(const char *path) {
         throw InitFail("Couldn't find a video stream");
     }
 
+    openDecoder(codec, format_ctx->streams[stream_index]->codecpar);
+}
+
+void RTPVideoReceiver::init(const AVCodecParameters *parameters) {
+    // replay, packets come from decodePacket instead of a format context
+    if (format_ctx) {
+        avformat_free_context(format_ctx);
+        format_ctx = nullptr;
+    }
+
+    if (codec_ctx) {
+        avcodec_free_context(&codec_ctx);
+    }
+
+    AVCodec *codec = avcodec_find_decoder(parameters->codec_id);
+    if (!codec) {
+        throw InitFail("Couldn't find a video decoder");
+    }
+    openDecoder(codec, parameters);
+}
+
+void RTPVideoReceiver::openDecoder(AVCodec *codec, const AVCodecParameters *parameters) {
     codec_ctx = avcodec_alloc_context3(codec);
     if (!codec_ctx) {
         throw InitFail("Could not allocate video codec context");
     }
 
-    if (avcodec_parameters_to_context(codec_ctx, format_ctx->streams[stream_index]->codecpar) < 0) {
+    if (avcodec_parameters_to_context(codec_ctx, parameters) < 0) {
         throw InitFail("Could not allocate video codec context");
     }
 
-    if (codec->capabilities | AV_CODEC_CAP_SLICE_THREADS) {
-        codec_ctx->thread_count = 4;
+    // frame threads delay the output by a frame per thread, slice threads only help with sliced streams
+    if (decoder_thread_type == FF_THREAD_FRAME && (codec->capabilities & AV_CODEC_CAP_FRAME_THREADS)) {
+        codec_ctx->thread_count = decoder_threads;
+        codec_ctx->thread_type = FF_THREAD_FRAME;
+    } else if (codec->capabilities & AV_CODEC_CAP_SLICE_THREADS) {
+        codec_ctx->thread_count = decoder_threads;
         codec_ctx->thread_type = FF_THREAD_SLICE;
     }
 
@@ -125,27 +182,47 @@ void RTPVideoReceiver::init(const char *path) {
         std::cout << "Failed to create VAAPI device, use software decoding" << std::endl;
     }*/
 
-    if (avcodec_open2(codec_ctx, codec, NULL) < 0) {
+    // libavcodec starts its slice threads here, give them the decoder placement
+    if (ThreadPolicy::adopt("video-decoder", [this, codec] { return avcodec_open2(codec_ctx, codec, NULL); }) < 0) {
         throw InitFail("Could not open codec");
     }
+    gate.reset(codec_ctx->codec_id, codec_ctx->extradata, codec_ctx->extradata_size);
 
     initialized = true;
-    std::cerr << name << ": initialized" << std::endl;
+    LOG_INFO(name << ": initialized");
+}
+
+void RTPVideoReceiver::setKeyframeRequest(std::function<void()> callback) {
+    keyframe_request = std::move(callback);
+}
+
+void RTPVideoReceiver::setDecoderThreads(int count, int type) {
+    decoder_threads = count;
+    decoder_thread_type = type;
 }
 
 AVCodecContext* RTPVideoReceiver::getContext() const {
     return codec_ctx;
 }
 
+AVRational RTPVideoReceiver::getTimeBase() const {
+    // without a format context the packets come from a capture, stamped with the rtp clock
+    return format_ctx ? format_ctx->streams[stream_index]->time_base : AVRational{1, 90000};
+}
+
+bool RTPVideoReceiver::isInitialized() const {
+    return initialized.load(std::memory_order_relaxed);
+}
+
 void RTPVideoReceiver::start() {
     //startDrain();
     startReceive();
 }
 
-void RTPVideoReceiver::stop() {
+void RTPVideoReceiver::stop(bool drain) {
     stopReceive();
     stopDrain();
-    flush();
+    flush(drain);
 }
 
 void RTPVideoReceiver::startReceive() {
@@ -156,57 +233,187 @@ void RTPVideoReceiver::startReceive() {
 }
 
 void RTPVideoReceiver::receive() {
-    std::cerr << name << ": receive thread pid is " << gettid() << std::endl;
-    int ret;
+    ThreadScope scope("video-receive");
+    LOG_DEBUG(name << ": receive thread pid is " << gettid());
     AVPacket *packet = av_packet_alloc();
     try {
         while (initialized.load(std::memory_order_relaxed) && !receive_stop_condition.load(std::memory_order_relaxed)) {
             if (av_read_frame(format_ctx, packet) < 0) {
                 throw RunError("can't grab frame");
             }
+            const int64_t receive_us = ClockSync::now();
 
             if (packet->stream_index != stream_index) {
                 throw RunError("wrong index");
             }
 
-            Source<AVPacket>::forward(packet);
+            decodePacket(packet, receive_us);
+            av_packet_unref(packet);
+        }
+    } catch (const std::exception &e) {
+        LOG_ERROR(name << ": " << e.what());
+    }
 
-            // for 2 threads
-            /*decoder_lock.lock();
-            ret = avcodec_send_packet(codec_ctx, packet);
-            decoder_lock.unlock();
-            decoder_cv.notify_all();
-            if (ret == AVERROR(EAGAIN)) {
-                std::cout << name << ": encoder buffer may be full, drop frame" << std::endl;
-            } else if (ret < 0) {
-                throw RunError("error when sending frame to encoder");
-            }*/
+    av_packet_free(&packet);
+}
 
-            // for 1 thread
-            ret = avcodec_send_packet(codec_ctx, packet);
-            if (ret < 0) {
-                throw RunError("decode packet error");
-            }
-            while (ret >= 0) {
-                AVFrame *frame = av_frame_alloc();
-                ret = avcodec_receive_frame(codec_ctx, frame);
-                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                    break;
-                } else if (ret < 0) {
-                    throw RunError("error during decoding");
-                }
+void RTPVideoReceiver::decodePacket(AVPacket *packet, int64_t receive_us) {
+    Trace::instant("video packet", packet->size);
+    packets_received.add();
+    bytes_received.add(packet->size);
+    if (packet->flags & AV_PKT_FLAG_CORRUPT) {
+        corrupt_packets.add();
+    }
 
-                Source<AVFrame>::forward(frame);
-                av_frame_unref(frame);
-            }
+    Source<AVPacket>::forward(packet);
 
-            av_packet_unref(packet);
+    // nothing is decoded behind a hidden window, the latest pictures are decoded at once when it shows again
+    if (hidden.load(std::memory_order_relaxed)) {
+        if (!was_hidden) {
+            was_hidden = true;
+            LOG_INFO(name << ": window hidden, decoding stopped");
         }
-    } catch (const std::exception &e) {
-        std::cerr << name << ": " << e.what() << std::endl;
+        keepHidden(packet, receive_us);
+        return;
+    }
+    if (was_hidden) {
+        was_hidden = false;
+        catchUp(receive_us);
     }
 
-    av_packet_free(&packet);
+    // nothing reaches the decoder before a picture it can start from
+    const bool waiting = !gate.isOpen();
+    if (!gate.admit(packet, receive_us)) {
+        held_packets.add();
+        if (gate.keyframeDue(receive_us) && keyframe_request) {
+            LOG_INFO(name << ": no random access point yet, request a keyframe");
+            keyframe_requests.add();
+            keyframe_request();
+        }
+        return;
+    }
+    if (waiting) {
+        LOG_INFO(name << ": decoding from " << gate.getStartReason() << ", " << gate.getHeld() << " packets held before");
+    }
+
+    // for 2 threads
+    /*decoder_lock.lock();
+    ret = avcodec_send_packet(codec_ctx, packet);
+    decoder_lock.unlock();
+    decoder_cv.notify_all();
+    if (ret == AVERROR(EAGAIN)) {
+        std::cout << name << ": encoder buffer may be full, drop frame" << std::endl;
+    } else if (ret < 0) {
+        throw RunError("error when sending frame to encoder");
+    }*/
+
+    // for 1 thread
+    const auto decode_start = std::chrono::steady_clock::now();
+    sendToDecoder(packet, receive_us, nullptr);
+    decode_time.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - decode_start).count());
+}
+
+void RTPVideoReceiver::sendToDecoder(AVPacket *packet, int64_t receive_us, AVFrame **latest) {
+    TraceScope trace_decode("video decode");
+    int ret = avcodec_send_packet(codec_ctx, packet);
+    if (ret < 0) {
+        decode_errors.add();
+        throw RunError("decode packet error");
+    }
+    while (ret >= 0) {
+        AVFrame *frame = av_frame_alloc();
+        ret = avcodec_receive_frame(codec_ctx, frame);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            av_frame_free(&frame);
+            break;
+        } else if (ret < 0) {
+            av_frame_free(&frame);
+            decode_errors.add();
+            throw RunError("error during decoding");
+        }
+
+        // arrival time of the packet, the display measures the latency of the rest of the pipeline from it
+        frame->opaque = reinterpret_cast<void*>(static_cast<intptr_t>(receive_us));
+        frames_decoded.add();
+        if (latest) {
+            av_frame_free(latest);
+            *latest = frame;
+            continue;
+        }
+        // the sinks get references of their own
+        Source<AVFrame>::forward(frame);
+        av_frame_free(&frame);
+    }
+}
+
+void RTPVideoReceiver::setHidden(bool hidden) {
+    this->hidden.store(hidden, std::memory_order_relaxed);
+}
+
+void RTPVideoReceiver::keepHidden(AVPacket *packet, int64_t receive_us) {
+    // parsed only, the parameter sets and random access points stay known
+    if (!gate.admit(packet, receive_us)) {
+        held_packets.add();
+        return;
+    }
+    hidden_packets.add();
+    if (gate.isRandomAccess()) {
+        // everything before it is useless now
+        clearBacklog();
+        backlog_broken = false;
+    } else if (backlog_broken) {
+        return;
+    }
+    if (backlog.size() >= max_backlog) {
+        // wait for the next random access point instead
+        clearBacklog();
+        backlog_broken = true;
+        return;
+    }
+    backlog.push_back(av_packet_clone(packet));
+}
+
+void RTPVideoReceiver::catchUp(int64_t receive_us) {
+    if (backlog_broken || !gate.isOpen()) {
+        clearBacklog();
+        backlog_broken = false;
+        gate.close();
+        LOG_INFO(name << ": window shown, nothing to resume from, request a keyframe");
+        if (keyframe_request) {
+            keyframe_requests.add();
+            keyframe_request();
+        }
+        return;
+    }
+
+    // only the reference pictures are needed to get to the last one, and only the last one is shown
+    const auto start = std::chrono::steady_clock::now();
+    AVFrame *latest = nullptr;
+    const size_t count = backlog.size();
+    for (size_t i = 0; i < count; ++i) {
+        codec_ctx->skip_frame = i + 1 < count ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+        try {
+            sendToDecoder(backlog[i], receive_us, &latest);
+        } catch (const std::exception &e) {
+            LOG_WARNING(name << ": " << e.what() << " while catching up");
+        }
+    }
+    codec_ctx->skip_frame = AVDISCARD_DEFAULT;
+    clearBacklog();
+    if (latest) {
+        latest->opaque = reinterpret_cast<void*>(static_cast<intptr_t>(receive_us));
+        Source<AVFrame>::forward(latest);
+        av_frame_free(&latest);
+    }
+    LOG_INFO(name << ": window shown, caught up on " << count << " packets in "
+             << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count() << " ms");
+}
+
+void RTPVideoReceiver::clearBacklog() {
+    for (AVPacket *&packet : backlog) {
+        av_packet_free(&packet);
+    }
+    backlog.clear();
 }
 
 void RTPVideoReceiver::stopReceive() {
@@ -215,10 +422,10 @@ void RTPVideoReceiver::stopReceive() {
         if (receive_thread.joinable()) {
             receive_thread.join();
         } else {
-            std::cout << name << ": keepalive thread is not joinable" << std::endl;
+            LOG_DEBUG(name << ": keepalive thread is not joinable");
         }
     } else {
-        std::cout << name << ": keepalive thread already stopped" << std::endl;
+        LOG_DEBUG(name << ": keepalive thread already stopped");
     }
 }
 
@@ -230,7 +437,8 @@ void RTPVideoReceiver::startDrain() {
 }
 
 void RTPVideoReceiver::drain() {
-    std::cerr << name << ": drain thread pid is " << gettid() << std::endl;
+    ThreadScope scope("video-drain");
+    LOG_DEBUG(name << ": drain thread pid is " << gettid());
     std::mutex m;
     AVFrame *frame = av_frame_alloc();
     //AVFrame *sw_frame = av_frame_alloc();
@@ -259,7 +467,7 @@ void RTPVideoReceiver::drain() {
             }
         }
     } catch (const std::exception &e) {
-        std::cout << e.what() << std::endl;
+        LOG_ERROR(e.what());
     }
 
     av_frame_free(&frame);
@@ -272,40 +480,51 @@ void RTPVideoReceiver::stopDrain() {
         if (drain_thread.joinable()) {
             drain_thread.join();
         } else {
-            std::cout << name << ": keepalive thread is not joinable" << std::endl;
+            LOG_DEBUG(name << ": keepalive thread is not joinable");
         }
     } else {
-        std::cout << name << ": keepalive thread already stopped" << std::endl;
+        LOG_DEBUG(name << ": keepalive thread already stopped");
     }
 }
 
-void RTPVideoReceiver::flush() {
+void RTPVideoReceiver::flush(bool drain) {
     if (!receive_stop_condition.load(std::memory_order_relaxed) || !drain_stop_condition.load(std::memory_order_relaxed)) {
-        std::cout << name << ": flush order ignored, stop threads first" << std::endl;
+        LOG_WARNING(name << ": flush order ignored, stop threads first");
         return;
     }
 
+    clearBacklog();
+    backlog_broken = false;
+    was_hidden = false;
     if (!initialized.load(std::memory_order_relaxed)) {
-        std::cout << name << ": is not initialized, nothing to do" << std::endl;
+        LOG_DEBUG(name << ": is not initialized, nothing to do");
         return;
     }
 
     initialized = false;
-    int ret = avcodec_send_frame(codec_ctx, nullptr);
-    AVFrame *frame = av_frame_alloc();
+    if (!drain) {
+        // the next init replaces the decoder with what it still holds
+        return;
+    }
+    // end of stream, the decoder hands out the frames it still holds
+    int ret = avcodec_send_packet(codec_ctx, nullptr);
     try {
-        while (ret >= 0 || ret == AVERROR(EAGAIN)) {
+        while (ret >= 0) {
+            AVFrame *frame = av_frame_alloc();
             ret = avcodec_receive_frame(codec_ctx, frame);
-            if (ret < 0 && ret != AVERROR_EOF) {
-                throw RunError("error while flushing decoder");
+            if (ret < 0) {
+                av_frame_free(&frame);
+                if (ret != AVERROR_EOF) {
+                    throw RunError("error while flushing decoder");
+                }
+                break;
             }
 
+            frames_decoded.add();
             Source<AVFrame>::forward(frame);
-            av_frame_unref(frame);
+            av_frame_free(&frame);
         }
     } catch (const std::exception &e) {
-        std::cout << e.what() << std::endl;
+        LOG_ERROR(e.what());
     }
-
-    av_frame_free(&frame);
 }
\ No newline at end of file
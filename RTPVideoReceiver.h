@@ -12,9 +12,14 @@ extern "C" {
 #include <thread>
 #include <atomic>
 #include <condition_variable>
+#include <functional>
+#include <vector>
 
 #include "source.h"
 #include "spinlock.h"
+#include "Metrics.h"
+#include "Budget.h"
+#include "BitstreamGate.h"
 
 class RTPVideoReceiver :  public Source<AVPacket>, public Source<AVFrame> {
 private:
@@ -25,6 +30,8 @@ private:
     AVBufferRef *hw_device_ctx = nullptr;
     int stream_index;
     AVCodecContext *codec_ctx = nullptr;
+    int decoder_threads;
+    int decoder_thread_type;
 
     std::atomic<bool> receive_stop_condition = true;
     std::thread receive_thread;
@@ -32,29 +39,78 @@ private:
     std::atomic<bool> drain_stop_condition = true;
     std::thread drain_thread;
 
+    // receive thread only, reset with every decoder
+    BitstreamGate gate;
+    std::function<void()> keyframe_request;
+
+    // while hidden the packets since the last random access point are kept instead of decoded,
+    // up to power.max_backlog, broken when that wasn't enough
+    std::atomic<bool> hidden = false;
+    bool was_hidden = false;
+    std::vector<AVPacket*> backlog;
+    bool backlog_broken = false;
+    size_t max_backlog;
+
     spinlock decoder_lock;
     std::condition_variable decoder_cv;
 
+    Counter &packets_received;
+    Counter &bytes_received;
+    Counter &corrupt_packets;
+    Counter &decode_errors;
+    Counter &frames_decoded;
+    Histogram &decode_time;
+    Counter &hidden_packets;
+    Counter &held_packets;
+    Counter &keyframe_requests;
+    // socket buffers handed to ffmpeg, counted in the budget while a stream is open
+    BudgetStage &socket_budget;
+    int64_t socket_reserved = 0;
+
+    void openDecoder(AVCodec *codec, const AVCodecParameters *parameters);
+    // frames go to the frame sinks, or only the last one to latest
+    void sendToDecoder(AVPacket *packet, int64_t receive_us, AVFrame **latest);
+    void keepHidden(AVPacket *packet, int64_t receive_us);
+    void catchUp(int64_t receive_us);
+    void clearBacklog();
+
 public:
     explicit RTPVideoReceiver();
-    explicit RTPVideoReceiver(std::string name);
+    // index is the stream's, 0 for the primary screen, it labels the metrics
+    explicit RTPVideoReceiver(std::string name, int index = 0);
     ~RTPVideoReceiver();
 
+    // applies at the next init, count 0 lets libavcodec pick
+    void setDecoderThreads(int count, int type);
+    // called from the receive thread while the decoder waits for a random access point, set before start
+    void setKeyframeRequest(std::function<void()> callback);
     void init(const char *path);
+    // decoder only, for packets fed through decodePacket
+    void init(const AVCodecParameters *parameters);
     AVCodecContext* getContext() const;
+    // of the packet timestamps
+    AVRational getTimeBase() const;
+    bool isInitialized() const;
 
     void start();
-    void stop();
+    // drain: the frames still in the decoder go to the sinks, otherwise they are dropped, for a re-init
+    // where the sinks are being torn down and the stream they belong to is gone
+    void stop(bool drain = true);
 
     void startReceive();
     void receive();
     void stopReceive();
 
+    // forwards the packet to the packet sinks, decodes it and forwards its frames
+    void decodePacket(AVPacket *packet, int64_t receive_us);
+    // the window of the stream can't be seen, decoding stops until it can
+    void setHidden(bool hidden);
+
     void startDrain();
     void drain();
     void stopDrain();
 
-    void flush();
+    void flush(bool drain = true);
 };
 
 
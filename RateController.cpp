@@ -0,0 +1,474 @@
+#include <cmath>
+#include <algorithm>
+#include <sstream>
+
+#include "RateController.h"
+#include "ClockSync.h"
+#include "Config.h"
+#include "Log.h"
+
+// GCC constants, see draft-ietf-rmcat-gcc
+constexpr double TREND_GAIN = 4;
+constexpr int TREND_MAX_SAMPLES = 60;
+constexpr double THRESHOLD_MIN = 6;
+constexpr double THRESHOLD_MAX = 600;
+constexpr double THRESHOLD_UP = 0.0087;
+constexpr double THRESHOLD_DOWN = 0.039;
+constexpr double THRESHOLD_OUTLIER = 15;
+constexpr double DECREASE_FACTOR = 0.85;
+constexpr double INCREASE_FACTOR = 1.08;
+constexpr double LOSS_HIGH = 0.1;
+constexpr double LOSS_LOW = 0.02;
+
+// decode side, relative to the time between two frames
+constexpr double DECODE_BUSY = 0.8;
+constexpr double DECODE_IDLE = 0.5;
+constexpr uint64_t QUEUE_BUSY = 3;
+// below this the picture falls apart, a smaller one looks better
+constexpr double BPP_LOW = 0.03;
+constexpr double BPP_ROOM = 0.06;
+constexpr int LADDER[] = {2160, 1440, 1080, 900, 720, 540, 360};
+constexpr int LADDER_FPS_STEP = 720;
+
+RateEstimator::Settings RateEstimator::Settings::fromConfig() {
+    const Config &config = Config::global();
+    Settings settings;
+    settings.min_kbps = config.getInt("rate.min_bitrate", settings.min_kbps);
+    settings.max_kbps = std::max(config.getInt("rate.max_bitrate", settings.max_kbps), settings.min_kbps);
+    settings.start_kbps = config.getInt("rate.start_bitrate", settings.start_kbps);
+    settings.max_fps = static_cast<int>(config.getInt("rate.max_fps", settings.max_fps));
+    settings.min_fps = static_cast<int>(std::min<int64_t>(config.getInt("rate.min_fps", settings.min_fps), settings.max_fps));
+    settings.down_hold_us = config.getInt("rate.down_hold", settings.down_hold_us / 1000) * 1000;
+    settings.up_hold_us = config.getInt("rate.up_hold", settings.up_hold_us / 1000) * 1000;
+    return settings;
+}
+
+RateEstimator::RateEstimator(const Settings &settings) : settings(settings) {
+
+}
+
+RateDecision RateEstimator::update(const RateSignals &signals) {
+    const double dt_ms = last_update_us < 0 ? signals.interval_us / 1000. : (signals.time_us - last_update_us) / 1000.;
+    last_update_us = signals.time_us;
+
+    if (signals.width > 0 && signals.height > 0 && static_cast<int64_t>(signals.width) * signals.height > static_cast<int64_t>(native_width) * native_height) {
+        buildLevels(signals.width, signals.height);
+    }
+
+    detectUsage(signals, dt_ms);
+    const char *reason = updateBitrate(signals, dt_ms);
+    if (const char *level_reason = updateLevel(signals)) {
+        reason = level_reason;
+    }
+
+    RateDecision decision = {};
+    decision.bitrate_kbps = std::llround(bitrate_kbps);
+    decision.usage = usage;
+    decision.reason = reason;
+    if (!levels.empty()) {
+        decision.width = levelWidth(levels[level]);
+        decision.height = levels[level].height;
+        decision.fps = levels[level].fps;
+    } else {
+        decision.fps = settings.max_fps;
+    }
+    return decision;
+}
+
+void RateEstimator::detectUsage(const RateSignals &signals, double dt_ms) {
+    if (signals.frames == 0) {
+        // nothing arrived, the trend is stale
+        overuse_count = 0;
+        usage = RateUsage::NORMAL;
+        return;
+    }
+
+    const double trend = std::min(signals.delay_samples, TREND_MAX_SAMPLES) * signals.delay_trend * TREND_GAIN;
+    if (trend > threshold) {
+        // sustained over two intervals, a single late frame is not congestion
+        if (++overuse_count >= 2) {
+            usage = RateUsage::OVERUSE;
+        }
+    } else if (trend < -threshold) {
+        overuse_count = 0;
+        usage = RateUsage::UNDERUSE;
+    } else {
+        overuse_count = 0;
+        usage = RateUsage::NORMAL;
+    }
+
+    // the threshold follows the trend so competing tcp flows don't starve us, outliers are ignored
+    const double magnitude = std::fabs(trend);
+    if (magnitude < threshold + THRESHOLD_OUTLIER) {
+        const double k = magnitude < threshold ? THRESHOLD_DOWN : THRESHOLD_UP;
+        threshold += k * (magnitude - threshold) * std::min(dt_ms, 100.);
+        threshold = std::clamp(threshold, THRESHOLD_MIN, THRESHOLD_MAX);
+    }
+}
+
+const char* RateEstimator::updateBitrate(const RateSignals &signals, double dt_ms) {
+    const double incoming_kbps = signals.interval_us > 0 ? signals.bytes * 8000. / signals.interval_us : 0;
+    const double loss = signals.frames > 0 ? static_cast<double>(signals.corrupt_frames) / signals.frames : 0;
+    const char *reason = "hold";
+
+    if (bitrate_kbps <= 0) {
+        if (settings.start_kbps <= 0 && incoming_kbps <= 0) {
+            return reason;
+        }
+        bitrate_kbps = settings.start_kbps > 0 ? settings.start_kbps : incoming_kbps;
+        reason = "start";
+    } else if (usage == RateUsage::OVERUSE) {
+        // remember where the link gave up, increases slow down near it
+        if (capacity_kbps < 0) {
+            capacity_kbps = incoming_kbps;
+        } else {
+            const double error = capacity_kbps - incoming_kbps;
+            capacity_kbps = 0.95 * capacity_kbps + 0.05 * incoming_kbps;
+            capacity_variance = std::clamp(0.95 * capacity_variance + 0.05 * error * error / std::max(capacity_kbps, 1.), 0.4, 2.5);
+        }
+        bitrate_kbps = std::min(bitrate_kbps, DECREASE_FACTOR * incoming_kbps);
+        reason = "delay";
+    } else if (incoming_kbps <= 0) {
+        // a paused stream says nothing about the link
+    } else if (usage == RateUsage::NORMAL && signals.jitter_ms * signals.frames * 1000 > signals.interval_us) {
+        // arrivals spread over more than a frame interval, the queues are building before the trend shows it
+        reason = "jitter";
+    } else if (usage == RateUsage::NORMAL) {
+        const double deviation = std::sqrt(capacity_variance * std::max(capacity_kbps, 1.));
+        if (capacity_kbps >= 0 && incoming_kbps > capacity_kbps + 3 * deviation) {
+            // the link got better than what we knew of
+            capacity_kbps = -1;
+        }
+        if (capacity_kbps >= 0 && incoming_kbps > capacity_kbps - 3 * deviation) {
+            // near the known capacity, about half a frame per response time
+            const double response_ms = 100 + signals.rtt_us / 1000.;
+            const double fps = signals.frames * 1e6 / std::max<int64_t>(signals.interval_us, 1);
+            const double frame_kbits = bitrate_kbps / std::max(fps, 1.);
+            bitrate_kbps += std::max(1., 0.5 * frame_kbits * std::min(dt_ms / response_ms, 1.));
+        } else {
+            bitrate_kbps *= std::pow(INCREASE_FACTOR, std::min(dt_ms / 1000., 1.));
+        }
+        reason = "increase";
+        // the server may send less than allowed on a static scene, don't run away from what is received
+        bitrate_kbps = std::min(bitrate_kbps, 1.5 * incoming_kbps + 10);
+    }
+
+    // loss based bound, decode corruption is the loss we can see after the depacketizer
+    if (loss > LOSS_HIGH) {
+        bitrate_kbps *= 1 - 0.5 * loss;
+        reason = "loss";
+    }
+
+    bitrate_kbps = std::clamp(bitrate_kbps, static_cast<double>(settings.min_kbps), static_cast<double>(settings.max_kbps));
+    return reason;
+}
+
+const char* RateEstimator::updateLevel(const RateSignals &signals) {
+    if (levels.empty()) {
+        return nullptr;
+    }
+
+    const double frame_ms = signals.frames > 0 ? signals.interval_us / 1000. / signals.frames : 0;
+    const bool decode_busy = signals.frames > 0 && signals.decode_ms > DECODE_BUSY * frame_ms;
+    const bool decode_idle = signals.frames == 0 || signals.decode_ms < DECODE_IDLE * frame_ms;
+    const bool display_busy = signals.queue_depth >= QUEUE_BUSY || signals.display_drops > 0;
+    const bool starved = bitrate_kbps > 0 && level + 1 < levels.size() && bitsPerPixel(levels[level]) < BPP_LOW;
+    const double loss = signals.frames > 0 ? static_cast<double>(signals.corrupt_frames) / signals.frames : 0;
+
+    if (decode_busy || display_busy || starved) {
+        headroom_since_us = -1;
+        if (problem_since_us < 0) {
+            problem_since_us = signals.time_us;
+        }
+        if (level + 1 < levels.size() && signals.time_us - problem_since_us >= settings.down_hold_us
+            && signals.time_us - last_step_us >= settings.down_hold_us) {
+            ++level;
+            last_step_us = signals.time_us;
+            problem_since_us = signals.time_us;
+            return starved && !decode_busy && !display_busy ? "bitrate" : "decode";
+        }
+        return nullptr;
+    }
+
+    problem_since_us = -1;
+    const bool room = level > 0 && decode_idle && usage != RateUsage::OVERUSE && loss < LOSS_LOW
+                      && bitsPerPixel(levels[level - 1]) >= BPP_ROOM;
+    if (!room) {
+        headroom_since_us = -1;
+        return nullptr;
+    }
+    if (headroom_since_us < 0) {
+        headroom_since_us = signals.time_us;
+    }
+    if (signals.time_us - headroom_since_us >= settings.up_hold_us && signals.time_us - last_step_us >= settings.up_hold_us) {
+        --level;
+        last_step_us = signals.time_us;
+        headroom_since_us = signals.time_us;
+        return "recover";
+    }
+    return nullptr;
+}
+
+// the native size at full rate, the ladder sizes down to 720p at full rate, then the reduced rate all the way down
+void RateEstimator::buildLevels(int width, int height) {
+    native_width = width;
+    native_height = height;
+    levels.clear();
+    levels.push_back({height, settings.max_fps});
+    for (const int step : LADDER) {
+        if (step < height && step >= LADDER_FPS_STEP) {
+            levels.push_back({step, settings.max_fps});
+        }
+    }
+    if (settings.min_fps < settings.max_fps) {
+        levels.push_back({levels.back().height, settings.min_fps});
+    }
+    for (const int step : LADDER) {
+        if (step < levels.back().height) {
+            levels.push_back({step, settings.min_fps});
+        }
+    }
+    level = 0;
+}
+
+int RateEstimator::levelWidth(const Level &level) const {
+    // same aspect as the native stream, even for the chroma planes
+    return static_cast<int>(std::llround(static_cast<double>(native_width) * level.height / native_height / 2) * 2);
+}
+
+double RateEstimator::bitsPerPixel(const Level &level) const {
+    return bitrate_kbps * 1000. / (static_cast<double>(levelWidth(level)) * level.height * level.fps);
+}
+
+RateController::RateController(const RateEstimator::Settings &settings, int64_t refresh_us, const std::string &log_path) :
+    name("rate controller"), estimator(settings), refresh_us(refresh_us),
+    decode_time(MetricsRegistry::global().histogram("decode_time_us", "time to send a packet and receive its frames", {{"stream", "video"}, {"index", "0"}})),
+    display_drops(MetricsRegistry::global().counter("display_dropped_frames_total", "frames dropped because the display queue was full", {{"stream", "video"}, {"index", "0"}})),
+    target_bitrate(MetricsRegistry::global().gauge("rate_target_kbps", "bitrate asked from the server")),
+    hint_height(MetricsRegistry::global().gauge("rate_hint_height", "largest picture height asked from the server")),
+    hint_fps(MetricsRegistry::global().gauge("rate_hint_fps", "largest frame rate asked from the server")) {
+    if (!log_path.empty()) {
+        log_file.open(log_path, std::ios::trunc);
+        if (!log_file) {
+            LOG_WARNING(name << ": unable to open " << log_path << ", decisions are not logged");
+        }
+    }
+}
+
+std::unique_ptr<RateController> RateController::fromConfig() {
+    const Config &config = Config::global();
+    if (!config.getBool("rate.enabled", true)) {
+        return nullptr;
+    }
+    return std::make_unique<RateController>(RateEstimator::Settings::fromConfig(), config.getInt("rate.refresh", 5000) * 1000,
+                                            config.getString("rate.log"));
+}
+
+int64_t RateController::intervalFromConfig() {
+    return std::max<int64_t>(Config::global().getInt("rate.interval", 500), 50);
+}
+
+void RateController::setStream(const AVCodecContext *codec_ctx, AVRational time_base) {
+    this->time_base = time_base;
+    last_pts = AV_NOPTS_VALUE;
+    accumulated_delay_ms = 0;
+    smoothed_delay_ms = 0;
+    delay_samples = 0;
+    trend_window.clear();
+    trend_samples.store(0, std::memory_order_relaxed);
+    delay_trend.store(0, std::memory_order_relaxed);
+    width.store(codec_ctx->width, std::memory_order_relaxed);
+    height.store(codec_ctx->height, std::memory_order_relaxed);
+}
+
+std::string RateController::update(uint64_t queue_depth, int64_t rtt_us) {
+    const int64_t now_us = ClockSync::now();
+    const HistogramSnapshot decode = decode_time.snapshot();
+    const uint64_t current_frames = frames.load(std::memory_order_relaxed);
+    const uint64_t current_bytes = bytes.load(std::memory_order_relaxed);
+    const uint64_t current_corrupt = corrupt_frames.load(std::memory_order_relaxed);
+    const uint64_t current_drops = display_drops.value();
+    if (last_update_us < 0) {
+        // a baseline first, the counters may have run before us
+        last_update_us = now_us;
+        last_frames = current_frames;
+        last_bytes = current_bytes;
+        last_corrupt_frames = current_corrupt;
+        last_decode_count = decode.count;
+        last_decode_sum = decode.sum;
+        last_display_drops = current_drops;
+        return {};
+    }
+
+    RateSignals signals = {};
+    signals.time_us = now_us;
+    signals.interval_us = now_us - last_update_us;
+    signals.frames = current_frames - last_frames;
+    signals.bytes = current_bytes - last_bytes;
+    signals.corrupt_frames = current_corrupt - last_corrupt_frames;
+    signals.delay_trend = delay_trend.load(std::memory_order_relaxed);
+    signals.delay_samples = trend_samples.load(std::memory_order_relaxed);
+    signals.jitter_ms = published_jitter_ms.load(std::memory_order_relaxed);
+    signals.decode_ms = decode.count > last_decode_count ? (decode.sum - last_decode_sum) / 1000. / (decode.count - last_decode_count) : 0;
+    signals.queue_depth = queue_depth;
+    signals.display_drops = current_drops - last_display_drops;
+    signals.rtt_us = std::max<int64_t>(rtt_us, 0);
+    signals.width = width.load(std::memory_order_relaxed);
+    signals.height = height.load(std::memory_order_relaxed);
+
+    last_update_us = now_us;
+    last_frames = current_frames;
+    last_bytes = current_bytes;
+    last_corrupt_frames = current_corrupt;
+    last_decode_count = decode.count;
+    last_decode_sum = decode.sum;
+    last_display_drops = current_drops;
+
+    RateDecision decision;
+    if (bitrate_cap_kbps > 0) {
+        decision = last_decision;
+        decision.bitrate_kbps = decision.bitrate_kbps > 0 ? std::min(decision.bitrate_kbps, bitrate_cap_kbps) : bitrate_cap_kbps;
+        decision.reason = "capped";
+    } else if (settling > 0) {
+        // the last decision before the cap, until the stream is back at it
+        --settling;
+        decision = last_decision;
+        decision.reason = "resume";
+    } else {
+        decision = estimator.update(signals);
+        last_decision = decision;
+        if (log_file.is_open()) {
+            log_file << toJson(signals, decision) << '\n';
+            log_file.flush();
+        }
+    }
+    if (decision.bitrate_kbps <= 0) {
+        return {};
+    }
+
+    target_bitrate.set(decision.bitrate_kbps);
+    hint_height.set(decision.height);
+    hint_fps.set(decision.fps);
+
+    // hysteresis on the wire too, small bitrate moves wait for the refresh
+    const bool hint_changed = decision.width != sent.width || decision.height != sent.height || decision.fps != sent.fps;
+    const bool bitrate_changed = std::abs(decision.bitrate_kbps - sent.bitrate_kbps) * 20 > sent.bitrate_kbps;
+    if (!hint_changed && !bitrate_changed && last_sent_us >= 0 && now_us - last_sent_us < refresh_us) {
+        return {};
+    }
+
+    if (hint_changed || decision.bitrate_kbps < sent.bitrate_kbps) {
+        LOG_INFO(name << ": " << decision.reason << ", " << sent.bitrate_kbps << " -> " << decision.bitrate_kbps << " kbit/s, "
+                 << decision.width << 'x' << decision.height << '@' << decision.fps << " (" << toString(decision.usage)
+                 << ", loss " << signals.corrupt_frames << '/' << signals.frames << ", decode " << signals.decode_ms
+                 << " ms, queue " << signals.queue_depth << ')');
+    }
+    sent = decision;
+    last_sent_us = now_us;
+
+    std::stringstream ss;
+    ss << R"({"t":"r","q":"rate","b":)" << decision.bitrate_kbps;
+    if (decision.height > 0) {
+        ss << R"(,"w":)" << decision.width << R"(,"h":)" << decision.height;
+    }
+    ss << R"(,"f":)" << decision.fps << '}';
+    return ss.str();
+}
+
+void RateController::setBitrateCap(int64_t kbps) {
+    if (bitrate_cap_kbps > 0 && kbps <= 0) {
+        // what arrives over the next intervals is still the capped stream
+        settling = 2;
+    }
+    bitrate_cap_kbps = std::max<int64_t>(kbps, 0);
+}
+
+void RateController::handle(AVPacket *packet) {
+    observe(packet);
+    av_packet_free(&packet);
+}
+
+void RateController::observe(const AVPacket *packet) {
+    const int64_t arrival_us = ClockSync::now();
+    frames.fetch_add(1, std::memory_order_relaxed);
+    bytes.fetch_add(packet->size, std::memory_order_relaxed);
+    if (packet->flags & AV_PKT_FLAG_CORRUPT) {
+        corrupt_frames.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (packet->pts == AV_NOPTS_VALUE) {
+        return;
+    }
+
+    if (last_pts == AV_NOPTS_VALUE) {
+        first_arrival_us = arrival_us;
+    } else if (packet->pts > last_pts) {
+        // one way delay variation between consecutive frames, pts is the server capture time
+        const double send_delta_ms = (packet->pts - last_pts) * 1000. * time_base.num / time_base.den;
+        const double arrival_delta_ms = (arrival_us - last_arrival_us) / 1000.;
+        const double variation_ms = arrival_delta_ms - send_delta_ms;
+        jitter_ms += (std::fabs(variation_ms) - jitter_ms) / 16;
+
+        accumulated_delay_ms += variation_ms;
+        smoothed_delay_ms = TREND_SMOOTHING * smoothed_delay_ms + (1 - TREND_SMOOTHING) * accumulated_delay_ms;
+        trend_window.emplace_back((arrival_us - first_arrival_us) / 1000., smoothed_delay_ms);
+        if (trend_window.size() > TREND_WINDOW) {
+            trend_window.pop_front();
+        }
+        ++delay_samples;
+
+        // least squares slope of the smoothed delay against arrival time
+        if (trend_window.size() == TREND_WINDOW) {
+            double mean_x = 0;
+            double mean_y = 0;
+            for (const auto &[x, y] : trend_window) {
+                mean_x += x;
+                mean_y += y;
+            }
+            mean_x /= TREND_WINDOW;
+            mean_y /= TREND_WINDOW;
+            double numerator = 0;
+            double denominator = 0;
+            for (const auto &[x, y] : trend_window) {
+                numerator += (x - mean_x) * (y - mean_y);
+                denominator += (x - mean_x) * (x - mean_x);
+            }
+            if (denominator > 0) {
+                delay_trend.store(numerator / denominator, std::memory_order_relaxed);
+                trend_samples.store(delay_samples, std::memory_order_relaxed);
+            }
+        }
+        published_jitter_ms.store(jitter_ms, std::memory_order_relaxed);
+    } else {
+        // reordered or repeated, not a new frame
+        return;
+    }
+    last_pts = packet->pts;
+    last_arrival_us = arrival_us;
+}
+
+std::string RateController::toJson(const RateSignals &signals, const RateDecision &decision) {
+    std::stringstream ss;
+    // exact doubles, a replay has to take the same branches
+    ss.precision(17);
+    ss << R"({"time_us":)" << signals.time_us << R"(,"interval_us":)" << signals.interval_us
+       << R"(,"frames":)" << signals.frames << R"(,"bytes":)" << signals.bytes << R"(,"corrupt_frames":)" << signals.corrupt_frames
+       << R"(,"delay_trend":)" << signals.delay_trend << R"(,"delay_samples":)" << signals.delay_samples
+       << R"(,"jitter_ms":)" << signals.jitter_ms << R"(,"decode_ms":)" << signals.decode_ms
+       << R"(,"queue_depth":)" << signals.queue_depth << R"(,"display_drops":)" << signals.display_drops
+       << R"(,"rtt_us":)" << signals.rtt_us << R"(,"width":)" << signals.width << R"(,"height":)" << signals.height
+       << R"(,"decision":{"bitrate_kbps":)" << decision.bitrate_kbps << R"(,"width":)" << decision.width
+       << R"(,"height":)" << decision.height << R"(,"fps":)" << decision.fps
+       << R"(,"usage":")" << toString(decision.usage) << R"(","reason":")" << decision.reason << R"("}})";
+    return ss.str();
+}
+
+const char* RateController::toString(RateUsage usage) {
+    switch (usage) {
+        case RateUsage::OVERUSE:
+            return "overuse";
+        case RateUsage::UNDERUSE:
+            return "underuse";
+        default:
+            return "normal";
+    }
+}
@@ -0,0 +1,198 @@
+#ifndef REMOTE_CLIENT_RATECONTROLLER_H
+#define REMOTE_CLIENT_RATECONTROLLER_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+};
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <fstream>
+#include <memory>
+
+#include "sink.h"
+#include "Metrics.h"
+
+enum class RateUsage {
+    NORMAL,
+    OVERUSE,
+    UNDERUSE,
+};
+
+// what the controller saw over one interval, logged with every decision so a run can be replayed
+struct RateSignals {
+    int64_t time_us;
+    int64_t interval_us;
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t corrupt_frames;
+    double delay_trend;     // slope of the smoothed delay variation against arrival time
+    int delay_samples;
+    double jitter_ms;
+    double decode_ms;       // mean over the interval
+    uint64_t queue_depth;
+    uint64_t display_drops;
+    int64_t rtt_us;
+    int width;              // of the stream being received
+    int height;
+};
+
+struct RateDecision {
+    int64_t bitrate_kbps;
+    int width;              // resolution and frame rate the client can take, at most
+    int height;
+    int fps;
+    RateUsage usage;
+    const char *reason;
+};
+
+// the decision logic alone, deterministic so a logged run gives the same decisions again:
+// a GCC style delay based controller (trendline, adaptive threshold, AIMD) bounded by a loss based one,
+// then a resolution and frame rate ladder driven by the decode side and the bits per pixel left
+//   rate.min_bitrate = 500       kbit/s
+//   rate.max_bitrate = 50000
+//   rate.start_bitrate = 0       0 to start from the received rate
+//   rate.max_fps = 60
+//   rate.min_fps = 30
+//   rate.down_hold = 1000        ms a problem has to last before stepping the ladder down
+//   rate.up_hold = 5000          ms of headroom before stepping it back up
+class RateEstimator {
+public:
+    struct Settings {
+        int64_t min_kbps = 500;
+        int64_t max_kbps = 50000;
+        int64_t start_kbps = 0;
+        int max_fps = 60;
+        int min_fps = 30;
+        int64_t down_hold_us = 1000000;
+        int64_t up_hold_us = 5000000;
+
+        static Settings fromConfig();
+    };
+
+private:
+    struct Level {
+        int height;
+        int fps;
+    };
+
+    Settings settings;
+
+    // delay based
+    double threshold = 12.5;
+    int64_t last_update_us = -1;
+    int overuse_count = 0;
+    RateUsage usage = RateUsage::NORMAL;
+    double bitrate_kbps = 0;
+    double capacity_kbps = -1;
+    double capacity_variance = 0.4;
+
+    // ladder, from the largest stream seen
+    int native_width = 0;
+    int native_height = 0;
+    std::vector<Level> levels;
+    size_t level = 0;
+    int64_t problem_since_us = -1;
+    int64_t headroom_since_us = -1;
+    int64_t last_step_us = 0;
+
+public:
+    explicit RateEstimator(const Settings &settings);
+
+    RateDecision update(const RateSignals &signals);
+
+private:
+    void detectUsage(const RateSignals &signals, double dt_ms);
+    const char* updateBitrate(const RateSignals &signals, double dt_ms);
+    const char* updateLevel(const RateSignals &signals);
+    void buildLevels(int width, int height);
+    int levelWidth(const Level &level) const;
+    double bitsPerPixel(const Level &level) const;
+};
+
+// feeds the estimator from the video packets and the decode side, and turns its decisions into
+// hints for the server on the control channel, {"t":"r","q":"rate","b":<kbit/s>,"w":..,"h":..,"f":..}
+//   rate.enabled = true
+//   rate.interval = 500          ms between updates
+//   rate.refresh = 5000          ms after which an unchanged hint is sent again
+//   rate.log = /tmp/rate.jsonl   signals and decision of every update, one json object per line
+class RateController : public Sink<AVPacket> {
+private:
+    static constexpr size_t TREND_WINDOW = 20;
+    static constexpr double TREND_SMOOTHING = 0.9;
+
+    std::string name;
+    RateEstimator estimator;
+    int64_t refresh_us;
+    std::ofstream log_file;
+
+    // receiver thread only, reset by setStream while the receiver is stopped
+    AVRational time_base = {1, 90000};
+    int64_t last_pts = AV_NOPTS_VALUE;
+    int64_t last_arrival_us = 0;
+    int64_t first_arrival_us = 0;
+    double accumulated_delay_ms = 0;
+    double smoothed_delay_ms = 0;
+    double jitter_ms = 0;
+    int delay_samples = 0;
+    std::deque<std::pair<double, double>> trend_window;
+
+    std::atomic<uint64_t> frames = 0;
+    std::atomic<uint64_t> bytes = 0;
+    std::atomic<uint64_t> corrupt_frames = 0;
+    std::atomic<double> delay_trend = 0;
+    std::atomic<int> trend_samples = 0;
+    std::atomic<double> published_jitter_ms = 0;
+    std::atomic<int> width = 0;
+    std::atomic<int> height = 0;
+
+    // update thread only
+    int64_t last_update_us = -1;
+    uint64_t last_frames = 0;
+    uint64_t last_bytes = 0;
+    uint64_t last_corrupt_frames = 0;
+    uint64_t last_decode_count = 0;
+    uint64_t last_decode_sum = 0;
+    uint64_t last_display_drops = 0;
+    RateDecision sent = {};
+    int64_t last_sent_us = -1;
+    RateDecision last_decision = {};
+    int64_t bitrate_cap_kbps = 0;
+    int settling = 0;
+
+    Histogram &decode_time;
+    Counter &display_drops;
+    Gauge &target_bitrate;
+    Gauge &hint_height;
+    Gauge &hint_fps;
+
+public:
+    RateController(const RateEstimator::Settings &settings, int64_t refresh_us, const std::string &log_path = "");
+
+    // from the rate.* settings, nullptr when disabled
+    static std::unique_ptr<RateController> fromConfig();
+    static int64_t intervalFromConfig();
+
+    // a new video stream, call while its receiver is stopped
+    void setStream(const AVCodecContext *codec_ctx, AVRational time_base);
+
+    // once per interval, returns the message for the server or an empty string when there is nothing new
+    std::string update(uint64_t queue_depth, int64_t rtt_us);
+    // a bitrate the hints stay under, 0 for none. the estimator is paused while capped, what it sees then
+    // (no decoding, a throttled stream) says nothing about the link. update thread only
+    void setBitrateCap(int64_t kbps);
+
+    void handle(AVPacket *packet) override;
+
+    static std::string toJson(const RateSignals &signals, const RateDecision &decision);
+    static const char* toString(RateUsage usage);
+
+private:
+    // receiver thread, the delay trend and jitter from the arrival of each frame
+    void observe(const AVPacket *packet);
+};
+
+#endif //REMOTE_CLIENT_RATECONTROLLER_H
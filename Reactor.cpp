@@ -0,0 +1,244 @@
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <iostream>
+
+#include "Reactor.h"
+#include "Log.h"
+#include "exception.h"
+#include "ThreadPolicy.h"
+
+constexpr int MAX_EVENTS = 16;
+
+static itimerspec to_itimerspec(std::chrono::nanoseconds delay, bool repeat) {
+    // a zero it_value disarms the timer, fire as soon as possible instead
+    if (delay.count() <= 0) {
+        delay = std::chrono::nanoseconds(1);
+    }
+
+    itimerspec spec = {};
+    spec.it_value.tv_sec = delay.count() / 1'000'000'000;
+    spec.it_value.tv_nsec = delay.count() % 1'000'000'000;
+    if (repeat) {
+        spec.it_interval = spec.it_value;
+    }
+    return spec;
+}
+
+Reactor::Reactor(std::string name, size_t worker_count) : name(std::move(name)), run_stop_condition(false) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        throw InitFail(strerror(errno));
+    }
+
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd < 0) {
+        throw InitFail(strerror(errno));
+    }
+
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = wakeup_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &event) < 0) {
+        throw InitFail(strerror(errno));
+    }
+
+    startWorkers(worker_count);
+}
+
+Reactor::~Reactor() {
+    stopWorkers();
+    close(wakeup_fd);
+    close(epoll_fd);
+}
+
+void Reactor::add(int fd, uint32_t events, Callback callback) {
+    handlers_lock.lock();
+    handlers[fd] = std::make_shared<Callback>(std::move(callback));
+    handlers_lock.unlock();
+
+    epoll_event event = {};
+    event.events = events;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        handlers_lock.lock();
+        handlers.erase(fd);
+        handlers_lock.unlock();
+        throw RunError(strerror(errno));
+    }
+}
+
+void Reactor::modify(int fd, uint32_t events) {
+    epoll_event event = {};
+    event.events = events;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
+        throw RunError(strerror(errno));
+    }
+}
+
+void Reactor::remove(int fd) {
+    // may fail if fd was already closed, the kernel removed it for us in that case
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    handlers_lock.lock();
+    handlers.erase(fd);
+    handlers_lock.unlock();
+}
+
+int Reactor::addTimer(std::chrono::nanoseconds delay, std::function<void()> callback, bool repeat) {
+    const int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        throw RunError(strerror(errno));
+    }
+
+    add(timer_fd, EPOLLIN, [timer_fd, callback = std::move(callback)](uint32_t) {
+        uint64_t expirations;
+        if (read(timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+            callback();
+        }
+    });
+    rearmTimer(timer_fd, delay, repeat);
+    return timer_fd;
+}
+
+void Reactor::rearmTimer(int timer_fd, std::chrono::nanoseconds delay, bool repeat) {
+    const itimerspec spec = to_itimerspec(delay, repeat);
+    if (timerfd_settime(timer_fd, 0, &spec, nullptr) < 0) {
+        throw RunError(strerror(errno));
+    }
+}
+
+void Reactor::removeTimer(int timer_fd) {
+    remove(timer_fd);
+    close(timer_fd);
+}
+
+void Reactor::post(Task task) {
+    posted_lock.lock();
+    posted_tasks.emplace_back(std::move(task));
+    posted_lock.unlock();
+    wakeup();
+}
+
+void Reactor::defer(Task task) {
+    {
+        std::lock_guard<std::mutex> guard(deferred_mutex);
+        deferred_tasks.emplace_back(std::move(task));
+    }
+    deferred_cv.notify_one();
+}
+
+void Reactor::run() {
+    epoll_event events[MAX_EVENTS];
+    while (!run_stop_condition.load(std::memory_order_relaxed)) {
+        const int count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw RunError(strerror(errno));
+        }
+
+        for (int i = 0; i < count; ++i) {
+            const int fd = events[i].data.fd;
+            if (fd == wakeup_fd) {
+                uint64_t value;
+                while (read(wakeup_fd, &value, sizeof(value)) > 0);
+                runPosted();
+                continue;
+            }
+
+            // keep a reference, the callback may remove itself
+            handlers_lock.lock();
+            const auto it = handlers.find(fd);
+            std::shared_ptr<Callback> handler = it != handlers.end() ? it->second : nullptr;
+            handlers_lock.unlock();
+            if (handler) {
+                try {
+                    (*handler)(events[i].events);
+                } catch (const std::exception &e) {
+                    LOG_ERROR(name << ": " << e.what());
+                }
+            }
+        }
+    }
+
+    run_stop_condition.store(false, std::memory_order_relaxed);
+}
+
+void Reactor::stop() {
+    run_stop_condition.store(true, std::memory_order_relaxed);
+    wakeup();
+}
+
+bool Reactor::running() const {
+    return !run_stop_condition.load(std::memory_order_relaxed);
+}
+
+void Reactor::wakeup() {
+    const uint64_t value = 1;
+    if (write(wakeup_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        LOG_ERROR(name << ": unable to wake up reactor, " << strerror(errno));
+    }
+}
+
+void Reactor::runPosted() {
+    std::deque<Task> tasks;
+    posted_lock.lock();
+    tasks.swap(posted_tasks);
+    posted_lock.unlock();
+    for (Task &task : tasks) {
+        try {
+            task();
+        } catch (const std::exception &e) {
+            LOG_ERROR(name << ": " << e.what());
+        }
+    }
+}
+
+void Reactor::startWorkers(size_t count) {
+    worker_stop_condition = false;
+    for (size_t i = 0; i < count; ++i) {
+        workers.emplace_back(&Reactor::runWorker, this);
+    }
+}
+
+void Reactor::runWorker() {
+    ThreadScope scope(name + "-worker");
+    for (;;) {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock(deferred_mutex);
+            deferred_cv.wait(lock, [this] { return worker_stop_condition || !deferred_tasks.empty(); });
+            if (deferred_tasks.empty()) {
+                return;
+            }
+            task = std::move(deferred_tasks.front());
+            deferred_tasks.pop_front();
+        }
+
+        try {
+            task();
+        } catch (const std::exception &e) {
+            LOG_ERROR(name << ": " << e.what());
+        }
+    }
+}
+
+void Reactor::stopWorkers() {
+    {
+        std::lock_guard<std::mutex> guard(deferred_mutex);
+        worker_stop_condition = true;
+        deferred_tasks.clear();
+    }
+    deferred_cv.notify_all();
+    for (std::thread &worker : workers) {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+    workers.clear();
+}
@@ -0,0 +1,82 @@
+#ifndef REMOTE_CLIENT_REACTOR_H
+#define REMOTE_CLIENT_REACTOR_H
+
+#include <cstdint>
+#include <string>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "spinlock.h"
+
+// epoll based event loop, fds and timers are dispatched on the thread calling run(),
+// blocking work is handed to worker threads with defer()
+class Reactor {
+public:
+    using Callback = std::function<void(uint32_t events)>;
+    using Task = std::function<void()>;
+
+private:
+    std::string name;
+
+    int epoll_fd = -1;
+    int wakeup_fd = -1;
+
+    std::unordered_map<int, std::shared_ptr<Callback>> handlers;
+    spinlock handlers_lock;
+
+    std::deque<Task> posted_tasks;
+    spinlock posted_lock;
+
+    std::atomic<bool> run_stop_condition = true;
+
+    std::vector<std::thread> workers;
+    std::deque<Task> deferred_tasks;
+    std::mutex deferred_mutex;
+    std::condition_variable deferred_cv;
+    bool worker_stop_condition = true;
+
+public:
+    explicit Reactor(std::string name, size_t worker_count = 1);
+    ~Reactor();
+
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    void add(int fd, uint32_t events, Callback callback);
+    void modify(int fd, uint32_t events);
+    void remove(int fd);
+
+    // returns the timerfd, use removeTimer() with it
+    int addTimer(std::chrono::nanoseconds delay, std::function<void()> callback, bool repeat = true);
+    void rearmTimer(int timer_fd, std::chrono::nanoseconds delay, bool repeat = true);
+    void removeTimer(int timer_fd);
+
+    // run task on the reactor thread
+    void post(Task task);
+    // run task on a worker thread, for blocking calls
+    void defer(Task task);
+
+    void run();
+    void stop();
+    bool running() const;
+
+    // drop queued deferred tasks and wait for the running ones
+    void stopWorkers();
+
+private:
+    void wakeup();
+    void runPosted();
+
+    void startWorkers(size_t count);
+    void runWorker();
+};
+
+#endif //REMOTE_CLIENT_REACTOR_H
@@ -0,0 +1,457 @@
+extern "C" {
+#include <libavutil/mem.h>
+};
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#include "Recorder.h"
+#include "ClockSync.h"
+#include "Config.h"
+#include "Log.h"
+
+constexpr int OPUS_PRE_SKIP = 312;
+
+static bool ends_with(const std::string &s, const char *suffix) {
+    const size_t size = strlen(suffix);
+    return s.size() >= size && s.compare(s.size() - size, size, suffix) == 0;
+}
+
+// the sdp usually carries sps and pps, when it doesn't take them from the keyframe
+static void extract_extradata(AVCodecParameters *parameters, const AVPacket *packet) {
+    const AVBitStreamFilter *filter = av_bsf_get_by_name("extract_extradata");
+    AVBSFContext *bsf = nullptr;
+    if (!filter || av_bsf_alloc(filter, &bsf) < 0) {
+        return;
+    }
+
+    AVPacket *copy = av_packet_clone(packet);
+    if (avcodec_parameters_copy(bsf->par_in, parameters) >= 0 && av_bsf_init(bsf) >= 0
+        && av_bsf_send_packet(bsf, copy) >= 0 && av_bsf_receive_packet(bsf, copy) >= 0) {
+        int size = 0;
+        const uint8_t *data = av_packet_get_side_data(copy, AV_PKT_DATA_NEW_EXTRADATA, &size);
+        if (data && size > 0) {
+            av_freep(&parameters->extradata);
+            parameters->extradata = static_cast<uint8_t*>(av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE));
+            memcpy(parameters->extradata, data, size);
+            parameters->extradata_size = size;
+        }
+    }
+    av_packet_free(&copy);
+    av_bsf_free(&bsf);
+}
+
+// the rtp depacketizer doesn't give one, matroska and mp4 need the OpusHead
+static void make_opus_head(AVCodecParameters *parameters) {
+    const int channels = std::max(parameters->channels, 1);
+    uint8_t head[19] = {'O', 'p', 'u', 's', 'H', 'e', 'a', 'd', 1, static_cast<uint8_t>(channels),
+                        OPUS_PRE_SKIP & 0xff, OPUS_PRE_SKIP >> 8};
+    const uint32_t sample_rate = parameters->sample_rate > 0 ? parameters->sample_rate : 48000;
+    for (int i = 0; i < 4; ++i) {
+        head[12 + i] = (sample_rate >> (8 * i)) & 0xff;
+    }
+
+    av_freep(&parameters->extradata);
+    parameters->extradata = static_cast<uint8_t*>(av_mallocz(sizeof(head) + AV_INPUT_BUFFER_PADDING_SIZE));
+    memcpy(parameters->extradata, head, sizeof(head));
+    parameters->extradata_size = sizeof(head);
+}
+
+Recorder::StreamSink::StreamSink(Recorder &recorder, uint8_t stream) : recorder(recorder), stream(stream) {
+
+}
+
+void Recorder::StreamSink::handle(AVPacket *packet) {
+    // a full queue costs the recording a packet, never the live pipeline a wait unless the policy is block
+    uint64_t evicted = 0;
+    if (!recorder.queue.enqueue(new Item(stream, ClockSync::now(), packet, nullptr, {0, 1}), evicted)) {
+        ++evicted;
+    }
+    recorder.packets_dropped.add(evicted);
+}
+
+Recorder::Item::Item(uint8_t stream, int64_t receive_us, AVPacket *packet, AVCodecParameters *parameters, AVRational time_base) :
+    stream(stream), receive_us(receive_us), packet(packet), parameters(parameters), time_base(time_base) {
+
+}
+
+Recorder::Item::~Item() {
+    av_packet_free(&packet);
+    avcodec_parameters_free(&parameters);
+}
+
+uint64_t Recorder::Item::bytes() const {
+    return packet ? packet->size : 0;
+}
+
+Recorder::ItemSink::ItemSink(Recorder &recorder) : recorder(recorder) {
+
+}
+
+void Recorder::ItemSink::handle(Item *item) {
+    recorder.handleItem(std::unique_ptr<Item>(item));
+}
+
+// the file belongs to the recorder thread, nothing is written inline while stopped
+Recorder::Recorder(std::string path, std::string format, bool direct, size_t buffer_size) : name("recorder"),
+    path(std::move(path)), format(std::move(format)), direct(direct),
+    buffer_size(std::max(buffer_size / WRITE_ALIGNMENT, size_t(1)) * WRITE_ALIGNMENT),
+    item_sink(*this), queue(name, item_sink, MemoryBudget::global().stage("recorder", {MAX_PENDING, 0, 0, DropPolicy::DROP_NEWEST}), false),
+    audio_sink(*this, 0), video_sink(*this, 1),
+    packets_written(MetricsRegistry::global().counter("record_packets_total", "packets written to the recording")),
+    packets_dropped(MetricsRegistry::global().counter("record_dropped_packets_total", "packets the recorder could not keep up with")),
+    bytes_written(MetricsRegistry::global().counter("record_bytes_total", "bytes written to the recording file")) {
+    if (this->format.empty()) {
+        this->format = ends_with(this->path, ".mp4") || ends_with(this->path, ".m4v") ? "mp4" : "matroska";
+    }
+}
+
+Recorder::~Recorder() {
+    stop();
+    for (Stream &stream : streams) {
+        avcodec_parameters_free(&stream.parameters);
+    }
+}
+
+std::unique_ptr<Recorder> Recorder::fromConfig() {
+    const Config &config = Config::global();
+    const std::string path = config.getString("record.file");
+    if (path.empty()) {
+        return nullptr;
+    }
+    return std::make_unique<Recorder>(path, config.getString("record.format"), config.getBool("record.direct"),
+                                      config.getSize("record.buffer", 4 << 20));
+}
+
+void Recorder::start() {
+    queue.start();
+}
+
+void Recorder::stop() {
+    if (!queue.isRunning()) {
+        return;
+    }
+    queue.stop();
+    // the stream still awaited won't come now, the video held is worth a file
+    if (!held.empty()) {
+        begin();
+    }
+    close();
+}
+
+Recorder::StreamSink& Recorder::getSink(uint8_t stream) {
+    return stream == 0 ? audio_sink : video_sink;
+}
+
+void Recorder::expectStream(uint8_t stream) {
+    // announcements are outside the budget, losing one loses the stream
+    queue.handleUnbounded(new Item(stream, ClockSync::now(), nullptr, nullptr, {0, 1}));
+}
+
+void Recorder::addStream(uint8_t stream, const AVCodecParameters *parameters, AVRational time_base) {
+    AVCodecParameters *copy = avcodec_parameters_alloc();
+    avcodec_parameters_copy(copy, parameters);
+    queue.handleUnbounded(new Item(stream, ClockSync::now(), nullptr, copy, time_base));
+}
+
+void Recorder::handleItem(std::unique_ptr<Item> item) {
+    if (item->stream >= STREAMS) {
+        return;
+    }
+
+    Stream &stream = streams[item->stream];
+    if (!item->packet && !item->parameters) {
+        stream.expected = true;
+        return;
+    }
+    if (item->parameters) {
+        if (recording) {
+            // the container can't take a new stream once written, the packets keep going to the old one
+            LOG_WARNING(name << ": stream " << static_cast<int>(item->stream) << " changed while recording, parameters ignored");
+        } else {
+            avcodec_parameters_free(&stream.parameters);
+            stream.parameters = item->parameters;
+            item->parameters = nullptr;
+            stream.time_base = item->time_base;
+            if (item->stream == 1) {
+                // held for the decoder that was replaced
+                held.clear();
+            }
+            if (!held.empty() && ready(item->receive_us)) {
+                begin();
+            }
+        }
+        return;
+    }
+
+    if (!stream.parameters) {
+        return;
+    }
+    if (!recording) {
+        hold(std::move(item));
+    } else {
+        writePacket(stream, item->packet, item->receive_us);
+    }
+}
+
+void Recorder::hold(std::unique_ptr<Item> item) {
+    const bool keyframe = item->packet->flags & AV_PKT_FLAG_KEY;
+    // start at a keyframe, everything before it can't be decoded anyway
+    if (item->stream != 1 || (held.empty() && !keyframe)) {
+        return;
+    }
+    if (held.empty()) {
+        waiting_since_us = item->receive_us;
+    } else if (keyframe) {
+        held.clear();
+    }
+    held.push_back(std::move(item));
+    if (ready(held.back()->receive_us)) {
+        begin();
+    }
+}
+
+bool Recorder::ready(int64_t now_us) const {
+    if (held.size() >= MAX_HELD || now_us - waiting_since_us >= STREAM_WAIT_US) {
+        return true;
+    }
+    for (const Stream &stream : streams) {
+        if (stream.expected && !stream.parameters) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Recorder::begin() {
+    for (uint8_t i = 0; i < STREAMS; ++i) {
+        if (streams[i].expected && !streams[i].parameters) {
+            LOG_WARNING(name << ": stream " << static_cast<int>(i) << " announced but not received, recording without it");
+        }
+    }
+    Stream &video = streams[1];
+    if (video.parameters->extradata_size == 0) {
+        extract_extradata(video.parameters, held.front()->packet);
+    }
+    const bool opened = open(held.front()->receive_us);
+    if (!opened) {
+        // don't retry on every keyframe
+        for (Stream &stream : streams) {
+            avcodec_parameters_free(&stream.parameters);
+        }
+    }
+    if (opened) {
+        for (const std::unique_ptr<Item> &item : held) {
+            writePacket(video, item->packet, item->receive_us);
+        }
+    }
+    held.clear();
+}
+
+void Recorder::writePacket(Stream &stream, AVPacket *packet, int64_t receive_us) {
+    if (!stream.output) {
+        return;
+    }
+
+    // each stream keeps its own clock, its first packet is placed at its arrival in the recording
+    if (!stream.started) {
+        const int64_t since_start = av_rescale_q(receive_us - start_us, {1, 1000000}, stream.time_base);
+        stream.base_ts = (packet->pts != AV_NOPTS_VALUE ? packet->pts : 0) - since_start;
+        stream.started = true;
+    }
+
+    int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts - stream.base_ts : av_rescale_q(receive_us - start_us, {1, 1000000}, stream.time_base);
+    // no b-frames in a live stream, decode order is presentation order
+    int64_t dts = packet->dts != AV_NOPTS_VALUE ? packet->dts - stream.base_ts : pts;
+    if (stream.last_dts != AV_NOPTS_VALUE && dts <= stream.last_dts) {
+        dts = stream.last_dts + 1;
+    }
+    pts = std::max(pts, dts);
+    stream.last_dts = dts;
+
+    packet->pts = av_rescale_q(pts, stream.time_base, stream.output->time_base);
+    packet->dts = av_rescale_q(dts, stream.time_base, stream.output->time_base);
+    packet->duration = av_rescale_q(packet->duration, stream.time_base, stream.output->time_base);
+    packet->stream_index = stream.output->index;
+    packet->pos = -1;
+
+    const int size = packet->size;
+    // takes the reference, the packet comes back empty
+    if (av_interleaved_write_frame(format_ctx, packet) < 0) {
+        packets_dropped.add();
+        return;
+    }
+    packets_written.add();
+    bytes_written.add(size);
+}
+
+bool Recorder::open(int64_t receive_us) {
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | (direct ? O_DIRECT : 0), 0644);
+    if (fd < 0 && direct && errno == EINVAL) {
+        LOG_WARNING(name << ": O_DIRECT not supported for " << path << ", using buffered writes");
+        direct = false;
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (fd < 0) {
+        LOG_ERROR(name << ": unable to open " << path << ", " << strerror(errno));
+        return false;
+    }
+
+    // aligned for O_DIRECT, written out in buffer_size chunks
+    if (posix_memalign(reinterpret_cast<void**>(&write_buffer), WRITE_ALIGNMENT, buffer_size) != 0) {
+        LOG_ERROR(name << ": unable to allocate the write buffer");
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    write_used = 0;
+    file_offset = file_end = 0;
+
+    avformat_alloc_output_context2(&format_ctx, nullptr, format.c_str(), path.c_str());
+    if (!format_ctx) {
+        LOG_ERROR(name << ": unknown format " << format);
+        close();
+        return false;
+    }
+
+    const bool mp4 = format == "mp4";
+    auto *avio_buffer = static_cast<uint8_t*>(av_malloc(AVIO_BUFFER_SIZE));
+    // fragmented mp4 never goes back, matroska does once at the end for the cues and the duration
+    format_ctx->pb = avio_alloc_context(avio_buffer, AVIO_BUFFER_SIZE, 1, this, nullptr, &Recorder::writeCallback, mp4 ? nullptr : &Recorder::seekCallback);
+    format_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    // opus in mp4
+    format_ctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+
+    for (Stream &stream : streams) {
+        if (!stream.parameters) {
+            continue;
+        }
+        if (stream.parameters->codec_id == AV_CODEC_ID_OPUS && stream.parameters->extradata_size == 0) {
+            make_opus_head(stream.parameters);
+        }
+        stream.output = avformat_new_stream(format_ctx, nullptr);
+        avcodec_parameters_copy(stream.output->codecpar, stream.parameters);
+        stream.output->codecpar->codec_tag = 0;
+        stream.output->time_base = stream.time_base;
+    }
+
+    AVDictionary *options = nullptr;
+    if (mp4) {
+        av_dict_set(&options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    }
+    const int ret = avformat_write_header(format_ctx, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+        LOG_ERROR(name << ": unable to write the " << format << " header");
+        close();
+        return false;
+    }
+
+    recording = true;
+    start_us = receive_us;
+    LOG_INFO(name << ": recording to " << path);
+    return true;
+}
+
+void Recorder::close() {
+    if (format_ctx) {
+        if (recording) {
+            av_write_trailer(format_ctx);
+            recording = false;
+        }
+        if (format_ctx->pb) {
+            av_freep(&format_ctx->pb->buffer);
+            avio_context_free(&format_ctx->pb);
+        }
+        avformat_free_context(format_ctx);
+        format_ctx = nullptr;
+    }
+
+    if (fd >= 0) {
+        flushBuffer(true);
+        ::close(fd);
+        fd = -1;
+        LOG_INFO(name << ": " << packets_written.value() << " packets written to " << path << ", " << packets_dropped.value() << " dropped");
+    }
+    free(write_buffer);
+    write_buffer = nullptr;
+
+    for (Stream &stream : streams) {
+        stream.output = nullptr;
+        stream.started = false;
+        stream.last_dts = AV_NOPTS_VALUE;
+    }
+}
+
+int Recorder::writeCallback(void *opaque, uint8_t *data, int size) {
+    static_cast<Recorder*>(opaque)->append(data, size);
+    return size;
+}
+
+int64_t Recorder::seekCallback(void *opaque, int64_t offset, int whence) {
+    auto *recorder = static_cast<Recorder*>(opaque);
+    const int64_t size = std::max(recorder->file_end, recorder->file_offset + static_cast<int64_t>(recorder->write_used));
+    if (whence == AVSEEK_SIZE) {
+        return size;
+    }
+
+    recorder->flushBuffer(true);
+    switch (whence) {
+        case SEEK_SET:
+            recorder->file_offset = offset;
+            break;
+        case SEEK_CUR:
+            recorder->file_offset += offset;
+            break;
+        case SEEK_END:
+            recorder->file_offset = size + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+    return recorder->file_offset;
+}
+
+void Recorder::append(const uint8_t *data, size_t size) {
+    while (size > 0) {
+        const size_t chunk = std::min(size, buffer_size - write_used);
+        memcpy(write_buffer + write_used, data, chunk);
+        write_used += chunk;
+        data += chunk;
+        size -= chunk;
+        if (write_used == buffer_size) {
+            flushBuffer(false);
+        }
+    }
+}
+
+void Recorder::flushBuffer(bool all) {
+    // whole blocks only while O_DIRECT is on, the tail stays for the next write
+    size_t length = all ? write_used : write_used & ~(WRITE_ALIGNMENT - 1);
+    if (direct && (length % WRITE_ALIGNMENT != 0 || file_offset % WRITE_ALIGNMENT != 0)) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+        direct = false;
+    }
+
+    size_t done = 0;
+    while (done < length) {
+        const ssize_t ret = pwrite(fd, write_buffer + done, length - done, file_offset + done);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR(name << ": write error, " << strerror(errno));
+            break;
+        }
+        done += ret;
+    }
+
+    file_offset += length;
+    file_end = std::max(file_end, file_offset);
+    memmove(write_buffer, write_buffer + length, write_used - length);
+    write_used -= length;
+}
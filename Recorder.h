@@ -0,0 +1,146 @@
+#ifndef REMOTE_CLIENT_RECORDER_H
+#define REMOTE_CLIENT_RECORDER_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+};
+
+#include <cstdint>
+#include <string>
+#include <memory>
+#include <vector>
+
+#include "sink.h"
+#include "AsyncSink.h"
+#include "Metrics.h"
+#include "Budget.h"
+
+// remuxes the received packets to a file from its own thread, nothing is decoded or encoded:
+//   record.file = /tmp/session.mkv   (default none, .mp4 gives fragmented mp4)
+//   record.format = matroska         (default from the file extension)
+//   record.buffer = 4M               (write size, a multiple of 4K)
+//   record.direct = false            (O_DIRECT, falls back to buffered writes when unsupported)
+// the file starts at the first video keyframe once every announced stream has its parameters, the video from the
+// latest keyframe is held meanwhile. a stream that doesn't come within a few seconds is left out, audio before the
+// start is dropped
+class Recorder {
+public:
+    // one per stream, attach it to the receiver as an AVPacket sink
+    class StreamSink : public Sink<AVPacket> {
+    private:
+        Recorder &recorder;
+        uint8_t stream;
+
+    public:
+        StreamSink(Recorder &recorder, uint8_t stream);
+        void handle(AVPacket *packet) override;
+    };
+
+private:
+    static constexpr size_t STREAMS = 2;
+    static constexpr size_t MAX_PENDING = 1024;    // default of budget.recorder.items
+    static constexpr size_t MAX_HELD = 1024;       // video packets held for the other streams at most
+    static constexpr int64_t STREAM_WAIT_US = 5000000;
+    static constexpr size_t WRITE_ALIGNMENT = 4096;
+    static constexpr int AVIO_BUFFER_SIZE = 64 * 1024;
+
+    struct Item {
+        uint8_t stream;
+        int64_t receive_us;
+        AVPacket *packet;
+        AVCodecParameters *parameters; // the stream parameters instead of a packet, neither when it's announced
+        AVRational time_base;
+
+        // takes packet and parameters
+        Item(uint8_t stream, int64_t receive_us, AVPacket *packet, AVCodecParameters *parameters, AVRational time_base);
+        ~Item();
+        Item(const Item&) = delete;
+        Item& operator=(const Item&) = delete;
+
+        uint64_t bytes() const;
+    };
+
+    // the recorder thread end of the queue
+    class ItemSink : public Sink<Item> {
+    private:
+        Recorder &recorder;
+
+    public:
+        explicit ItemSink(Recorder &recorder);
+        void handle(Item *item) override;
+    };
+
+    struct Stream {
+        AVCodecParameters *parameters = nullptr;
+        AVRational time_base = {0, 1};
+        AVStream *output = nullptr;
+        bool expected = false;
+        bool started = false;
+        int64_t base_ts = 0;
+        int64_t last_dts = AV_NOPTS_VALUE;
+    };
+
+    std::string name;
+    std::string path;
+    std::string format;
+    bool direct;
+    size_t buffer_size;
+
+    // recorder thread only, or after stop
+    Stream streams[STREAMS];
+    AVFormatContext *format_ctx = nullptr;
+    bool recording = false;
+    int64_t start_us = 0;
+    // video from the latest keyframe while a stream is awaited
+    std::vector<std::unique_ptr<Item>> held;
+    int64_t waiting_since_us = 0;
+    int fd = -1;
+    uint8_t *write_buffer = nullptr;
+    size_t write_used = 0;
+    int64_t file_offset = 0;
+    int64_t file_end = 0;
+
+    ItemSink item_sink;
+    AsyncSink<Item> queue;
+
+    StreamSink audio_sink;
+    StreamSink video_sink;
+
+    Counter &packets_written;
+    Counter &packets_dropped;
+    Counter &bytes_written;
+
+public:
+    explicit Recorder(std::string path, std::string format = "", bool direct = false, size_t buffer_size = 4 << 20);
+    ~Recorder();
+
+    // from the record.* settings, nullptr when recording is off
+    static std::unique_ptr<Recorder> fromConfig();
+
+    void start();
+    // writes what is queued and closes the file
+    void stop();
+
+    StreamSink& getSink(uint8_t stream);
+    // the server announced the stream, the file waits for its parameters
+    void expectStream(uint8_t stream);
+    // parameters and time base of the packets that follow on this stream, copied
+    void addStream(uint8_t stream, const AVCodecParameters *parameters, AVRational time_base);
+
+private:
+    void handleItem(std::unique_ptr<Item> item);
+    void hold(std::unique_ptr<Item> item);
+    bool ready(int64_t now_us) const;
+    void begin();
+    void writePacket(Stream &stream, AVPacket *packet, int64_t receive_us);
+    bool open(int64_t receive_us);
+    void close();
+
+    static int writeCallback(void *opaque, uint8_t *data, int size);
+    static int64_t seekCallback(void *opaque, int64_t offset, int whence);
+    void append(const uint8_t *data, size_t size);
+    void flushBuffer(bool all);
+};
+
+#endif //REMOTE_CLIENT_RECORDER_H
@@ -7,11 +7,17 @@
 #include <sstream>
 #include <chrono>
 #include <unordered_set>
+#include <vector>
+#include <algorithm>
 
 #include "SDLDisplay.h"
+#include "Log.h"
 #include "exception.h"
+#include "ThreadPolicy.h"
+#include "Trace.h"
 
 constexpr int32_t LOOP_MIN_TIME = 8; // max 125Hz, most common polling freq
+constexpr size_t MAX_MOTION_SAMPLES = 32; // per datagram, extra samples are merged into the last one
 
 void fill_audio(void *userdata, Uint8 *stream, int len) {
     //std::cout << sample_queue.size_approx() << std::endl;
@@ -26,16 +32,34 @@ void fill_audio(void *userdata, Uint8 *stream, int len) {
     memset(stream + size, 0, len - size);
 }
 
-SDLDisplay::SDLDisplay() : name("sdl display"), audio_frame_queue(4), sample_queue(8192), video_frame_queue(8) {
+SDLDisplay::SDLDisplay() : name("sdl display"),
+    audio_budget(MemoryBudget::global().stage("audio-frames", {4, 0, 0, DropPolicy::DROP_NEWEST})),
+    device_budget(MemoryBudget::global().stage("audio-device", {0, 0, 0, DropPolicy::FLUSH})),
+    sample_queue(8192), audio_frame_queue(std::max<size_t>(audio_budget.getLimits().items, 1)),
+    audio_drops(MetricsRegistry::global().counter("display_dropped_frames_total", "frames dropped because the display queue was full", {{"stream", "audio"}})),
+    audio_resets(MetricsRegistry::global().counter("audio_queue_resets_total", "times the sdl audio queue was cleared to catch up")),
+    input_packets(MetricsRegistry::global().counter("input_messages_total", "input messages sent")),
+    input_bytes(MetricsRegistry::global().counter("input_bytes_total", "input message bytes sent")) {
     SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_GAMECONTROLLER | SDL_INIT_TIMER);
+    for (int i = 0; i < MAX_VIDEO_STREAMS; ++i) {
+        windows[i] = std::make_unique<SDLVideoWindow>(i);
+    }
+
+    MetricsRegistry::global().addCollector(this, [this](std::vector<MetricSample> &samples) {
+        for (int i = 0; i < MAX_VIDEO_STREAMS; ++i) {
+            samples.push_back({"display_queue_depth", {{"stream", "video"}, {"index", std::to_string(i)}}, "frames waiting in the display queue", MetricType::GAUGE, static_cast<double>(windows[i]->getQueueDepth())});
+        }
+        samples.push_back({"display_queue_depth", {{"stream", "audio"}}, "frames waiting in the display queue", MetricType::GAUGE, static_cast<double>(audio_frame_queue.size_approx())});
+        samples.push_back({"audio_queued_bytes", {}, "bytes queued in the sdl audio device", MetricType::GAUGE, static_cast<double>(dev > 0 ? SDL_GetQueuedAudioSize(dev) : 0)});
+    });
 }
 
 SDLDisplay::~SDLDisplay() {
+    MetricsRegistry::global().removeCollectors(this);
     stop();
-    SDL_DestroyTexture(texture_yuv420);
-    SDL_DestroyTexture(texture_nv12);
-    SDL_DestroyRenderer(renderer);
-    SDL_DestroyWindow(screen);
+    for (auto &window : windows) {
+        window.reset();
+    }
     for (SDL_GameController* gamepad : gamepads) {
         SDL_GameControllerClose(gamepad);
     }
@@ -43,45 +67,8 @@ SDLDisplay::~SDLDisplay() {
 }
 
 void SDLDisplay::init(AVCodecContext *audio_ctx, AVCodecContext *video_ctx) {
-    SDL_DestroyWindow(screen);
-    screen = SDL_CreateWindow("Remote Desktop Client",SDL_WINDOWPOS_CENTERED,SDL_WINDOWPOS_CENTERED,
-                              1280, 720,SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
-
-    SDL_DestroyRenderer(renderer);
-    renderer = SDL_CreateRenderer(screen, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE);
-    SDL_RenderSetViewport(renderer, NULL);
-
-    //SDL_RenderSetIntegerScale(renderer, SDL_TRUE);
-    const char scale_mode = SDL_ScaleModeLinear;
-    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, &scale_mode);
-
-    //texture_rgb = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STREAMING, 1920, 1080);
-    SDL_DestroyTexture(texture_yuv420);
-    texture_yuv420 = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_YV12, SDL_TEXTUREACCESS_STREAMING, video_ctx->width, video_ctx->height);
-    SDL_SetTextureBlendMode(texture_yuv420, SDL_BLENDMODE_NONE);
-    SDL_DestroyTexture(texture_nv12);
-    texture_nv12 = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_NV12, SDL_TEXTUREACCESS_STREAMING, video_ctx->width, video_ctx->height);
-    SDL_SetTextureBlendMode(texture_nv12, SDL_BLENDMODE_NONE);
-
-    SDL_AudioSpec wanted;
-    SDL_zero(wanted);
-    SDL_zero(given);
-    wanted.format = AUDIO_F32SYS;
-    wanted.freq = audio_ctx->sample_rate;
-    wanted.channels = audio_ctx->channels;
-    wanted.samples = 512;
-    wanted.callback = nullptr;
-    //wanted.callback = fill_audio;
-    //wanted.userdata = &sample_queue;
-
-    SDL_CloseAudioDevice(dev);
-    dev = SDL_OpenAudioDevice(NULL, 0, &wanted, &given, 0);
-    if (dev <= 0) {
-        std::cout << "audio error" << std::endl;
-    }
-
-    std::cerr << "audio open with the given values: " << given.freq << "Hz, " << (int)given.channels << "ch, buffer total size is " << given.size << " bytes" << std::endl;
-    SDL_PauseAudioDevice(dev, 0);
+    initVideo(video_ctx);
+    initAudio(audio_ctx);
 }
 
 void SDLDisplay::initAudio(AVCodecContext *audio_ctx) {
@@ -99,33 +86,17 @@ void SDLDisplay::initAudio(AVCodecContext *audio_ctx) {
     SDL_CloseAudioDevice(dev);
     dev = SDL_OpenAudioDevice(NULL, 0, &wanted, &given, 0);
     if (dev <= 0) {
-        std::cout << "audio error" << std::endl;
+        LOG_ERROR("audio error");
     }
 
-    std::cerr << "audio open with the given values: " << given.freq << "Hz, " << (int)given.channels << "ch, buffer total size is " << given.size << " bytes" << std::endl;
+    LOG_INFO("audio open with the given values: " << given.freq << "Hz, " << (int)given.channels << "ch, buffer total size is " << given.size << " bytes");
+    // 8 device buffers unless configured
+    device_budget.setLimits(BudgetLimits::fromConfig("audio-device", {0, 8ULL * given.size, 0, DropPolicy::FLUSH}));
     SDL_PauseAudioDevice(dev, 0);
 }
 
-void SDLDisplay::initVideo(AVCodecContext *video_ctx) {
-    SDL_DestroyWindow(screen);
-    screen = SDL_CreateWindow("Remote Desktop Client",SDL_WINDOWPOS_CENTERED,SDL_WINDOWPOS_CENTERED,
-                              1280, 720,SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
-
-    SDL_DestroyRenderer(renderer);
-    renderer = SDL_CreateRenderer(screen, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE);
-    SDL_RenderSetViewport(renderer, NULL);
-
-    //SDL_RenderSetIntegerScale(renderer, SDL_TRUE);
-    const char scale_mode = SDL_ScaleModeLinear;
-    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, &scale_mode);
-
-    //texture_rgb = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STREAMING, 1920, 1080);
-    SDL_DestroyTexture(texture_yuv420);
-    texture_yuv420 = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_YV12, SDL_TEXTUREACCESS_STREAMING, video_ctx->width, video_ctx->height);
-    SDL_SetTextureBlendMode(texture_yuv420, SDL_BLENDMODE_NONE);
-    SDL_DestroyTexture(texture_nv12);
-    texture_nv12 = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_NV12, SDL_TEXTUREACCESS_STREAMING, video_ctx->width, video_ctx->height);
-    SDL_SetTextureBlendMode(texture_nv12, SDL_BLENDMODE_NONE);
+void SDLDisplay::initVideo(AVCodecContext *video_ctx, int index) {
+    windows[index]->init(video_ctx);
 }
 
 void SDLDisplay::start() {
@@ -141,61 +112,31 @@ void SDLDisplay::stop() {
 }
 
 void SDLDisplay::startDisplay() {
-    if (display_stop_condition) {
-        display_stop_condition = false;
-        display_thread = std::thread(&SDLDisplay::runDisplay, this);
+    for (auto &window : windows) {
+        window->start();
     }
 }
 
-static inline uint32_t log_2(const uint32_t x) {
-    return x ? (31 - __builtin_clz (x)) : 0;
+void SDLDisplay::startDisplay(int index) {
+    windows[index]->start();
 }
 
-void SDLDisplay::runDisplay() {
-    Uint32 start = SDL_GetTicks();
-    Uint32 last = 0;
-    int delay = 0;
-    int i = 0;
-    int j = 0;
-    AVFrame *frame;
-    uint64_t calculated_next_pts = 0;
-    while (!display_stop_condition) {
-        if (!video_frame_queue.wait_dequeue_timed(frame, std::chrono::milliseconds(100))) {
-            continue;
-        }
-
-        if (int64_t wait_ticks = calculated_next_pts - frame->pts; wait_ticks > 0) {
-            std::cout << "need to wait " << wait_ticks / 90 << "ms before present next frame" << std::endl;
-            SDL_Delay(wait_ticks / 90); // in milliseconds, rtp sample rate = 90000Hz
-        }
+void SDLDisplay::stopDisplay() {
+    for (auto &window : windows) {
+        window->stop();
+    }
+}
 
-        calculated_next_pts = frame->pts + frame->pkt_duration;
-        int64_t presentation_time = frame->pkt_duration / 90 - log_2(video_frame_queue.size_approx());
-        displayImpl(frame);
-        av_frame_free(&frame);
-        ++j;
-        if (SDL_GetTicks() - start >= 1000) {
-            start = SDL_GetTicks();
-            std::stringstream ss;
-            ss << "Remote Desktop Client (framerate = " << j - i << " fps, pipeline latency = " << ((j - i > 0) ? delay / (j - i) : -1) << " ms)";
-            SDL_SetWindowTitle(screen, ss.str().c_str());
-            i = j;
-            delay = 0;
-        }
+void SDLDisplay::stopDisplay(int index) {
+    windows[index]->stop();
+}
 
-        //std::cout << "frame will be displayed " << presentation_time << "ms, " << video_frame_queue.size_approx() << " waiting" << std::endl;
-        //SDL_Delay(12);
-        SDL_Delay(presentation_time > 0 ? presentation_time : 0);
-    }
+SDLVideoWindow& SDLDisplay::getVideoSink(int index) {
+    return *windows[index];
 }
 
-void SDLDisplay::stopDisplay() {
-    if (!display_stop_condition) {
-        display_stop_condition = true;
-        if (display_thread.joinable()) {
-            display_thread.join();
-        }
-    }
+size_t SDLDisplay::getVideoQueueDepth(int index) const {
+    return windows[index]->getQueueDepth();
 }
 
 void SDLDisplay::startAudio() {
@@ -206,6 +147,7 @@ void SDLDisplay::startAudio() {
 }
 
 void SDLDisplay::runAudio() {
+    ThreadScope scope("audio-output");
     /*SwrContext *swr_ctx = swr_alloc();
     //swr_alloc_set_opts(NULL, av_get_default_channel_layout(2), AV_SAMPLE_FMT_S16, 48000,
     //                   av_get_default_channel_layout(2), AV_SAMPLE_FMT_FLTP, 48000, 0, NULL);
@@ -220,7 +162,7 @@ void SDLDisplay::runAudio() {
         exit(-1);
     }*/
 
-    AVFrame *frame;
+    AVFrame *frame = nullptr;
     /*AVFrame *frame_out = av_frame_alloc();
     frame_out->channels = 2;
     frame_out->channel_layout = av_get_default_channel_layout(frame_out->channels);
@@ -233,15 +175,22 @@ void SDLDisplay::runAudio() {
             if (!audio_frame_queue.wait_dequeue_timed(frame, std::chrono::milliseconds(100))) {
                 continue;
             }
+            Trace::instant("audio dequeue", audio_frame_queue.size_approx());
+            audio_budget.release(frame);
 
             //int size = swr_convert(swr_ctx, (uint8_t**)&data, 512, (const uint8_t**)frame_in->data, frame_in->linesize[0]);
             audioImpl(frame);
+            av_frame_free(&frame);
         }
     } catch (const std::exception &e) {
-        std::cerr << e.what() << std::endl;
+        LOG_ERROR(e.what());
     }
 
     av_frame_free(&frame);
+    while (audio_frame_queue.try_dequeue(frame)) {
+        audio_budget.release(frame);
+        av_frame_free(&frame);
+    }
     SDL_CloseAudioDevice(dev);
 }
 
@@ -262,21 +211,11 @@ void SDLDisplay::startEvent() {
 }
 
 void SDLDisplay::runEvent() {
-#ifdef DEBUG
-    std::cerr << "input listening thread is " << gettid() << std::endl;
-#endif
+    ThreadScope scope("input");
+    LOG_DEBUG("input listening thread is " << gettid());
 
-    std::unordered_set<int> keyup;
-    std::unordered_set<int> keydown;
-    float x = 0;
-    float y = 0;
-    int wx = 0;
-    int wy = 0;
-    unsigned char mouse_button_states = 0;
-    unsigned char last_mouse_button_states = 0;
-    std::array<int16_t, 6> gamepad_axis = {0};
-    uint32_t gamepad_button_states = 0;
-    uint32_t last_gamepad_button_states = 0;
+    InputState input;
+    input.motion_samples.reserve(MAX_MOTION_SAMPLES);
     bool relative = false;
     bool lock = false;
     int last_key;
@@ -291,7 +230,7 @@ void SDLDisplay::runEvent() {
                     if (SDL_GameController *gamepad = SDL_GameControllerOpen(event.cdevice.which)) {
                         gamepads.insert(gamepad);
                     } else {
-                        std::cerr << SDL_GetError() << std::endl;
+                        LOG_WARNING(SDL_GetError());
                     }
 
                     break;
@@ -300,13 +239,36 @@ void SDLDisplay::runEvent() {
                     if (SDL_GameController *gamepad = SDL_GameControllerFromInstanceID(event.cdevice.which)) {
                         gamepads.erase(gamepad);
                     } else {
-                        std::cerr << SDL_GetError() << std::endl;
+                        LOG_WARNING(SDL_GetError());
                     }
 
                     break;
                 }
                 case SDL_CONTROLLERDEVICEREMAPPED: {
-                    std::cout << "controller remap event" << std::endl;
+                    LOG_INFO("controller remap event");
+                    break;
+                }
+                case SDL_WINDOWEVENT: {
+                    // sdl2 has no occlusion event, minimized is what most window managers report for a hidden window
+                    const int index = findWindow(event.window.windowID);
+                    if (index < 0) {
+                        break;
+                    }
+                    switch (event.window.event) {
+                        case SDL_WINDOWEVENT_MINIMIZED:
+                        case SDL_WINDOWEVENT_HIDDEN:
+                            setHidden(index, true);
+                            break;
+                        case SDL_WINDOWEVENT_RESTORED:
+                        case SDL_WINDOWEVENT_MAXIMIZED:
+                        case SDL_WINDOWEVENT_SHOWN:
+                        case SDL_WINDOWEVENT_EXPOSED:
+                            setHidden(index, false);
+                            break;
+                        case SDL_WINDOWEVENT_SIZE_CHANGED:
+                            windows[index]->setSize(event.window.data1, event.window.data2);
+                            break;
+                    }
                     break;
                 }
                 case SDL_KEYDOWN: {
@@ -314,66 +276,78 @@ void SDLDisplay::runEvent() {
                         if (--count <= 0 && SDL_SetRelativeMouseMode(!lock ? SDL_TRUE : SDL_FALSE) == 0) {
                             lock ^= true;
                             relative ^= true;
-                            std::cout << "relative mode" << std::endl;
+                            LOG_INFO("relative mode");
                             count = 50;
                         }
                     } else {
                         count = 50;
                     }
                     last_key = event.key.keysym.scancode;
-                    keydown.emplace(event.key.keysym.scancode);
-                    keyup.erase(event.key.keysym.scancode);
+                    input.keydown.emplace(event.key.keysym.scancode);
+                    input.keyup.erase(event.key.keysym.scancode);
                     break;
                 }
                 case SDL_KEYUP: {
-                    keyup.emplace(event.key.keysym.scancode);
-                    keydown.erase(event.key.keysym.scancode);
+                    input.keyup.emplace(event.key.keysym.scancode);
+                    input.keydown.erase(event.key.keysym.scancode);
                     break;
                 }
                 case SDL_MOUSEMOTION: {
                     if (relative) {
-                        x += event.motion.xrel;
-                        y += event.motion.yrel;
-                    } else {
-                        int max_x, max_y;
-                        SDL_GetWindowSize(screen, &max_x, &max_y);
-                        x = event.motion.x / (max_x - 1.f);
-                        y = event.motion.y / (max_y - 1.f);
+                        input.x += event.motion.xrel;
+                        input.y += event.motion.yrel;
+                        if (input.motion_samples.size() < MAX_MOTION_SAMPLES) {
+                            input.motion_samples.push_back({event.motion.timestamp, event.motion.xrel, event.motion.yrel});
+                        } else {
+                            MotionSample &last = input.motion_samples.back();
+                            last.timestamp = event.motion.timestamp;
+                            last.dx += event.motion.xrel;
+                            last.dy += event.motion.yrel;
+                        }
+                    } else if (const int index = findWindow(event.motion.windowID); index >= 0) {
+                        // relative to the window the pointer is in, a recreated window asks for its size again
+                        int window_width;
+                        int window_height;
+                        if (windows[index]->getSize(window_width, window_height)) {
+                            input.x = event.motion.x / (window_width - 1.f);
+                            input.y = event.motion.y / (window_height - 1.f);
+                            input.display = index;
+                        }
                     }
                     break;
                 }
                 case SDL_MOUSEBUTTONDOWN: {
-                    mouse_button_states |= 1U << (event.button.button - 1);
+                    input.mouse_button_states |= 1U << (event.button.button - 1);
                     break;
                 }
                 case SDL_MOUSEBUTTONUP: {
-                    mouse_button_states &= ~(1U << (event.button.button - 1));
+                    input.mouse_button_states &= ~(1U << (event.button.button - 1));
                     break;
                 }
                 case SDL_MOUSEWHEEL: {
-                    wx = event.wheel.x;
-                    wy = event.wheel.y;
+                    input.wx = event.wheel.x;
+                    input.wy = event.wheel.y;
                     break;
                 }
                 case SDL_CONTROLLERAXISMOTION: {
                     if (event.jaxis.axis >= 0 && event.jaxis.axis <= 5) {
-                        gamepad_axis[event.jaxis.axis] = event.jaxis.value;
+                        input.gamepad_axis[event.jaxis.axis] = event.jaxis.value;
                     }
                     break;
                 }
                 case SDL_CONTROLLERBUTTONDOWN: {
                     if (event.jbutton.button >= 0 && event.jbutton.button <= 14) {
-                        gamepad_button_states |= 1U << (event.jbutton.button);
+                        input.gamepad_button_states |= 1U << (event.jbutton.button);
                     } else {
-                        std::cout << "button not mapped" << std::endl;
+                        LOG_DEBUG("button not mapped");
                     }
                     break;
                 }
                 case SDL_CONTROLLERBUTTONUP: {
                     if (event.jbutton.button >= 0 && event.jbutton.button <= 14) {
-                        gamepad_button_states  &= ~(1U << event.jbutton.button);
+                        input.gamepad_button_states  &= ~(1U << event.jbutton.button);
                     } else {
-                        std::cout << "button not mapped" << std::endl;
+                        LOG_DEBUG("button not mapped");
                     }
                     break;
                 }
@@ -381,52 +355,7 @@ void SDLDisplay::runEvent() {
         }
 
         // build JSON
-        ss << R"({"t":"i")";
-        if (!keyup.empty() || !keydown.empty()) {
-            ss << R"(,"k":[[)";
-            bool comma = false;
-            for (int key: keyup) {
-                ss << (comma ? "," : "") << key;
-                comma = true;
-            }
-            ss << "],[";
-            comma = false;
-            for (int key: keydown) {
-                ss << (comma ? "," : "") << key;
-                comma = true;
-            }
-            ss << "]]";
-            keyup.clear();
-        }
-
-        if (x != 0 || y != 0) {
-            ss << R"(,"m":[)" << x << ',' << y << ']';
-            x = 0;
-            y = 0;
-        }
-
-        //if (mouse_button_states != last_mouse_button_states) {
-            ss << R"(,"b":)" << (int) mouse_button_states;
-            last_mouse_button_states = mouse_button_states;
-        //}
-
-        if (wx || wy) {
-            ss << R"(,"w":[)" << wx << ',' << wy << ']';
-            wx = 0;
-            wy = 0;
-        }
-
-        //if (std::find_if(gamepad_axis.begin(), gamepad_axis.end(), [](auto e) { return e != 0; }) != gamepad_axis.end()) {
-            ss << R"(,"a":[)" << (int) gamepad_axis[0] << ',' << (int) gamepad_axis[1] << ',' << (int) gamepad_axis[2]
-               << ',' << (int) gamepad_axis[3] << ',' << (int) gamepad_axis[4] << ',' << (int) gamepad_axis[5] << ']';
-        //}
-
-        //if (gamepad_button_states != last_gamepad_button_states) {
-            ss << R"(,"c":)" << (int) gamepad_button_states;
-            last_gamepad_button_states = gamepad_button_states;
-        //}
-
-        ss << '}';
+        encodeInput(input, ss);
 
         const std::string &json = ss.str();
         if (json.size() > 9) { // no command == R"({"t":"i"})";
@@ -434,6 +363,9 @@ void SDLDisplay::runEvent() {
             for (const auto &command_sink: command_sinks) {
                 command_sink->handle(json);
             }
+            Trace::instant("input send", json.size());
+            input_packets.add();
+            input_bytes.add(json.size());
         }
 
         ss.clear();
@@ -447,6 +379,71 @@ void SDLDisplay::runEvent() {
     }
 }
 
+void SDLDisplay::encodeInput(InputState &input, std::ostream &ss) {
+    ss << R"({"t":"i")";
+    if (!input.keyup.empty() || !input.keydown.empty()) {
+        ss << R"(,"k":[[)";
+        bool comma = false;
+        for (int key: input.keyup) {
+            ss << (comma ? "," : "") << key;
+            comma = true;
+        }
+        ss << "],[";
+        comma = false;
+        for (int key: input.keydown) {
+            ss << (comma ? "," : "") << key;
+            comma = true;
+        }
+        ss << "]]";
+        input.keyup.clear();
+    }
+
+    if (input.x != 0 || input.y != 0) {
+        ss << R"(,"m":[)" << input.x << ',' << input.y << ']';
+        // the first window is implied, a single stream server never sees it
+        if (input.display != 0) {
+            ss << R"(,"d":)" << input.display;
+        }
+        input.x = 0;
+        input.y = 0;
+    }
+
+    // relative motion with per-event timing, "m" keeps the tick sum for older servers
+    if (!input.motion_samples.empty()) {
+        ss << R"(,"s":[)";
+        bool comma = false;
+        for (const MotionSample &sample : input.motion_samples) {
+            ss << (comma ? ",[" : "[") << sample.timestamp << ',' << sample.dx << ',' << sample.dy << ']';
+            comma = true;
+        }
+        ss << ']';
+        input.motion_samples.clear();
+    }
+
+    //if (input.mouse_button_states != input.last_mouse_button_states) {
+        ss << R"(,"b":)" << (int) input.mouse_button_states;
+        input.last_mouse_button_states = input.mouse_button_states;
+    //}
+
+    if (input.wx || input.wy) {
+        ss << R"(,"w":[)" << input.wx << ',' << input.wy << ']';
+        input.wx = 0;
+        input.wy = 0;
+    }
+
+    //if (std::find_if(input.gamepad_axis.begin(), input.gamepad_axis.end(), [](auto e) { return e != 0; }) != input.gamepad_axis.end()) {
+        ss << R"(,"a":[)" << (int) input.gamepad_axis[0] << ',' << (int) input.gamepad_axis[1] << ',' << (int) input.gamepad_axis[2]
+           << ',' << (int) input.gamepad_axis[3] << ',' << (int) input.gamepad_axis[4] << ',' << (int) input.gamepad_axis[5] << ']';
+    //}
+
+    //if (input.gamepad_button_states != input.last_gamepad_button_states) {
+        ss << R"(,"c":)" << (int) input.gamepad_button_states;
+        input.last_gamepad_button_states = input.gamepad_button_states;
+    //}
+
+    ss << '}';
+}
+
 void SDLDisplay::stopEvent() {
     if (!event_stop_condition) {
         event_stop_condition = true;
@@ -456,69 +453,57 @@ void SDLDisplay::stopEvent() {
     }
 }
 
+void SDLDisplay::setClockSync(const ClockSync *clock_sync) {
+    this->clock_sync = clock_sync;
+    for (auto &window : windows) {
+        window->setClockSync(clock_sync);
+    }
+}
+
+void SDLDisplay::setVisibilityCallback(std::function<void(int index, bool hidden)> callback) {
+    visibility_callback = std::move(callback);
+}
+
+void SDLDisplay::setHidden(int index, bool hidden) {
+    if (windows[index]->isHidden() == hidden) {
+        return;
+    }
+    LOG_INFO(name << ": window " << index << (hidden ? " hidden" : " shown"));
+    windows[index]->setHidden(hidden);
+    if (visibility_callback) {
+        visibility_callback(index, hidden);
+    }
+}
+
+int SDLDisplay::findWindow(Uint32 window_id) const {
+    for (int i = 0; i < MAX_VIDEO_STREAMS; ++i) {
+        if (window_id != 0 && windows[i]->getWindowId() == window_id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 void SDLDisplay::handle(AVFrame *frame) {
     if (frame->width == 0) {
         if (audio_thread.joinable()) {
-            if (!audio_frame_queue.try_enqueue(frame)) {
-                std::cout << name << ": audio queue full, drop" << std::endl;
+            uint64_t evicted = 0;
+            const bool queued = audio_budget.enqueue(audio_frame_queue, frame, evicted);
+            audio_drops.add(evicted);
+            if (!queued) {
+                LOG_WARNING(name << ": audio queue full, drop");
+                Trace::instant("audio drop");
+                audio_drops.add();
                 av_frame_free(&frame);
+            } else {
+                Trace::instant("audio enqueue", audio_frame_queue.size_approx());
             }
         } else {
             audioImpl(frame);
             av_frame_free(&frame);
         }
     } else {
-        if (display_thread.joinable()) {
-            if (!video_frame_queue.try_enqueue(frame)) {
-                std::cout << name << ": video queue full, drop" << std::endl;
-                av_frame_free(&frame);
-            }
-        } else {
-            displayImpl(frame);
-            av_frame_free(&frame);
-        }
-    }
-}
-
-void SDLDisplay::displayImpl(AVFrame *frame) {
-    SDL_Texture *texture;
-    int ret;
-    switch (frame->format) {
-/*            case AV_PIX_FMT_GBRP:
-                Uint8 *pixels;
-                int pitch;
-                SDL_LockTexture(texture = texture_rgb, NULL, (void**)&pixels, &pitch);
-                for (int k = 0; k < 100; ++k) {
-                    memcpy(pixels + 3 * k * pitch, frame->data[0] + k * pitch, pitch);
-                    memcpy(pixels + (3 * k + 1) * pitch, frame->data[1] + k * pitch, pitch);
-                    memcpy(pixels + (3 * k + 2) * pitch, frame->data[2] + k * pitch, pitch);
-                }
-
-                SDL_UnlockTexture(texture);
-                break;*/
-        case AV_PIX_FMT_YUV420P:
-            ret = SDL_UpdateYUVTexture(texture = texture_yuv420, NULL,
-                                       frame->data[0], frame->linesize[0],
-                                       frame->data[1], frame->linesize[1],
-                                       frame->data[2], frame->linesize[2]);
-            break;
-        case AV_PIX_FMT_NV12:
-            ret = SDL_UpdateNVTexture(texture = texture_nv12, NULL,
-                                      frame->data[0], frame->linesize[0],
-                                      frame->data[1], frame->linesize[1]);
-            break;
-        default:
-            char buffer[32];
-            std::cout << "no rule for " << av_fourcc_make_string(buffer, avcodec_pix_fmt_to_codec_tag((AVPixelFormat)frame->format)) << std::endl;
-            break;
-    }
-
-    if (ret < 0) {
-        std::cout << SDL_GetError() << std::endl;
-    } else {
-        //SDL_RenderClear(renderer);
-        SDL_RenderCopy(renderer, texture, NULL, NULL);
-        SDL_RenderPresent(renderer);
+        windows[0]->handle(frame);
     }
 }
 
@@ -531,13 +516,32 @@ void SDLDisplay::audioImpl(AVFrame *frame) {
         }
     }*/
 
-    if (SDL_GetQueuedAudioSize(dev) > 8 * given.size) {
+    TraceScope trace_audio("audio queue");
+    const uint32_t queued = SDL_GetQueuedAudioSize(dev);
+    const int64_t bytes_per_second = static_cast<int64_t>(given.freq) * given.channels * sizeof(float);
+    if (device_budget.observe(0, queued, bytes_per_second > 0 ? queued * 1000000LL / bytes_per_second : 0)) {
+        device_budget.dropped();
+        const DropPolicy policy = device_budget.getLimits().policy;
+        if (policy == DropPolicy::DROP_NEWEST || policy == DropPolicy::BLOCK) {
+            // let the device drain instead, the frame is skipped
+            return;
+        }
+        // sdl can only clear its queue, oldest and flush both catch up at once
         SDL_ClearQueuedAudio(dev);
+        device_budget.observe(0, 0, 0);
+        audio_resets.add();
     }
 
+    // one queue call per frame, each call takes the device lock
+    audio_buffer.resize(static_cast<size_t>(frame->nb_samples) * given.channels);
+    interleaveAudio(frame, given.channels, audio_buffer.data());
+    SDL_QueueAudio(dev, audio_buffer.data(), audio_buffer.size() * sizeof(float));
+}
+
+void SDLDisplay::interleaveAudio(const AVFrame *frame, int channels, float *out) {
     for (int i = 0; i < frame->nb_samples; ++i) {
-        for (int c = 0; c < given.channels; ++c) {
-            SDL_QueueAudio(dev, frame->data[c] + sizeof(float) * i, sizeof(float));
+        for (int c = 0; c < channels; ++c) {
+            *out++ = reinterpret_cast<const float*>(frame->data[c])[i];
         }
     }
 }
\ No newline at end of file
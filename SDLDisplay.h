@@ -13,44 +13,81 @@ extern "C" {
 
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <deque>
+#include <vector>
+#include <array>
+#include <memory>
+#include <functional>
+#include <ostream>
 
 #include "concurrentqueue/blockingconcurrentqueue.h"
 
 #include "sink.h"
 #include "CommandSource.h"
+#include "ClockSync.h"
+#include "Metrics.h"
+#include "SDLVideoWindow.h"
+#include "Budget.h"
+
+// one window per video stream, "g" 1 to MAX_VIDEO_STREAMS in the stream command
+constexpr int MAX_VIDEO_STREAMS = 4;
+
+struct MotionSample {
+    Uint32 timestamp;
+    int32_t dx;
+    int32_t dy;
+};
+
+// what the input thread gathered since its last message
+struct InputState {
+    std::unordered_set<int> keyup;
+    std::unordered_set<int> keydown;
+    float x = 0;
+    float y = 0;
+    int display = 0; // window the absolute position is in
+    std::vector<MotionSample> motion_samples;
+    int wx = 0;
+    int wy = 0;
+    unsigned char mouse_button_states = 0;
+    unsigned char last_mouse_button_states = 0;
+    std::array<int16_t, 6> gamepad_axis = {0};
+    uint32_t gamepad_button_states = 0;
+    uint32_t last_gamepad_button_states = 0;
+};
 
 class SDLDisplay : public Sink<AVFrame>, public CommandSource {
 private:
     std::string name;
     bool initialized = false;
 
-    bool NV12;
-
-    SDL_Window *screen = nullptr;
-    SDL_Renderer *renderer = nullptr;
-    SDL_Texture *texture_rgb = nullptr;
-    SDL_Texture *texture_yuv420 = nullptr;
-    SDL_Texture *texture_nv12 = nullptr;
     SDL_Event event;
     std::unordered_set<SDL_GameController*> gamepads;
 
-
-
-    bool display_stop_condition = true;
-    std::thread display_thread;
-    moodycamel::BlockingConcurrentQueue<AVFrame*> video_frame_queue;
+    std::array<std::unique_ptr<SDLVideoWindow>, MAX_VIDEO_STREAMS> windows;
 
     bool audio_stop_condition = true;
     std::thread audio_thread;
-    SDL_AudioDeviceID dev;
+    SDL_AudioDeviceID dev = 0;
     SDL_AudioSpec given;
+    std::vector<float> audio_buffer;
+    BudgetStage &audio_budget;
+    BudgetStage &device_budget;
     moodycamel::ConcurrentQueue<uint8_t> sample_queue;
     moodycamel::BlockingConcurrentQueue<AVFrame*> audio_frame_queue;
 
     bool event_stop_condition = true;
     std::thread event_thread;
 
+    const ClockSync *clock_sync = nullptr;
+    // window index and whether it is hidden now, from the input thread
+    std::function<void(int, bool)> visibility_callback;
+
+    Counter &audio_drops;
+    Counter &audio_resets;
+    Counter &input_packets;
+    Counter &input_bytes;
+
 public:
     SDLDisplay();
     ~SDLDisplay() override;
@@ -58,14 +95,19 @@ public:
 
     void init(AVCodecContext *audio_ctx, AVCodecContext *video_ctx);
     void initAudio(AVCodecContext *audio_ctx);
-    void initVideo(AVCodecContext *video_ctx);
+    void initVideo(AVCodecContext *video_ctx, int index = 0);
 
     void start();
     void stop();
 
+    // every window or one
     void startDisplay();
-    void runDisplay();
+    void startDisplay(int index);
     void stopDisplay();
+    void stopDisplay(int index);
+    // frame sink of a video stream, handle() sends the video frames to the first one
+    SDLVideoWindow& getVideoSink(int index);
+    size_t getVideoQueueDepth(int index) const;
 
     void startAudio();
     void runAudio();
@@ -75,10 +117,20 @@ public:
     void runEvent();
     void stopEvent();
 
+    void setClockSync(const ClockSync *clock_sync);
+    // called when a window gets minimized or hidden and when it shows again, set before startEvent
+    void setVisibilityCallback(std::function<void(int index, bool hidden)> callback);
+
     void handle(AVFrame *frame) override;
 
+    // one input message, the one shot parts (released keys, motion, wheel) are cleared
+    static void encodeInput(InputState &input, std::ostream &ss);
+    // planar to interleaved audio ([a1,a2], [b1,b2]) -> (a1,b1,a2,b2)
+    static void interleaveAudio(const AVFrame *frame, int channels, float *out);
+
 private:
-    void displayImpl(AVFrame *frame);
+    int findWindow(Uint32 window_id) const;
+    void setHidden(int index, bool hidden);
     void audioImpl(AVFrame *frame);
 };
 
@@ -0,0 +1,280 @@
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+
+#include "SDLVideoWindow.h"
+#include "Log.h"
+#include "ThreadPolicy.h"
+#include "Trace.h"
+
+static inline uint32_t log_2(const uint32_t x) {
+    return x ? (31 - __builtin_clz (x)) : 0;
+}
+
+// both formats the textures take are 4:2:0
+static inline int64_t picture_bytes(const int width, const int height) {
+    return static_cast<int64_t>(width) * height + 2 * static_cast<int64_t>((width + 1) / 2) * ((height + 1) / 2);
+}
+
+static Labels window_labels(int index, Labels labels = {}) {
+    labels.emplace_back("index", std::to_string(index));
+    return labels;
+}
+
+SDLVideoWindow::SDLVideoWindow(int index) : name("sdl video window " + std::to_string(index)),
+    title(index == 0 ? "Remote Desktop Client" : "Remote Desktop Client #" + std::to_string(index + 1)),
+    index(index),
+    damage(DamageTracker::Settings::fromConfig()),
+    budget(MemoryBudget::global().stage(index == 0 ? "video-frames" : "video-frames-" + std::to_string(index + 1), {8, 0, 0, DropPolicy::DROP_NEWEST}, "video-frames")),
+    video_frame_queue(std::max<size_t>(budget.getLimits().items, 1)),
+    video_drops(MetricsRegistry::global().counter("display_dropped_frames_total", "frames dropped because the display queue was full", window_labels(index, {{"stream", "video"}}))),
+    present_time(MetricsRegistry::global().histogram("present_time_us", "texture upload and present time", window_labels(index))),
+    presented_frames(MetricsRegistry::global().counter("presented_frames_total", "frames presented", window_labels(index))),
+    pipeline_latency(MetricsRegistry::global().histogram("pipeline_latency_us", "packet arrival to end of present", window_labels(index))),
+    upload_bytes(MetricsRegistry::global().counter("texture_upload_bytes_total", "bytes copied into the video textures", window_labels(index))),
+    saved_bytes(MetricsRegistry::global().counter("texture_upload_saved_bytes_total", "bytes of unchanged regions not copied into the video textures", window_labels(index))),
+    full_uploads(MetricsRegistry::global().counter("texture_uploads_total", "texture updates", window_labels(index, {{"kind", "full"}}))),
+    server_uploads(MetricsRegistry::global().counter("texture_uploads_total", "texture updates", window_labels(index, {{"kind", "server"}}))),
+    compare_uploads(MetricsRegistry::global().counter("texture_uploads_total", "texture updates", window_labels(index, {{"kind", "compare"}}))) {
+
+}
+
+SDLVideoWindow::~SDLVideoWindow() {
+    stop();
+    AVFrame *frame;
+    while (video_frame_queue.try_dequeue(frame)) {
+        budget.release(frame);
+        av_frame_free(&frame);
+    }
+    SDL_DestroyTexture(texture_yuv420);
+    SDL_DestroyTexture(texture_nv12);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(screen);
+}
+
+void SDLVideoWindow::init(AVCodecContext *video_ctx) {
+    const int display = index < SDL_GetNumVideoDisplays() ? index : 0;
+    SDL_DestroyWindow(screen);
+    screen = SDL_CreateWindow(title.c_str(), SDL_WINDOWPOS_CENTERED_DISPLAY(display), SDL_WINDOWPOS_CENTERED_DISPLAY(display),
+                              1280, 720,SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
+
+    SDL_DestroyRenderer(renderer);
+    renderer = SDL_CreateRenderer(screen, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE);
+    SDL_RenderSetViewport(renderer, NULL);
+
+    //SDL_RenderSetIntegerScale(renderer, SDL_TRUE);
+    const char scale_mode = SDL_ScaleModeLinear;
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, &scale_mode);
+
+    SDL_DestroyTexture(texture_yuv420);
+    texture_yuv420 = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_YV12, SDL_TEXTUREACCESS_STREAMING, video_ctx->width, video_ctx->height);
+    SDL_SetTextureBlendMode(texture_yuv420, SDL_BLENDMODE_NONE);
+    SDL_DestroyTexture(texture_nv12);
+    texture_nv12 = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_NV12, SDL_TEXTUREACCESS_STREAMING, video_ctx->width, video_ctx->height);
+    SDL_SetTextureBlendMode(texture_nv12, SDL_BLENDMODE_NONE);
+    damage.reset();
+
+    window_width.store(0, std::memory_order_relaxed);
+    window_height.store(0, std::memory_order_relaxed);
+    window_id.store(SDL_GetWindowID(screen), std::memory_order_relaxed);
+}
+
+void SDLVideoWindow::start() {
+    if (display_stop_condition) {
+        display_stop_condition = false;
+        display_thread = std::thread(&SDLVideoWindow::run, this);
+    }
+}
+
+void SDLVideoWindow::run() {
+    ThreadScope scope("display");
+    Uint32 start = SDL_GetTicks();
+    int delay = 0;
+    int i = 0;
+    int j = 0;
+    AVFrame *frame;
+    uint64_t calculated_next_pts = 0;
+    while (!display_stop_condition) {
+        if (!video_frame_queue.wait_dequeue_timed(frame, std::chrono::milliseconds(100))) {
+            if (hidden.load(std::memory_order_relaxed)) {
+                // no frame is expected, not a stall
+                FlightRecorder::beat();
+            }
+            continue;
+        }
+        Trace::instant("video dequeue", video_frame_queue.size_approx());
+        budget.release(frame);
+        if (hidden.load(std::memory_order_relaxed)) {
+            av_frame_free(&frame);
+            continue;
+        }
+
+        if (int64_t wait_ticks = calculated_next_pts - frame->pts; wait_ticks > 0) {
+            LOG_DEBUG("need to wait " << wait_ticks / 90 << "ms before present next frame");
+            SDL_Delay(wait_ticks / 90); // in milliseconds, rtp sample rate = 90000Hz
+        }
+
+        calculated_next_pts = frame->pts + frame->pkt_duration;
+        int64_t presentation_time = frame->pkt_duration / 90 - log_2(video_frame_queue.size_approx());
+        const auto present_start = std::chrono::steady_clock::now();
+        Trace::begin("present");
+        displayImpl(frame);
+        Trace::end("present");
+        present_time.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - present_start).count());
+        presented_frames.add();
+        if (frame->opaque) {
+            pipeline_latency.record(ClockSync::now() - reinterpret_cast<intptr_t>(frame->opaque));
+        }
+        FlightRecorder::beat();
+        av_frame_free(&frame);
+        ++j;
+        if (SDL_GetTicks() - start >= 1000) {
+            start = SDL_GetTicks();
+            std::stringstream ss;
+            ss << title << " (framerate = " << j - i << " fps, pipeline latency = " << ((j - i > 0) ? delay / (j - i) : -1) << " ms";
+            if (clock_sync && clock_sync->isSynchronized()) {
+                ss << ", rtt = " << clock_sync->getSmoothedRtt() / 1000. << " ms";
+            }
+            ss << ')';
+            SDL_SetWindowTitle(screen, ss.str().c_str());
+            i = j;
+            delay = 0;
+        }
+
+        SDL_Delay(presentation_time > 0 ? presentation_time : 0);
+    }
+}
+
+void SDLVideoWindow::stop() {
+    if (!display_stop_condition) {
+        display_stop_condition = true;
+        if (display_thread.joinable()) {
+            display_thread.join();
+        }
+    }
+}
+
+void SDLVideoWindow::setClockSync(const ClockSync *clock_sync) {
+    this->clock_sync = clock_sync;
+}
+
+void SDLVideoWindow::setHidden(bool hidden) {
+    this->hidden.store(hidden, std::memory_order_relaxed);
+}
+
+bool SDLVideoWindow::isHidden() const {
+    return hidden.load(std::memory_order_relaxed);
+}
+
+SDL_Window* SDLVideoWindow::getWindow() const {
+    return screen;
+}
+
+Uint32 SDLVideoWindow::getWindowId() const {
+    return window_id.load(std::memory_order_relaxed);
+}
+
+bool SDLVideoWindow::getSize(int &width, int &height) {
+    width = window_width.load(std::memory_order_relaxed);
+    height = window_height.load(std::memory_order_relaxed);
+    if (width <= 1 || height <= 1) {
+        SDL_GetWindowSize(screen, &width, &height);
+        setSize(width, height);
+    }
+    return width > 1 && height > 1;
+}
+
+void SDLVideoWindow::setSize(int width, int height) {
+    window_width.store(width, std::memory_order_relaxed);
+    window_height.store(height, std::memory_order_relaxed);
+}
+
+size_t SDLVideoWindow::getQueueDepth() const {
+    return video_frame_queue.size_approx();
+}
+
+void SDLVideoWindow::handle(AVFrame *frame) {
+    if (display_thread.joinable()) {
+        uint64_t evicted = 0;
+        const bool queued = budget.enqueue(video_frame_queue, frame, evicted);
+        video_drops.add(evicted);
+        if (!queued) {
+            LOG_WARNING(name << ": video queue full, drop");
+            Trace::instant("video drop");
+            video_drops.add();
+            av_frame_free(&frame);
+        } else {
+            Trace::instant("video enqueue", video_frame_queue.size_approx());
+        }
+    } else {
+        displayImpl(frame);
+        av_frame_free(&frame);
+    }
+}
+
+void SDLVideoWindow::displayImpl(AVFrame *frame) {
+    SDL_Texture *texture;
+    switch (frame->format) {
+        case AV_PIX_FMT_YUV420P:
+            texture = texture_yuv420;
+            break;
+        case AV_PIX_FMT_NV12:
+            texture = texture_nv12;
+            break;
+        default:
+            char buffer[32];
+            LOG_WARNING("no rule for " << av_fourcc_make_string(buffer, avcodec_pix_fmt_to_codec_tag((AVPixelFormat)frame->format)));
+            return;
+    }
+
+    if (upload(texture, frame) < 0) {
+        LOG_WARNING(SDL_GetError());
+        // part of the texture may be stale
+        damage.reset();
+    } else {
+        SDL_RenderCopy(renderer, texture, NULL, NULL);
+        SDL_RenderPresent(renderer);
+    }
+}
+
+int SDLVideoWindow::upload(SDL_Texture *texture, const AVFrame *frame) {
+    const int64_t frame_bytes = picture_bytes(frame->width, frame->height);
+    if (!damage.update(frame, damage_rects)) {
+        full_uploads.add();
+        upload_bytes.add(frame_bytes);
+        if (frame->format == AV_PIX_FMT_NV12) {
+            return SDL_UpdateNVTexture(texture, NULL,
+                                       frame->data[0], frame->linesize[0],
+                                       frame->data[1], frame->linesize[1]);
+        }
+        return SDL_UpdateYUVTexture(texture, NULL,
+                                    frame->data[0], frame->linesize[0],
+                                    frame->data[1], frame->linesize[1],
+                                    frame->data[2], frame->linesize[2]);
+    }
+
+    (damage.getSource() == DamageTracker::SERVER ? server_uploads : compare_uploads).add();
+    int64_t bytes = 0;
+    for (const DamageRect &damaged : damage_rects) {
+        // origins are even, the chroma rows and columns start at half of them
+        const SDL_Rect rect = {damaged.x, damaged.y, damaged.width, damaged.height};
+        const uint8_t *luma = frame->data[0] + static_cast<ptrdiff_t>(rect.y) * frame->linesize[0] + rect.x;
+        const ptrdiff_t chroma_row = static_cast<ptrdiff_t>(rect.y / 2);
+        int ret;
+        if (frame->format == AV_PIX_FMT_NV12) {
+            ret = SDL_UpdateNVTexture(texture, &rect, luma, frame->linesize[0],
+                                      frame->data[1] + chroma_row * frame->linesize[1] + rect.x, frame->linesize[1]);
+        } else {
+            ret = SDL_UpdateYUVTexture(texture, &rect, luma, frame->linesize[0],
+                                       frame->data[1] + chroma_row * frame->linesize[1] + rect.x / 2, frame->linesize[1],
+                                       frame->data[2] + chroma_row * frame->linesize[2] + rect.x / 2, frame->linesize[2]);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        bytes += picture_bytes(rect.w, rect.h);
+    }
+    upload_bytes.add(bytes);
+    saved_bytes.add(std::max<int64_t>(frame_bytes - bytes, 0));
+    return 0;
+}
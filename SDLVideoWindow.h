@@ -0,0 +1,93 @@
+#ifndef REMOTE_CLIENT_SDLVIDEOWINDOW_H
+#define REMOTE_CLIENT_SDLVIDEOWINDOW_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <SDL2/SDL.h>
+};
+
+#include <string>
+#include <thread>
+#include <atomic>
+#include <vector>
+
+#include "concurrentqueue/blockingconcurrentqueue.h"
+
+#include "sink.h"
+#include "ClockSync.h"
+#include "Metrics.h"
+#include "Budget.h"
+#include "DamageTracker.h"
+
+// one video stream: its window, textures, frame queue and presentation thread,
+// a stall in one window never holds the frames of another
+class SDLVideoWindow : public Sink<AVFrame> {
+private:
+    std::string name;
+    std::string title;
+    int index;
+
+    SDL_Window *screen = nullptr;
+    SDL_Renderer *renderer = nullptr;
+    SDL_Texture *texture_yuv420 = nullptr;
+    SDL_Texture *texture_nv12 = nullptr;
+
+    // minimized or hidden, frames are dropped instead of uploaded and presented
+    std::atomic<bool> hidden = false;
+    // for the event loop, so a mouse motion costs no sdl call. 0 until the window exists or its size is known
+    std::atomic<Uint32> window_id = 0;
+    std::atomic<int> window_width = 0;
+    std::atomic<int> window_height = 0;
+
+    // display thread only, which parts of the texture the next frame has to replace
+    DamageTracker damage;
+    std::vector<DamageRect> damage_rects;
+
+    bool display_stop_condition = true;
+    std::thread display_thread;
+    BudgetStage &budget;
+    moodycamel::BlockingConcurrentQueue<AVFrame*> video_frame_queue;
+
+    const ClockSync *clock_sync = nullptr;
+
+    Counter &video_drops;
+    Histogram &present_time;
+    Counter &presented_frames;
+    Histogram &pipeline_latency;
+    Counter &upload_bytes;
+    Counter &saved_bytes;
+    Counter &full_uploads;
+    Counter &server_uploads;
+    Counter &compare_uploads;
+
+public:
+    explicit SDLVideoWindow(int index);
+    ~SDLVideoWindow() override;
+
+    // (re)creates the window at the size of the stream, on the monitor of the same index when there is one
+    void init(AVCodecContext *video_ctx);
+
+    void start();
+    void run();
+    void stop();
+
+    void setClockSync(const ClockSync *clock_sync);
+    void setHidden(bool hidden);
+    bool isHidden() const;
+    SDL_Window* getWindow() const;
+    Uint32 getWindowId() const;
+    // the cached size, asked from sdl the first time after the window was created
+    bool getSize(int &width, int &height);
+    // from SDL_WINDOWEVENT_SIZE_CHANGED
+    void setSize(int width, int height);
+    size_t getQueueDepth() const;
+
+    void handle(AVFrame *frame) override;
+
+private:
+    void displayImpl(AVFrame *frame);
+    // the whole frame, or only the damaged rects
+    int upload(SDL_Texture *texture, const AVFrame *frame);
+};
+
+#endif //REMOTE_CLIENT_SDLVIDEOWINDOW_H
@@ -0,0 +1,233 @@
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+#include <mutex>
+#include <map>
+
+#include "ThreadPolicy.h"
+#include "Config.h"
+
+constexpr size_t MAX_THREAD_NAME = 15; // kernel limit, without the null terminator
+
+static std::mutex registry_mutex;
+// running threads, the exited ones are summed per role so threads restarted on every stream init don't pile up
+static std::vector<ThreadReport> registry;
+static std::map<std::string, ThreadReport> retired;
+static std::mutex adopt_mutex;
+
+static void set_name(pid_t tid, const std::string &role) {
+    std::ofstream comm("/proc/self/task/" + std::to_string(tid) + "/comm");
+    comm << role.substr(0, MAX_THREAD_NAME);
+}
+
+static std::string get_name(pid_t tid) {
+    std::ifstream comm("/proc/self/task/" + std::to_string(tid) + "/comm");
+    std::string name;
+    std::getline(comm, name);
+    return name;
+}
+
+// registry_mutex held
+static void fold(const ThreadReport &entry) {
+    ThreadReport &total = retired.try_emplace(entry.role, ThreadReport{0, entry.role, false, 0, 0, 0, 0}).first->second;
+    total.user_seconds += entry.user_seconds;
+    total.system_seconds += entry.system_seconds;
+    total.voluntary_switches += entry.voluntary_switches;
+    total.involuntary_switches += entry.involuntary_switches;
+}
+
+static bool read_usage(pid_t tid, ThreadReport &report) {
+    const std::string task = "/proc/self/task/" + std::to_string(tid);
+    std::ifstream stat(task + "/stat");
+    std::string line;
+    if (!std::getline(stat, line)) {
+        return false;
+    }
+
+    // the name may contain spaces, fields are counted from the closing parenthesis
+    std::istringstream fields(line.substr(line.rfind(')') + 2));
+    std::string field;
+    uint64_t utime = 0;
+    uint64_t stime = 0;
+    for (int i = 3; fields >> field && i <= 15; ++i) {
+        if (i == 14) {
+            utime = std::stoull(field);
+        } else if (i == 15) {
+            stime = std::stoull(field);
+        }
+    }
+    const double ticks = sysconf(_SC_CLK_TCK);
+    report.user_seconds = utime / ticks;
+    report.system_seconds = stime / ticks;
+
+    std::ifstream status(task + "/status");
+    while (std::getline(status, line)) {
+        if (line.rfind("voluntary_ctxt_switches:", 0) == 0) {
+            report.voluntary_switches = std::stoull(line.substr(line.find(':') + 1));
+        } else if (line.rfind("nonvoluntary_ctxt_switches:", 0) == 0) {
+            report.involuntary_switches = std::stoull(line.substr(line.find(':') + 1));
+        }
+    }
+    return true;
+}
+
+void ThreadPolicy::apply(const std::string &role) {
+    apply(gettid(), role);
+}
+
+void ThreadPolicy::apply(pid_t tid, const std::string &role) {
+    const Config &config = Config::global();
+    const std::string prefix = "thread." + role + ".";
+
+    set_name(tid, role);
+
+    const std::vector<int> cpus = config.getIntList(prefix + "cpus");
+    if (!cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus) {
+            CPU_SET(cpu, &set);
+        }
+        if (sched_setaffinity(tid, sizeof(set), &set) < 0) {
+            std::cerr << role << ": unable to set cpu affinity, " << strerror(errno) << std::endl;
+        }
+    }
+
+    const std::string policy = config.getString(prefix + "policy");
+    if (policy == "fifo" || policy == "rr") {
+        sched_param param = {};
+        param.sched_priority = static_cast<int>(config.getInt(prefix + "priority", 1));
+        if (sched_setscheduler(tid, policy == "fifo" ? SCHED_FIFO : SCHED_RR, &param) < 0) {
+            std::cerr << role << ": unable to set " << policy << " scheduling, " << strerror(errno) << std::endl;
+        }
+    } else if (!policy.empty() && policy != "other") {
+        std::cerr << role << ": unknown scheduling policy " << policy << ", ignored" << std::endl;
+    }
+
+    if (config.has(prefix + "nice")) {
+        if (setpriority(PRIO_PROCESS, tid, static_cast<int>(config.getInt(prefix + "nice"))) < 0) {
+            std::cerr << role << ": unable to set nice level, " << strerror(errno) << std::endl;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    const auto it = std::find_if(registry.begin(), registry.end(), [tid](const ThreadReport &r) { return r.tid == tid; });
+    if (it != registry.end()) {
+        it->role = role;
+        it->running = true;
+    } else {
+        registry.push_back({tid, role, true, 0, 0, 0, 0});
+    }
+}
+
+void ThreadPolicy::retire() {
+    rusage usage = {};
+    if (getrusage(RUSAGE_THREAD, &usage) < 0) {
+        return;
+    }
+
+    const pid_t tid = gettid();
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    const auto it = std::find_if(registry.begin(), registry.end(), [tid](const ThreadReport &r) { return r.tid == tid; });
+    if (it != registry.end()) {
+        it->user_seconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+        it->system_seconds = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+        it->voluntary_switches = usage.ru_nvcsw;
+        it->involuntary_switches = usage.ru_nivcsw;
+        fold(*it);
+        registry.erase(it);
+    }
+}
+
+std::vector<pid_t> ThreadPolicy::listThreads() {
+    std::vector<pid_t> tids;
+    if (DIR *dir = opendir("/proc/self/task")) {
+        while (dirent *entry = readdir(dir)) {
+            if (entry->d_name[0] != '.') {
+                tids.push_back(std::stoi(entry->d_name));
+            }
+        }
+        closedir(dir);
+    }
+    return tids;
+}
+
+int ThreadPolicy::adopt(const std::string &role, const std::function<int()> &start) {
+    std::lock_guard<std::mutex> lock(adopt_mutex);
+    // a new thread starts with the name of the one that created it. the caller goes by a name no other thread
+    // has meanwhile, its siblings (every reactor worker has the same) may start threads of their own
+    const pid_t self = gettid();
+    const std::string name = get_name(self);
+    const std::string tag = "adopt-" + std::to_string(self);
+    set_name(self, tag);
+    const std::vector<pid_t> before = listThreads();
+    const int ret = start();
+    for (pid_t tid : listThreads()) {
+        if (std::find(before.begin(), before.end(), tid) == before.end() && get_name(tid) == tag) {
+            apply(tid, role);
+        }
+    }
+    set_name(self, name);
+    return ret;
+}
+
+std::vector<ThreadReport> ThreadPolicy::report() {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    // threads started by libraries exit without retire(), their last known values are kept
+    for (auto it = registry.begin(); it != registry.end();) {
+        if (read_usage(it->tid, *it)) {
+            ++it;
+        } else {
+            fold(*it);
+            it = registry.erase(it);
+        }
+    }
+    std::vector<ThreadReport> reports = registry;
+    for (const auto &[role, total] : retired) {
+        reports.push_back(total);
+    }
+    return reports;
+}
+
+std::vector<ThreadReport> ThreadPolicy::reportByRole() {
+    std::vector<ThreadReport> totals;
+    for (const ThreadReport &entry : report()) {
+        auto it = std::find_if(totals.begin(), totals.end(), [&entry](const ThreadReport &r) { return r.role == entry.role; });
+        if (it == totals.end()) {
+            totals.push_back({0, entry.role, false, 0, 0, 0, 0});
+            it = totals.end() - 1;
+        }
+        it->running |= entry.running;
+        it->user_seconds += entry.user_seconds;
+        it->system_seconds += entry.system_seconds;
+        it->voluntary_switches += entry.voluntary_switches;
+        it->involuntary_switches += entry.involuntary_switches;
+    }
+    return totals;
+}
+
+void ThreadPolicy::printReport(std::ostream &os) {
+    os << std::left << std::setw(16) << "thread" << std::setw(8) << "tid" << std::setw(10) << "user(s)"
+       << std::setw(10) << "sys(s)" << std::setw(10) << "vol cs" << "invol cs" << std::endl;
+    for (const ThreadReport &entry : report()) {
+        os << std::left << std::setw(16) << entry.role << std::setw(8) << (entry.running ? std::to_string(entry.tid) : "exited")
+           << std::setw(10) << entry.user_seconds << std::setw(10) << entry.system_seconds
+           << std::setw(10) << entry.voluntary_switches << entry.involuntary_switches << std::endl;
+    }
+}
+
+ThreadScope::ThreadScope(const std::string &role) {
+    ThreadPolicy::apply(role);
+}
+
+ThreadScope::~ThreadScope() {
+    ThreadPolicy::retire();
+}
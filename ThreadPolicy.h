@@ -0,0 +1,55 @@
+#ifndef REMOTE_CLIENT_THREADPOLICY_H
+#define REMOTE_CLIENT_THREADPOLICY_H
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <ostream>
+
+struct ThreadReport {
+    pid_t tid;
+    std::string role;
+    bool running;
+    double user_seconds;
+    double system_seconds;
+    uint64_t voluntary_switches;
+    uint64_t involuntary_switches;
+};
+
+// names pipeline threads and applies the placement found in the config for their role:
+//   thread.<role>.cpus = 2,3         affinity
+//   thread.<role>.policy = fifo|rr   real-time scheduling, needs CAP_SYS_NICE
+//   thread.<role>.priority = 10      real-time priority
+//   thread.<role>.nice = -5          nice level for the default policy
+// settings that can't be applied are reported and ignored
+class ThreadPolicy {
+public:
+    // current thread
+    static void apply(const std::string &role);
+    // any thread of the process, e.g. the ones libavcodec starts
+    static void apply(pid_t tid, const std::string &role);
+    // snapshot the usage of the current thread before it exits
+    static void retire();
+
+    static std::vector<pid_t> listThreads();
+    // runs start, e.g. avcodec_open2, and applies role to the threads it started, returns what start returned.
+    // one start at a time in the process, and only new threads started by the calling thread are taken, so
+    // decoders opened in parallel don't swap their threads
+    static int adopt(const std::string &role, const std::function<int()> &start);
+
+    // the running threads, then one entry per role with tid 0 for the sum of the ones that exited
+    static std::vector<ThreadReport> report();
+    // everything summed per role, the numbers stay monotonic as threads come and go
+    static std::vector<ThreadReport> reportByRole();
+    static void printReport(std::ostream &os);
+};
+
+// apply on construction, retire on destruction, put it first in a thread function
+class ThreadScope {
+public:
+    explicit ThreadScope(const std::string &role);
+    ~ThreadScope();
+};
+
+#endif //REMOTE_CLIENT_THREADPOLICY_H
@@ -0,0 +1,255 @@
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/prctl.h>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+#include "Trace.h"
+#include "Config.h"
+#include "ThreadPolicy.h"
+
+namespace {
+    // rings of exited threads kept for the dump, beyond that the oldest is handed to the next new thread.
+    // receive and display threads come and go with every stream init and reconnect
+    constexpr size_t TRACE_DEAD_RINGS = 4;
+
+    struct TraceRing {
+        pid_t tid;
+        char thread_name[16];
+        // single writer, published with release so a dump sees complete events
+        std::atomic<uint64_t> head = 0;
+        bool alive = true;
+        int64_t exited_ns = 0;
+        TraceEvent events[TRACE_RING_SIZE];
+    };
+
+    // rings outlive their thread, a dump after a crash of the pipeline still shows what it did
+    std::mutex rings_mutex;
+    std::vector<std::unique_ptr<TraceRing>> rings;
+
+    // marks the ring of the thread as free to reuse when the thread exits
+    struct LocalRing {
+        TraceRing *ring = nullptr;
+
+        ~LocalRing() {
+            if (ring) {
+                std::lock_guard<std::mutex> lock(rings_mutex);
+                ring->alive = false;
+                ring->exited_ns = Trace::now();
+                ring = nullptr;
+            }
+        }
+    };
+
+    thread_local LocalRing local_ring;
+
+    TraceRing* register_ring() {
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        TraceRing *ring = nullptr;
+        size_t dead = 0;
+        for (const auto &candidate : rings) {
+            if (!candidate->alive) {
+                ++dead;
+                if (!ring || candidate->exited_ns < ring->exited_ns) {
+                    ring = candidate.get();
+                }
+            }
+        }
+        if (dead < TRACE_DEAD_RINGS) {
+            rings.push_back(std::make_unique<TraceRing>());
+            ring = rings.back().get();
+        }
+
+        ring->tid = gettid();
+        prctl(PR_GET_NAME, ring->thread_name, 0, 0, 0);
+        ring->thread_name[sizeof(ring->thread_name) - 1] = '\0';
+        ring->head.store(0, std::memory_order_relaxed);
+        ring->alive = true;
+        ring->exited_ns = 0;
+        return ring;
+    }
+
+    void write_escaped(std::ostream &os, const char *s) {
+        for (; *s; ++s) {
+            if (*s == '"' || *s == '\\') {
+                os << '\\';
+            }
+            os << *s;
+        }
+    }
+}
+
+int64_t Trace::now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void Trace::begin(const char *name) {
+    record('B', name, 0);
+}
+
+void Trace::end(const char *name) {
+    record('E', name, 0);
+}
+
+void Trace::instant(const char *name, int64_t value) {
+    record('i', name, value);
+}
+
+void Trace::counter(const char *name, int64_t value) {
+    record('C', name, value);
+}
+
+void Trace::record(char phase, const char *name, int64_t value) {
+    TraceRing *ring = local_ring.ring;
+    if (!ring) {
+        ring = local_ring.ring = register_ring();
+    }
+
+    const uint64_t head = ring->head.load(std::memory_order_relaxed);
+    ring->events[head & (TRACE_RING_SIZE - 1)] = {now(), name, value, phase};
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+bool Trace::dump(const std::string &path, std::chrono::milliseconds window) {
+    const int64_t since = now() - std::chrono::duration_cast<std::chrono::nanoseconds>(window).count();
+    const pid_t pid = getpid();
+
+    const std::string tmp_path = path + ".tmp";
+    std::ofstream file(tmp_path, std::ios::trunc);
+    file << R"({"displayTimeUnit":"ms","traceEvents":[)";
+    bool comma = false;
+
+    std::vector<TraceEvent> events;
+    events.reserve(TRACE_RING_SIZE);
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    for (const auto &ring : rings) {
+        // prefer the current name, the thread may have been renamed after its first event
+        std::string thread_name = ring->thread_name;
+        if (std::ifstream comm("/proc/self/task/" + std::to_string(ring->tid) + "/comm"); comm) {
+            std::getline(comm, thread_name);
+        }
+        file << (comma ? "," : "") << R"({"name":"thread_name","ph":"M","pid":)" << pid << R"(,"tid":)" << ring->tid << R"(,"args":{"name":")";
+        write_escaped(file, thread_name.c_str());
+        file << R"("}})";
+        comma = true;
+
+        // copy first then drop what the writer may have overwritten meanwhile
+        const uint64_t head = ring->head.load(std::memory_order_acquire);
+        const uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        events.clear();
+        for (uint64_t i = first; i < head; ++i) {
+            events.push_back(ring->events[i & (TRACE_RING_SIZE - 1)]);
+        }
+        const uint64_t new_head = ring->head.load(std::memory_order_acquire);
+        const uint64_t valid = new_head >= TRACE_RING_SIZE ? new_head - TRACE_RING_SIZE + 1 : 0;
+        const size_t skip = valid > first ? std::min<uint64_t>(valid - first, events.size()) : 0;
+
+        for (size_t i = skip; i < events.size(); ++i) {
+            const TraceEvent &event = events[i];
+            if (event.timestamp_ns < since) {
+                continue;
+            }
+
+            file << R"(,{"name":")";
+            write_escaped(file, event.name);
+            file << R"(","ph":")" << event.phase << R"(","ts":)" << event.timestamp_ns / 1000 << '.' << (event.timestamp_ns / 100) % 10
+                 << R"(,"pid":)" << pid << R"(,"tid":)" << ring->tid;
+            if (event.phase == 'i') {
+                file << R"(,"s":"t","args":{"value":)" << event.value << '}';
+            } else if (event.phase == 'C') {
+                file << R"(,"args":{"value":)" << event.value << '}';
+            }
+            file << '}';
+        }
+    }
+    file << "]}";
+    file.close();
+
+    if (!file || rename(tmp_path.c_str(), path.c_str()) < 0) {
+        std::cerr << "trace: unable to write " << path << ", " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+std::atomic<int64_t> FlightRecorder::last_beat = 0;
+std::atomic<bool> FlightRecorder::dump_requested = false;
+
+FlightRecorder::FlightRecorder() : name("flight recorder") {
+    const Config &config = Config::global();
+    path = config.getString("trace.file", "/tmp/remote_client-trace.json");
+    window = std::chrono::milliseconds(config.getInt("trace.window", 10000));
+    stall = std::chrono::milliseconds(config.getInt("trace.stall", 1000));
+    on_exit = config.getBool("trace.on_exit", true);
+}
+
+FlightRecorder::~FlightRecorder() {
+    stop();
+}
+
+void FlightRecorder::start() {
+    if (watch_stop_condition.load(std::memory_order_relaxed)) {
+        signal(SIGUSR1, &FlightRecorder::signalHandler);
+        watch_stop_condition.store(false, std::memory_order_relaxed);
+        watch_thread = std::thread(&FlightRecorder::run, this);
+    }
+}
+
+void FlightRecorder::run() {
+    ThreadScope scope("trace-watch");
+    bool stalled = false;
+    while (!watch_stop_condition.load(std::memory_order_relaxed)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+        if (dump_requested.exchange(false, std::memory_order_relaxed)) {
+            dump("requested");
+        }
+
+        // one dump per stall, armed again by the next beat
+        const int64_t beat = last_beat.load(std::memory_order_relaxed);
+        if (stall.count() > 0 && beat > 0) {
+            const bool late = Trace::now() - beat > std::chrono::duration_cast<std::chrono::nanoseconds>(stall).count();
+            if (late && !stalled) {
+                dump("stall");
+            }
+            stalled = late;
+        }
+    }
+}
+
+void FlightRecorder::stop() {
+    if (!watch_stop_condition.load(std::memory_order_relaxed)) {
+        watch_stop_condition.store(true, std::memory_order_relaxed);
+        if (watch_thread.joinable()) {
+            watch_thread.join();
+        }
+        signal(SIGUSR1, SIG_DFL);
+        if (on_exit) {
+            dump("exit");
+        }
+    }
+}
+
+void FlightRecorder::beat() {
+    last_beat.store(Trace::now(), std::memory_order_relaxed);
+}
+
+void FlightRecorder::signalHandler(int) {
+    dump_requested.store(true, std::memory_order_relaxed);
+}
+
+void FlightRecorder::dump(const char *reason) {
+    if (Trace::dump(path, window)) {
+        std::cerr << name << ": " << reason << ", last " << window.count() << "ms written to " << path << std::endl;
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef REMOTE_CLIENT_TRACE_H
+#define REMOTE_CLIENT_TRACE_H
+
+#include <sys/types.h>
+#include <cstdint>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+// each thread appends to its own ring, no lock and no allocation after the first event of a thread,
+// recording a event is a clock read and a 32 bytes store, so it stays on in release builds
+constexpr size_t TRACE_RING_SIZE = 1U << 14; // power of two, ~25s of pipeline events per thread at 60fps
+
+struct TraceEvent {
+    int64_t timestamp_ns;
+    const char *name; // string literal, never freed
+    int64_t value;
+    char phase; // chrome trace_event phase: B, E, i or C
+};
+
+class Trace {
+public:
+    static int64_t now();
+
+    static void begin(const char *name);
+    static void end(const char *name);
+    static void instant(const char *name, int64_t value = 0);
+    static void counter(const char *name, int64_t value);
+
+    // chrome trace_event json of the last window, open it in ui.perfetto.dev or chrome://tracing
+    static bool dump(const std::string &path, std::chrono::milliseconds window);
+
+private:
+    static void record(char phase, const char *name, int64_t value);
+};
+
+class TraceScope {
+private:
+    const char *name;
+
+public:
+    explicit TraceScope(const char *name) : name(name) {
+        Trace::begin(name);
+    }
+
+    ~TraceScope() {
+        Trace::end(name);
+    }
+};
+
+// dumps the rings on SIGUSR1, when the display stops beating for too long and on exit:
+//   trace.file = /tmp/remote_client-trace.json
+//   trace.window = 10000 (ms of history in a dump)
+//   trace.stall = 1000 (ms without a presented frame, 0 disables the watchdog)
+//   trace.on_exit = true
+class FlightRecorder {
+private:
+    std::string name;
+    std::string path;
+    std::chrono::milliseconds window;
+    std::chrono::milliseconds stall;
+    bool on_exit;
+
+    std::atomic<bool> watch_stop_condition = true;
+    std::thread watch_thread;
+
+    static std::atomic<int64_t> last_beat;
+    static std::atomic<bool> dump_requested;
+
+public:
+    FlightRecorder();
+    ~FlightRecorder();
+
+    void start();
+    void run();
+    void stop();
+
+    // the stall watchdog looks at the time since the last beat
+    static void beat();
+
+private:
+    static void signalHandler(int signum);
+    void dump(const char *reason);
+};
+
+#endif //REMOTE_CLIENT_TRACE_H
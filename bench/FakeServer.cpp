@@ -0,0 +1,509 @@
+extern "C" {
+#include <libavutil/opt.h>
+#include <libavutil/channel_layout.h>
+};
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <cmath>
+#include <chrono>
+
+#include "FakeServer.h"
+#include "ClockSync.h"
+#include "ThreadPolicy.h"
+#include "Log.h"
+#include "exception.h"
+
+constexpr size_t BUFFER_SIZE = 4096;
+constexpr int RTP_PACKET_SIZE = 1200;
+constexpr int AUDIO_SAMPLE_RATE = 48000;
+constexpr double TONE_FREQUENCY = 440.;
+
+static std::string json_escape(const std::string &s) {
+    std::string escaped;
+    escaped.reserve(s.size() + 64);
+    for (char c : s) {
+        switch (c) {
+            case '"': escaped += "\\\""; break;
+            case '\\': escaped += "\\\\"; break;
+            case '\n': escaped += "\\n"; break;
+            case '\r': escaped += "\\r"; break;
+            default: escaped += c;
+        }
+    }
+    return escaped;
+}
+
+FakeServer::FakeServer(FakeServerSettings settings) : name("fake server"), settings(settings) {
+
+}
+
+FakeServer::~FakeServer() {
+    stop();
+    for (Stream *stream : {&video, &audio}) {
+        if (stream->format_ctx) {
+            av_write_trailer(stream->format_ctx);
+            avio_closep(&stream->format_ctx->pb);
+            avformat_free_context(stream->format_ctx);
+        }
+        avcodec_free_context(&stream->codec_ctx);
+    }
+    for (int fd : {client_socket, udp_socket, listen_socket}) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+void FakeServer::init() {
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(settings.control_port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    const int enable = 1;
+    listen_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_socket < 0 || setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0
+        || bind(listen_socket, (sockaddr*)&address, sizeof(address)) < 0 || ::listen(listen_socket, 1) < 0) {
+        throw InitFail(strerror(errno));
+    }
+
+    if (settings.control_udp_port) {
+        address.sin_port = htons(settings.control_udp_port);
+    }
+    udp_socket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (udp_socket < 0 || bind(udp_socket, (sockaddr*)&address, sizeof(address)) < 0) {
+        throw InitFail(strerror(errno));
+    }
+
+    initVideo();
+    if (settings.audio) {
+        initAudio();
+    }
+}
+
+void FakeServer::initVideo() {
+    AVCodec *codec = avcodec_find_encoder_by_name("libx264");
+    if (!codec) {
+        codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+    }
+    if (!codec) {
+        throw InitFail("No H.264 encoder available");
+    }
+
+    video.codec_ctx = avcodec_alloc_context3(codec);
+    if (!video.codec_ctx) {
+        throw InitFail("Could not allocate video codec context");
+    }
+
+    AVCodecContext *ctx = video.codec_ctx;
+    ctx->width = settings.width;
+    ctx->height = settings.height;
+    ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    ctx->time_base = {1, settings.fps};
+    ctx->framerate = {settings.fps, 1};
+    ctx->bit_rate = settings.video_bitrate;
+    video_bitrate.store(settings.video_bitrate, std::memory_order_relaxed);
+    ctx->gop_size = settings.fps;
+    ctx->max_b_frames = 0;
+    // parameter sets go in the sdp, like the real server
+    ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    av_opt_set(ctx->priv_data, "preset", "ultrafast", 0);
+    av_opt_set(ctx->priv_data, "tune", "zerolatency", 0);
+    av_opt_set(ctx->priv_data, "forced-idr", "1", 0);
+
+    if (avcodec_open2(ctx, codec, nullptr) < 0) {
+        throw InitFail("Could not open video encoder");
+    }
+    openMuxer(video, settings.video_send_port ? settings.video_send_port : settings.video_port, settings.video_port);
+}
+
+void FakeServer::initAudio() {
+    AVCodec *codec = avcodec_find_encoder_by_name("libopus");
+    if (!codec) {
+        codec = avcodec_find_encoder(AV_CODEC_ID_OPUS);
+    }
+    if (!codec) {
+        throw InitFail("No Opus encoder available");
+    }
+
+    audio.codec_ctx = avcodec_alloc_context3(codec);
+    if (!audio.codec_ctx) {
+        throw InitFail("Could not allocate audio codec context");
+    }
+
+    AVCodecContext *ctx = audio.codec_ctx;
+    ctx->sample_rate = AUDIO_SAMPLE_RATE;
+    ctx->channels = 2;
+    ctx->channel_layout = AV_CH_LAYOUT_STEREO;
+    ctx->sample_fmt = codec->sample_fmts ? codec->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
+    ctx->bit_rate = settings.audio_bitrate;
+    ctx->time_base = {1, AUDIO_SAMPLE_RATE};
+    // the native encoder is still flagged experimental
+    ctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+
+    if (avcodec_open2(ctx, codec, nullptr) < 0) {
+        throw InitFail("Could not open audio encoder");
+    }
+    openMuxer(audio, settings.audio_send_port ? settings.audio_send_port : settings.audio_port, settings.audio_port);
+}
+
+void FakeServer::openMuxer(Stream &stream, uint16_t send_port, uint16_t advertised_port) {
+    const std::string url = "rtp://127.0.0.1:" + std::to_string(send_port) + "?pkt_size=" + std::to_string(RTP_PACKET_SIZE);
+    if (avformat_alloc_output_context2(&stream.format_ctx, nullptr, "rtp", url.c_str()) < 0) {
+        throw InitFail("Could not allocate rtp muxer");
+    }
+
+    AVStream *av_stream = avformat_new_stream(stream.format_ctx, nullptr);
+    if (!av_stream || avcodec_parameters_from_context(av_stream->codecpar, stream.codec_ctx) < 0) {
+        throw InitFail("Could not add rtp stream");
+    }
+    av_stream->time_base = stream.codec_ctx->time_base;
+
+    if (avio_open(&stream.format_ctx->pb, url.c_str(), AVIO_FLAG_WRITE) < 0) {
+        throw InitFail("Could not open rtp output");
+    }
+
+    if (avformat_write_header(stream.format_ctx, nullptr) < 0) {
+        throw InitFail("Could not write rtp header");
+    }
+
+    char sdp[BUFFER_SIZE];
+    if (av_sdp_create(&stream.format_ctx, 1, sdp, sizeof(sdp)) < 0) {
+        throw InitFail("Could not create sdp");
+    }
+    stream.sdp = sdp;
+
+    if (send_port != advertised_port) {
+        const std::string media = stream.codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO ? "m=video " : "m=audio ";
+        if (const size_t pos = stream.sdp.find(media + std::to_string(send_port)); pos != std::string::npos) {
+            stream.sdp.replace(pos + media.size(), std::to_string(send_port).size(), std::to_string(advertised_port));
+        }
+    }
+}
+
+void FakeServer::start() {
+    startControl();
+}
+
+void FakeServer::stop() {
+    stopStreams();
+    stopControl();
+}
+
+void FakeServer::startControl() {
+    if (control_stop_condition.load(std::memory_order_relaxed)) {
+        control_stop_condition.store(false, std::memory_order_relaxed);
+        control_thread = std::thread(&FakeServer::runControl, this);
+    }
+}
+
+void FakeServer::runControl() {
+    ThreadScope scope("bench-control");
+    pollfd fds[3] = {{listen_socket, POLLIN, 0}, {udp_socket, POLLIN, 0}, {-1, POLLIN, 0}};
+    while (!control_stop_condition.load(std::memory_order_relaxed)) {
+        fds[2].fd = client_socket;
+        if (poll(fds, 3, 100) <= 0) {
+            continue;
+        }
+
+        // a reconnecting client replaces the previous one
+        if (fds[0].revents & POLLIN) {
+            const int fd = accept4(listen_socket, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                if (client_socket >= 0) {
+                    close(client_socket);
+                }
+                client_socket = fd;
+                frame_reader.clear();
+                LOG_INFO(name << ": client connected");
+            }
+        }
+
+        if (fds[1].revents & POLLIN) {
+            readUdp();
+        }
+
+        if (fds[2].fd >= 0 && fds[2].revents & (POLLIN | POLLHUP | POLLERR)) {
+            readTcp();
+        }
+    }
+}
+
+void FakeServer::stopControl() {
+    if (!control_stop_condition.load(std::memory_order_relaxed)) {
+        control_stop_condition.store(true, std::memory_order_relaxed);
+        if (control_thread.joinable()) {
+            control_thread.join();
+        }
+    }
+}
+
+void FakeServer::readTcp() {
+    const ssize_t size = frame_reader.readFrom(client_socket);
+    if (size <= 0) {
+        if (size == 0 || (errno != EAGAIN && errno != EINTR)) {
+            LOG_INFO(name << ": client disconnected");
+            close(client_socket);
+            client_socket = -1;
+        }
+        return;
+    }
+
+    Frame frame;
+    while (frame_reader.next(frame)) {
+        handleMessage(frame.data, frame.size, frame.capacity, nullptr);
+    }
+}
+
+void FakeServer::readUdp() {
+    uint8_t buffer[BUFFER_SIZE + simdjson::SIMDJSON_PADDING];
+    sockaddr_in from = {};
+    socklen_t from_size = sizeof(from);
+    const ssize_t size = recvfrom(udp_socket, buffer, BUFFER_SIZE, 0, (sockaddr*)&from, &from_size);
+    if (size > 0) {
+        handleMessage(buffer, size, sizeof(buffer), &from);
+    }
+}
+
+void FakeServer::handleMessage(const uint8_t *data, size_t size, size_t capacity, const sockaddr_in *from) {
+    const int64_t receive_us = ClockSync::now();
+    try {
+        simdjson::ondemand::document document = parser.iterate(data, size, capacity);
+        const std::string_view type = document["t"];
+        if (type == "p") {
+            pings.fetch_add(1, std::memory_order_relaxed);
+            const uint64_t id = document["i"];
+            const std::string pong = R"({"t":"P","i":)" + std::to_string(id) + R"(,"r":)" + std::to_string(receive_us)
+                                   + R"(,"s":)" + std::to_string(ClockSync::now()) + "}";
+            if (from) {
+                sendto(udp_socket, pong.data(), pong.size(), MSG_NOSIGNAL, (const sockaddr*)from, sizeof(*from));
+            } else {
+                sendTcp(pong);
+            }
+        } else if (type == "i") {
+            input_messages.fetch_add(1, std::memory_order_relaxed);
+        } else if (type == "r") {
+            const std::string_view query = document["q"];
+            if (query == "rtp") {
+                if (audio.format_ctx) {
+                    sendTcp(R"({"t":"R","g":0,"k":0,"v":")" + json_escape(audio.sdp) + R"("})");
+                }
+                sendTcp(R"({"t":"R","g":1,"k":0,"v":")" + json_escape(video.sdp) + R"("})");
+                startStreams();
+            } else if (query == "key") {
+                keyframe_requests.fetch_add(1, std::memory_order_relaxed);
+                keyframe_requested.store(true, std::memory_order_relaxed);
+            } else if (query == "rate") {
+                // only the bitrate is followed, the picture size and rate stay those of the sdp
+                const int64_t kbps = document["b"];
+                rate_hints.fetch_add(1, std::memory_order_relaxed);
+                requested_bitrate.store(kbps * 1000, std::memory_order_relaxed);
+            }
+        }
+    } catch (const simdjson::simdjson_error &e) {
+        LOG_WARNING(name << ": " << e.what());
+    }
+}
+
+void FakeServer::sendTcp(const std::string &msg) {
+    if (client_socket < 0) {
+        return;
+    }
+
+    std::string framed;
+    framed.reserve(FrameReader::HEADER_SIZE + msg.size());
+    framed.push_back(static_cast<char>(FrameReader::DELIMITER));
+    framed.push_back(static_cast<char>(msg.size() >> 8));
+    framed.push_back(static_cast<char>(msg.size() & 0xff));
+    framed += msg;
+
+    size_t offset = 0;
+    while (offset < framed.size()) {
+        const ssize_t sent = send(client_socket, framed.data() + offset, framed.size() - offset, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return;
+        }
+        offset += sent;
+    }
+}
+
+void FakeServer::startStreams() {
+    if (stream_stop_condition.load(std::memory_order_relaxed)) {
+        stream_stop_condition.store(false, std::memory_order_relaxed);
+        video_thread = std::thread(&FakeServer::runVideo, this);
+        if (audio.codec_ctx) {
+            audio_thread = std::thread(&FakeServer::runAudio, this);
+        }
+    } else {
+        // the client re-initializes its decoder, make sure it can start right away
+        keyframe_requested.store(true, std::memory_order_relaxed);
+    }
+}
+
+size_t FakeServer::writePackets(Stream &stream, AVFrame *frame) {
+    size_t bytes = 0;
+    int ret = avcodec_send_frame(stream.codec_ctx, frame);
+    AVPacket *packet = av_packet_alloc();
+    while (ret >= 0) {
+        ret = avcodec_receive_packet(stream.codec_ctx, packet);
+        if (ret < 0) {
+            break;
+        }
+
+        bytes += packet->size;
+        av_packet_rescale_ts(packet, stream.codec_ctx->time_base, stream.format_ctx->streams[0]->time_base);
+        packet->stream_index = 0;
+        av_write_frame(stream.format_ctx, packet);
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+    return bytes;
+}
+
+void FakeServer::runVideo() {
+    ThreadScope scope("bench-video");
+    AVFrame *frame = av_frame_alloc();
+    frame->format = video.codec_ctx->pix_fmt;
+    frame->width = video.codec_ctx->width;
+    frame->height = video.codec_ctx->height;
+    if (av_frame_get_buffer(frame, 0) < 0) {
+        LOG_ERROR(name << ": unable to allocate video frame");
+        av_frame_free(&frame);
+        return;
+    }
+
+    const auto period = std::chrono::nanoseconds(1000000000 / settings.fps);
+    auto next = std::chrono::steady_clock::now();
+    for (int64_t index = 0; !stream_stop_condition.load(std::memory_order_relaxed); ++index) {
+        av_frame_make_writable(frame);
+
+        // scrolling gradient and a sweeping bar, every frame differs like a game would
+        const int offset = static_cast<int>(index * 4);
+        const int bar = static_cast<int>((index * 8) % frame->width);
+        for (int y = 0; y < frame->height; ++y) {
+            uint8_t *row = frame->data[0] + y * frame->linesize[0];
+            for (int x = 0; x < frame->width; ++x) {
+                row[x] = static_cast<uint8_t>(x + y + offset);
+            }
+            memset(row + bar, 235, std::min(32, frame->width - bar));
+        }
+        for (int y = 0; y < frame->height / 2; ++y) {
+            memset(frame->data[1] + y * frame->linesize[1], static_cast<uint8_t>(128 + y / 8 - offset / 2), frame->width / 2);
+            memset(frame->data[2] + y * frame->linesize[2], static_cast<uint8_t>(128 - y / 8 + offset / 2), frame->width / 2);
+        }
+
+        // libx264 reconfigures on the fly when the bitrate changes
+        if (const int64_t bitrate = requested_bitrate.exchange(0, std::memory_order_relaxed); bitrate > 0) {
+            video.codec_ctx->bit_rate = bitrate;
+            video_bitrate.store(bitrate, std::memory_order_relaxed);
+        }
+
+        frame->pts = index;
+        frame->pict_type = keyframe_requested.exchange(false, std::memory_order_relaxed) ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+
+        const int64_t encode_start = ClockSync::now();
+        const size_t bytes = writePackets(video, frame);
+        encode_time.record(ClockSync::now() - encode_start);
+        video_frames.fetch_add(1, std::memory_order_relaxed);
+        video_bytes.fetch_add(bytes, std::memory_order_relaxed);
+
+        // real time pacing, a frame that could not be made in time is counted and the clock resets
+        next += period;
+        if (std::chrono::steady_clock::now() > next) {
+            late_frames.fetch_add(1, std::memory_order_relaxed);
+            next = std::chrono::steady_clock::now();
+        } else {
+            std::this_thread::sleep_until(next);
+        }
+    }
+
+    av_frame_free(&frame);
+}
+
+void FakeServer::runAudio() {
+    ThreadScope scope("bench-audio");
+    AVCodecContext *ctx = audio.codec_ctx;
+    AVFrame *frame = av_frame_alloc();
+    frame->format = ctx->sample_fmt;
+    frame->channels = ctx->channels;
+    frame->channel_layout = ctx->channel_layout;
+    frame->sample_rate = ctx->sample_rate;
+    frame->nb_samples = ctx->frame_size > 0 ? ctx->frame_size : AUDIO_SAMPLE_RATE / 50;
+    if (av_frame_get_buffer(frame, 0) < 0) {
+        LOG_ERROR(name << ": unable to allocate audio frame");
+        av_frame_free(&frame);
+        return;
+    }
+
+    const auto period = std::chrono::nanoseconds(1000000000LL * frame->nb_samples / ctx->sample_rate);
+    auto next = std::chrono::steady_clock::now();
+    for (int64_t sample_index = 0; !stream_stop_condition.load(std::memory_order_relaxed); sample_index += frame->nb_samples) {
+        av_frame_make_writable(frame);
+        for (int i = 0; i < frame->nb_samples; ++i) {
+            const float value = 0.2f * static_cast<float>(std::sin(2 * M_PI * TONE_FREQUENCY * (sample_index + i) / ctx->sample_rate));
+            for (int c = 0; c < ctx->channels; ++c) {
+                switch (ctx->sample_fmt) {
+                    case AV_SAMPLE_FMT_S16:
+                        reinterpret_cast<int16_t*>(frame->data[0])[i * ctx->channels + c] = static_cast<int16_t>(value * 32767);
+                        break;
+                    case AV_SAMPLE_FMT_FLT:
+                        reinterpret_cast<float*>(frame->data[0])[i * ctx->channels + c] = value;
+                        break;
+                    default: // AV_SAMPLE_FMT_FLTP
+                        reinterpret_cast<float*>(frame->data[c])[i] = value;
+                        break;
+                }
+            }
+        }
+
+        frame->pts = sample_index;
+        const size_t bytes = writePackets(audio, frame);
+        audio_frames.fetch_add(1, std::memory_order_relaxed);
+        audio_bytes.fetch_add(bytes, std::memory_order_relaxed);
+
+        next += period;
+        if (std::chrono::steady_clock::now() > next) {
+            next = std::chrono::steady_clock::now();
+        } else {
+            std::this_thread::sleep_until(next);
+        }
+    }
+
+    av_frame_free(&frame);
+}
+
+void FakeServer::stopStreams() {
+    if (!stream_stop_condition.load(std::memory_order_relaxed)) {
+        stream_stop_condition.store(true, std::memory_order_relaxed);
+        if (video_thread.joinable()) {
+            video_thread.join();
+        }
+        if (audio_thread.joinable()) {
+            audio_thread.join();
+        }
+    }
+}
+
+FakeServerStats FakeServer::getStats() const {
+    FakeServerStats stats = {};
+    stats.video_frames = video_frames.load(std::memory_order_relaxed);
+    stats.video_bytes = video_bytes.load(std::memory_order_relaxed);
+    stats.audio_frames = audio_frames.load(std::memory_order_relaxed);
+    stats.audio_bytes = audio_bytes.load(std::memory_order_relaxed);
+    stats.late_frames = late_frames.load(std::memory_order_relaxed);
+    stats.keyframe_requests = keyframe_requests.load(std::memory_order_relaxed);
+    stats.rate_hints = rate_hints.load(std::memory_order_relaxed);
+    stats.video_bitrate = video_bitrate.load(std::memory_order_relaxed);
+    stats.input_messages = input_messages.load(std::memory_order_relaxed);
+    stats.pings = pings.load(std::memory_order_relaxed);
+    return stats;
+}
+
+const Histogram& FakeServer::getEncodeTime() const {
+    return encode_time;
+}
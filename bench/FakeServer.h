@@ -0,0 +1,127 @@
+#ifndef REMOTE_CLIENT_FAKESERVER_H
+#define REMOTE_CLIENT_FAKESERVER_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+};
+
+#include <netinet/in.h>
+#include <string>
+#include <thread>
+#include <atomic>
+
+#include "FrameReader.h"
+#include "Metrics.h"
+
+#include "simdjson/singleheader/simdjson.h"
+
+struct FakeServerSettings {
+    uint16_t control_port = 19999;
+    uint16_t video_port = 15004;
+    uint16_t audio_port = 15006;
+    // 0 for the ports above, otherwise where the datagrams really go, e.g. an impairment proxy
+    // in front of the client, the sdp still gives the ports above
+    uint16_t control_udp_port = 0;
+    uint16_t video_send_port = 0;
+    uint16_t audio_send_port = 0;
+    int width = 1280;
+    int height = 720;
+    int fps = 60;
+    int64_t video_bitrate = 8000000;
+    int64_t audio_bitrate = 128000;
+    bool audio = true;
+};
+
+struct FakeServerStats {
+    uint64_t video_frames;
+    uint64_t video_bytes;
+    uint64_t audio_frames;
+    uint64_t audio_bytes;
+    uint64_t late_frames;
+    uint64_t keyframe_requests;
+    uint64_t rate_hints;
+    int64_t video_bitrate;
+    uint64_t input_messages;
+    uint64_t pings;
+};
+
+// stand-in for the game server on 127.0.0.1: answers the stream request with the sdp of its rtp muxers,
+// pings with pongs, and streams a synthetic moving picture as H.264 and a tone as Opus in real time
+class FakeServer {
+private:
+    struct Stream {
+        AVCodecContext *codec_ctx = nullptr;
+        AVFormatContext *format_ctx = nullptr;
+        std::string sdp;
+    };
+
+    std::string name;
+    FakeServerSettings settings;
+
+    int listen_socket = -1;
+    int udp_socket = -1;
+    int client_socket = -1;
+    FrameReader frame_reader;
+    simdjson::ondemand::parser parser;
+
+    Stream video;
+    Stream audio;
+    std::atomic<bool> keyframe_requested = false;
+    // from the client rate hints, 0 when none is pending
+    std::atomic<int64_t> requested_bitrate = 0;
+    std::atomic<int64_t> video_bitrate = 0;
+
+    std::atomic<bool> control_stop_condition = true;
+    std::thread control_thread;
+
+    std::atomic<bool> stream_stop_condition = true;
+    std::thread video_thread;
+    std::thread audio_thread;
+
+    std::atomic<uint64_t> video_frames = 0;
+    std::atomic<uint64_t> video_bytes = 0;
+    std::atomic<uint64_t> audio_frames = 0;
+    std::atomic<uint64_t> audio_bytes = 0;
+    std::atomic<uint64_t> late_frames = 0;
+    std::atomic<uint64_t> keyframe_requests = 0;
+    std::atomic<uint64_t> rate_hints = 0;
+    std::atomic<uint64_t> input_messages = 0;
+    std::atomic<uint64_t> pings = 0;
+    Histogram encode_time;
+
+public:
+    explicit FakeServer(FakeServerSettings settings);
+    ~FakeServer();
+
+    void init();
+
+    void start();
+    void stop();
+
+    void startControl();
+    void runControl();
+    void stopControl();
+
+    void startStreams();
+    void runVideo();
+    void runAudio();
+    void stopStreams();
+
+    FakeServerStats getStats() const;
+    const Histogram& getEncodeTime() const;
+
+private:
+    void initVideo();
+    void initAudio();
+    void openMuxer(Stream &stream, uint16_t send_port, uint16_t advertised_port);
+
+    void readTcp();
+    void readUdp();
+    void handleMessage(const uint8_t *data, size_t size, size_t capacity, const sockaddr_in *from);
+    void sendTcp(const std::string &msg);
+
+    size_t writePackets(Stream &stream, AVFrame *frame);
+};
+
+#endif //REMOTE_CLIENT_FAKESERVER_H
@@ -0,0 +1,276 @@
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <algorithm>
+
+#include "ImpairmentProxy.h"
+#include "ClockSync.h"
+#include "Config.h"
+#include "ThreadPolicy.h"
+#include "Log.h"
+#include "exception.h"
+
+constexpr size_t DATAGRAM_SIZE = 65536;
+constexpr int POLL_MAX_WAIT_MS = 100;
+
+ImpairmentSettings ImpairmentSettings::fromConfig(const std::string &flow) {
+    const Config &config = Config::global();
+    const std::string prefix = "impair." + flow + ".";
+    ImpairmentSettings settings;
+    settings.loss = config.getDouble(prefix + "loss", settings.loss);
+    settings.burst_enter = config.getDouble(prefix + "burst_enter", settings.burst_enter);
+    settings.burst_exit = config.getDouble(prefix + "burst_exit", settings.burst_exit);
+    settings.burst_loss = config.getDouble(prefix + "burst_loss", settings.burst_loss);
+    settings.delay_ms = static_cast<int>(config.getInt(prefix + "delay", settings.delay_ms));
+    settings.jitter_ms = static_cast<int>(config.getInt(prefix + "jitter", settings.jitter_ms));
+    settings.reorder = config.getDouble(prefix + "reorder", settings.reorder);
+    settings.duplicate = config.getDouble(prefix + "duplicate", settings.duplicate);
+    settings.rate_kbps = config.getInt(prefix + "rate", settings.rate_kbps);
+    settings.queue_bytes = config.getSize(prefix + "queue", settings.queue_bytes);
+    return settings;
+}
+
+bool ImpairmentSettings::enabled() const {
+    return loss > 0 || burst_enter > 0 || delay_ms > 0 || jitter_ms > 0 || reorder > 0 || duplicate > 0 || rate_kbps > 0;
+}
+
+ImpairmentProxy::ImpairmentProxy(uint64_t seed) : name("impairment proxy"), seed(seed) {
+
+}
+
+ImpairmentProxy::~ImpairmentProxy() {
+    stop();
+    for (const auto &link : links) {
+        close(link->listen_socket);
+        close(link->target_socket);
+    }
+}
+
+void ImpairmentProxy::addLink(const std::string &link_name, uint16_t listen_port, uint16_t target_port,
+                              const ImpairmentSettings &upstream, const ImpairmentSettings &downstream) {
+    auto link = std::make_unique<Link>();
+    link->name = link_name;
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    address.sin_port = htons(listen_port);
+    link->listen_socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (link->listen_socket < 0 || bind(link->listen_socket, (sockaddr*)&address, sizeof(address)) < 0) {
+        LOG_ERROR(name << ": " << link_name << " on port " << listen_port);
+        throw InitFail(strerror(errno));
+    }
+
+    address.sin_port = htons(target_port);
+    link->target_socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (link->target_socket < 0 || connect(link->target_socket, (sockaddr*)&address, sizeof(address)) < 0) {
+        LOG_ERROR(name << ": " << link_name << " to port " << target_port);
+        throw InitFail(strerror(errno));
+    }
+
+    // a generator per direction, the fate of a datagram only depends on its rank in its own flow
+    const uint64_t link_index = links.size();
+    MetricsRegistry &registry = MetricsRegistry::global();
+    const ImpairmentSettings *settings[2] = {&upstream, &downstream};
+    for (int i = 0; i < 2; ++i) {
+        Direction &direction = link->directions[i];
+        direction.settings = *settings[i];
+        direction.generator.seed(seed + 2 * link_index + i);
+
+        const Labels labels = {{"link", link_name}, {"direction", i == 0 ? "up" : "down"}};
+        direction.received = &registry.counter("impair_received_total", "datagrams entering the impairment proxy", labels);
+        direction.forwarded = &registry.counter("impair_forwarded_total", "datagrams sent by the impairment proxy, duplicates included", labels);
+        direction.lost = &registry.counter("impair_lost_total", "datagrams dropped by the loss models", labels);
+        direction.queue_drops = &registry.counter("impair_queue_drops_total", "datagrams dropped by the full bottleneck queue", labels);
+        direction.duplicated = &registry.counter("impair_duplicated_total", "datagrams sent twice", labels);
+        direction.reordered = &registry.counter("impair_reordered_total", "datagrams that overtook the queue", labels);
+    }
+
+    links.push_back(std::move(link));
+}
+
+void ImpairmentProxy::start() {
+    if (proxy_stop_condition.load(std::memory_order_relaxed)) {
+        proxy_stop_condition.store(false, std::memory_order_relaxed);
+        proxy_thread = std::thread(&ImpairmentProxy::run, this);
+    }
+}
+
+void ImpairmentProxy::run() {
+    ThreadScope scope("impair-proxy");
+    std::vector<pollfd> fds;
+    for (const auto &link : links) {
+        fds.push_back({link->listen_socket, POLLIN, 0});
+        fds.push_back({link->target_socket, POLLIN, 0});
+    }
+
+    int64_t next_release_us = -1;
+    while (!proxy_stop_condition.load(std::memory_order_relaxed)) {
+        int timeout = POLL_MAX_WAIT_MS;
+        if (next_release_us >= 0) {
+            // round up, waking before the release time would only spin
+            timeout = static_cast<int>(std::clamp<int64_t>((next_release_us - ClockSync::now() + 999) / 1000, 0, POLL_MAX_WAIT_MS));
+        }
+
+        if (poll(fds.data(), fds.size(), timeout) > 0) {
+            for (size_t i = 0; i < fds.size(); ++i) {
+                if (fds[i].revents & POLLIN) {
+                    receive(*links[i / 2], i % 2);
+                }
+            }
+        }
+
+        next_release_us = flush(ClockSync::now());
+    }
+}
+
+void ImpairmentProxy::stop() {
+    if (!proxy_stop_condition.load(std::memory_order_relaxed)) {
+        proxy_stop_condition.store(true, std::memory_order_relaxed);
+        if (proxy_thread.joinable()) {
+            proxy_thread.join();
+        }
+    }
+}
+
+void ImpairmentProxy::receive(Link &link, int direction) {
+    const int fd = direction == 0 ? link.listen_socket : link.target_socket;
+    std::vector<uint8_t> buffer(DATAGRAM_SIZE);
+    for (;;) {
+        sockaddr_in from = {};
+        socklen_t from_size = sizeof(from);
+        const ssize_t size = recvfrom(fd, buffer.data(), buffer.size(), 0, (sockaddr*)&from, &from_size);
+        if (size < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                LOG_WARNING(name << ": " << link.name << ", " << strerror(errno));
+            }
+            return;
+        }
+
+        // answers go back to whoever spoke last, like a nat would
+        if (direction == 0) {
+            link.peer = from;
+            link.has_peer = true;
+        }
+
+        impair(link.directions[direction], std::vector<uint8_t>(buffer.begin(), buffer.begin() + size), ClockSync::now());
+    }
+}
+
+bool ImpairmentProxy::chance(Direction &direction, double probability) {
+    // always draw, so one impairment turned on or off doesn't shift the decisions of the others
+    return std::uniform_real_distribution<double>(0, 1)(direction.generator) < probability;
+}
+
+void ImpairmentProxy::impair(Direction &direction, std::vector<uint8_t> &&data, int64_t now_us) {
+    const ImpairmentSettings &settings = direction.settings;
+    direction.received->add();
+
+    // Gilbert-Elliott: the state moves first, then the loss of the state applies on top of the random one
+    const bool transition = chance(direction, direction.bad_state ? settings.burst_exit : settings.burst_enter);
+    if (transition) {
+        direction.bad_state = !direction.bad_state;
+    }
+    const bool burst_lost = chance(direction, direction.bad_state ? settings.burst_loss : 0);
+    const bool random_lost = chance(direction, settings.loss);
+    const bool reordered = chance(direction, settings.reorder);
+    const bool duplicated = chance(direction, settings.duplicate);
+    const int64_t jitter_us = std::uniform_int_distribution<int64_t>(-settings.jitter_ms * 1000LL, settings.jitter_ms * 1000LL)(direction.generator);
+
+    if (burst_lost || random_lost) {
+        direction.lost->add();
+        return;
+    }
+
+    // bottleneck: serialized one after the other at rate, tail drop when the backlog exceeds the queue
+    int64_t departure_us = now_us;
+    if (settings.rate_kbps > 0) {
+        const int64_t start_us = std::max(now_us, direction.bottleneck_free_us);
+        const uint64_t backlog_bytes = (start_us - now_us) * settings.rate_kbps / 8000;
+        if (backlog_bytes + data.size() > settings.queue_bytes) {
+            direction.queue_drops->add();
+            return;
+        }
+        direction.bottleneck_free_us = start_us + static_cast<int64_t>(data.size()) * 8000 / settings.rate_kbps;
+        departure_us = direction.bottleneck_free_us;
+    }
+
+    if (reordered) {
+        // jumps ahead of everything still delayed, only visible with some delay
+        direction.reordered->add();
+        if (duplicated) {
+            direction.duplicated->add();
+            schedule(direction, data, departure_us);
+        }
+        schedule(direction, std::move(data), departure_us);
+        return;
+    }
+
+    // jitter never reorders on its own, a datagram can't leave before the previous one
+    const int64_t release_us = std::max<int64_t>(departure_us + settings.delay_ms * 1000LL + jitter_us, direction.last_release_us);
+    direction.last_release_us = release_us;
+    if (duplicated) {
+        direction.duplicated->add();
+        schedule(direction, data, release_us);
+    }
+    schedule(direction, std::move(data), release_us);
+}
+
+void ImpairmentProxy::schedule(Direction &direction, std::vector<uint8_t> data, int64_t release_us) {
+    direction.pending.push({release_us, sequence++, std::move(data)});
+}
+
+int64_t ImpairmentProxy::flush(int64_t now_us) {
+    int64_t next_release_us = -1;
+    for (const auto &link : links) {
+        for (int i = 0; i < 2; ++i) {
+            Direction &direction = link->directions[i];
+            while (!direction.pending.empty() && direction.pending.top().release_us <= now_us) {
+                send(*link, i, direction.pending.top().data);
+                direction.forwarded->add();
+                direction.pending.pop();
+            }
+
+            if (!direction.pending.empty() && (next_release_us < 0 || direction.pending.top().release_us < next_release_us)) {
+                next_release_us = direction.pending.top().release_us;
+            }
+        }
+    }
+    return next_release_us;
+}
+
+void ImpairmentProxy::send(Link &link, int direction, const std::vector<uint8_t> &data) {
+    ssize_t ret;
+    if (direction == 0) {
+        ret = ::send(link.target_socket, data.data(), data.size(), MSG_NOSIGNAL);
+    } else if (link.has_peer) {
+        ret = sendto(link.listen_socket, data.data(), data.size(), MSG_NOSIGNAL, (const sockaddr*)&link.peer, sizeof(link.peer));
+    } else {
+        return;
+    }
+
+    // nobody listening yet on the target is expected while a stream starts
+    if (ret < 0 && errno != ECONNREFUSED) {
+        LOG_WARNING(name << ": " << link.name << ", " << strerror(errno));
+    }
+}
+
+ImpairmentStats ImpairmentProxy::getStats(const std::string &link_name, bool upstream) const {
+    ImpairmentStats stats = {};
+    for (const auto &link : links) {
+        if (link->name == link_name) {
+            const Direction &direction = link->directions[upstream ? 0 : 1];
+            stats.received = direction.received->value();
+            stats.forwarded = direction.forwarded->value();
+            stats.lost = direction.lost->value();
+            stats.queue_drops = direction.queue_drops->value();
+            stats.duplicated = direction.duplicated->value();
+            stats.reordered = direction.reordered->value();
+        }
+    }
+    return stats;
+}
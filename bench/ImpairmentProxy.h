@@ -0,0 +1,125 @@
+#ifndef REMOTE_CLIENT_IMPAIRMENTPROXY_H
+#define REMOTE_CLIENT_IMPAIRMENTPROXY_H
+
+#include <netinet/in.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <queue>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <memory>
+
+#include "Metrics.h"
+
+// what one direction of a link does to its datagrams, everything off by default:
+//   impair.<flow>.loss = 0.01          independent loss probability
+//   impair.<flow>.burst_enter = 0.005  Gilbert-Elliott good -> bad transition probability, 0 disables
+//   impair.<flow>.burst_exit = 0.3     bad -> good transition probability
+//   impair.<flow>.burst_loss = 0.5     loss probability while bad
+//   impair.<flow>.delay = 20           ms
+//   impair.<flow>.jitter = 5           ms, uniform in [-jitter, +jitter], order is kept
+//   impair.<flow>.reorder = 0.01       probability a datagram skips the delay and overtakes the queue
+//   impair.<flow>.duplicate = 0.001    probability a datagram is sent twice
+//   impair.<flow>.rate = 20000         kbit/s bottleneck, 0 for none
+//   impair.<flow>.queue = 256K         bottleneck queue size, tail drop beyond
+//   impair.seed = 1
+struct ImpairmentSettings {
+    double loss = 0;
+    double burst_enter = 0;
+    double burst_exit = 0;
+    double burst_loss = 0;
+    int delay_ms = 0;
+    int jitter_ms = 0;
+    double reorder = 0;
+    double duplicate = 0;
+    int64_t rate_kbps = 0;
+    uint64_t queue_bytes = 256 * 1024;
+
+    static ImpairmentSettings fromConfig(const std::string &flow);
+    bool enabled() const;
+};
+
+struct ImpairmentStats {
+    uint64_t received;
+    uint64_t forwarded;
+    uint64_t lost;
+    uint64_t queue_drops;
+    uint64_t duplicated;
+    uint64_t reordered;
+};
+
+// user space netem for udp: each link listens on a port, sends what it gets to a target port
+// and sends the answers back to the last peer it heard from, each direction with its own settings.
+// decisions come from a per link generator seeded from a fixed seed, so the same datagram sequence
+// always meets the same fate whatever the timing
+class ImpairmentProxy {
+private:
+    struct Datagram {
+        int64_t release_us;
+        uint64_t sequence;
+        std::vector<uint8_t> data;
+        bool operator>(const Datagram &other) const {
+            return release_us != other.release_us ? release_us > other.release_us : sequence > other.sequence;
+        }
+    };
+
+    struct Direction {
+        ImpairmentSettings settings;
+        std::mt19937_64 generator;
+        bool bad_state = false;
+        int64_t last_release_us = 0;
+        int64_t bottleneck_free_us = 0;
+        std::priority_queue<Datagram, std::vector<Datagram>, std::greater<>> pending;
+
+        Counter *received;
+        Counter *forwarded;
+        Counter *lost;
+        Counter *queue_drops;
+        Counter *duplicated;
+        Counter *reordered;
+    };
+
+    struct Link {
+        std::string name;
+        int listen_socket = -1;
+        int target_socket = -1;
+        sockaddr_in peer = {};
+        bool has_peer = false;
+        // 0 toward the target, 1 back toward the peer
+        Direction directions[2];
+    };
+
+    std::string name;
+    uint64_t seed;
+    std::vector<std::unique_ptr<Link>> links;
+    uint64_t sequence = 0;
+
+    std::atomic<bool> proxy_stop_condition = true;
+    std::thread proxy_thread;
+
+public:
+    explicit ImpairmentProxy(uint64_t seed);
+    ~ImpairmentProxy();
+
+    // before start, upstream applies toward the target and downstream on the way back
+    void addLink(const std::string &link_name, uint16_t listen_port, uint16_t target_port,
+                 const ImpairmentSettings &upstream, const ImpairmentSettings &downstream = {});
+
+    void start();
+    void run();
+    void stop();
+
+    ImpairmentStats getStats(const std::string &link_name, bool upstream = true) const;
+
+private:
+    void receive(Link &link, int direction);
+    void impair(Direction &direction, std::vector<uint8_t> &&data, int64_t now_us);
+    void schedule(Direction &direction, std::vector<uint8_t> data, int64_t release_us);
+    int64_t flush(int64_t now_us);
+    void send(Link &link, int direction, const std::vector<uint8_t> &data);
+    bool chance(Direction &direction, double probability);
+};
+
+#endif //REMOTE_CLIENT_IMPAIRMENTPROXY_H
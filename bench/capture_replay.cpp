@@ -0,0 +1,234 @@
+extern "C" {
+#include <libavcodec/avcodec.h>
+};
+
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <memory>
+
+#include "Capture.h"
+#include "SDLDisplay.h"
+#include "RTPAudioReceiver.h"
+#include "RTPVideoReceiver.h"
+#include "Config.h"
+#include "Metrics.h"
+#include "ClockSync.h"
+#include "Log.h"
+
+struct ReplayOptions {
+    std::string path;
+    bool fast = false;
+    bool display = false;
+    bool window = false;
+    int loops = 1;
+    std::string output;
+};
+
+static void usage(const char *program) {
+    std::cout << program << ": <capture file> [--fast] [--display] [--window] [--loops=1] [--output=<file>] [--config=<file>]" << std::endl;
+}
+
+static bool parse(int argc, char **argv, ReplayOptions &options) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const size_t equal = arg.find('=');
+        const std::string key = arg.substr(0, equal);
+        const std::string value = equal != std::string::npos ? arg.substr(equal + 1) : "";
+        if (key == "--fast") {
+            options.fast = true;
+        } else if (key == "--display") {
+            options.display = true;
+        } else if (key == "--window") {
+            options.display = options.window = true;
+        } else if (key == "--loops") {
+            options.loops = std::stoi(value);
+        } else if (key == "--output") {
+            options.output = value;
+        } else if (key == "--config") {
+            Config::global().load(value);
+        } else if (arg.rfind("--", 0) != 0 && options.path.empty()) {
+            options.path = arg;
+        } else {
+            return false;
+        }
+    }
+    return !options.path.empty() && options.loops > 0;
+}
+
+// stands for the display when decoding alone is measured, frames are owned by the sink
+class NullFrameSink : public Sink<AVFrame> {
+public:
+    std::atomic<uint64_t> frames = 0;
+
+    void handle(AVFrame *frame) override {
+        frames.fetch_add(1, std::memory_order_relaxed);
+        av_frame_free(&frame);
+    }
+};
+
+struct ReplayStats {
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    uint64_t messages = 0;
+    uint64_t decode_errors = 0;
+};
+
+static void replay(const CaptureReader &reader, const ReplayOptions &options, RTPAudioReceiver &audio, RTPVideoReceiver &video,
+                   SDLDisplay *display, Sink<AVFrame> &audio_sink, Sink<AVFrame> &video_sink, ReplayStats &stats) {
+    const std::vector<CaptureIndexEntry> &index = reader.getIndex();
+    AVCodecParameters *parameters = avcodec_parameters_alloc();
+    AVPacket *packet = av_packet_alloc();
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < index.size(); ++i) {
+        const CaptureRecord record = reader.record(i);
+        if (!options.fast) {
+            std::this_thread::sleep_until(start + std::chrono::microseconds(record.header->time_us));
+        }
+
+        switch (record.header->type) {
+            case CaptureRecordType::STREAM: {
+                // a new stream command, reopen the decoder like the client did
+                CaptureReader::toParameters(record, parameters);
+                if (record.header->stream == 0) {
+                    audio.init(parameters);
+                    audio.Source<AVFrame>::attachSink(&audio_sink);
+                    if (display) {
+                        display->stopAudio();
+                        display->initAudio(audio.getContext());
+                        display->startAudio();
+                    }
+                } else {
+                    video.init(parameters);
+                    video.Source<AVFrame>::attachSink(&video_sink);
+                    if (display) {
+                        display->stopDisplay();
+                        display->initVideo(video.getContext());
+                        display->startDisplay();
+                    }
+                }
+                break;
+            }
+            case CaptureRecordType::PACKET: {
+                // the payload stays in the mapping, the decoder copies a packet without buffer
+                packet->data = const_cast<uint8_t*>(record.payload);
+                packet->size = static_cast<int>(record.header->size);
+                packet->pts = record.header->pts;
+                packet->dts = record.header->dts;
+                packet->flags = record.header->flags;
+                stats.packets++;
+                stats.bytes += record.header->size;
+                try {
+                    if (record.header->stream == 0 && audio.getContext()) {
+                        audio.decodePacket(packet, ClockSync::now());
+                    } else if (record.header->stream == 1 && video.getContext()) {
+                        video.decodePacket(packet, ClockSync::now());
+                    }
+                } catch (const std::exception &e) {
+                    // the live receiver would stop here, a replay keeps going to see what follows
+                    stats.decode_errors++;
+                    LOG_DEBUG("replay: packet " << i << ", " << e.what());
+                }
+                break;
+            }
+            case CaptureRecordType::SERVER_MESSAGE:
+            case CaptureRecordType::CLIENT_MESSAGE:
+                stats.messages++;
+                LOG_DEBUG("replay: " << (record.header->type == CaptureRecordType::SERVER_MESSAGE ? "server " : "client ")
+                          << std::string(reinterpret_cast<const char*>(record.payload), record.header->size));
+                break;
+        }
+    }
+    packet->data = nullptr;
+    packet->size = 0;
+    av_packet_free(&packet);
+    avcodec_parameters_free(&parameters);
+}
+
+static void write_report(std::ostream &os, const ReplayOptions &options, const CaptureReader &reader, const ReplayStats &stats,
+                         uint64_t frames, double seconds) {
+    MetricsRegistry &registry = MetricsRegistry::global();
+    os << "{\"capture\":{\"path\":\"" << options.path << "\",\"records\":" << reader.getIndex().size()
+       << ",\"complete\":" << (reader.isComplete() ? "true" : "false") << "}"
+       << ",\"config\":{\"fast\":" << (options.fast ? "true" : "false") << ",\"display\":" << (options.display ? "true" : "false")
+       << ",\"loops\":" << options.loops << ",\"seconds\":" << seconds << "}"
+       << ",\"packets\":" << stats.packets << ",\"bytes\":" << stats.bytes << ",\"messages\":" << stats.messages
+       << ",\"decode_errors\":" << stats.decode_errors << ",\"frames\":" << frames
+       << ",\"fps\":" << frames / seconds << ",\"decode_time_us\":{";
+    bool comma = false;
+    const std::pair<const char*, Labels> decoders[] = {{"video", {{"stream", "video"}, {"index", "0"}}}, {"audio", {{"stream", "audio"}}}};
+    for (const auto &[stream, labels] : decoders) {
+        const HistogramSnapshot snapshot = registry.histogram("decode_time_us", "", labels).snapshot();
+        os << (comma ? "," : "") << '"' << stream << "\":{\"count\":" << snapshot.count
+           << ",\"mean\":" << (snapshot.count ? snapshot.sum / snapshot.count : 0)
+           << ",\"p50\":" << snapshot.quantile(0.5) << ",\"p99\":" << snapshot.quantile(0.99) << ",\"max\":" << snapshot.max << '}';
+        comma = true;
+    }
+    os << "}}" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    ReplayOptions options;
+    try {
+        if (!parse(argc, argv, options)) {
+            usage(argv[0]);
+            return -1;
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        usage(argv[0]);
+        return -1;
+    }
+
+    if (!options.window) {
+        setenv("SDL_VIDEODRIVER", "dummy", 0);
+        setenv("SDL_AUDIODRIVER", "dummy", 0);
+    }
+
+    Log::global().start();
+    try {
+        CaptureReader reader(options.path);
+        RTPAudioReceiver audio;
+        RTPVideoReceiver video;
+        NullFrameSink null_audio;
+        NullFrameSink null_video;
+        std::unique_ptr<SDLDisplay> display;
+        Sink<AVFrame> *audio_sink = &null_audio;
+        Sink<AVFrame> *video_sink = &null_video;
+        if (options.display) {
+            display = std::make_unique<SDLDisplay>();
+            audio_sink = video_sink = display.get();
+        }
+
+        ReplayStats stats;
+        const auto start = std::chrono::steady_clock::now();
+        for (int loop = 0; loop < options.loops; ++loop) {
+            replay(reader, options, audio, video, display.get(), *audio_sink, *video_sink, stats);
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (display) {
+            display->stop();
+        }
+        const uint64_t frames = options.display ? MetricsRegistry::global().counter("presented_frames_total", "", {{"index", "0"}}).value()
+                                                : null_video.frames.load(std::memory_order_relaxed);
+
+        if (options.output.empty()) {
+            write_report(std::cout, options, reader, stats, frames, seconds);
+        } else {
+            std::ofstream file(options.output, std::ios::trunc);
+            write_report(file, options, reader, stats, frames, seconds);
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        Log::global().stop();
+        return -1;
+    }
+
+    Log::global().stop();
+    return 0;
+}
@@ -0,0 +1,365 @@
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+};
+
+#include <sched.h>
+#include <sys/resource.h>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <future>
+#include <chrono>
+#include <memory>
+
+#include "Capture.h"
+#include "RTPVideoReceiver.h"
+#include "Config.h"
+#include "ThreadPolicy.h"
+#include "ClockSync.h"
+#include "Metrics.h"
+#include "Log.h"
+#include "exception.h"
+
+// frames leave a frame threaded decoder at most thread_count packets late
+constexpr size_t SUBMIT_RING_SIZE = 1024;
+
+struct DecodeBenchOptions {
+    std::string path;
+    std::vector<int> streams = {1, 2, 4};
+    int threads = 1;
+    int thread_type = FF_THREAD_SLICE;
+    int loops = 1;
+    bool pin = false;
+    std::string output;
+};
+
+static void usage(const char *program) {
+    std::cout << program << ": <capture or media file> [--streams=1,2,4] [--threads=1] [--thread-type=slice|frame] [--loops=1]"
+              << " [--pin] [--output=<file>] [--config=<file>]" << std::endl;
+}
+
+static bool parse(int argc, char **argv, DecodeBenchOptions &options) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const size_t equal = arg.find('=');
+        const std::string key = arg.substr(0, equal);
+        const std::string value = equal != std::string::npos ? arg.substr(equal + 1) : "";
+        if (key == "--streams") {
+            options.streams.clear();
+            std::istringstream list(value);
+            std::string item;
+            while (std::getline(list, item, ',')) {
+                options.streams.push_back(std::stoi(item));
+                if (options.streams.back() <= 0) {
+                    return false;
+                }
+            }
+        } else if (key == "--threads") {
+            options.threads = std::stoi(value);
+        } else if (key == "--thread-type") {
+            options.thread_type = value == "frame" ? FF_THREAD_FRAME : FF_THREAD_SLICE;
+        } else if (key == "--loops") {
+            options.loops = std::stoi(value);
+        } else if (key == "--pin") {
+            options.pin = true;
+        } else if (key == "--output") {
+            options.output = value;
+        } else if (key == "--config") {
+            Config::global().load(value);
+        } else if (arg.rfind("--", 0) != 0 && options.path.empty()) {
+            options.path = arg;
+        } else {
+            return false;
+        }
+    }
+    return !options.path.empty() && !options.streams.empty() && options.loops > 0;
+}
+
+// the video stream of the input, decoded again and again by every instance
+struct DecodeInput {
+    std::string kind;
+    AVCodecParameters *parameters = avcodec_parameters_alloc();
+    std::vector<AVPacket*> packets;
+
+    ~DecodeInput() {
+        for (AVPacket *packet : packets) {
+            av_packet_free(&packet);
+        }
+        avcodec_parameters_free(&parameters);
+    }
+};
+
+static bool is_capture(const std::string &path) {
+    char magic[sizeof(CAPTURE_MAGIC)] = {};
+    std::ifstream file(path, std::ios::binary);
+    file.read(magic, sizeof(magic));
+    return file && memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) == 0;
+}
+
+static void load_capture(const std::string &path, DecodeInput &input) {
+    // the first video stream of the session, up to the next stream command
+    CaptureReader reader(path);
+    bool found = false;
+    for (size_t i = 0; i < reader.getIndex().size(); ++i) {
+        const CaptureRecord record = reader.record(i);
+        if (record.header->stream != 1) {
+            continue;
+        }
+        if (record.header->type == CaptureRecordType::STREAM) {
+            if (found) {
+                break;
+            }
+            CaptureReader::toParameters(record, input.parameters);
+            found = true;
+        } else if (record.header->type == CaptureRecordType::PACKET && found) {
+            AVPacket *packet = av_packet_alloc();
+            av_new_packet(packet, static_cast<int>(record.header->size));
+            memcpy(packet->data, record.payload, record.header->size);
+            packet->flags = record.header->flags;
+            input.packets.push_back(packet);
+        }
+    }
+
+    if (!found) {
+        throw InitFail("No video stream in the capture");
+    }
+    input.kind = "capture";
+}
+
+static void load_media(const std::string &path, DecodeInput &input) {
+    AVFormatContext *format_ctx = nullptr;
+    if (avformat_open_input(&format_ctx, path.c_str(), nullptr, nullptr) != 0) {
+        throw InitFail("Couldn't open input file");
+    }
+
+    try {
+        if (avformat_find_stream_info(format_ctx, nullptr) < 0) {
+            throw InitFail("Couldn't find stream information");
+        }
+        const int stream_index = av_find_best_stream(format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+        if (stream_index < 0) {
+            throw InitFail("Couldn't find a video stream");
+        }
+        avcodec_parameters_copy(input.parameters, format_ctx->streams[stream_index]->codecpar);
+
+        AVPacket *packet = av_packet_alloc();
+        while (av_read_frame(format_ctx, packet) >= 0) {
+            if (packet->stream_index == stream_index) {
+                input.packets.push_back(av_packet_clone(packet));
+            }
+            av_packet_unref(packet);
+        }
+        av_packet_free(&packet);
+    } catch (...) {
+        avformat_close_input(&format_ctx);
+        throw;
+    }
+
+    avformat_close_input(&format_ctx);
+    input.kind = "media";
+}
+
+// counts the frames of one instance and times them from the submission of their packet
+class LatencySink : public Sink<AVFrame> {
+public:
+    int64_t submit_us[SUBMIT_RING_SIZE] = {};
+    uint64_t frames = 0;
+    Histogram latency;
+
+    void handle(AVFrame *frame) override {
+        // called from decodePacket on the instance thread, no synchronization needed
+        frames++;
+        if (frame->pts != AV_NOPTS_VALUE) {
+            latency.record(ClockSync::now() - submit_us[frame->pts % SUBMIT_RING_SIZE]);
+        }
+        av_frame_free(&frame);
+    }
+};
+
+struct StreamResult {
+    uint64_t frames = 0;
+    uint64_t errors = 0;
+    double seconds = 0;
+    HistogramSnapshot latency;
+};
+
+struct RunResult {
+    int streams;
+    double seconds;
+    double cpu_seconds;
+    std::vector<StreamResult> results;
+};
+
+static void decode_stream(RTPVideoReceiver &receiver, LatencySink &sink, const DecodeInput &input, int loops,
+                          std::shared_future<void> go, StreamResult &result) {
+    ThreadScope scope("decode-bench");
+    AVPacket *packet = av_packet_alloc();
+    go.wait();
+    const auto start = std::chrono::steady_clock::now();
+    int64_t sequence = 0;
+    for (int loop = 0; loop < loops; ++loop) {
+        for (const AVPacket *source : input.packets) {
+            // numbered in decode order, the frame carries the number of its packet out of the decoder
+            av_packet_ref(packet, source);
+            packet->pts = packet->dts = sequence;
+            const int64_t now_us = ClockSync::now();
+            sink.submit_us[sequence % SUBMIT_RING_SIZE] = now_us;
+            try {
+                receiver.decodePacket(packet, now_us);
+            } catch (const std::exception &e) {
+                result.errors++;
+            }
+            av_packet_unref(packet);
+            sequence++;
+        }
+    }
+    // drains the frames still in the decoder
+    receiver.stop();
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.frames = sink.frames;
+    result.latency = sink.latency.snapshot();
+    av_packet_free(&packet);
+}
+
+static double cpu_seconds() {
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static RunResult run(const DecodeBenchOptions &options, const DecodeInput &input, int streams, const cpu_set_t &allowed) {
+    // one core per instance, the decoder threads and the instance threads inherit the mask of this thread
+    cpu_set_t mask = allowed;
+    if (options.pin) {
+        CPU_ZERO(&mask);
+        int count = 0;
+        for (int cpu = 0; cpu < CPU_SETSIZE && count < streams; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                CPU_SET(cpu, &mask);
+                count++;
+            }
+        }
+    }
+    sched_setaffinity(0, sizeof(mask), &mask);
+
+    std::vector<std::unique_ptr<RTPVideoReceiver>> receivers;
+    std::vector<std::unique_ptr<LatencySink>> sinks;
+    for (int i = 0; i < streams; ++i) {
+        receivers.push_back(std::make_unique<RTPVideoReceiver>("decode bench " + std::to_string(i)));
+        sinks.push_back(std::make_unique<LatencySink>());
+        receivers.back()->setDecoderThreads(options.threads, options.thread_type);
+        receivers.back()->init(input.parameters);
+        receivers.back()->Source<AVFrame>::attachSink(sinks.back().get());
+    }
+
+    RunResult result = {streams, 0, 0, std::vector<StreamResult>(streams)};
+    std::promise<void> go;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < streams; ++i) {
+        threads.emplace_back(decode_stream, std::ref(*receivers[i]), std::ref(*sinks[i]), std::cref(input), options.loops,
+                             go.get_future().share(), std::ref(result.results[i]));
+    }
+
+    const double cpu_start = cpu_seconds();
+    const auto start = std::chrono::steady_clock::now();
+    go.set_value();
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.cpu_seconds = cpu_seconds() - cpu_start;
+    return result;
+}
+
+static void write_report(std::ostream &os, const DecodeBenchOptions &options, const DecodeInput &input, const std::vector<RunResult> &runs) {
+    os << "{\"input\":{\"path\":\"" << options.path << "\",\"kind\":\"" << input.kind
+       << "\",\"codec\":\"" << avcodec_get_name(input.parameters->codec_id) << "\",\"width\":" << input.parameters->width
+       << ",\"height\":" << input.parameters->height << ",\"packets\":" << input.packets.size() << "}"
+       << ",\"config\":{\"threads\":" << options.threads << ",\"thread_type\":\"" << (options.thread_type == FF_THREAD_FRAME ? "frame" : "slice")
+       << "\",\"loops\":" << options.loops << ",\"pin\":" << (options.pin ? "true" : "false")
+       << ",\"cores\":" << std::thread::hardware_concurrency() << "},\"runs\":[";
+
+    // against the per instance rate of the first run, 1 means each added instance decodes as fast as the first
+    double baseline_fps = 0;
+    bool comma = false;
+    for (const RunResult &run : runs) {
+        uint64_t frames = 0, errors = 0;
+        for (const StreamResult &stream : run.results) {
+            frames += stream.frames;
+            errors += stream.errors;
+        }
+        const double fps = frames / run.seconds;
+        if (baseline_fps == 0) {
+            baseline_fps = fps / run.streams;
+        }
+
+        os << (comma ? "," : "") << "{\"streams\":" << run.streams << ",\"seconds\":" << run.seconds << ",\"frames\":" << frames
+           << ",\"decode_errors\":" << errors << ",\"fps\":" << fps << ",\"efficiency\":" << (baseline_fps > 0 ? fps / run.streams / baseline_fps : 0)
+           << ",\"cpu_percent\":" << 100 * run.cpu_seconds / run.seconds << ",\"per_stream\":[";
+        for (size_t i = 0; i < run.results.size(); ++i) {
+            const StreamResult &stream = run.results[i];
+            const HistogramSnapshot &latency = stream.latency;
+            os << (i ? "," : "") << "{\"fps\":" << stream.frames / stream.seconds << ",\"latency_us\":{\"mean\":"
+               << (latency.count ? latency.sum / latency.count : 0) << ",\"p50\":" << latency.quantile(0.5)
+               << ",\"p90\":" << latency.quantile(0.9) << ",\"p99\":" << latency.quantile(0.99) << ",\"max\":" << latency.max << "}}";
+        }
+        os << "]}";
+        comma = true;
+    }
+    os << "]}" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    DecodeBenchOptions options;
+    try {
+        if (!parse(argc, argv, options)) {
+            usage(argv[0]);
+            return -1;
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        usage(argv[0]);
+        return -1;
+    }
+
+    Log::global().start();
+    try {
+        DecodeInput input;
+        if (is_capture(options.path)) {
+            load_capture(options.path, input);
+        } else {
+            load_media(options.path, input);
+        }
+        if (input.packets.empty()) {
+            throw InitFail("No video packet in the input");
+        }
+
+        cpu_set_t allowed;
+        sched_getaffinity(0, sizeof(allowed), &allowed);
+        std::vector<RunResult> runs;
+        for (const int streams : options.streams) {
+            runs.push_back(run(options, input, streams, allowed));
+            LOG_INFO("decode bench: " << streams << " streams in " << runs.back().seconds << "s");
+        }
+        sched_setaffinity(0, sizeof(allowed), &allowed);
+
+        if (options.output.empty()) {
+            write_report(std::cout, options, input, runs);
+        } else {
+            std::ofstream file(options.output, std::ios::trunc);
+            write_report(file, options, input, runs);
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        Log::global().stop();
+        return -1;
+    }
+
+    Log::global().stop();
+    return 0;
+}
@@ -0,0 +1,184 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <vector>
+
+#include "FrameReader.h"
+
+// FrameReader against a plain byte vector reassembler. the input is a list of operations:
+//   0 n bytes...      append the next n + 1 bytes as they are, split anywhere, garbage included
+//   1 hi lo n         a header announcing hi lo bytes when hi is odd, lo bytes when it's even, then (n + 1) * 256
+//                     bytes of it at most: a length the data never completes, or one that makes the ring grow
+//   2                 take every complete frame and compare them
+//   3                 clear both
+// the reader is built with a capacity between one page and 64K from the first byte
+
+namespace {
+
+class Model {
+private:
+    std::vector<uint8_t> pending;
+
+public:
+    void append(const uint8_t *data, size_t size) {
+        pending.insert(pending.end(), data, data + size);
+    }
+
+    bool next(std::vector<uint8_t> &frame) {
+        size_t start = 0;
+        while (start < pending.size() && pending[start] != FrameReader::DELIMITER) {
+            ++start;
+        }
+        pending.erase(pending.begin(), pending.begin() + start);
+        if (pending.size() < FrameReader::HEADER_SIZE) {
+            return false;
+        }
+        const size_t size = (static_cast<size_t>(pending[1]) << 8) | pending[2];
+        if (pending.size() < FrameReader::HEADER_SIZE + size) {
+            return false;
+        }
+        frame.assign(pending.begin() + FrameReader::HEADER_SIZE, pending.begin() + FrameReader::HEADER_SIZE + size);
+        pending.erase(pending.begin(), pending.begin() + FrameReader::HEADER_SIZE + size);
+        return true;
+    }
+
+    void clear() {
+        pending.clear();
+    }
+
+    size_t buffered() const {
+        return pending.size();
+    }
+};
+
+void check(bool condition, const char *what) {
+    if (!condition) {
+        fprintf(stderr, "frame reader mismatch: %s\n", what);
+        abort();
+    }
+}
+
+void compare(FrameReader &reader, Model &model) {
+    Frame frame;
+    std::vector<uint8_t> expected;
+    for (;;) {
+        const bool got = reader.next(frame);
+        check(got == model.next(expected), "a frame on one side only");
+        if (!got) {
+            break;
+        }
+        check(frame.size == expected.size(), "frame size");
+        check(frame.size == 0 || memcmp(frame.data, expected.data(), frame.size) == 0, "frame payload");
+        check(frame.capacity >= frame.size + FrameReader::PADDING, "padding");
+        // the padding has to be mapped, a read past the mapping faults
+        volatile uint8_t last = frame.data[frame.size + FrameReader::PADDING - 1];
+        (void)last;
+    }
+    check(reader.buffered() == model.buffered(), "buffered bytes");
+}
+
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    FrameReader reader(static_cast<size_t>(1) << (12 + data[0] % 5));
+    Model model;
+    std::vector<uint8_t> synthesized;
+
+    size_t i = 1;
+    while (i < size) {
+        const uint8_t op = data[i++] % 4;
+        switch (op) {
+            case 0: {
+                if (i >= size) {
+                    break;
+                }
+                const size_t requested = data[i++] + 1;
+                const size_t length = std::min(requested, size - i);
+                reader.append(data + i, length);
+                model.append(data + i, length);
+                i += length;
+                break;
+            }
+            case 1: {
+                if (i + 3 > size) {
+                    i = size;
+                    break;
+                }
+                const size_t announced = (data[i] % 2 ? static_cast<size_t>(data[i]) << 8 : 0) | data[i + 1];
+                const size_t available = std::min<size_t>((data[i + 2] + 1) * 256, announced);
+                i += 3;
+                synthesized.assign(FrameReader::HEADER_SIZE + available, 0);
+                synthesized[0] = FrameReader::DELIMITER;
+                synthesized[1] = announced >> 8;
+                synthesized[2] = announced & 0xff;
+                for (size_t b = 0; b < available; ++b) {
+                    synthesized[FrameReader::HEADER_SIZE + b] = static_cast<uint8_t>(b * 31 + announced);
+                }
+                reader.append(synthesized.data(), synthesized.size());
+                model.append(synthesized.data(), synthesized.size());
+                break;
+            }
+            case 2:
+                compare(reader, model);
+                break;
+            case 3:
+                reader.clear();
+                model.clear();
+                break;
+        }
+    }
+    compare(reader, model);
+    return 0;
+}
+
+#ifndef FUZZ_WITH_LIBFUZZER
+// without libFuzzer: replays the files given, or runs random inputs
+//   ./fuzz_frame_reader crash-1234
+//   ./fuzz_frame_reader --runs=100000 --seed=1
+int main(int argc, char **argv) {
+    uint64_t runs = 10000;
+    uint64_t seed = std::random_device()();
+    std::vector<const char*> files;
+    for (int a = 1; a < argc; ++a) {
+        if (strncmp(argv[a], "--runs=", 7) == 0) {
+            runs = strtoull(argv[a] + 7, nullptr, 10);
+        } else if (strncmp(argv[a], "--seed=", 7) == 0) {
+            seed = strtoull(argv[a] + 7, nullptr, 10);
+        } else {
+            files.push_back(argv[a]);
+        }
+    }
+
+    if (!files.empty()) {
+        for (const char *path : files) {
+            std::ifstream file(path, std::ios::binary);
+            const std::vector<uint8_t> input((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            LLVMFuzzerTestOneInput(input.data(), input.size());
+        }
+        printf("%zu inputs replayed\n", files.size());
+        return 0;
+    }
+
+    std::mt19937_64 rng(seed);
+    std::vector<uint8_t> input;
+    for (uint64_t run = 0; run < runs; ++run) {
+        input.resize(1 + rng() % 4096);
+        for (uint8_t &byte : input) {
+            // delimiters more often than chance, so frames actually form
+            const uint64_t r = rng();
+            byte = r % 8 == 0 ? FrameReader::DELIMITER : static_cast<uint8_t>(r >> 8);
+        }
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+    }
+    printf("%llu random inputs, seed %llu\n", static_cast<unsigned long long>(runs), static_cast<unsigned long long>(seed));
+    return 0;
+}
+#endif
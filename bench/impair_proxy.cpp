@@ -0,0 +1,99 @@
+#include <csignal>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+
+#include "ImpairmentProxy.h"
+#include "Config.h"
+#include "Log.h"
+
+std::atomic<bool> stop = false;
+void signalHandler(int) {
+    stop.store(true, std::memory_order_relaxed);
+}
+
+struct LinkSpec {
+    std::string name;
+    uint16_t listen_port;
+    uint16_t target_port;
+};
+
+// <name>:<listen_port>:<target_port>, impair.<name>.* applies toward the target and impair.<name>-down.* on the way back
+static bool parse_link(const std::string &arg, LinkSpec &spec) {
+    const size_t first = arg.find(':');
+    const size_t second = arg.find(':', first + 1);
+    if (first == std::string::npos || second == std::string::npos) {
+        return false;
+    }
+
+    try {
+        spec.name = arg.substr(0, first);
+        spec.listen_port = std::stoul(arg.substr(first + 1, second - first - 1));
+        spec.target_port = std::stoul(arg.substr(second + 1));
+    } catch (const std::exception &e) {
+        return false;
+    }
+    return !spec.name.empty();
+}
+
+int main(int argc, char **argv) {
+    std::vector<LinkSpec> specs;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        LinkSpec spec;
+        if (arg.rfind("--config=", 0) == 0) {
+            try {
+                Config::global().load(arg.substr(9));
+            } catch (const std::exception &e) {
+                std::cerr << e.what() << ": " << arg.substr(9) << std::endl;
+                return -1;
+            }
+        } else if (parse_link(arg, spec)) {
+            specs.push_back(spec);
+        } else {
+            specs.clear();
+            break;
+        }
+    }
+
+    if (specs.empty()) {
+        std::cout << argv[0] << ": [--config=<file>] <name>:<listen_port>:<target_port>..." << std::endl;
+        return -1;
+    }
+
+    Log::global().start();
+    signal(SIGINT, signalHandler);
+    signal(SIGTERM, signalHandler);
+
+    try {
+        ImpairmentProxy proxy(Config::global().getInt("impair.seed", 1));
+        for (const LinkSpec &spec : specs) {
+            proxy.addLink(spec.name, spec.listen_port, spec.target_port,
+                          ImpairmentSettings::fromConfig(spec.name), ImpairmentSettings::fromConfig(spec.name + "-down"));
+        }
+        proxy.start();
+
+        while (!stop.load(std::memory_order_relaxed)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        proxy.stop();
+
+        for (const LinkSpec &spec : specs) {
+            for (const bool upstream : {true, false}) {
+                const ImpairmentStats stats = proxy.getStats(spec.name, upstream);
+                std::cout << spec.name << (upstream ? " up" : " down") << ": " << stats.received << " received, "
+                          << stats.forwarded << " forwarded, " << stats.lost << " lost, " << stats.queue_drops << " queue drops, "
+                          << stats.duplicated << " duplicated, " << stats.reordered << " reordered" << std::endl;
+            }
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        Log::global().stop();
+        return -1;
+    }
+
+    Log::global().stop();
+    return 0;
+}
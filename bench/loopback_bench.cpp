@@ -0,0 +1,337 @@
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavdevice/avdevice.h>
+};
+
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <map>
+#include <memory>
+
+#include "FakeServer.h"
+#include "ImpairmentProxy.h"
+#include "SDLDisplay.h"
+#include "CommandSocket.h"
+#include "Config.h"
+#include "ThreadPolicy.h"
+#include "Metrics.h"
+#include "Log.h"
+
+constexpr uint16_t CLIENT_PORT = 19998;
+// behind the impairment proxy the server sends rtp here and reads datagrams from the client here
+constexpr uint16_t PROXIED_PORT_OFFSET = 10000;
+constexpr const char *IMPAIRED_LINKS[] = {"video", "video-rtcp", "audio", "audio-rtcp", "input"};
+
+struct BenchOptions {
+    FakeServerSettings server;
+    std::chrono::seconds duration{20};
+    std::chrono::seconds warmup{3};
+    std::string output;
+    bool window = false;
+};
+
+static void usage(const char *program) {
+    std::cout << program << ": [--width=1280] [--height=720] [--fps=60] [--bitrate=8000000] [--duration=20] [--warmup=3]"
+              << " [--no-audio] [--window] [--output=<file>] [--config=<file>]" << std::endl;
+}
+
+static bool parse(int argc, char **argv, BenchOptions &options) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const size_t equal = arg.find('=');
+        const std::string key = arg.substr(0, equal);
+        const std::string value = equal != std::string::npos ? arg.substr(equal + 1) : "";
+        if (key == "--width") {
+            options.server.width = std::stoi(value);
+        } else if (key == "--height") {
+            options.server.height = std::stoi(value);
+        } else if (key == "--fps") {
+            options.server.fps = std::stoi(value);
+        } else if (key == "--bitrate") {
+            options.server.video_bitrate = std::stoll(value);
+        } else if (key == "--duration") {
+            options.duration = std::chrono::seconds(std::stoi(value));
+        } else if (key == "--warmup") {
+            options.warmup = std::chrono::seconds(std::stoi(value));
+        } else if (key == "--no-audio") {
+            options.server.audio = false;
+        } else if (key == "--window") {
+            options.window = true;
+        } else if (key == "--output") {
+            options.output = value;
+        } else if (key == "--config") {
+            Config::global().load(value);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// counters and histograms only grow, the measured window is the difference of two snapshots
+struct Snapshot {
+    std::chrono::steady_clock::time_point timepoint;
+    std::map<std::string, uint64_t> counters;
+    std::map<std::string, HistogramSnapshot> histograms;
+    // by role and tid, the exited threads of a role are one entry with tid 0
+    std::map<std::pair<std::string, pid_t>, ThreadReport> threads;
+};
+
+static const std::pair<const char*, Labels> COUNTERS[] = {
+        {"presented_frames_total", {{"index", "0"}}},
+        {"decoded_frames_total", {{"stream", "video"}, {"index", "0"}}},
+        {"decoded_frames_total", {{"stream", "audio"}}},
+        {"rtp_packets_total", {{"stream", "video"}, {"index", "0"}}},
+        {"rtp_bytes_total", {{"stream", "video"}, {"index", "0"}}},
+        {"rtp_corrupt_packets_total", {{"stream", "video"}, {"index", "0"}}},
+        {"rtp_corrupt_packets_total", {{"stream", "audio"}}},
+        {"decode_errors_total", {{"stream", "video"}, {"index", "0"}}},
+        {"decode_errors_total", {{"stream", "audio"}}},
+        {"display_dropped_frames_total", {{"stream", "video"}, {"index", "0"}}},
+        {"display_dropped_frames_total", {{"stream", "audio"}}},
+        {"audio_queue_resets_total", {}},
+};
+
+static const std::pair<const char*, Labels> HISTOGRAMS[] = {
+        {"pipeline_latency_us", {{"index", "0"}}},
+        {"decode_time_us", {{"stream", "video"}, {"index", "0"}}},
+        {"decode_time_us", {{"stream", "audio"}}},
+        {"present_time_us", {{"index", "0"}}},
+};
+
+static std::string key(const char *name, const Labels &labels) {
+    std::string k = name;
+    for (const auto &[label, value] : labels) {
+        // one screen only, the report keeps its names
+        if (label == "index") {
+            continue;
+        }
+        k += "_" + value;
+    }
+    return k;
+}
+
+static Snapshot take_snapshot(const FakeServer &server) {
+    // get or create returns the instances the pipeline updates, the help text is ignored when they exist
+    MetricsRegistry &registry = MetricsRegistry::global();
+    Snapshot snapshot;
+    snapshot.timepoint = std::chrono::steady_clock::now();
+    for (const auto &[name, labels] : COUNTERS) {
+        snapshot.counters[key(name, labels)] = registry.counter(name, "", labels).value();
+    }
+    for (const auto &[name, labels] : HISTOGRAMS) {
+        snapshot.histograms[key(name, labels)] = registry.histogram(name, "", labels).snapshot();
+    }
+    snapshot.histograms["server_encode_time_us"] = server.getEncodeTime().snapshot();
+    for (const ThreadReport &report : ThreadPolicy::report()) {
+        snapshot.threads[{report.role, report.tid}] = report;
+    }
+    return snapshot;
+}
+
+static HistogramSnapshot difference(const HistogramSnapshot &after, const HistogramSnapshot &before) {
+    HistogramSnapshot diff = after;
+    diff.count -= before.count;
+    diff.sum -= before.sum;
+    for (size_t i = 0; i < diff.buckets.size() && i < before.buckets.size(); ++i) {
+        diff.buckets[i] -= before.buckets[i];
+    }
+    // max can't be subtracted, take the highest non empty bucket of the window
+    diff.max = 0;
+    for (size_t i = diff.buckets.size(); i-- > 0;) {
+        if (diff.buckets[i] > 0) {
+            diff.max = std::min(after.max, Histogram::upperBound(i));
+            break;
+        }
+    }
+    return diff;
+}
+
+static void read_memory(uint64_t &rss_kb, uint64_t &hwm_kb) {
+    rss_kb = hwm_kb = 0;
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("VmRSS:", 0) == 0) {
+            rss_kb = std::strtoull(line.c_str() + 6, nullptr, 10);
+        } else if (line.rfind("VmHWM:", 0) == 0) {
+            hwm_kb = std::strtoull(line.c_str() + 6, nullptr, 10);
+        }
+    }
+}
+
+static void write_report(std::ostream &os, const BenchOptions &options, const Snapshot &before, const Snapshot &after,
+                         const FakeServerStats &server_before, const FakeServerStats &server_after, const ClockSync &clock_sync,
+                         const ImpairmentProxy *proxy) {
+    const double seconds = std::chrono::duration<double>(after.timepoint - before.timepoint).count();
+    const auto delta = [&](const char *name, const Labels &labels) {
+        const std::string k = key(name, labels);
+        return after.counters.at(k) - before.counters.at(k);
+    };
+
+    os << "{\"config\":{\"width\":" << options.server.width << ",\"height\":" << options.server.height
+       << ",\"fps\":" << options.server.fps << ",\"bitrate\":" << options.server.video_bitrate
+       << ",\"audio\":" << (options.server.audio ? "true" : "false") << ",\"seconds\":" << seconds << "}";
+
+    os << ",\"throughput\":{\"server_fps\":" << (server_after.video_frames - server_before.video_frames) / seconds
+       << ",\"decoded_fps\":" << delta("decoded_frames_total", {{"stream", "video"}, {"index", "0"}}) / seconds
+       << ",\"presented_fps\":" << delta("presented_frames_total", {{"index", "0"}}) / seconds
+       << ",\"video_mbps\":" << delta("rtp_bytes_total", {{"stream", "video"}, {"index", "0"}}) * 8 / seconds / 1e6
+       << ",\"server_bitrate_mbps\":" << server_after.video_bitrate / 1e6
+       << ",\"rate_hints\":" << server_after.rate_hints - server_before.rate_hints << "}";
+
+    os << ",\"losses\":{\"server_late_frames\":" << server_after.late_frames - server_before.late_frames
+       << ",\"video_drops\":" << delta("display_dropped_frames_total", {{"stream", "video"}, {"index", "0"}})
+       << ",\"audio_drops\":" << delta("display_dropped_frames_total", {{"stream", "audio"}})
+       << ",\"video_corrupt\":" << delta("rtp_corrupt_packets_total", {{"stream", "video"}, {"index", "0"}})
+       << ",\"audio_corrupt\":" << delta("rtp_corrupt_packets_total", {{"stream", "audio"}})
+       << ",\"video_decode_errors\":" << delta("decode_errors_total", {{"stream", "video"}, {"index", "0"}})
+       << ",\"audio_decode_errors\":" << delta("decode_errors_total", {{"stream", "audio"}})
+       << ",\"audio_resets\":" << delta("audio_queue_resets_total", {})
+       << ",\"keyframe_requests\":" << server_after.keyframe_requests - server_before.keyframe_requests << "}";
+
+    os << ",\"latency_us\":{";
+    bool comma = false;
+    for (const auto &[name, snapshot] : after.histograms) {
+        const HistogramSnapshot diff = difference(snapshot, before.histograms.at(name));
+        os << (comma ? "," : "") << '"' << name << "\":{\"count\":" << diff.count
+           << ",\"mean\":" << (diff.count ? diff.sum / diff.count : 0)
+           << ",\"p50\":" << diff.quantile(0.5) << ",\"p90\":" << diff.quantile(0.9)
+           << ",\"p99\":" << diff.quantile(0.99) << ",\"p999\":" << diff.quantile(0.999) << ",\"max\":" << diff.max << '}';
+        comma = true;
+    }
+    os << ",\"rtt_smoothed\":" << clock_sync.getSmoothedRtt() << ",\"rtt_variation\":" << clock_sync.getRttVariation() << "}";
+
+    // cpu per thread over the window, a thread may have started or exited meanwhile
+    os << ",\"threads\":[";
+    comma = false;
+    double total_cpu = 0;
+    for (const auto &[id, report] : after.threads) {
+        double user = report.user_seconds, system = report.system_seconds;
+        uint64_t voluntary = report.voluntary_switches, involuntary = report.involuntary_switches;
+        if (const auto it = before.threads.find(id); it != before.threads.end()) {
+            user -= it->second.user_seconds;
+            system -= it->second.system_seconds;
+            voluntary -= it->second.voluntary_switches;
+            involuntary -= it->second.involuntary_switches;
+        }
+        total_cpu += user + system;
+        os << (comma ? "," : "") << "{\"thread\":\"" << report.role << "\",\"tid\":" << report.tid
+           << ",\"cpu_percent\":" << 100 * (user + system) / seconds
+           << ",\"voluntary_switches\":" << voluntary << ",\"involuntary_switches\":" << involuntary << '}';
+        comma = true;
+    }
+    os << "],\"cpu_percent\":" << 100 * total_cpu / seconds;
+
+    // whole run, the decisions only depend on the seed and the datagram rank
+    if (proxy) {
+        os << ",\"impairment\":{";
+        comma = false;
+        for (const char *link : IMPAIRED_LINKS) {
+            const ImpairmentStats stats = proxy->getStats(link);
+            os << (comma ? "," : "") << '"' << link << "\":{\"received\":" << stats.received << ",\"forwarded\":" << stats.forwarded
+               << ",\"lost\":" << stats.lost << ",\"queue_drops\":" << stats.queue_drops
+               << ",\"duplicated\":" << stats.duplicated << ",\"reordered\":" << stats.reordered << '}';
+            comma = true;
+        }
+        os << '}';
+    }
+
+    uint64_t rss_kb, hwm_kb;
+    read_memory(rss_kb, hwm_kb);
+    os << ",\"memory_kb\":{\"rss\":" << rss_kb << ",\"peak\":" << hwm_kb << "}}" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    BenchOptions options;
+    try {
+        if (!parse(argc, argv, options)) {
+            usage(argv[0]);
+            return -1;
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        usage(argv[0]);
+        return -1;
+    }
+
+    // headless unless asked otherwise, the pipeline still uploads and presents every frame
+    if (!options.window) {
+        setenv("SDL_VIDEODRIVER", "dummy", 0);
+        setenv("SDL_AUDIODRIVER", "dummy", 0);
+    }
+
+    Log::global().start();
+    avdevice_register_all();
+    avformat_network_init();
+
+    try {
+        // impair.* settings in the config put a proxy between the server and the client
+        const ImpairmentSettings video_impairment = ImpairmentSettings::fromConfig("video");
+        const ImpairmentSettings audio_impairment = ImpairmentSettings::fromConfig("audio");
+        const ImpairmentSettings input_impairment = ImpairmentSettings::fromConfig("input");
+        std::unique_ptr<ImpairmentProxy> proxy;
+        if (video_impairment.enabled() || audio_impairment.enabled() || input_impairment.enabled()) {
+            FakeServerSettings &server = options.server;
+            server.video_send_port = server.video_port + PROXIED_PORT_OFFSET;
+            server.audio_send_port = server.audio_port + PROXIED_PORT_OFFSET;
+            server.control_udp_port = server.control_port + PROXIED_PORT_OFFSET;
+
+            proxy = std::make_unique<ImpairmentProxy>(Config::global().getInt("impair.seed", 1));
+            proxy->addLink("video", server.video_send_port, server.video_port, video_impairment);
+            proxy->addLink("video-rtcp", server.video_send_port + 1, server.video_port + 1, {});
+            proxy->addLink("audio", server.audio_send_port, server.audio_port, audio_impairment);
+            proxy->addLink("audio-rtcp", server.audio_send_port + 1, server.audio_port + 1, {});
+            proxy->addLink("input", server.control_port, server.control_udp_port, input_impairment);
+            proxy->start();
+        }
+
+        FakeServer server(options.server);
+        server.init();
+        server.start();
+
+        SDLDisplay display;
+        CommandSocket client(display);
+        display.attachInputSink(&client);
+        client.init("127.0.0.1", options.server.control_port, CLIENT_PORT);
+
+        display.startDisplay();
+        client.start();
+        client.writeCommand(R"({"t":"r","q":"rtp"})");
+        display.startEvent();
+
+        std::this_thread::sleep_for(options.warmup);
+        const Snapshot before = take_snapshot(server);
+        const FakeServerStats server_before = server.getStats();
+
+        std::this_thread::sleep_for(options.duration);
+        const Snapshot after = take_snapshot(server);
+        const FakeServerStats server_after = server.getStats();
+
+        display.stopEvent();
+        client.stop();
+        server.stop();
+        if (proxy) {
+            proxy->stop();
+        }
+
+        if (options.output.empty()) {
+            write_report(std::cout, options, before, after, server_before, server_after, client.getClockSync(), proxy.get());
+        } else {
+            std::ofstream file(options.output, std::ios::trunc);
+            write_report(file, options, before, after, server_before, server_after, client.getClockSync(), proxy.get());
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        Log::global().stop();
+        return -1;
+    }
+
+    Log::global().stop();
+    return 0;
+}
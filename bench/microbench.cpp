@@ -0,0 +1,449 @@
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+#include <SDL2/SDL.h>
+};
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include <benchmark/benchmark.h>
+
+#include "source.h"
+#include "spinlock.h"
+#include "FrameReader.h"
+#include "SDLDisplay.h"
+#include "CommandSocket.h"
+#include "DamageTracker.h"
+
+#include "simdjson/singleheader/simdjson.h"
+
+// same sample rate and frame size as the Opus decoder output
+constexpr int AUDIO_SAMPLES = 960;
+
+static AVFrame* make_audio_frame(int channels, int samples) {
+    AVFrame *frame = av_frame_alloc();
+    frame->format = AV_SAMPLE_FMT_FLTP;
+    frame->channels = channels;
+    frame->channel_layout = av_get_default_channel_layout(channels);
+    frame->sample_rate = 48000;
+    frame->nb_samples = samples;
+    av_frame_get_buffer(frame, 0);
+    for (int c = 0; c < channels; ++c) {
+        for (int i = 0; i < samples; ++i) {
+            reinterpret_cast<float*>(frame->data[c])[i] = static_cast<float>(i % 100) / 100.f;
+        }
+    }
+    return frame;
+}
+
+static AVFrame* make_video_frame(AVPixelFormat format, int width, int height) {
+    AVFrame *frame = av_frame_alloc();
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+    av_frame_get_buffer(frame, 0);
+    for (int p = 0; p < AV_NUM_DATA_POINTERS && frame->data[p]; ++p) {
+        memset(frame->data[p], 0x80, frame->buf[p] ? frame->buf[p]->size : 0);
+    }
+    return frame;
+}
+
+// sdl is started once with the dummy drivers, nothing here needs a display or a sound card
+static void init_sdl() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        setenv("SDL_VIDEODRIVER", "dummy", 0);
+        setenv("SDL_AUDIODRIVER", "dummy", 0);
+        SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
+    });
+}
+
+static SDL_AudioDeviceID open_audio(int channels) {
+    init_sdl();
+    SDL_AudioSpec wanted, given;
+    SDL_zero(wanted);
+    wanted.format = AUDIO_F32SYS;
+    wanted.freq = 48000;
+    wanted.channels = channels;
+    wanted.samples = 512;
+    return SDL_OpenAudioDevice(nullptr, 0, &wanted, &given, 0);
+}
+
+// audio: the former one SDL_QueueAudio call per sample and channel against one call per frame
+
+static void BM_AudioQueuePerSample(benchmark::State &state) {
+    const int channels = state.range(0);
+    AVFrame *frame = make_audio_frame(channels, AUDIO_SAMPLES);
+    const SDL_AudioDeviceID dev = open_audio(channels);
+    for (auto _ : state) {
+        for (int i = 0; i < frame->nb_samples; ++i) {
+            for (int c = 0; c < channels; ++c) {
+                SDL_QueueAudio(dev, frame->data[c] + sizeof(float) * i, sizeof(float));
+            }
+        }
+        state.PauseTiming();
+        SDL_ClearQueuedAudio(dev);
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * AUDIO_SAMPLES * channels);
+    SDL_CloseAudioDevice(dev);
+    av_frame_free(&frame);
+}
+BENCHMARK(BM_AudioQueuePerSample)->Arg(1)->Arg(2)->Arg(6)->Arg(8);
+
+static void BM_AudioInterleaveQueue(benchmark::State &state) {
+    const int channels = state.range(0);
+    AVFrame *frame = make_audio_frame(channels, AUDIO_SAMPLES);
+    const SDL_AudioDeviceID dev = open_audio(channels);
+    std::vector<float> buffer(static_cast<size_t>(AUDIO_SAMPLES) * channels);
+    for (auto _ : state) {
+        SDLDisplay::interleaveAudio(frame, channels, buffer.data());
+        SDL_QueueAudio(dev, buffer.data(), buffer.size() * sizeof(float));
+        state.PauseTiming();
+        SDL_ClearQueuedAudio(dev);
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * AUDIO_SAMPLES * channels);
+    SDL_CloseAudioDevice(dev);
+    av_frame_free(&frame);
+}
+BENCHMARK(BM_AudioInterleaveQueue)->Arg(1)->Arg(2)->Arg(6)->Arg(8);
+
+static void BM_AudioInterleave(benchmark::State &state) {
+    const int channels = state.range(0);
+    AVFrame *frame = make_audio_frame(channels, AUDIO_SAMPLES);
+    std::vector<float> buffer(static_cast<size_t>(AUDIO_SAMPLES) * channels);
+    for (auto _ : state) {
+        SDLDisplay::interleaveAudio(frame, channels, buffer.data());
+        benchmark::DoNotOptimize(buffer.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * buffer.size() * sizeof(float));
+    av_frame_free(&frame);
+}
+BENCHMARK(BM_AudioInterleave)->Arg(1)->Arg(2)->Arg(6)->Arg(8);
+
+// input: one message per polling period, argument is the number of motion samples and keys in it
+
+static void BM_InputEncode(benchmark::State &state) {
+    const int events = state.range(0);
+    InputState input;
+    std::stringstream ss;
+    size_t bytes = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        input.keydown.clear();
+        for (int i = 0; i < events; ++i) {
+            input.motion_samples.push_back({static_cast<Uint32>(i), i % 7 - 3, i % 5 - 2});
+            input.x += 1.5f;
+            input.y -= 0.5f;
+            (i & 1 ? input.keyup : input.keydown).insert(4 + i);
+        }
+        input.gamepad_axis = {1200, -3400, 0, 0, 16000, -16000};
+        state.ResumeTiming();
+
+        SDLDisplay::encodeInput(input, ss);
+        const std::string &json = ss.str();
+        bytes += json.size();
+        benchmark::DoNotOptimize(json.data());
+        ss.clear();
+        ss.str(std::string());
+    }
+    state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_InputEncode)->Arg(0)->Arg(1)->Arg(8)->Arg(32);
+
+// control channel: framing and parsing, argument is the payload size
+
+static std::string make_session_message(size_t size) {
+    const std::string prefix = R"({"t":"S","v":")";
+    const std::string suffix = R"("})";
+    return prefix + std::string(size > prefix.size() + suffix.size() ? size - prefix.size() - suffix.size() : 1, 'x') + suffix;
+}
+
+static void BM_FrameReader(benchmark::State &state) {
+    const std::string msg = make_session_message(state.range(0));
+    std::string framed;
+    for (int i = 0; i < 16; ++i) {
+        framed.push_back(static_cast<char>(FrameReader::DELIMITER));
+        framed.push_back(static_cast<char>(msg.size() >> 8));
+        framed.push_back(static_cast<char>(msg.size() & 0xff));
+        framed += msg;
+    }
+
+    FrameReader reader;
+    Frame frame;
+    for (auto _ : state) {
+        // as recv() would deliver it, cut at an arbitrary point
+        const size_t cut = framed.size() / 3;
+        reader.append(reinterpret_cast<const uint8_t*>(framed.data()), cut);
+        while (reader.next(frame)) {
+            benchmark::DoNotOptimize(frame.data);
+        }
+        reader.append(reinterpret_cast<const uint8_t*>(framed.data()) + cut, framed.size() - cut);
+        while (reader.next(frame)) {
+            benchmark::DoNotOptimize(frame.data);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * 16);
+    state.SetBytesProcessed(state.iterations() * framed.size());
+}
+BENCHMARK(BM_FrameReader)->Arg(64)->Arg(256)->Arg(1024)->Arg(8192)->Arg(60000);
+
+// sustained throughput: a session's worth of mostly small messages with a few large ones, delivered in chunks
+// of the argument size like recv() hands them over, frames straddle the chunks and wrap around the ring
+static void BM_FrameReaderStream(benchmark::State &state) {
+    const size_t chunk = state.range(0);
+    std::string stream;
+    size_t frames = 0;
+    for (size_t i = 0; stream.size() < (4 << 20); ++i, ++frames) {
+        const std::string msg = make_session_message(i % 64 == 0 ? 8192 : 48 + (i * 37) % 200);
+        stream.push_back(static_cast<char>(FrameReader::DELIMITER));
+        stream.push_back(static_cast<char>(msg.size() >> 8));
+        stream.push_back(static_cast<char>(msg.size() & 0xff));
+        stream += msg;
+    }
+
+    FrameReader reader;
+    Frame frame;
+    for (auto _ : state) {
+        for (size_t offset = 0; offset < stream.size(); offset += chunk) {
+            reader.append(reinterpret_cast<const uint8_t*>(stream.data()) + offset, std::min(chunk, stream.size() - offset));
+            while (reader.next(frame)) {
+                benchmark::DoNotOptimize(frame.data);
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * frames);
+    state.SetBytesProcessed(state.iterations() * stream.size());
+}
+BENCHMARK(BM_FrameReaderStream)->Arg(1448)->Arg(16 * 1024)->Arg(64 * 1024);
+
+static void BM_HandleCommand(benchmark::State &state) {
+    init_sdl();
+    SDLDisplay display;
+    CommandSocket socket(display);
+    // pongs are the most frequent command, session tokens give a size knob
+    const std::string msg = state.range(0) > 0 ? make_session_message(state.range(0)) : R"({"t":"P","i":123456,"r":1700000000123456,"s":1700000000123789})";
+    std::vector<uint8_t> buffer(msg.begin(), msg.end());
+    buffer.resize(msg.size() + simdjson::SIMDJSON_PADDING);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(socket.handleCommand(buffer.data(), msg.size(), buffer.size()));
+    }
+    state.SetBytesProcessed(state.iterations() * msg.size());
+}
+BENCHMARK(BM_HandleCommand)->Arg(0)->Arg(64)->Arg(1024)->Arg(8192);
+
+// fan out of decoded frames
+
+class BenchSource : public Source<AVFrame> {
+public:
+    void push(AVFrame *frame) {
+        forward(frame);
+    }
+};
+
+class BenchSink : public Sink<AVFrame> {
+public:
+    uint64_t handled = 0;
+
+    void handle(AVFrame *frame) override {
+        benchmark::DoNotOptimize(frame);
+        ++handled;
+        av_frame_free(&frame);
+    }
+};
+
+static void BM_SourceForward(benchmark::State &state) {
+    const int sink_count = state.range(0);
+    BenchSource source;
+    std::vector<BenchSink> sinks(sink_count);
+    for (BenchSink &sink : sinks) {
+        source.attachSink(&sink);
+    }
+
+    AVFrame *frame = av_frame_alloc();
+    for (auto _ : state) {
+        source.push(frame);
+    }
+    state.SetItemsProcessed(state.iterations());
+    av_frame_free(&frame);
+}
+BENCHMARK(BM_SourceForward)->DenseRange(1, 4);
+
+// spinlock: critical section about as long as Source::forward's, thread count is the contention knob
+
+static void BM_SpinlockContention(benchmark::State &state) {
+    static spinlock lock;
+    static uint64_t shared = 0;
+    for (auto _ : state) {
+        lock.lock();
+        for (int i = 0; i < 16; ++i) {
+            benchmark::DoNotOptimize(++shared);
+        }
+        lock.unlock();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SpinlockContention)->ThreadRange(1, 8)->UseRealTime();
+
+// texture upload: the copy displayImpl does before every present, argument is the picture height in 16:9
+
+static void BM_TextureUpload(benchmark::State &state, AVPixelFormat format) {
+    init_sdl();
+    const int height = state.range(0);
+    const int width = height * 16 / 9;
+    SDL_Window *window = SDL_CreateWindow("bench", 0, 0, width, height, SDL_WINDOW_HIDDEN);
+    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+    SDL_Texture *texture = SDL_CreateTexture(renderer, format == AV_PIX_FMT_NV12 ? SDL_PIXELFORMAT_NV12 : SDL_PIXELFORMAT_YV12,
+                                             SDL_TEXTUREACCESS_STREAMING, width, height);
+    if (!texture) {
+        state.SkipWithError(SDL_GetError());
+    }
+
+    AVFrame *frame = make_video_frame(format, width, height);
+    for (auto _ : state) {
+        if (format == AV_PIX_FMT_NV12) {
+            SDL_UpdateNVTexture(texture, nullptr, frame->data[0], frame->linesize[0], frame->data[1], frame->linesize[1]);
+        } else {
+            SDL_UpdateYUVTexture(texture, nullptr, frame->data[0], frame->linesize[0], frame->data[1], frame->linesize[1],
+                                 frame->data[2], frame->linesize[2]);
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * av_image_get_buffer_size(format, width, height, 1));
+
+    av_frame_free(&frame);
+    SDL_DestroyTexture(texture);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+}
+BENCHMARK_CAPTURE(BM_TextureUpload, yuv420p, AV_PIX_FMT_YUV420P)->Arg(720)->Arg(1080)->Arg(1440)->Arg(2160);
+BENCHMARK_CAPTURE(BM_TextureUpload, nv12, AV_PIX_FMT_NV12)->Arg(720)->Arg(1080)->Arg(1440)->Arg(2160);
+
+// plain plane copies, the floor for any upload path
+static void BM_PlaneCopy(benchmark::State &state) {
+    const int height = state.range(0);
+    const int width = height * 16 / 9;
+    AVFrame *src = make_video_frame(AV_PIX_FMT_YUV420P, width, height);
+    AVFrame *dst = make_video_frame(AV_PIX_FMT_YUV420P, width, height);
+    for (auto _ : state) {
+        av_image_copy(dst->data, dst->linesize, const_cast<const uint8_t**>(src->data), src->linesize, AV_PIX_FMT_YUV420P, width, height);
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * av_image_get_buffer_size(AV_PIX_FMT_YUV420P, width, height, 1));
+    av_frame_free(&dst);
+    av_frame_free(&src);
+}
+BENCHMARK(BM_PlaneCopy)->Arg(720)->Arg(1080)->Arg(1440)->Arg(2160);
+
+// damage tracking on desktop-like content: a static textured background where only a region changes between frames,
+// the tile compare plus the partial upload against BM_TextureUpload. bytes are counted as whole frames so the
+// rates compare, uploaded is the part that went into the texture
+
+enum DesktopChange {
+    STATIC,     // nothing changes
+    TYPING,     // a line of text, 320x32
+    DRAG,       // a window moving, 640x480
+};
+
+static void paint_desktop(AVFrame *frame) {
+    for (int p = 0; p < 3 && frame->data[p]; ++p) {
+        const int rows = p == 0 ? frame->height : (frame->height + 1) / 2;
+        for (int y = 0; y < rows; ++y) {
+            for (int x = 0; x < frame->linesize[p]; ++x) {
+                frame->data[p][y * frame->linesize[p] + x] = static_cast<uint8_t>((x * 7 + y * 13) ^ (x >> 3));
+            }
+        }
+    }
+}
+
+static void BM_DamageUpload(benchmark::State &state, DesktopChange change) {
+    init_sdl();
+    const int height = state.range(0);
+    const int width = height * 16 / 9;
+    SDL_Window *window = SDL_CreateWindow("bench", 0, 0, width, height, SDL_WINDOW_HIDDEN);
+    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+    SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_YV12, SDL_TEXTUREACCESS_STREAMING, width, height);
+    if (!texture) {
+        state.SkipWithError(SDL_GetError());
+    }
+
+    // two frames alternate, they differ in the changed region only
+    AVFrame *frames[2];
+    for (AVFrame *&frame : frames) {
+        frame = make_video_frame(AV_PIX_FMT_YUV420P, width, height);
+        paint_desktop(frame);
+    }
+    const int change_width = change == TYPING ? 320 : change == DRAG ? 640 : 0;
+    const int change_height = change == TYPING ? 32 : change == DRAG ? 480 : 0;
+    for (int y = height / 3; y < height / 3 + change_height; ++y) {
+        memset(frames[1]->data[0] + y * frames[1]->linesize[0] + width / 3, 0x20, change_width);
+    }
+
+    DamageTracker damage(DamageTracker::Settings{});
+    std::vector<DamageRect> rects;
+    int64_t uploaded = 0;
+    int64_t i = 0;
+    for (auto _ : state) {
+        const AVFrame *frame = frames[i++ & 1];
+        if (!damage.update(frame, rects)) {
+            SDL_UpdateYUVTexture(texture, nullptr, frame->data[0], frame->linesize[0], frame->data[1], frame->linesize[1],
+                                 frame->data[2], frame->linesize[2]);
+            uploaded += av_image_get_buffer_size(AV_PIX_FMT_YUV420P, width, height, 1);
+            continue;
+        }
+        for (const DamageRect &damaged : rects) {
+            const SDL_Rect rect = {damaged.x, damaged.y, damaged.width, damaged.height};
+            const int chroma_offset = rect.y / 2 * frame->linesize[1] + rect.x / 2;
+            SDL_UpdateYUVTexture(texture, &rect, frame->data[0] + rect.y * frame->linesize[0] + rect.x, frame->linesize[0],
+                                 frame->data[1] + chroma_offset, frame->linesize[1],
+                                 frame->data[2] + chroma_offset, frame->linesize[2]);
+            uploaded += av_image_get_buffer_size(AV_PIX_FMT_YUV420P, rect.w, rect.h, 1);
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * av_image_get_buffer_size(AV_PIX_FMT_YUV420P, width, height, 1));
+    state.counters["uploaded"] = benchmark::Counter(uploaded, benchmark::Counter::kAvgIterations, benchmark::Counter::kIs1024);
+
+    for (AVFrame *&frame : frames) {
+        av_frame_free(&frame);
+    }
+    SDL_DestroyTexture(texture);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+}
+BENCHMARK_CAPTURE(BM_DamageUpload, static, STATIC)->Arg(1080)->Arg(1440)->Arg(2160);
+BENCHMARK_CAPTURE(BM_DamageUpload, typing, TYPING)->Arg(1080)->Arg(1440)->Arg(2160);
+BENCHMARK_CAPTURE(BM_DamageUpload, drag, DRAG)->Arg(1080)->Arg(1440)->Arg(2160);
+
+// the row compare alone over two equal planes, the worst case of the tile scan, against memcmp
+static void BM_DamageCompare(benchmark::State &state, bool simd) {
+    const int height = state.range(0);
+    const int width = height * 16 / 9;
+    AVFrame *a = make_video_frame(AV_PIX_FMT_YUV420P, width, height);
+    AVFrame *b = make_video_frame(AV_PIX_FMT_YUV420P, width, height);
+    for (auto _ : state) {
+        bool equal = true;
+        for (int y = 0; y < height; ++y) {
+            const uint8_t *row_a = a->data[0] + y * a->linesize[0];
+            const uint8_t *row_b = b->data[0] + y * b->linesize[0];
+            for (int x = 0; x < width; x += DamageTracker::TILE_WIDTH) {
+                const int size = std::min(DamageTracker::TILE_WIDTH, width - x);
+                equal &= simd ? DamageTracker::equal(row_a + x, row_b + x, size) : memcmp(row_a + x, row_b + x, size) == 0;
+            }
+        }
+        benchmark::DoNotOptimize(equal);
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(width) * height);
+    av_frame_free(&b);
+    av_frame_free(&a);
+}
+BENCHMARK_CAPTURE(BM_DamageCompare, simd, true)->Arg(1080)->Arg(2160);
+BENCHMARK_CAPTURE(BM_DamageCompare, memcmp, false)->Arg(1080)->Arg(2160);
+
+BENCHMARK_MAIN();
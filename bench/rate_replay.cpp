@@ -0,0 +1,153 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "RateController.h"
+#include "Config.h"
+#include "Log.h"
+#include "simdjson/singleheader/simdjson.h"
+
+struct RateReplayOptions {
+    std::string path;
+    std::string output;
+    bool trace = false;
+};
+
+static void usage(const char *program) {
+    std::cout << program << ": <rate.log file> [--trace] [--output=<file>] [--config=<file>]" << std::endl;
+}
+
+static bool parse(int argc, char **argv, RateReplayOptions &options) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const size_t equal = arg.find('=');
+        const std::string key = arg.substr(0, equal);
+        const std::string value = equal != std::string::npos ? arg.substr(equal + 1) : "";
+        if (key == "--trace") {
+            options.trace = true;
+        } else if (key == "--output") {
+            options.output = value;
+        } else if (key == "--config") {
+            Config::global().load(value);
+        } else if (arg.rfind("--", 0) != 0 && options.path.empty()) {
+            options.path = arg;
+        } else {
+            return false;
+        }
+    }
+    return !options.path.empty();
+}
+
+struct LoggedDecision {
+    int64_t bitrate_kbps;
+    int64_t width;
+    int64_t height;
+    int64_t fps;
+};
+
+static void read_line(simdjson::ondemand::parser &parser, const std::string &line, RateSignals &signals, LoggedDecision &logged) {
+    const simdjson::padded_string padded(line);
+    simdjson::ondemand::document document = parser.iterate(padded);
+    signals.time_us = document["time_us"].get_int64();
+    signals.interval_us = document["interval_us"].get_int64();
+    signals.frames = document["frames"].get_uint64();
+    signals.bytes = document["bytes"].get_uint64();
+    signals.corrupt_frames = document["corrupt_frames"].get_uint64();
+    signals.delay_trend = document["delay_trend"].get_double();
+    signals.delay_samples = static_cast<int>(document["delay_samples"].get_int64());
+    signals.jitter_ms = document["jitter_ms"].get_double();
+    signals.decode_ms = document["decode_ms"].get_double();
+    signals.queue_depth = document["queue_depth"].get_uint64();
+    signals.display_drops = document["display_drops"].get_uint64();
+    signals.rtt_us = document["rtt_us"].get_int64();
+    signals.width = static_cast<int>(document["width"].get_int64());
+    signals.height = static_cast<int>(document["height"].get_int64());
+    simdjson::ondemand::object decision = document["decision"].get_object();
+    logged.bitrate_kbps = decision["bitrate_kbps"].get_int64();
+    logged.width = decision["width"].get_int64();
+    logged.height = decision["height"].get_int64();
+    logged.fps = decision["fps"].get_int64();
+}
+
+// runs a logged session through the estimator again, with the settings of --config:
+// the same settings give the same decisions, other ones show what they would have changed
+int main(int argc, char **argv) {
+    RateReplayOptions options;
+    try {
+        if (!parse(argc, argv, options)) {
+            usage(argv[0]);
+            return -1;
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        usage(argv[0]);
+        return -1;
+    }
+
+    std::ifstream input(options.path);
+    if (!input) {
+        std::cerr << "unable to open " << options.path << std::endl;
+        return -1;
+    }
+
+    std::ofstream file;
+    if (!options.output.empty()) {
+        file.open(options.output, std::ios::trunc);
+    }
+    std::ostream &os = options.output.empty() ? std::cout : file;
+
+    RateEstimator estimator(RateEstimator::Settings::fromConfig());
+    simdjson::ondemand::parser parser;
+    RateSignals signals = {};
+    LoggedDecision logged = {};
+    uint64_t updates = 0;
+    uint64_t different = 0;
+    uint64_t bitrate_changes = 0;
+    uint64_t level_changes = 0;
+    int64_t min_kbps = -1;
+    int64_t max_kbps = 0;
+    RateDecision last = {};
+    std::string line;
+    size_t line_number = 0;
+    while (std::getline(input, line)) {
+        ++line_number;
+        if (line.empty()) {
+            continue;
+        }
+        try {
+            read_line(parser, line, signals, logged);
+        } catch (const simdjson::simdjson_error &e) {
+            std::cerr << options.path << ':' << line_number << ": " << e.what() << std::endl;
+            return -1;
+        }
+
+        const RateDecision decision = estimator.update(signals);
+        if (decision.bitrate_kbps != logged.bitrate_kbps || decision.width != logged.width
+            || decision.height != logged.height || decision.fps != logged.fps) {
+            ++different;
+        }
+        if (updates > 0 && decision.bitrate_kbps != last.bitrate_kbps) {
+            ++bitrate_changes;
+        }
+        if (updates > 0 && (decision.height != last.height || decision.fps != last.fps)) {
+            ++level_changes;
+        }
+        if (decision.bitrate_kbps > 0) {
+            min_kbps = min_kbps < 0 ? decision.bitrate_kbps : std::min(min_kbps, decision.bitrate_kbps);
+            max_kbps = std::max(max_kbps, decision.bitrate_kbps);
+        }
+        if (options.trace) {
+            os << RateController::toJson(signals, decision) << '\n';
+        }
+        last = decision;
+        ++updates;
+    }
+
+    os << "{\"log\":\"" << options.path << "\",\"updates\":" << updates << ",\"different_decisions\":" << different
+       << ",\"bitrate_changes\":" << bitrate_changes << ",\"level_changes\":" << level_changes
+       << ",\"min_kbps\":" << std::max<int64_t>(min_kbps, 0) << ",\"max_kbps\":" << max_kbps
+       << ",\"final\":{\"bitrate_kbps\":" << last.bitrate_kbps << ",\"width\":" << last.width << ",\"height\":" << last.height
+       << ",\"fps\":" << last.fps << "}}" << std::endl;
+    return 0;
+}
@@ -10,9 +10,16 @@ extern "C" {
 #include <thread>
 #include <atomic>
 #include <csignal>
+#include <string>
+#include <vector>
 #include "RTPAudioReceiver.h"
 #include "SDLDisplay.h"
 #include "CommandSocket.h"
+#include "Config.h"
+#include "ThreadPolicy.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Log.h"
 
 std::atomic<bool> stop = false;
 void signalHandler( int signum ) {
@@ -21,14 +28,32 @@ void signalHandler( int signum ) {
 }
 
 int main(int argc, char **argv) {
-    if (argc <= 1) {
-        std::cout << argv[0] << ": <remote_ip> [remote_port] [local_port]" << std::endl;
+    // options first, what remains is positional
+    std::vector<const char*> args;
+    for (int i = 0; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg.rfind("--config=", 0) == 0) {
+            try {
+                Config::global().load(arg.substr(9));
+            } catch (const std::exception &e) {
+                std::cerr << e.what() << ": " << arg.substr(9) << std::endl;
+                return -1;
+            }
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+
+    if (args.size() <= 1) {
+        std::cout << argv[0] << ": [--config=<file>] <remote_ip> [remote_port] [local_port]" << std::endl;
         return -1;
     }
 
-    const char* remote_ip = argv[1];
-    const uint16_t remote_port = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 9999;
-    const uint16_t local_port = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 9999;
+    const char* remote_ip = args[1];
+    const uint16_t remote_port = args.size() > 2 ? std::strtoul(args[2], nullptr, 10) : 9999;
+    const uint16_t local_port = args.size() > 3 ? std::strtoul(args[3], nullptr, 10) : 9999;
+
+    Log::global().start();
 
     signal(SIGINT, signalHandler);
     //signal(SIGTERM, signalHandler);
@@ -36,6 +61,24 @@ int main(int argc, char **argv) {
     avdevice_register_all();
     avformat_network_init();
 
+    // usage per thread role, the threads of a role added up, exited ones included. the report printed at exit
+    // has them one by one
+    MetricsRegistry::global().addCollector(nullptr, [](std::vector<MetricSample> &samples) {
+        for (const ThreadReport &report : ThreadPolicy::reportByRole()) {
+            const auto sample = [&](const char *name, const char *help, const char *key, const char *value, double v) {
+                samples.push_back({name, {{"thread", report.role}, {key, value}}, help, MetricType::COUNTER, v});
+            };
+            sample("thread_cpu_seconds_total", "cpu time per pipeline thread", "mode", "user", report.user_seconds);
+            sample("thread_cpu_seconds_total", "cpu time per pipeline thread", "mode", "system", report.system_seconds);
+            sample("thread_context_switches_total", "context switches per pipeline thread", "kind", "voluntary", report.voluntary_switches);
+            sample("thread_context_switches_total", "context switches per pipeline thread", "kind", "involuntary", report.involuntary_switches);
+        }
+    });
+    MetricsExporter exporter;
+    exporter.start();
+    FlightRecorder recorder;
+    recorder.start();
+
     try {
         SDLDisplay display;
         CommandSocket client(display);
@@ -58,5 +101,9 @@ int main(int argc, char **argv) {
         std::cerr << e.what() << std::endl;
     }
 
+    exporter.stop();
+    recorder.stop();
+    ThreadPolicy::printReport(std::cout);
+    Log::global().stop();
     return 0;
 }
@@ -10,6 +10,7 @@ protected:
     virtual ~Sink() = default;
 
 public:
+    // takes ownership of t, a sink frees what it doesn't pass on
     virtual void handle(T *t) = 0;
 };
 
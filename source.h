@@ -15,6 +15,8 @@ extern "C" {
 #include "sink.h"
 #include "spinlock.h"
 
+// forward() hands every attached sink a reference of its own, a clone, which the sink owns and frees.
+// the caller keeps its object whether or not a sink is attached and frees or reuses it afterwards
 template<class T>
 class Source {
 private:
@@ -38,14 +40,30 @@ public:
         lock.unlock();
     }
 
-protected:
-    void forward(T *t) {
-        lock.lock();
-        for (auto& sink : sinks) {
-            sink->handle(t);
-        }
-        lock.unlock();
+    LockStats lockStats() const {
+        return lock.stats();
     }
+
+protected:
+    void forward(T *t);
 };
 
+template<>
+inline void Source<AVFrame>::forward(AVFrame *frame) {
+    lock.lock();
+    for (auto& sink : sinks) {
+        sink->handle(av_frame_clone(frame));
+    }
+    lock.unlock();
+}
+
+template<>
+inline void Source<AVPacket>::forward(AVPacket *packet) {
+    lock.lock();
+    for (auto& sink : sinks) {
+        sink->handle(av_packet_clone(packet));
+    }
+    lock.unlock();
+}
+
 #endif //REMOTE_DESKTOP_SOURCE_H
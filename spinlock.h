@@ -2,36 +2,166 @@
 #define REMOTE_CLIENT_SPINLOCK_H
 
 #include <atomic>
+#include <cstdint>
+#include <thread>
 
-// from https://rigtorp.se/spinlock/
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef LOCK_STATS
+#include <chrono>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+static inline void cpu_relax() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield" ::: "memory");
+#else
+    std::this_thread::yield();
+#endif
+}
+
+struct LockStats {
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t spins;
+    uint64_t parks;
+    uint64_t max_hold_ns;
+};
+
+// spin a little then park on a futex, the spinning part is from https://rigtorp.se/spinlock/
+// and the parking part follows Drepper's "Futexes Are Tricky" mutex
+// build with LOCK_STATS to count acquisitions, spins, parks and the max hold time
 struct spinlock {
-    std::atomic<bool> lock_ = {0};
+    static constexpr int SPIN_LIMIT = 128;
+
+    // 0: unlocked, 1: locked, 2: locked and some waiters may be parked
+    std::atomic<uint32_t> state_ = {0};
+
+#ifdef LOCK_STATS
+    std::atomic<uint64_t> acquisitions_ = {0};
+    std::atomic<uint64_t> contended_ = {0};
+    std::atomic<uint64_t> spins_ = {0};
+    std::atomic<uint64_t> parks_ = {0};
+    std::atomic<uint64_t> max_hold_ns_ = {0};
+    int64_t acquired_ns_ = 0;
+#endif
 
     void lock() noexcept {
-        for (;;) {
-            // Optimistically assume the lock is free on the first try
-            if (!lock_.exchange(true, std::memory_order_acquire)) {
-                return;
-            }
-            // Wait for lock to be released without generating cache misses
-            while (lock_.load(std::memory_order_relaxed)) {
-                // Issue X86 PAUSE or ARM YIELD instruction to reduce contention between
-                // hyper-threads
-                __builtin_ia32_pause();
-            }
+        // Optimistically assume the lock is free on the first try
+        uint32_t expected = 0;
+        if (!state_.compare_exchange_strong(expected, 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+            lock_slow();
         }
+        on_acquired();
     }
 
     bool try_lock() noexcept {
         // First do a relaxed load to check if lock is free in order to prevent
         // unnecessary cache misses if someone does while(!try_lock())
-        return !lock_.load(std::memory_order_relaxed) &&
-               !lock_.exchange(true, std::memory_order_acquire);
+        uint32_t expected = 0;
+        if (state_.load(std::memory_order_relaxed) == 0 &&
+            state_.compare_exchange_strong(expected, 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+            on_acquired();
+            return true;
+        }
+        return false;
     }
 
     void unlock() noexcept {
-        lock_.store(false, std::memory_order_release);
+#ifdef LOCK_STATS
+        const uint64_t held = now_ns() - acquired_ns_;
+        uint64_t max_hold = max_hold_ns_.load(std::memory_order_relaxed);
+        while (held > max_hold && !max_hold_ns_.compare_exchange_weak(max_hold, held, std::memory_order_relaxed));
+#endif
+        if (state_.exchange(0, std::memory_order_release) == 2) {
+            wake();
+        }
+    }
+
+    LockStats stats() const noexcept {
+        LockStats stats = {};
+#ifdef LOCK_STATS
+        stats.acquisitions = acquisitions_.load(std::memory_order_relaxed);
+        stats.contended = contended_.load(std::memory_order_relaxed);
+        stats.spins = spins_.load(std::memory_order_relaxed);
+        stats.parks = parks_.load(std::memory_order_relaxed);
+        stats.max_hold_ns = max_hold_ns_.load(std::memory_order_relaxed);
+#endif
+        return stats;
     }
+
+private:
+    void lock_slow() noexcept {
+#ifdef LOCK_STATS
+        contended_.fetch_add(1, std::memory_order_relaxed);
+#endif
+        // the holder is likely running, wait for it without generating cache misses
+        for (int i = 0; i < SPIN_LIMIT; ++i) {
+            uint32_t expected = 0;
+            if (state_.load(std::memory_order_relaxed) == 0 &&
+                state_.compare_exchange_weak(expected, 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+#ifdef LOCK_STATS
+                spins_.fetch_add(i, std::memory_order_relaxed);
+#endif
+                return;
+            }
+            // Issue X86 PAUSE or ARM YIELD instruction to reduce contention between
+            // hyper-threads
+            cpu_relax();
+        }
+#ifdef LOCK_STATS
+        spins_.fetch_add(SPIN_LIMIT, std::memory_order_relaxed);
+#endif
+
+        // the holder may be descheduled, stop burning the core; from here on we take the lock
+        // as contended (2) so our own unlock wakes the next waiter
+        while (state_.exchange(2, std::memory_order_acquire) != 0) {
+#ifdef LOCK_STATS
+            parks_.fetch_add(1, std::memory_order_relaxed);
+#endif
+            park();
+        }
+    }
+
+    void park() noexcept {
+#ifdef __linux__
+        // returns immediately if the state changed in between
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&state_), FUTEX_WAIT_PRIVATE, 2, nullptr, nullptr, 0);
+#else
+        std::this_thread::yield();
+#endif
+    }
+
+    void wake() noexcept {
+#ifdef __linux__
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&state_), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+    }
+
+    void on_acquired() noexcept {
+#ifdef LOCK_STATS
+        acquisitions_.fetch_add(1, std::memory_order_relaxed);
+        acquired_ns_ = now_ns();
+#endif
+    }
+
+#ifdef LOCK_STATS
+    static int64_t now_ns() noexcept {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+#endif
 };
 
+static_assert(std::atomic<uint32_t>::is_always_lock_free && sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+              "futex needs a plain 32 bits word");
+
 #endif //REMOTE_CLIENT_SPINLOCK_H